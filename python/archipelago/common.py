@@ -96,6 +96,21 @@ def is_power2(x):
     return bool(x != 0 and (x & (x-1)) == 0)
 
 
+def archip_dirs(archip_dir):
+    """Return the data directories of a path[:weight],... list"""
+    dirs = []
+    for d in archip_dir.split(','):
+        if not d:
+            continue
+        path, sep, weight = d.rpartition(':')
+        if not sep:
+            path = weight
+        elif not path or not weight.isdigit() or not int(weight):
+            raise Error("Invalid weight of archip dir %s" % d)
+        dirs.append(path)
+    return dirs
+
+
 # hack to test green waiting with python gevent.
 class posixfd_signal_desc(Structure):
     pass
@@ -147,7 +162,7 @@ class Peer(object):
     def __init__(self, role=None, daemon=True, nr_ops=16,  # NOQA
                  logfile=None, pidfile=None, portno_start=None,
                  portno_end=None, log_level=0, spec=None, threshold=None,
-                 user=None, group=None, umask="0o007"):
+                 user=None, group=None, umask="0o007", hugepages=False):
         if not role:
             raise Error("Role was not provided")
         self.role = role
@@ -206,6 +221,7 @@ class Peer(object):
 
         self.log_level = log_level
         self.threshold = threshold
+        self.hugepages = hugepages
 
         if self.log_level < 0 or self.log_level > 3:
             raise Error("%s: Invalid log level %d" %
@@ -321,6 +337,8 @@ class Peer(object):
         if self.umask:
             self.cli_opts.append("--umask")
             self.cli_opts.append(str(self.umask))
+        if self.hugepages:
+            self.cli_opts.append("--hugepages")
 
 
 class MTpeer(Peer):
@@ -338,10 +356,13 @@ class MTpeer(Peer):
 
 
 class Radosd(MTpeer):
-    def __init__(self, pool=None, cephx_id=None, **kwargs):
+    def __init__(self, pool=None, cephx_id=None, lock_threads=None,
+                 handles=None, **kwargs):
         self.executable = RADOS_BLOCKER
         self.pool = pool
         self.cephx_id = cephx_id
+        self.lock_threads = lock_threads
+        self.handles = handles
         super(Radosd, self).__init__(**kwargs)
 
         if self.cli_opts is None:
@@ -355,12 +376,23 @@ class Radosd(MTpeer):
         if self.cephx_id:
             self.cli_opts.append("--cephx-id")
             self.cli_opts.append(self.cephx_id)
+        if self.lock_threads:
+            self.cli_opts.append("--lock-threads")
+            self.cli_opts.append(str(self.lock_threads))
+        if self.handles:
+            self.cli_opts.append("--handles")
+            self.cli_opts.append(str(self.handles))
 
 
 class Filed(MTpeer):
     def __init__(self, archip_dir=None, prefix=None, fdcache=None,
                  unique_str=None, nr_threads=1, nr_ops=16, direct=True,
-                 pithos_migrate=False, lock_dir=None, **kwargs):
+                 pithos_migrate=False, lock_dir=None, block_cache=None,
+                 disk_threads=None, rebalance=False, fast_dir=None,
+                 move_bw=None, tier_promote=None, tier_fast_max=None,
+                 coalesce=None, meta_threads=None, readahead=None,
+                 readahead_drop=False, prealloc=None,
+                 prealloc_grow_size=False, **kwargs):
         self.executable = FILE_BLOCKER
         self.archip_dir = archip_dir
         self.prefix = prefix
@@ -369,6 +401,19 @@ class Filed(MTpeer):
         self.direct = direct
         self.pithos_migrate = pithos_migrate
         self.lock_dir = lock_dir
+        self.block_cache = block_cache
+        self.disk_threads = disk_threads
+        self.rebalance = rebalance
+        self.fast_dir = fast_dir
+        self.move_bw = move_bw
+        self.tier_promote = tier_promote
+        self.tier_fast_max = tier_fast_max
+        self.coalesce = coalesce
+        self.meta_threads = meta_threads
+        self.readahead = readahead
+        self.readahead_drop = readahead_drop
+        self.prealloc = prealloc
+        self.prealloc_grow_size = prealloc_grow_size
         nr_threads = nr_ops
         if self.fdcache and fdcache < 2*nr_threads:
             raise Error("Fdcache should be greater than 2*nr_threads")
@@ -378,8 +423,11 @@ class Filed(MTpeer):
 
         if not self.archip_dir:
             raise Error("%s: Archip dir must be set" % self.role)
-        if not os.path.isdir(self.archip_dir):
-            raise Error("%s: Archip dir invalid" % self.role)
+        for archip_dir in archip_dirs(self.archip_dir):
+            if not os.path.isdir(archip_dir):
+                raise Error("%s: Archip dir invalid" % self.role)
+        if self.fast_dir and not os.path.isdir(self.fast_dir):
+            raise Error("%s: Fast dir invalid" % self.role)
         if self.lock_dir and not os.path.isdir(self.lock_dir):
             raise Error("%s: Lock dir invalid" % self.role)
         if not self.fdcache:
@@ -411,10 +459,48 @@ class Filed(MTpeer):
         if self.lock_dir:
             self.cli_opts.append("--lockdir")
             self.cli_opts.append(self.lock_dir)
+        if self.block_cache:
+            self.cli_opts.append("--blockcache")
+            self.cli_opts.append(str(self.block_cache))
+        if self.disk_threads:
+            self.cli_opts.append("--disk-threads")
+            self.cli_opts.append(str(self.disk_threads))
+        if self.rebalance:
+            self.cli_opts.append("--rebalance")
+        if self.fast_dir:
+            self.cli_opts.append("--archip-fast")
+            self.cli_opts.append(self.fast_dir)
+        if self.move_bw:
+            self.cli_opts.append("--move-bw")
+            self.cli_opts.append(str(self.move_bw))
+        if self.tier_promote:
+            self.cli_opts.append("--tier-promote")
+            self.cli_opts.append(str(self.tier_promote))
+        if self.tier_fast_max:
+            self.cli_opts.append("--tier-fast-max")
+            self.cli_opts.append(str(self.tier_fast_max))
+        if self.coalesce:
+            self.cli_opts.append("--coalesce")
+            self.cli_opts.append(str(self.coalesce))
+        if self.meta_threads:
+            self.cli_opts.append("--meta-threads")
+            self.cli_opts.append(str(self.meta_threads))
+        if self.readahead:
+            self.cli_opts.append("--readahead")
+            self.cli_opts.append(str(self.readahead))
+        if self.readahead_drop:
+            self.cli_opts.append("--readahead-drop")
+        if self.prealloc:
+            self.cli_opts.append("--prealloc")
+            self.cli_opts.append(str(self.prealloc))
+        if self.prealloc_grow_size:
+            self.cli_opts.append("--prealloc-grow-size")
 
 
 class Mapperd(Peer):
-    def __init__(self, blockerm_port=None, blockerb_port=None, **kwargs):
+    def __init__(self, blockerm_port=None, blockerb_port=None, shards=None,
+                 shard_port=None, reclaim_rate=None, reclaim_journal=None,
+                 partial_copyups=False, **kwargs):
         self.executable = MAPPER
         if blockerm_port is None:
             raise Error("blockerm_port must be provied for %s" % role)
@@ -423,6 +509,14 @@ class Mapperd(Peer):
         if blockerb_port is None:
             raise Error("blockerb_port must be provied for %s" % role)
         self.blockerb_port = blockerb_port
+
+        if shards and shards > 1 and shard_port is None:
+            raise Error("shard_port must be provied for %s" % role)
+        self.shards = shards
+        self.shard_port = shard_port
+        self.reclaim_rate = reclaim_rate
+        self.reclaim_journal = reclaim_journal
+        self.partial_copyups = partial_copyups
         super(Mapperd, self).__init__(**kwargs)
 
         if self.cli_opts is None:
@@ -436,6 +530,20 @@ class Mapperd(Peer):
         if self.blockerb_port is not None:
             self.cli_opts.append("-bp")
             self.cli_opts.append(str(self.blockerb_port))
+        if self.shards:
+            self.cli_opts.append("--shards")
+            self.cli_opts.append(str(self.shards))
+        if self.shard_port is not None:
+            self.cli_opts.append("--shard-port")
+            self.cli_opts.append(str(self.shard_port))
+        if self.reclaim_rate is not None:
+            self.cli_opts.append("--reclaim-rate")
+            self.cli_opts.append(str(self.reclaim_rate))
+        if self.reclaim_journal:
+            self.cli_opts.append("--reclaim-journal")
+            self.cli_opts.append(self.reclaim_journal)
+        if self.partial_copyups:
+            self.cli_opts.append("--partial-copyups")
 
 
 class Vlmcd(Peer):
@@ -908,6 +1016,8 @@ def createDict(cfg, section):  # NOQA
         sec_dic['log_level'] = cfg.getint(section, 'log_level')
     if cfg.has_option(section, 'umask'):
         sec_dic['umask'] = cfg.get(section, 'umask')
+    if cfg.has_option(section, 'hugepages'):
+        sec_dic['hugepages'] = cfg.getboolean(section, 'hugepages')
 
     if t == 'file_blocker':
         sec_dic['nr_threads'] = cfg.getint(section, 'nr_threads')
@@ -925,15 +1035,58 @@ def createDict(cfg, section):  # NOQA
             sec_dic['unique_str'] = cfg.getint(section, 'unique_str')
         if cfg.has_option(section, 'prefix'):
             sec_dic['prefix'] = cfg.getint(section, 'prefix')
+        if cfg.has_option(section, 'block_cache'):
+            sec_dic['block_cache'] = cfg.getint(section, 'block_cache')
+        if cfg.has_option(section, 'disk_threads'):
+            sec_dic['disk_threads'] = cfg.getint(section, 'disk_threads')
+        if cfg.has_option(section, 'rebalance'):
+            sec_dic['rebalance'] = cfg.getboolean(section, 'rebalance')
+        if cfg.has_option(section, 'fast_dir'):
+            sec_dic['fast_dir'] = cfg.get(section, 'fast_dir')
+        if cfg.has_option(section, 'move_bw'):
+            sec_dic['move_bw'] = cfg.getint(section, 'move_bw')
+        if cfg.has_option(section, 'tier_promote'):
+            sec_dic['tier_promote'] = cfg.getint(section, 'tier_promote')
+        if cfg.has_option(section, 'tier_fast_max'):
+            sec_dic['tier_fast_max'] = cfg.getint(section, 'tier_fast_max')
+        if cfg.has_option(section, 'coalesce'):
+            sec_dic['coalesce'] = cfg.getint(section, 'coalesce')
+        if cfg.has_option(section, 'meta_threads'):
+            sec_dic['meta_threads'] = cfg.getint(section, 'meta_threads')
+        if cfg.has_option(section, 'readahead'):
+            sec_dic['readahead'] = cfg.getint(section, 'readahead')
+        if cfg.has_option(section, 'readahead_drop'):
+            sec_dic['readahead_drop'] = cfg.getboolean(section,
+                                                       'readahead_drop')
+        if cfg.has_option(section, 'prealloc'):
+            sec_dic['prealloc'] = cfg.getint(section, 'prealloc')
+        if cfg.has_option(section, 'prealloc_grow_size'):
+            sec_dic['prealloc_grow_size'] = cfg.getboolean(
+                section, 'prealloc_grow_size')
     elif t == 'rados_blocker':
         if cfg.has_option(section, 'nr_threads'):
             sec_dic['nr_threads'] = cfg.getint(section, 'nr_threads')
         if cfg.has_option(section, 'cephx_id'):
             sec_dic['cephx_id'] = cfg.get(section, 'cephx_id')
+        if cfg.has_option(section, 'lock_threads'):
+            sec_dic['lock_threads'] = cfg.getint(section, 'lock_threads')
+        if cfg.has_option(section, 'handles'):
+            sec_dic['handles'] = cfg.getint(section, 'handles')
         sec_dic['pool'] = cfg.get(section, 'pool')
     elif t == 'mapperd':
         sec_dic['blockerb_port'] = cfg.getint(section, 'blockerb_port')
         sec_dic['blockerm_port'] = cfg.getint(section, 'blockerm_port')
+        if cfg.has_option(section, 'shards'):
+            sec_dic['shards'] = cfg.getint(section, 'shards')
+        if cfg.has_option(section, 'shard_port'):
+            sec_dic['shard_port'] = cfg.getint(section, 'shard_port')
+        if cfg.has_option(section, 'reclaim_rate'):
+            sec_dic['reclaim_rate'] = cfg.getint(section, 'reclaim_rate')
+        if cfg.has_option(section, 'reclaim_journal'):
+            sec_dic['reclaim_journal'] = cfg.get(section, 'reclaim_journal')
+        if cfg.has_option(section, 'partial_copyups'):
+            sec_dic['partial_copyups'] = cfg.getboolean(section,
+                                                        'partial_copyups')
     elif t == 'vlmcd':
         sec_dic['blocker_port'] = cfg.getint(section, 'blocker_port')
         sec_dic['mapper_port'] = cfg.getint(section, 'mapper_port')
@@ -1393,8 +1546,11 @@ class Request(object):
         return cls(xseg, dst, target, op=X_RELEASE, flags=flags)
 
     @classmethod
-    def get_delete_request(cls, xseg, dst, target):
-        return cls(xseg, dst, target, op=X_DELETE)
+    def get_delete_request(cls, xseg, dst, target, force=False):
+        flags = 0
+        if force:
+            flags = XF_FORCE
+        return cls(xseg, dst, target, op=X_DELETE, flags=flags)
 
     @classmethod
     def get_update_request(cls, xseg, dst, target):
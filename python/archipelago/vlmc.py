@@ -295,26 +295,26 @@ def list_volumes(cli=False, **kwargs):  # NOQA
                 except:
                     pass
         elif isinstance(peers['blockerm'], Filed):
-            path = peers['blockerm'].archip_dir
-            for root, dirs, files in os.walk(path):
-                for f in files:
-                    name = f
-                    try:
-                        f = open(os.path.join(root, f), 'r')
-                        header = f.read(MAX_HEADER_SIZE)
-                        f.close()
-                        ph = parse_header(name, header)
-                        if ph is None:
-                            continue
-                        (version, readonly, deleted) = ph
-                        volume = name
-                        if volume.startswith(ARCHIP_PREFIX):
-                            volume = volume[len(ARCHIP_PREFIX):]
-                        yield Volume(name=volume, version=version,
-                                     header_object=name, deleted=deleted,
-                                     readonly=readonly)
-                    except:
-                        pass
+            for path in archip_dirs(peers['blockerm'].archip_dir):
+                for root, dirs, files in os.walk(path):
+                    for f in files:
+                        name = f
+                        try:
+                            f = open(os.path.join(root, f), 'r')
+                            header = f.read(MAX_HEADER_SIZE)
+                            f.close()
+                            ph = parse_header(name, header)
+                            if ph is None:
+                                continue
+                            (version, readonly, deleted) = ph
+                            volume = name
+                            if volume.startswith(ARCHIP_PREFIX):
+                                volume = volume[len(ARCHIP_PREFIX):]
+                            yield Volume(name=volume, version=version,
+                                         header_object=name, deleted=deleted,
+                                         readonly=readonly)
+                        except:
+                            pass
         else:
             raise Error("Invalid storage")
 
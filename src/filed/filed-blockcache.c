@@ -0,0 +1,361 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+
+#include "peer.h"
+#include "filed-blockcache.h"
+#include "fnv.h"
+
+#define max(_a, _b) (_a > _b ? _a : _b)
+#define min(_a, _b) (_a < _b ? _a : _b)
+
+/*
+ * All blocks of an object hash to the same bucket, so that invalidating a
+ * whole object (delete, copy) only has to walk a single chain.
+ */
+static struct bc_bucket *get_bucket(struct blockcache *bc, char *name,
+                                    uint32_t namelen)
+{
+    return &bc->buckets[fnv_hash(name, namelen) % bc->nr_buckets];
+}
+
+static struct bc_block *find_block(struct bc_bucket *bucket, char *name,
+                                   uint32_t namelen, uint64_t index)
+{
+    struct bc_block *b;
+
+    for (b = bucket->head; b; b = b->hnext) {
+        if (b->index == index && b->namelen == namelen &&
+            !strncmp(b->name, name, namelen)) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void list_remove(struct blockcache *bc, struct bc_block *b)
+{
+    struct bc_list *l = &bc->lists[b->list];
+
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        l->head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        l->tail = b->prev;
+    }
+    b->prev = NULL;
+    b->next = NULL;
+    l->count--;
+}
+
+static void list_push(struct blockcache *bc, struct bc_block *b, int list)
+{
+    struct bc_list *l = &bc->lists[list];
+
+    b->list = list;
+    b->prev = NULL;
+    b->next = l->head;
+    if (l->head) {
+        l->head->prev = b;
+    } else {
+        l->tail = b;
+    }
+    l->head = b;
+    l->count++;
+}
+
+static void hash_remove(struct blockcache *bc, struct bc_block *b)
+{
+    struct bc_bucket *bucket = get_bucket(bc, b->name, b->namelen);
+    struct bc_block **pb;
+
+    for (pb = &bucket->head; *pb; pb = &(*pb)->hnext) {
+        if (*pb == b) {
+            *pb = b->hnext;
+            break;
+        }
+    }
+    b->hnext = NULL;
+}
+
+static void destroy_block(struct blockcache *bc, struct bc_block *b)
+{
+    list_remove(bc, b);
+    hash_remove(bc, b);
+    free(b->data);
+    free(b);
+}
+
+/* Move the LRU block of @from to the MRU position of ghost list @to. */
+static void demote(struct blockcache *bc, int from, int to)
+{
+    struct bc_block *b = bc->lists[from].tail;
+
+    list_remove(bc, b);
+    free(b->data);
+    b->data = NULL;
+    list_push(bc, b, to);
+    bc->stats.evictions++;
+}
+
+/* ARC REPLACE(x, p): make room for one more resident block. */
+static void replace(struct blockcache *bc, int in_b2)
+{
+    uint64_t t1 = bc->lists[BC_T1].count;
+
+    if (bc->lists[BC_T1].count + bc->lists[BC_T2].count < bc->size) {
+        return;
+    }
+
+    if (t1 && ((in_b2 && t1 == bc->p) || t1 > bc->p ||
+               !bc->lists[BC_T2].count)) {
+        demote(bc, BC_T1, BC_B1);
+    } else {
+        demote(bc, BC_T2, BC_B2);
+    }
+}
+
+int blockcache_init(struct blockcache *bc, uint64_t memory, uint64_t blocksize)
+{
+    int i;
+
+    memset(bc, 0, sizeof(struct blockcache));
+
+    if (!blocksize || blocksize % 512) {
+        XSEGLOG2(&lc, E, "Block cache blocksize must be a multiple of 512");
+        return -EINVAL;
+    }
+
+    bc->blocksize = blocksize;
+    bc->size = memory / blocksize;
+    if (!bc->size) {
+        XSEGLOG2(&lc, E, "Block cache memory %llu is less than blocksize %llu",
+                 (unsigned long long) memory,
+                 (unsigned long long) blocksize);
+        return -EINVAL;
+    }
+
+    bc->nr_buckets = bc->size;
+    bc->buckets = calloc(bc->nr_buckets, sizeof(struct bc_bucket));
+    if (!bc->buckets) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < BC_NR_LISTS; i++) {
+        bc->lists[i].head = NULL;
+        bc->lists[i].tail = NULL;
+        bc->lists[i].count = 0;
+    }
+
+    pthread_mutex_init(&bc->lock, NULL);
+
+    XSEGLOG2(&lc, I, "Block cache initialized with %llu blocks of %llu bytes",
+             (unsigned long long) bc->size, (unsigned long long) blocksize);
+    return 0;
+}
+
+void blockcache_destroy(struct blockcache *bc)
+{
+    int i;
+
+    if (!bc->buckets) {
+        return;
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    for (i = 0; i < BC_NR_LISTS; i++) {
+        while (bc->lists[i].tail) {
+            destroy_block(bc, bc->lists[i].tail);
+        }
+    }
+    free(bc->buckets);
+    bc->buckets = NULL;
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * Copy @len bytes at @offset of block @index to @buf.
+ *
+ * Returns 0 on a hit. On a miss it returns -1 and stores in @generation the
+ * value that must be passed to blockcache_insert, so that a block read from
+ * disk concurrently with a write to the same object is not cached.
+ */
+int blockcache_lookup(struct blockcache *bc, char *name, uint32_t namelen,
+                      uint64_t index, char *buf, uint64_t offset,
+                      uint64_t len, uint64_t *generation)
+{
+    struct bc_bucket *bucket;
+    struct bc_block *b;
+
+    pthread_mutex_lock(&bc->lock);
+    bucket = get_bucket(bc, name, namelen);
+    b = find_block(bucket, name, namelen, index);
+    if (!b || !b->data) {
+        bc->stats.misses++;
+        *generation = bucket->generation;
+        pthread_mutex_unlock(&bc->lock);
+        return -1;
+    }
+
+    memcpy(buf, b->data + offset, len);
+    list_remove(bc, b);
+    list_push(bc, b, BC_T2);
+    bc->stats.hits++;
+    pthread_mutex_unlock(&bc->lock);
+
+    return 0;
+}
+
+/*
+ * Insert block @index of object @name. @data must be a blocksize buffer
+ * allocated with malloc/posix_memalign. The cache takes ownership of it.
+ */
+void blockcache_insert(struct blockcache *bc, char *name, uint32_t namelen,
+                       uint64_t index, char *data, uint64_t generation)
+{
+    struct bc_bucket *bucket;
+    struct bc_block *b;
+    uint64_t b1, b2, l1, total;
+
+    pthread_mutex_lock(&bc->lock);
+    bucket = get_bucket(bc, name, namelen);
+    if (bucket->generation != generation) {
+        /* object was modified while the block was being read */
+        goto out_free;
+    }
+
+    b = find_block(bucket, name, namelen, index);
+    if (b && b->data) {
+        /* raced with another reader */
+        goto out_free;
+    }
+
+    b1 = bc->lists[BC_B1].count;
+    b2 = bc->lists[BC_B2].count;
+
+    if (b && b->list == BC_B1) {
+        bc->p = min(bc->size, bc->p + max(b2 / b1, 1));
+        replace(bc, 0);
+        list_remove(bc, b);
+        b->data = data;
+        list_push(bc, b, BC_T2);
+        bc->stats.ghost_hits++;
+        goto out;
+    }
+
+    if (b && b->list == BC_B2) {
+        l1 = max(b1 / b2, 1);
+        bc->p = bc->p > l1 ? bc->p - l1 : 0;
+        replace(bc, 1);
+        list_remove(bc, b);
+        b->data = data;
+        list_push(bc, b, BC_T2);
+        bc->stats.ghost_hits++;
+        goto out;
+    }
+
+    l1 = bc->lists[BC_T1].count + b1;
+    total = l1 + bc->lists[BC_T2].count + b2;
+    if (l1 >= bc->size) {
+        if (bc->lists[BC_T1].count < bc->size) {
+            destroy_block(bc, bc->lists[BC_B1].tail);
+            replace(bc, 0);
+        } else {
+            destroy_block(bc, bc->lists[BC_T1].tail);
+            bc->stats.evictions++;
+        }
+    } else if (total >= bc->size) {
+        if (total >= 2 * bc->size) {
+            destroy_block(bc, bc->lists[BC_B2].tail);
+        }
+        replace(bc, 0);
+    }
+
+    b = malloc(sizeof(struct bc_block));
+    if (!b) {
+        goto out_free;
+    }
+    b->index = index;
+    b->data = data;
+    b->namelen = namelen;
+    strncpy(b->name, name, namelen);
+    b->name[namelen] = 0;
+    b->hnext = bucket->head;
+    bucket->head = b;
+    list_push(bc, b, BC_T1);
+
+  out:
+    bc->stats.inserts++;
+    pthread_mutex_unlock(&bc->lock);
+    return;
+
+  out_free:
+    pthread_mutex_unlock(&bc->lock);
+    free(data);
+}
+
+/*
+ * Drop all cached blocks of @name that overlap with [offset, offset + size).
+ * A zero @size drops every block of the object.
+ */
+void blockcache_invalidate(struct blockcache *bc, char *name,
+                           uint32_t namelen, uint64_t offset, uint64_t size)
+{
+    struct bc_bucket *bucket;
+    struct bc_block *b, *next;
+    uint64_t first = 0, last = UINT64_MAX;
+
+    if (size) {
+        first = offset / bc->blocksize;
+        last = (offset + size - 1) / bc->blocksize;
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    bucket = get_bucket(bc, name, namelen);
+    bucket->generation++;
+    for (b = bucket->head; b; b = next) {
+        next = b->hnext;
+        if (b->index < first || b->index > last || b->namelen != namelen ||
+            strncmp(b->name, name, namelen)) {
+            continue;
+        }
+        if (b->data) {
+            bc->stats.invalidations++;
+        }
+        destroy_block(bc, b);
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+void blockcache_get_stats(struct blockcache *bc, struct bc_stats *stats)
+{
+    pthread_mutex_lock(&bc->lock);
+    *stats = bc->stats;
+    pthread_mutex_unlock(&bc->lock);
+}
@@ -0,0 +1,226 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Report the on-disk fragmentation of the objects of a filed instance.
+ *
+ * Walks the archip directories and maps the extents of every object with the
+ * FIEMAP ioctl. Physically adjacent extents count as one fragment, so the
+ * report shows how many seeks a sequential read of each object takes.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define MAX_EXTENTS	512
+#define MAX_WORST	10
+#define MAX_PATH_SIZE	1024
+
+struct frag_file {
+    char path[MAX_PATH_SIZE + 1];
+    uint64_t fragments;
+};
+
+static struct fiemap *fm;
+static int verbose;
+static uint64_t nr_files, nr_bytes, nr_extents, nr_fragments;
+static uint64_t nr_fragmented, nr_errors;
+static struct frag_file worst[MAX_WORST];
+static int nr_worst;
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-v] <archip dir>[:weight][,...]\n"
+            "  -v: Print the fragments of every object\n", argv0);
+}
+
+static void add_worst(const char *path, uint64_t fragments)
+{
+    int i;
+
+    if (nr_worst == MAX_WORST && fragments <= worst[nr_worst - 1].fragments) {
+        return;
+    }
+    i = (nr_worst < MAX_WORST) ? nr_worst++ : nr_worst - 1;
+    for (; i > 0 && worst[i - 1].fragments < fragments; i--) {
+        worst[i] = worst[i - 1];
+    }
+    strncpy(worst[i].path, path, MAX_PATH_SIZE);
+    worst[i].path[MAX_PATH_SIZE] = 0;
+    worst[i].fragments = fragments;
+}
+
+/* Count the extents and physically contiguous fragments of @fd */
+static int map_file(int fd, uint64_t size, uint64_t *extents,
+                    uint64_t *fragments)
+{
+    struct fiemap_extent *fe;
+    uint64_t start = 0, next_physical = 0;
+    uint32_t i;
+    int last = 0;
+
+    *extents = 0;
+    *fragments = 0;
+    while (!last && start < size) {
+        memset(fm, 0, sizeof(struct fiemap));
+        fm->fm_start = start;
+        fm->fm_length = size - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = MAX_EXTENTS;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+            return -errno;
+        }
+        if (!fm->fm_mapped_extents) {
+            break;
+        }
+        for (i = 0; i < fm->fm_mapped_extents; i++) {
+            fe = &fm->fm_extents[i];
+            if (!*extents || fe->fe_physical != next_physical) {
+                (*fragments)++;
+            }
+            (*extents)++;
+            next_physical = fe->fe_physical + fe->fe_length;
+            start = fe->fe_logical + fe->fe_length;
+            if (fe->fe_flags & FIEMAP_EXTENT_LAST) {
+                last = 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int walk_cb(const char *path, const struct stat *st, int type,
+                   struct FTW *ftw)
+{
+    uint64_t extents, fragments;
+    int fd, r;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        nr_errors++;
+        return 0;
+    }
+    r = map_file(fd, st->st_size, &extents, &fragments);
+    close(fd);
+    if (r < 0) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(-r));
+        nr_errors++;
+        return 0;
+    }
+
+    if (verbose) {
+        printf("%s: %llu bytes, %llu extents, %llu fragments\n", path,
+               (unsigned long long) st->st_size,
+               (unsigned long long) extents,
+               (unsigned long long) fragments);
+    }
+    nr_files++;
+    nr_bytes += st->st_size;
+    nr_extents += extents;
+    nr_fragments += fragments;
+    if (fragments > 1) {
+        nr_fragmented++;
+        add_worst(path, fragments);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *dirs, *dir, *sep, *saveptr;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fm = malloc(sizeof(struct fiemap) +
+                MAX_EXTENTS * sizeof(struct fiemap_extent));
+    if (!fm) {
+        perror("malloc");
+        return 1;
+    }
+
+    dirs = argv[optind];
+    for (dir = strtok_r(dirs, ",", &saveptr); dir;
+         dir = strtok_r(NULL, ",", &saveptr)) {
+        /* the list of filed, whose directories may be weighted */
+        sep = strrchr(dir, ':');
+        if (sep && sep[1] && strspn(sep + 1, "0123456789") == strlen(sep + 1)) {
+            *sep = 0;
+        }
+        if (nftw(dir, walk_cb, 64, FTW_PHYS) < 0) {
+            fprintf(stderr, "Could not walk %s: %s\n", dir, strerror(errno));
+            free(fm);
+            return 1;
+        }
+    }
+
+    printf("Objects:            %llu\n", (unsigned long long) nr_files);
+    printf("Bytes:              %llu\n", (unsigned long long) nr_bytes);
+    printf("Extents:            %llu\n", (unsigned long long) nr_extents);
+    printf("Fragments:          %llu\n", (unsigned long long) nr_fragments);
+    printf("Fragments/object:   %.2f\n",
+           nr_files ? (double) nr_fragments / nr_files : 0);
+    printf("Fragmented objects: %llu (%.1f%%)\n",
+           (unsigned long long) nr_fragmented,
+           nr_files ? 100.0 * nr_fragmented / nr_files : 0);
+    if (nr_errors) {
+        printf("Errors:             %llu\n", (unsigned long long) nr_errors);
+    }
+    if (nr_worst) {
+        printf("Most fragmented:\n");
+        for (i = 0; i < nr_worst; i++) {
+            printf("  %6llu %s\n", (unsigned long long) worst[i].fragments,
+                   worst[i].path);
+        }
+    }
+
+    free(fm);
+    return nr_errors ? 2 : 0;
+}
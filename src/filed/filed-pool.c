@@ -0,0 +1,276 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+
+#include "peer.h"
+#include "filed-pool.h"
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void account_wait(struct filed_pool *pool, struct pool_entry *pe,
+                         uint64_t t)
+{
+    uint64_t wait = t > pe->queued ? t - pe->queued : 0;
+
+    pool->stats.wait_us += wait;
+    if (wait > pool->stats.max_wait_us) {
+        pool->stats.max_wait_us = wait;
+    }
+}
+
+static struct pool_entry *pool_dequeue(struct filed_pool *pool)
+{
+    struct pool_entry *pe = pool->head;
+
+    pool->head = pe->next;
+    if (!pool->head) {
+        pool->tail = NULL;
+    }
+    pe->next = NULL;
+    pool->stats.depth--;
+
+    return pe;
+}
+
+/*
+ * Move to @batch the queued requests that can be merged after its last one,
+ * until none is left or the batch is full. Returns the new batch size.
+ */
+static int pool_collect(struct filed_pool *pool, struct peer_req **batch,
+                        int nr)
+{
+    struct pool_entry *pe, *prev;
+    int found = 1;
+
+    while (found && nr < POOL_MAX_BATCH) {
+        found = 0;
+        for (prev = NULL, pe = pool->head; pe; prev = pe, pe = pe->next) {
+            if (!pool->can_merge(pool->peer, batch[nr - 1], pe->pr)) {
+                continue;
+            }
+            if (prev) {
+                prev->next = pe->next;
+            } else {
+                pool->head = pe->next;
+            }
+            if (pool->tail == pe) {
+                pool->tail = prev;
+            }
+            pe->next = NULL;
+            pool->stats.depth--;
+            account_wait(pool, pe, now_us());
+            batch[nr++] = pe->pr;
+            found = 1;
+            break;
+        }
+    }
+
+    return nr;
+}
+
+static void pool_wait_window(struct filed_pool *pool)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += pool->window / 1000000;
+    ts.tv_nsec += (pool->window % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+}
+
+static void *pool_worker(void *arg)
+{
+    struct filed_pool *pool = (struct filed_pool *) arg;
+    struct pool_entry *pe;
+    struct peer_req *batch[POOL_MAX_BATCH];
+    uint64_t start;
+    int nr;
+
+    XSEGLOG2(&lc, I, "Pool %s worker started", pool->name);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (!pool->head) {
+            break;
+        }
+        pe = pool_dequeue(pool);
+        account_wait(pool, pe, now_us());
+        batch[0] = pe->pr;
+        nr = 1;
+        if (pool->can_merge) {
+            nr = pool_collect(pool, batch, nr);
+            if (nr == 1 && pool->window && pool->busy && !pool->stopping) {
+                /* more requests are likely to follow */
+                pool_wait_window(pool);
+                nr = pool_collect(pool, batch, nr);
+                if (pool->head) {
+                    /* we may have consumed the wakeup of an idle worker */
+                    pthread_cond_signal(&pool->cond);
+                }
+            }
+            if (nr > 1) {
+                pool->stats.batches++;
+                pool->stats.merged += nr;
+            }
+        }
+        pool->busy++;
+        pthread_mutex_unlock(&pool->lock);
+
+        start = now_us();
+        if (nr > 1) {
+            pool->execute_batch(pool->peer, batch, nr);
+        } else {
+            pool->execute(pool->peer, batch[0]);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stats.service_us += now_us() - start;
+        pool->stats.completed += nr;
+        pool->busy--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    XSEGLOG2(&lc, I, "Pool %s worker stopped", pool->name);
+    return NULL;
+}
+
+int pool_init(struct filed_pool *pool, struct peerd *peer, char *name,
+              uint32_t nr_threads,
+              void (*execute) (struct peerd * peer, struct peer_req * pr))
+{
+    uint32_t i;
+    int r;
+
+    memset(pool, 0, sizeof(struct filed_pool));
+    strncpy(pool->name, name, POOL_NAME_LEN);
+    pool->name[POOL_NAME_LEN] = 0;
+    pool->peer = peer;
+    pool->execute = execute;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+        r = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+        if (r) {
+            XSEGLOG2(&lc, E, "Could not create worker %u for pool %s",
+                     i, pool->name);
+            pool_stop(pool);
+            return -r;
+        }
+        pool->nr_threads++;
+    }
+
+    return 0;
+}
+
+/*
+ * Enable coalescing of queued requests. Must be called before any request is
+ * submitted.
+ */
+void pool_set_coalescing(struct filed_pool *pool, uint64_t window,
+                         int (*can_merge) (struct peerd * peer,
+                                           struct peer_req * last,
+                                           struct peer_req * next),
+                         void (*execute_batch) (struct peerd * peer,
+                                                struct peer_req ** prs,
+                                                int nr))
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->window = window;
+    pool->can_merge = can_merge;
+    pool->execute_batch = execute_batch;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_submit(struct filed_pool *pool, struct pool_entry *pe,
+                 struct peer_req *pr)
+{
+    pe->pr = pr;
+    pe->next = NULL;
+    pe->queued = now_us();
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = pe;
+    } else {
+        pool->head = pe;
+    }
+    pool->tail = pe;
+    pool->stats.submitted++;
+    pool->stats.depth++;
+    if (pool->stats.depth > pool->stats.max_depth) {
+        pool->stats.max_depth = pool->stats.depth;
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait for the queued requests to be served and join the workers */
+void pool_stop(struct filed_pool *pool)
+{
+    uint32_t i;
+
+    if (!pool->threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nr_threads = 0;
+}
+
+void pool_get_stats(struct filed_pool *pool, struct pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
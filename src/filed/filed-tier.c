@@ -0,0 +1,183 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+
+#include "peer.h"
+#include "filed-tier.h"
+#include "fnv.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t name_hash(char *name, uint32_t namelen)
+{
+    uint64_t h = fnv_hash(name, namelen);
+
+    /* zero marks an empty entry */
+    return h ? h : 1;
+}
+
+static double decayed(struct heat_entry *e, double t)
+{
+    return e->heat * exp2(-(t - e->last) / HEAT_HALFLIFE);
+}
+
+int heat_init(struct heat_table *ht, uint64_t nr_entries)
+{
+    int i;
+
+    ht->nr_sets = nr_entries / HEAT_SET_WAYS;
+    if (!ht->nr_sets) {
+        ht->nr_sets = 1;
+    }
+    ht->entries = calloc(ht->nr_sets * HEAT_SET_WAYS,
+                         sizeof(struct heat_entry));
+    if (!ht->entries) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < HEAT_NR_LOCKS; i++) {
+        pthread_mutex_init(&ht->locks[i], NULL);
+    }
+
+    return 0;
+}
+
+static struct heat_entry *find_entry(struct heat_table *ht, uint64_t hash,
+                                     char *name, uint32_t namelen,
+                                     struct heat_entry **victim, double t)
+{
+    struct heat_entry *set, *e;
+    int i;
+
+    set = &ht->entries[(hash % ht->nr_sets) * HEAT_SET_WAYS];
+    if (victim) {
+        *victim = set;
+    }
+    for (i = 0; i < HEAT_SET_WAYS; i++) {
+        e = &set[i];
+        if (e->hash == hash && e->namelen == namelen &&
+            !strncmp(e->name, name, namelen)) {
+            return e;
+        }
+        if (victim && (!e->hash || ((*victim)->hash &&
+                                    decayed(e, t) < decayed(*victim, t)))) {
+            *victim = e;
+        }
+    }
+
+    return NULL;
+}
+
+static pthread_mutex_t *set_lock(struct heat_table *ht, uint64_t hash)
+{
+    return &ht->locks[(hash % ht->nr_sets) % HEAT_NR_LOCKS];
+}
+
+/* Record an access to @name */
+void heat_touch(struct heat_table *ht, char *name, uint32_t namelen)
+{
+    uint64_t hash = name_hash(name, namelen);
+    pthread_mutex_t *lock = set_lock(ht, hash);
+    struct heat_entry *e, *victim;
+    double t = now();
+
+    pthread_mutex_lock(lock);
+    e = find_entry(ht, hash, name, namelen, &victim, t);
+    if (!e) {
+        e = victim;
+        e->hash = hash;
+        e->heat = 0;
+        e->namelen = namelen;
+        strncpy(e->name, name, namelen);
+        e->name[namelen] = 0;
+    } else {
+        e->heat = decayed(e, t);
+    }
+    e->heat += 1;
+    e->last = t;
+    pthread_mutex_unlock(lock);
+}
+
+/* Return the current heat of @name. Untracked objects are cold. */
+double heat_get(struct heat_table *ht, char *name, uint32_t namelen)
+{
+    uint64_t hash = name_hash(name, namelen);
+    pthread_mutex_t *lock = set_lock(ht, hash);
+    struct heat_entry *e;
+    double heat = 0;
+
+    pthread_mutex_lock(lock);
+    e = find_entry(ht, hash, name, namelen, NULL, 0);
+    if (e) {
+        heat = decayed(e, now());
+    }
+    pthread_mutex_unlock(lock);
+
+    return heat;
+}
+
+/*
+ * Copy to @out up to @max of the hottest entries with heat at least
+ * @min_heat, hottest first. Returns the number of entries copied.
+ */
+int heat_hottest(struct heat_table *ht, struct heat_entry *out, int max,
+                 double min_heat)
+{
+    uint64_t i;
+    int j, n = 0;
+    double t = now(), heat;
+    struct heat_entry *e;
+    pthread_mutex_t *lock;
+
+    for (i = 0; i < ht->nr_sets * HEAT_SET_WAYS; i++) {
+        e = &ht->entries[i];
+        lock = &ht->locks[(i / HEAT_SET_WAYS) % HEAT_NR_LOCKS];
+        pthread_mutex_lock(lock);
+        heat = e->hash ? decayed(e, t) : 0;
+        if (!e->hash || heat < min_heat ||
+            (n == max && heat <= out[n - 1].heat)) {
+            pthread_mutex_unlock(lock);
+            continue;
+        }
+        /* insertion sort into out */
+        j = (n < max) ? n++ : n - 1;
+        for (; j > 0 && out[j - 1].heat < heat; j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = *e;
+        out[j].heat = heat;
+        pthread_mutex_unlock(lock);
+    }
+
+    return n;
+}
@@ -30,16 +30,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <syscall.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <openssl/sha.h>
 #include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <math.h>
 #include <xseg/xseg.h>
 #include <xseg/protocol.h>
 
 #include "hash.h"
 #include "peer.h"
 #include "filed.h"
+#include "fnv.h"
 
 #define min(_a, _b) (_a < _b ? _a : _b)
+/* buffer of copies that the kernel cannot do on its own */
+#define COPY_BUF_SIZE (1024 * 1024)
 
 /*
  * Globals, holding command-line arguments
@@ -51,9 +58,41 @@ void custom_peer_usage(char *argv0)
             "  Option        | Default    | \n"
             "  --------------------------------------------\n"
             "    --fdcache   | 2 * nr_ops | Fd cache size\n"
-            "    --archip    | None       | Archipelago directory\n"
+            "    --archip    | None       | Archipelago directory. A comma-separated\n"
+            "                |            | list stripes objects over many disks,\n"
+            "                |            | each one as path[:weight] (weight: 1)\n"
             "    --prefix    | None       | Common prefix of objects that should be stripped\n"
             "    --uniquestr | None       | Unique string for this instance\n"
+            "    --blockcache| 0          | Block cache memory in MB (0 disables it).\n"
+            "                |            | Meant to be used with --directio\n"
+            "    --blockcache-bs | 65536  | Block cache blocksize in bytes\n"
+            "    --disk-threads | 0       | I/O threads per data directory\n"
+            "                |            | (0 serves requests on the peer threads)\n"
+            "    --rebalance | False      | Move objects to their home data directory\n"
+            "                |            | in the background, e.g. after adding one\n"
+            "    --move-bw   | 0          | Bandwidth limit in MB/s for moving objects\n"
+            "                |            | in the background (0 for no limit)\n"
+            "    --archip-fast | None     | Fast tier directory. Hot objects are\n"
+            "                |            | promoted there in the background\n"
+            "    --tier-promote | 4       | Accesses (decaying over time) that make\n"
+            "                |            | an object hot\n"
+            "    --tier-fast-max | 90     | Max usage percentage of the fast tier\n"
+            "    --tier-track | 16384     | Number of objects tracked for tiering\n"
+            "    --meta-threads | 0       | Threads for metadata operations (create,\n"
+            "                |            | delete, copy, lock, hash), kept apart\n"
+            "                |            | from reads and writes (0 disables it).\n"
+            "                |            | Implies --disk-threads\n"
+            "    --coalesce  | 0          | Merge queued reads/writes to adjacent\n"
+            "                |            | ranges of an object, waiting up to this\n"
+            "                |            | many usecs for more (0 disables it)\n"
+            "    --readahead | 0          | Readahead in KB for sequential reads\n"
+            "                |            | (0 disables it, ignored with --directio)\n"
+            "    --readahead-drop | False | Drop pages of sequential streams from\n"
+            "                |            | the page cache once they are read\n"
+            "    --prealloc  | 0          | Preallocate this many KB of new objects\n"
+            "                |            | (0 disables it)\n"
+            "    --prealloc-grow-size | False | Also set the size of new objects\n"
+            "                |            | to the preallocated size\n"
             "\n");
 }
 
@@ -84,6 +123,10 @@ static void *cache_node_init(void *p, void *xh)
 
     fdentry->fd = -1;
     fdentry->flags = 0;
+    pthread_mutex_init(&fdentry->ra_lock, NULL);
+    fdentry->ra_next = 0;
+    fdentry->ra_end = 0;
+    fdentry->ra_seq = 0;
 
     return fdentry;
 }
@@ -112,6 +155,9 @@ static void cache_put(void *p, void *e)
 
     fdentry->fd = -1;
     fdentry->flags = 0;
+    fdentry->ra_next = 0;
+    fdentry->ra_end = 0;
+    fdentry->ra_seq = 0;
     return;
 }
 
@@ -188,12 +234,12 @@ static int create_dir(char *path)
     return 0;
 }
 
-static int __create_path(char *buf, struct pfiled *pfiled, char dirs[6],
+static int __create_path(char *buf, struct filed_disk *disk, char dirs[6],
                          char *target, uint32_t targetlen, int mkdirs)
 {
     int i, r;
-    char *path = pfiled->vpath;
-    uint32_t pathlen = pfiled->vpath_len;
+    char *path = disk->path;
+    uint32_t pathlen = disk->path_len;
 
     strncpy(buf, path, pathlen);
 
@@ -216,8 +262,48 @@ static int __create_path(char *buf, struct pfiled *pfiled, char dirs[6],
     return 0;
 }
 
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/*
+ * Pick the home disk of an object with weighted rendezvous hashing. Every
+ * disk scores the object and the highest score wins, so adding a disk only
+ * moves the objects that the new disk wins, in proportion to its weight.
+ */
+static uint32_t place_object(struct pfiled *pfiled, unsigned char *sha)
+{
+    uint32_t i, best = 0;
+    uint64_t key, h;
+    double u, score, best_score = -1.0;
+
+    if (pfiled->nr_disks < 2) {
+        return 0;
+    }
+
+    /* the first bytes are used for the directory structure */
+    memcpy(&key, sha + 8, sizeof(key));
+    for (i = 0; i < pfiled->nr_disks; i++) {
+        h = mix64(key ^ pfiled->disks[i].seed);
+        u = ((h >> 11) + 0.5) / 9007199254740992.0;
+        score = (double) pfiled->disks[i].weight / -log(u);
+        if (score > best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
 static int get_dirs_filed(char buf[6], struct pfiled *pfiled, char *target,
-                          uint32_t targetlen)
+                          uint32_t targetlen, uint32_t *disk)
 {
     unsigned char sha[SHA256_DIGEST_SIZE];
     char hex[HEXLIFIED_SHA256_DIGEST_SIZE];
@@ -225,6 +311,9 @@ static int get_dirs_filed(char buf[6], struct pfiled *pfiled, char *target,
     SHA256((unsigned char *) target, targetlen, sha);
     hexlify(sha, 3, hex);
     strncpy(buf, hex, 6);
+    if (disk) {
+        *disk = place_object(pfiled, sha);
+    }
 
     return 0;
 }
@@ -234,9 +323,10 @@ static int get_dirs_filed(char buf[6], struct pfiled *pfiled, char *target,
 //Migrations only work with caching, since old pithos files are guaranteed read
 //only.
 static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
-                           uint32_t targetlen)
+                           uint32_t targetlen, uint32_t *disk)
 {
     int ret, r, pithos_fd;
+    uint32_t home;
     char *pithos_path = NULL, *filed_path = NULL;
     struct stat pithos_st, filed_st;
 
@@ -247,8 +337,10 @@ static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
         goto out;
     }
 
+    /* old pithos files live on the first disk */
+    *disk = 0;
     strncpy(buf, target, 6);
-    __create_path(pithos_path, pfiled, buf, target, targetlen, 0);
+    __create_path(pithos_path, &pfiled->disks[0], buf, target, targetlen, 0);
 
     pithos_fd = open_file_read_path(pfiled, pithos_path);
     if (pithos_fd < 0) {
@@ -269,8 +361,17 @@ static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
         goto out_close_pithos;
     }
 
-    get_dirs_filed(buf, pfiled, target, targetlen);
-    r = __create_path(filed_path, pfiled, buf, target, targetlen, 1);
+    get_dirs_filed(buf, pfiled, target, targetlen, &home);
+    if (home != 0) {
+        /* cannot link across disks. Keep serving the old path. */
+        XSEGLOG2(&lc, W, "Pithos file %s does not belong to the first disk. "
+                 "Not migrating", pithos_path);
+        strncpy(buf, target, 6);
+        ret = 0;
+        goto out_close_pithos;
+    }
+    r = __create_path(filed_path, &pfiled->disks[0], buf, target, targetlen,
+                      1);
     if (r < 0) {
         r = -EIO;
         goto out_close_pithos;
@@ -332,19 +433,19 @@ static int get_dirs_pithos(char buf[6], struct pfiled *pfiled, char *target,
 }
 
 static int get_dirs(char buf[6], struct pfiled *pfiled, char *target,
-                    uint32_t targetlen)
+                    uint32_t targetlen, uint32_t *disk)
 {
     uint32_t prefixlen = pfiled->prefix_len;
     int r;
 
     if (matches_pithos_object(target, targetlen)) {
-        r = get_dirs_pithos(buf, pfiled, target, targetlen);
+        r = get_dirs_pithos(buf, pfiled, target, targetlen, disk);
         if (r != -ENOENT) {
             return r;
         }
     }
 
-    return get_dirs_filed(buf, pfiled, target, targetlen);
+    return get_dirs_filed(buf, pfiled, target, targetlen, disk);
 }
 
 static int strnjoin(char *dest, int n, ...)
@@ -386,15 +487,90 @@ static int create_path(char *buf, struct pfiled *pfiled, char *target,
                        uint32_t targetlen, int mkdirs)
 {
     char dirs[6];
+    uint32_t disk;
     int r;
     //propagate mkdirs here, to signal a write and filter them out or signal
     //error when do_not_migrate flag enabled ?
-    r = get_dirs(dirs, pfiled, target, targetlen);
+    r = get_dirs(dirs, pfiled, target, targetlen, &disk);
+    if (r < 0) {
+        return r;
+    }
+
+    return __create_path(buf, &pfiled->disks[disk], dirs, target, targetlen,
+                         mkdirs);
+}
+
+/* Create the path of @target on a specific disk */
+static int create_path_on_disk(char *buf, struct pfiled *pfiled,
+                               uint32_t disk, char *target,
+                               uint32_t targetlen, int mkdirs)
+{
+    char dirs[6];
+
+    get_dirs_filed(dirs, pfiled, target, targetlen, NULL);
+    return __create_path(buf, &pfiled->disks[disk], dirs, target, targetlen,
+                         mkdirs);
+}
+
+static uint32_t get_disk(struct pfiled *pfiled, char *target,
+                         uint32_t targetlen)
+{
+    char dirs[6];
+    uint32_t disk;
+
+    get_dirs_filed(dirs, pfiled, target, targetlen, &disk);
+    return disk;
+}
+
+/*
+ * Find the path of an existing @target. Objects are looked up on the fast
+ * tier, if any, then on their home disk and then on the rest of the disks,
+ * since they may have not been rebalanced yet. If the object does not exist
+ * anywhere, the path on its home disk is returned.
+ */
+static int locate_path(char *buf, struct pfiled *pfiled, char *target,
+                       uint32_t targetlen, int mkdirs)
+{
+    char dirs[6];
+    uint32_t home, i;
+    struct stat st;
+    int r;
+
+    r = get_dirs(dirs, pfiled, target, targetlen, &home);
     if (r < 0) {
         return r;
     }
 
-    return __create_path(buf, pfiled, dirs, target, targetlen, mkdirs);
+    if (pfiled->tiering) {
+        create_path_on_disk(buf, pfiled, FAST_DISK, target, targetlen, 0);
+        if (!stat(buf, &st)) {
+            return 0;
+        }
+    }
+
+    if (pfiled->nr_disks < 2) {
+        return __create_path(buf, &pfiled->disks[home], dirs, target,
+                             targetlen, mkdirs);
+    }
+
+    __create_path(buf, &pfiled->disks[home], dirs, target, targetlen, 0);
+    if (!stat(buf, &st)) {
+        return 0;
+    }
+
+    for (i = 0; i < pfiled->nr_disks; i++) {
+        if (i == home) {
+            continue;
+        }
+        create_path_on_disk(buf, pfiled, i, target, targetlen, 0);
+        if (!stat(buf, &st)) {
+            XSEGLOG2(&lc, D, "Found %s away from its home disk %u", buf, home);
+            return 0;
+        }
+    }
+
+    return __create_path(buf, &pfiled->disks[home], dirs, target, targetlen,
+                         mkdirs);
 }
 
 
@@ -451,6 +627,40 @@ static ssize_t persisting_write(int fd, void *data, size_t size, off_t offset)
     return sum;
 }
 
+/* Vectored version of persisting_read/persisting_write */
+static ssize_t persisting_iov(int fd, struct iovec *iov, int iovcnt,
+                              off_t offset, int write)
+{
+    ssize_t r = 0, sum = 0;
+
+    while (iovcnt) {
+        if (write) {
+            r = pwritev(fd, iov, iovcnt, offset + sum);
+        } else {
+            r = preadv(fd, iov, iovcnt, offset + sum);
+        }
+        if (r <= 0) {
+            break;
+        }
+        sum += r;
+        while (iovcnt && r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    XSEGLOG2(&lc, D, "Finished. Transferred %zd, r = %zd", sum, r);
+
+    if (sum == 0 && r < 0) {
+        sum = r;
+    }
+    return sum;
+}
+
 static ssize_t aligned_read(int fd, void *data, ssize_t size, off_t offset,
                             int alignment)
 {
@@ -636,6 +846,128 @@ static ssize_t pfiled_write(struct pfiled *pfiled, int fd, void *data,
     return filed_write(fd, data, size, offset, pfiled->directio);
 }
 
+/*
+ * Serve a read through the block cache. Missing blocks are read from disk as
+ * a whole, so that they can be cached, and are zero-filled beyond EOF.
+ */
+static ssize_t cached_read(struct pfiled *pfiled, int fd, char *target,
+                           uint32_t targetlen, char *data, uint64_t size,
+                           uint64_t offset)
+{
+    struct blockcache *bc = &pfiled->bcache;
+    uint64_t bs = bc->blocksize;
+    uint64_t index, boff, len, generation, pos = 0;
+    char *buf;
+    ssize_t r;
+
+    while (pos < size) {
+        index = (offset + pos) / bs;
+        boff = (offset + pos) % bs;
+        len = min(bs - boff, size - pos);
+
+        r = blockcache_lookup(bc, target, targetlen, index, data + pos, boff,
+                              len, &generation);
+        if (r < 0) {
+            r = posix_memalign((void **) &buf, 512, bs);
+            if (r) {
+                return -1;
+            }
+            r = pfiled_read(pfiled, fd, buf, bs, index * bs);
+            if (r < 0) {
+                free(buf);
+                return -1;
+            } else if (r < bs) {
+                memset(buf + r, 0, bs - r);
+            }
+            memcpy(data + pos, buf + boff, len);
+            blockcache_insert(bc, target, targetlen, index, buf, generation);
+        }
+        pos += len;
+    }
+
+    return size;
+}
+
+/*
+ * Track the reads on the fd of @fio and, once they form a sequential stream,
+ * ask the kernel to prefetch up to pfiled->readahead bytes ahead of them.
+ * The prefetched range is topped up when less than half of it is left.
+ * Returns 1 if the read of [offset, offset + size) is part of a stream.
+ */
+static int readahead_before(struct pfiled *pfiled, struct fio *fio, int fd,
+                            uint64_t offset, uint64_t size)
+{
+    struct fdcache_entry *e;
+    uint64_t end = offset + size, start = 0, len = 0;
+    int seq, hit;
+
+    if (!pfiled->readahead) {
+        return 0;
+    }
+    e = xcache_get_entry(&pfiled->cache, fio->h);
+    if (!e) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&e->ra_lock);
+    if (offset == e->ra_next) {
+        e->ra_seq++;
+    } else {
+        e->ra_seq = 0;
+        e->ra_end = 0;
+    }
+    e->ra_next = end;
+    seq = (e->ra_seq >= RA_MIN_SEQ);
+    hit = (seq && end <= e->ra_end);
+    if (seq && e->ra_end < end + pfiled->readahead / 2) {
+        start = e->ra_end > end ? e->ra_end : end;
+        len = end + pfiled->readahead - start;
+        e->ra_end = start + len;
+    }
+    pthread_mutex_unlock(&e->ra_lock);
+
+    if (!seq) {
+        return 0;
+    }
+    __sync_fetch_and_add(&pfiled->ra_seq_reads, 1);
+    if (hit) {
+        __sync_fetch_and_add(&pfiled->ra_hits, 1);
+    }
+    if (len && !posix_fadvise(fd, start, len, POSIX_FADV_WILLNEED)) {
+        __sync_fetch_and_add(&pfiled->ra_prefetches, 1);
+        __sync_fetch_and_add(&pfiled->ra_prefetched, len);
+    }
+    return 1;
+}
+
+/*
+ * With --readahead-drop, drop the pages a stream has read past from the
+ * page cache, so that streaming reads do not evict more useful data.
+ */
+static void readahead_after(struct pfiled *pfiled, int fd, uint64_t offset,
+                            uint64_t size, int seq)
+{
+    uint64_t start = offset & ~((uint64_t) RA_PAGE_SIZE - 1);
+    uint64_t end = (offset + size) & ~((uint64_t) RA_PAGE_SIZE - 1);
+
+    if (!seq || !pfiled->ra_drop || end <= start) {
+        return;
+    }
+    if (!posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED)) {
+        __sync_fetch_and_add(&pfiled->ra_dropped, end - start);
+    }
+}
+
+static void invalidate_blocks(struct pfiled *pfiled, char *target,
+                              uint32_t targetlen, uint64_t offset,
+                              uint64_t size)
+{
+    if (!pfiled->bcache_size) {
+        return;
+    }
+    blockcache_invalidate(&pfiled->bcache, target, targetlen, offset, size);
+}
+
 static ssize_t generic_io_path(char *path, void *data, size_t size,
                                off_t offset, int write, int flags, mode_t mode)
 {
@@ -676,7 +1008,7 @@ static ssize_t pfiled_read_name(struct pfiled *pfiled, char *name,
 {
     char path[XSEG_MAX_TARGETLEN + MAX_PATH_SIZE + 1];
     int r;
-    r = create_path(path, pfiled, name, namelen, 0);
+    r = locate_path(path, pfiled, name, namelen, 0);
     if (r < 0) {
         XSEGLOG2(&lc, E, "Could not create path");
         return -1;
@@ -754,10 +1086,31 @@ static int is_target_valid(struct pfiled *pfiled, char *target, int mode)
 }
 */
 
+/*
+ * Allocate the first pfiled->prealloc bytes of a new object at once, so that
+ * the filesystem can lay it out contiguously instead of growing it extent by
+ * extent as it is written. The size of the object is kept, unless asked
+ * otherwise, so that it still tells how much of the object has been written.
+ */
+static void preallocate(struct pfiled *pfiled, int fd, char *path)
+{
+    int mode = pfiled->prealloc_grow_size ? 0 : FALLOC_FL_KEEP_SIZE;
+    char error_str[1024];
+
+    if (fallocate(fd, mode, 0, pfiled->prealloc) < 0) {
+        XSEGLOG2(&lc, W, "Could not preallocate file %s. Error: %s", path,
+                 strerror_r(errno, error_str, 1023));
+        __sync_fetch_and_add(&pfiled->nr_prealloc_failed, 1);
+        return;
+    }
+    __sync_fetch_and_add(&pfiled->nr_prealloc, 1);
+}
+
 static int open_file_path(struct pfiled *pfiled, char *path, int create)
 {
     int fd, flags;
     char error_str[1024];
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 
     flags = O_RDWR;
     if (create) {
@@ -771,8 +1124,20 @@ static int open_file_path(struct pfiled *pfiled, char *path, int create)
         flags |= O_DIRECT;
     }
 
-    fd = open(path, flags,
-              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (create && pfiled->prealloc) {
+        /* find out if we are the ones creating the file */
+        fd = open(path, flags | O_EXCL, mode);
+        if (fd >= 0) {
+            preallocate(pfiled, fd, path);
+            return fd;
+        } else if (errno != EEXIST) {
+            XSEGLOG2(&lc, E, "Could not open file %s. Error: %s", path,
+                     strerror_r(errno, error_str, 1023));
+            return -errno;
+        }
+    }
+
+    fd = open(path, flags, mode);
     if (fd < 0) {
         XSEGLOG2(&lc, E, "Could not open file %s. Error: %s", path,
                  strerror_r(errno, error_str, 1023));
@@ -798,7 +1163,7 @@ static int open_file_write(struct pfiled *pfiled, char *target,
     int r;
     char tmp[XSEG_MAX_TARGETLEN + MAX_PATH_SIZE + 1];
 
-    r = create_path(tmp, pfiled, target, targetlen, 1);
+    r = locate_path(tmp, pfiled, target, targetlen, 1);
     if (r < 0) {
         XSEGLOG2(&lc, E, "Could not create path");
         return -1;
@@ -813,7 +1178,7 @@ static int open_file_read(struct pfiled *pfiled, char *target,
     int r;
     char tmp[XSEG_MAX_TARGETLEN + MAX_PATH_SIZE + 1];
 
-    r = create_path(tmp, pfiled, target, targetlen, 0);
+    r = locate_path(tmp, pfiled, target, targetlen, 0);
     if (r < 0) {
         XSEGLOG2(&lc, E, "Could not create path");
         return -1;
@@ -924,7 +1289,7 @@ static void handle_read(struct peerd *peer, struct peer_req *pr)
     struct pfiled *pfiled = __get_pfiled(peer);
     struct fio *fio = __get_fio(pr);
     struct xseg_request *req = pr->req;
-    int r, fd;
+    int r, fd, seq;
     char *target = xseg_get_target(peer->xseg, req);
     char *data = xseg_get_data(peer->xseg, req);
 
@@ -952,7 +1317,14 @@ static void handle_read(struct peerd *peer, struct peer_req *pr)
 
     XSEGLOG2(&lc, D, "req->serviced: %llu, req->size: %llu", req->serviced,
              req->size);
-    r = pfiled_read(pfiled, fd, data, req->size, req->offset);
+    seq = readahead_before(pfiled, fio, fd, req->offset, req->size);
+    if (pfiled->bcache_size) {
+        r = cached_read(pfiled, fd, target, req->targetlen, data, req->size,
+                        req->offset);
+    } else {
+        r = pfiled_read(pfiled, fd, data, req->size, req->offset);
+    }
+    readahead_after(pfiled, fd, req->offset, req->size, seq);
     if (r < 0) {
         XSEGLOG2(&lc, E, "Cannot read");
         req->serviced = 0;
@@ -1025,6 +1397,7 @@ static void handle_write(struct peerd *peer, struct peer_req *pr)
     } else {
         req->serviced = r;
     }
+    invalidate_blocks(pfiled, target, req->targetlen, req->offset, req->size);
     XSEGLOG2(&lc, D, "req->serviced: %llu, req->size: %llu", req->serviced,
              req->size);
     r = fsync(fd);
@@ -1046,6 +1419,88 @@ static void handle_write(struct peerd *peer, struct peer_req *pr)
     return;
 }
 
+/*
+ * Serve reads or writes to adjacent ranges of the same object, as put
+ * together by can_merge, with a single vectored I/O and a single fsync.
+ * Each request still completes on its own.
+ */
+static void handle_batch(struct peerd *peer, struct peer_req **prs, int nr)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct xseg_request *req = prs[0]->req;
+    int write = (req->op == X_WRITE);
+    char *target = xseg_get_target(peer->xseg, req);
+    struct iovec iov[POOL_MAX_BATCH];
+    uint64_t offset = req->offset, total = 0, pos = 0;
+    ssize_t r;
+    int i, fd, seq = 0;
+
+    XSEGLOG2(&lc, I, "Handle batch of %d %s started", nr,
+             write ? "writes" : "reads");
+
+    fd = dir_open(pfiled, __get_fio(prs[0]), target, req->targetlen,
+                  write ? WRITE : READ);
+    if (fd < 0) {
+        XSEGLOG2(&lc, E, "Open failed");
+        for (i = 0; i < nr; i++) {
+            pfiled_fail(peer, prs[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        req = prs[i]->req;
+        iov[i].iov_base = xseg_get_data(peer->xseg, req);
+        iov[i].iov_len = req->size;
+        total += req->size;
+    }
+
+    if (!write) {
+        seq = readahead_before(pfiled, __get_fio(prs[0]), fd, offset, total);
+    }
+    r = persisting_iov(fd, iov, nr, offset, write);
+    if (!write) {
+        readahead_after(pfiled, fd, offset, total, seq);
+    }
+    if (write) {
+        invalidate_blocks(pfiled, target, prs[0]->req->targetlen, offset,
+                          total);
+        if (fsync(fd) < 0) {
+            XSEGLOG2(&lc, E, "Fsync failed.");
+            r = -1;
+        }
+    }
+
+    for (i = 0; i < nr; i++) {
+        req = prs[i]->req;
+        if (r < 0) {
+            req->serviced = 0;
+        } else if (write) {
+            req->serviced = r > pos ? min(r - pos, req->size) : 0;
+        } else {
+            if (r < pos + req->size) {
+                /* reached end of file. zero out the rest data buffer */
+                char *data = xseg_get_data(peer->xseg, req);
+                uint64_t done = r > pos ? r - pos : 0;
+                memset(data + done, 0, req->size - done);
+            }
+            req->serviced = req->size;
+        }
+        pos += req->size;
+    }
+
+    /* complete the request holding the fd last */
+    for (i = nr - 1; i >= 0; i--) {
+        if (prs[i]->req->serviced > 0) {
+            pfiled_complete(peer, prs[i]);
+        } else {
+            pfiled_fail(peer, prs[i]);
+        }
+    }
+    XSEGLOG2(&lc, I, "Handle batch of %d %s finished", nr,
+             write ? "writes" : "reads");
+}
+
 static void handle_info(struct peerd *peer, struct peer_req *pr)
 {
     struct pfiled *pfiled = __get_pfiled(peer);
@@ -1094,6 +1549,57 @@ static void handle_info(struct peerd *peer, struct peer_req *pr)
     pfiled_complete(peer, pr);
 }
 
+/*
+ * Copy [offset, offset + size) of @src to the same range of @dst. Where the
+ * kernel cannot copy between the two files, e.g. because they are on
+ * different filesystems, the data are read and written through a buffer.
+ */
+static ssize_t copy_range(struct pfiled *pfiled, int src, int dst,
+                          uint64_t offset, size_t size)
+{
+    loff_t src_off = offset, dst_off = offset;
+    ssize_t c = 0, bytes;
+    void *buf;
+
+    while (c < size) {
+        bytes = copy_file_range(src, &src_off, dst, &dst_off, size - c, 0);
+        if (bytes < 0) {
+            if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP) {
+                break;
+            }
+            return -1;
+        }
+        if (!bytes) {
+            return c;
+        }
+        c += bytes;
+    }
+    if (c == size) {
+        return c;
+    }
+
+    XSEGLOG2(&lc, D, "Falling back to buffered copy: %s", strerror(errno));
+    if (posix_memalign(&buf, 512, COPY_BUF_SIZE)) {
+        XSEGLOG2(&lc, E, "Out of memory");
+        return -1;
+    }
+    while (c < size) {
+        bytes = pfiled_read(pfiled, src, buf, min(size - c, COPY_BUF_SIZE),
+                            offset + c);
+        if (bytes <= 0) {
+            break;
+        }
+        if (pfiled_write(pfiled, dst, buf, bytes, offset + c) != bytes) {
+            free(buf);
+            return -1;
+        }
+        c += bytes;
+    }
+    free(buf);
+
+    return bytes < 0 ? -1 : c;
+}
+
 static void handle_copy(struct peerd *peer, struct peer_req *pr)
 {
     struct pfiled *pfiled = __get_pfiled(peer);
@@ -1105,7 +1611,7 @@ static void handle_copy(struct peerd *peer, struct peer_req *pr)
     struct stat st;
     char *buf = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE);
     int src = -1, dst = -1, r = -1;
-    ssize_t c = 0, bytes;
+    ssize_t c = 0;
     ssize_t limit = 0;
 
     XSEGLOG2(&lc, I, "Handle copy started for pr: %p, req: %p", pr, pr->req);
@@ -1142,19 +1648,27 @@ static void handle_copy(struct peerd *peer, struct peer_req *pr)
 
     c = 0;
 
-    limit = min(req->size, st.st_size);
-    while (c < limit) {
-        bytes = sendfile(dst, src, NULL, limit - c);
-        if (bytes < 0) {
-            XSEGLOG2(&lc, E, "Copy failed for %s", buf);
-            r = -1;
-            goto out;
-        }
-        c += bytes;
+    /*
+     * Copy [offset, offset + size) of the source to the same range of the
+     * destination. The file offsets of cached fds are shared, so they are
+     * not used.
+     */
+    if (req->offset < (uint64_t) st.st_size) {
+        limit = min(req->size, st.st_size - req->offset);
+    }
+    c = copy_range(pfiled, src, dst, req->offset, limit);
+    if (c < 0) {
+        XSEGLOG2(&lc, E, "Copy failed for %s", buf);
+        c = 0;
+        r = -1;
+        goto out;
     }
     r = 0;
 
   out:
+    if (dst >= 0) {
+        invalidate_blocks(pfiled, target, req->targetlen, 0, 0);
+    }
     req->serviced = c;
     if (limit && c == limit) {
         req->serviced = req->size;
@@ -1184,7 +1698,9 @@ static void handle_delete(struct peerd *peer, struct peer_req *pr)
     char name[XSEG_MAX_TARGETLEN + 1];
     char *buf = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE);
     int r;
+    uint32_t i;
     char *target = xseg_get_target(peer->xseg, req);
+    int missing;
 
     XSEGLOG2(&lc, I, "Handle delete started for pr: %p, req: %p", pr, pr->req);
 
@@ -1206,6 +1722,33 @@ static void handle_delete(struct peerd *peer, struct peer_req *pr)
         goto out;
     }
     r = unlink(buf);
+    missing = (r < 0 && errno == ENOENT);
+
+    if (pfiled->nr_disks > 1) {
+        /* also remove copies that have not been rebalanced yet */
+        for (i = 0; i < pfiled->nr_disks; i++) {
+            create_path_on_disk(buf, pfiled, i, target, req->targetlen, 0);
+            if (!unlink(buf)) {
+                r = 0;
+            } else if (errno != ENOENT) {
+                missing = 0;
+            }
+        }
+    }
+    if (pfiled->tiering) {
+        create_path_on_disk(buf, pfiled, FAST_DISK, target, req->targetlen,
+                            0);
+        if (!unlink(buf)) {
+            r = 0;
+        } else if (errno != ENOENT) {
+            missing = 0;
+        }
+    }
+    if (r < 0 && missing && (req->flags & XF_FORCE)) {
+        /* forced deletions of objects that do not exist succeed */
+        XSEGLOG2(&lc, I, "Object %s already deleted", buf);
+        r = 0;
+    }
   out:
     free(buf);
     if (r < 0) {
@@ -1216,6 +1759,7 @@ static void handle_delete(struct peerd *peer, struct peer_req *pr)
         strncpy(name, target, XSEG_MAX_TARGETLEN);
         name[XSEG_MAX_TARGETLEN] = 0;
         xcache_invalidate(&pfiled->cache, name);
+        invalidate_blocks(pfiled, target, req->targetlen, 0, 0);
         XSEGLOG2(&lc, I, "Handle delete completed for pr: %p, req: %p", pr,
                  pr->req);
         pfiled_complete(peer, pr);
@@ -1439,10 +1983,20 @@ static void handle_hash(struct peerd *peer, struct peer_req *pr)
                    pfiled->uniquestr, pfiled->uniquestr_len,
                    fio->str_id, FIO_STR_ID_LEN);
 
-    r = pfiled_write_name(pfiled, tmpfile, len, object_data, sum, 0,
-                          O_CREAT | O_EXCL,
-                          S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH |
-                          S_IWOTH);
+    /* the tmpfile must be on the same disk, to be linked */
+    r = create_path_on_disk(tmpfile_pathname, pfiled,
+                            get_disk(pfiled, hash_name,
+                                     HEXLIFIED_SHA256_DIGEST_SIZE),
+                            tmpfile, len, 1);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Create path failed");
+        r = -1;
+        goto out;
+    }
+
+    r = write_path(tmpfile_pathname, object_data, sum, 0, pfiled->directio,
+                   O_CREAT | O_EXCL,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
     if (r < 0) {
         if (errno != EEXIST) {
             char error_str[1024];
@@ -1461,13 +2015,6 @@ static void handle_hash(struct peerd *peer, struct peer_req *pr)
     }
     XSEGLOG2(&lc, D, "Opened %s and wrote", tmpfile);
 
-    r = create_path(tmpfile_pathname, pfiled, tmpfile, len, 1);
-    if (r < 0) {
-        XSEGLOG2(&lc, E, "Create path failed");
-        r = -1;
-        goto out;
-    }
-
     r = link(tmpfile_pathname, pathname);
     if (r < 0 && errno != EEXIST) {
         XSEGLOG2(&lc, E, "Error linking tmp file %s. Errno %d",
@@ -1642,12 +2189,15 @@ static void handle_acquire(struct peerd *peer, struct peer_req *pr)
     XSEGLOG2(&lc, I, "Trying to acquire lock %s", buf);
 
     if (!pfiled->lockpath_len) {
-        if (create_path(tmpfile_pathname, pfiled, tmpfile, tmpfile_len, 1) < 0) {
+        /* lock files always live on the first disk */
+        if (create_path_on_disk(tmpfile_pathname, pfiled, 0, tmpfile,
+                                tmpfile_len, 1) < 0) {
             XSEGLOG2(&lc, E, "Create path failed for %s", buf);
             goto out;
         }
 
-        if (create_path(lockfile_pathname, pfiled, buf, buf_len, 1) < 0) {
+        if (create_path_on_disk(lockfile_pathname, pfiled, 0, buf, buf_len,
+                                1) < 0) {
             XSEGLOG2(&lc, E, "Create path failed for %s", buf);
             goto out;
         }
@@ -1750,7 +2300,7 @@ static void handle_release(struct peerd *peer, struct peer_req *pr)
     XSEGLOG2(&lc, I, "Started. Lockfile: %s", buf);
 
     if (!pfiled->lockpath_len) {
-        r = create_path(pathname, pfiled, buf, buf_len, 0);
+        r = create_path_on_disk(pathname, pfiled, 0, buf, buf_len, 0);
         if (r < 0) {
             XSEGLOG2(&lc, E, "Create path failed for %s", buf);
             goto out;
@@ -1788,21 +2338,414 @@ static void handle_release(struct peerd *peer, struct peer_req *pr)
     return;
 }
 
-int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
-             enum dispatch_reason reason)
+static pthread_rwlock_t *object_lock(struct pfiled *pfiled, char *target,
+                                     uint32_t targetlen)
 {
-    struct fio *fio = __get_fio(pr);
-    if (reason == dispatch_accept) {
-        fio->h = NoEntry;
-    }
+    return &pfiled->object_locks[fnv_hash(target, targetlen) %
+                                 NR_OBJECT_LOCKS];
+}
 
-    switch (req->op) {
-    case X_READ:
-        handle_read(peer, pr);
-        break;
-    case X_WRITE:
-        handle_write(peer, pr);
-        break;
+/*
+ * Move an object from one disk to another. The object is copied next to its
+ * new location and renamed into place, before the old copy is removed.
+ * Requests on the object are held off while it is being moved.
+ */
+static int move_object(struct pfiled *pfiled, uint32_t from, uint32_t to,
+                       char *name, uint32_t namelen)
+{
+    char *src_path = NULL, *dst_path = NULL, *tmp_path = NULL;
+    pthread_rwlock_t *lock = object_lock(pfiled, name, namelen);
+    int src = -1, dst = -1, r = -1;
+    struct stat st;
+    ssize_t c = 0, bytes;
+    uint64_t moved = 0;
+
+    src_path = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1);
+    dst_path = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1);
+    tmp_path = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + sizeof(MOVE_SUFFIX));
+    if (!src_path || !dst_path || !tmp_path) {
+        XSEGLOG2(&lc, E, "Out of memory");
+        goto out_free;
+    }
+
+    pthread_rwlock_wrlock(lock);
+
+    create_path_on_disk(src_path, pfiled, from, name, namelen, 0);
+    r = create_path_on_disk(dst_path, pfiled, to, name, namelen, 1);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Create path failed for %s", name);
+        goto out_unlock;
+    }
+
+    src = open(src_path, O_RDONLY);
+    if (src < 0) {
+        /* deleted in the meantime */
+        r = (errno == ENOENT) ? 0 : -1;
+        goto out_unlock;
+    }
+
+    if (!stat(dst_path, &st)) {
+        /*
+         * A previous move was interrupted after the rename. Requests have
+         * been served from the copy that locate_path() finds first, so that
+         * one is kept. If it is the source, it is moved over the stale
+         * destination.
+         */
+        r = locate_path(tmp_path, pfiled, name, namelen, 0);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Locate path failed for %s", name);
+            goto out_unlock;
+        }
+        if (strcmp(tmp_path, src_path)) {
+            XSEGLOG2(&lc, I, "Keeping %s over %s", tmp_path, src_path);
+            r = unlink(src_path);
+            goto out_unlock;
+        }
+        XSEGLOG2(&lc, I, "Replacing stale %s with %s", dst_path, src_path);
+    }
+    sprintf(tmp_path, "%s%s", dst_path, MOVE_SUFFIX);
+
+    r = fstat(src, &st);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Fail in stat for %s", src_path);
+        goto out_unlock;
+    }
+
+    dst = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (dst < 0) {
+        XSEGLOG2(&lc, E, "Could not open %s", tmp_path);
+        r = -1;
+        goto out_unlock;
+    }
+
+    while (c < st.st_size) {
+        bytes = sendfile(dst, src, NULL, st.st_size - c);
+        if (bytes <= 0) {
+            XSEGLOG2(&lc, E, "Copy failed for %s", src_path);
+            r = -1;
+            goto out_unlink;
+        }
+        c += bytes;
+    }
+
+    r = fsync(dst);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Fsync failed for %s", tmp_path);
+        goto out_unlink;
+    }
+
+    r = rename(tmp_path, dst_path);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Could not rename %s to %s", tmp_path, dst_path);
+        goto out_unlink;
+    }
+
+    r = unlink(src_path);
+    if (r < 0) {
+        XSEGLOG2(&lc, W, "Could not remove %s", src_path);
+        r = 0;
+    }
+
+    /* drop cached fds to the old copy */
+    xcache_invalidate(&pfiled->cache, name);
+    __sync_fetch_and_add(&pfiled->nr_moved, 1);
+    XSEGLOG2(&lc, I, "Moved %s from disk %u to disk %u", name, from, to);
+    moved = st.st_size;
+    goto out_unlock;
+
+  out_unlink:
+    unlink(tmp_path);
+  out_unlock:
+    pthread_rwlock_unlock(lock);
+    if (src >= 0) {
+        close(src);
+    }
+    if (dst >= 0) {
+        close(dst);
+    }
+  out_free:
+    free(src_path);
+    free(dst_path);
+    free(tmp_path);
+
+    /* limit the bandwidth used for moving objects around */
+    if (moved && pfiled->move_bw) {
+        usleep((moved * 1000000) / (pfiled->move_bw << 20));
+    }
+    return r;
+}
+
+static int has_suffix(char *name, uint32_t namelen, char *suffix,
+                      uint32_t suffixlen)
+{
+    return namelen >= suffixlen &&
+        !strncmp(name + namelen - suffixlen, suffix, suffixlen);
+}
+
+typedef int (*walk_cb) (struct pfiled * pfiled, uint32_t disk, char *name,
+                        uint32_t namelen, uint32_t home);
+
+/* Call @cb for every object found in @dir of @disk */
+static int walk_dir(struct pfiled *pfiled, uint32_t disk, char *dir,
+                    char dirs[6], walk_cb cb)
+{
+    DIR *d;
+    struct dirent *de;
+    char fdirs[6];
+    uint32_t namelen, home;
+    int r = 0;
+
+    d = opendir(dir);
+    if (!d) {
+        return 0;
+    }
+
+    while (!r && !pfiled->stop_movers && (de = readdir(d))) {
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        namelen = strlen(de->d_name);
+        if (namelen > XSEG_MAX_TARGETLEN ||
+            has_suffix(de->d_name, namelen, LOCK_SUFFIX, LOCK_SUFFIX_LEN)) {
+            continue;
+        }
+        if (has_suffix(de->d_name, namelen, MOVE_SUFFIX,
+                       strlen(MOVE_SUFFIX))) {
+            XSEGLOG2(&lc, I, "Removing stale file %s%s", dir, de->d_name);
+            unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+        if (pfiled->uniquestr_len &&
+            strstr(de->d_name, pfiled->uniquestr)) {
+            /* in-flight tmpfile */
+            continue;
+        }
+
+        get_dirs_filed(fdirs, pfiled, de->d_name, namelen, &home);
+        if (strncmp(fdirs, dirs, 6)) {
+            /* not in the filed layout, e.g. an old pithos file */
+            continue;
+        }
+        r = cb(pfiled, disk, de->d_name, namelen, home);
+    }
+
+    closedir(d);
+    return r;
+}
+
+static int is_dirs_entry(struct dirent *de)
+{
+    return strlen(de->d_name) == 2 && is_hex_char(de->d_name[0]) &&
+        is_hex_char(de->d_name[1]);
+}
+
+/* Walk the 3 levels of hash directories under @path */
+static int __walk_disk(struct pfiled *pfiled, uint32_t disk, char *path,
+                       uint32_t pathlen, char dirs[6], int level, walk_cb cb)
+{
+    DIR *d;
+    struct dirent *de;
+    int r = 0;
+
+    if (level == 3) {
+        return walk_dir(pfiled, disk, path, dirs, cb);
+    }
+
+    d = opendir(path);
+    if (!d) {
+        return 0;
+    }
+    while (!r && !pfiled->stop_movers && (de = readdir(d))) {
+        if (!is_dirs_entry(de)) {
+            continue;
+        }
+        dirs[level * 2] = de->d_name[0];
+        dirs[level * 2 + 1] = de->d_name[1];
+        sprintf(path + pathlen, "%s/", de->d_name);
+        r = __walk_disk(pfiled, disk, path, pathlen + 3, dirs, level + 1, cb);
+    }
+    closedir(d);
+    path[pathlen] = '\0';
+    return r;
+}
+
+/* Call @cb for every object of @disk, until it returns non-zero */
+static int walk_disk(struct pfiled *pfiled, uint32_t disk, walk_cb cb)
+{
+    char path[MAX_PATH_SIZE + 10];
+    char dirs[6];
+
+    strcpy(path, pfiled->disks[disk].path);
+    return __walk_disk(pfiled, disk, path, pfiled->disks[disk].path_len, dirs,
+                       0, cb);
+}
+
+static int rebalance_object(struct pfiled *pfiled, uint32_t disk, char *name,
+                            uint32_t namelen, uint32_t home)
+{
+    if (home != disk) {
+        move_object(pfiled, disk, home, name, namelen);
+    }
+    return 0;
+}
+
+/*
+ * Background rebalancer. Walks the directory tree of every disk and moves
+ * the objects whose home disk has changed, e.g. after a disk was added.
+ */
+static void *rebalance_thread(void *arg)
+{
+    struct pfiled *pfiled = (struct pfiled *) arg;
+    uint32_t disk;
+
+    XSEGLOG2(&lc, I, "Rebalancing started");
+    for (disk = 0; disk < pfiled->nr_disks && !pfiled->stop_movers; disk++) {
+        walk_disk(pfiled, disk, rebalance_object);
+    }
+    XSEGLOG2(&lc, I, "Rebalancing finished. Moved %llu objects",
+             (unsigned long long) pfiled->nr_moved);
+
+    return NULL;
+}
+
+/* Percentage of the fast tier that is in use */
+static uint64_t fast_tier_usage(struct pfiled *pfiled)
+{
+    struct statvfs vfs;
+
+    if (statvfs(pfiled->disks[FAST_DISK].path, &vfs) < 0 || !vfs.f_blocks) {
+        return 100;
+    }
+    return 100 - (vfs.f_bavail * 100) / vfs.f_blocks;
+}
+
+static int demote_object(struct pfiled *pfiled, uint32_t disk, char *name,
+                         uint32_t namelen, uint32_t home)
+{
+    if (heat_get(&pfiled->heat, name, namelen) >= pfiled->tier_promote / 2.0) {
+        return 0;
+    }
+    if (!move_object(pfiled, FAST_DISK, home, name, namelen)) {
+        __sync_fetch_and_add(&pfiled->nr_demoted, 1);
+    }
+    /* stop once enough room has been made */
+    return fast_tier_usage(pfiled) + TIER_HYSTERESIS <= pfiled->tier_fast_max;
+}
+
+static void promote_objects(struct pfiled *pfiled)
+{
+    struct heat_entry *hot;
+    char *path;
+    struct stat st;
+    uint32_t disk;
+    int i, n;
+
+    hot = malloc(TIER_BATCH * sizeof(struct heat_entry));
+    path = malloc(MAX_PATH_SIZE + MAX_FILENAME_SIZE + 1);
+    if (!hot || !path) {
+        goto out;
+    }
+
+    n = heat_hottest(&pfiled->heat, hot, TIER_BATCH, pfiled->tier_promote);
+    for (i = 0; i < n && !pfiled->stop_movers; i++) {
+        if (fast_tier_usage(pfiled) >= pfiled->tier_fast_max) {
+            break;
+        }
+        create_path_on_disk(path, pfiled, FAST_DISK, hot[i].name,
+                            hot[i].namelen, 0);
+        if (!stat(path, &st)) {
+            continue;
+        }
+        for (disk = 0; disk < pfiled->nr_disks; disk++) {
+            create_path_on_disk(path, pfiled, disk, hot[i].name,
+                                hot[i].namelen, 0);
+            if (!stat(path, &st)) {
+                break;
+            }
+        }
+        if (disk == pfiled->nr_disks) {
+            /* deleted, or not in the filed layout */
+            continue;
+        }
+        if (!move_object(pfiled, disk, FAST_DISK, hot[i].name,
+                         hot[i].namelen)) {
+            __sync_fetch_and_add(&pfiled->nr_promoted, 1);
+        }
+    }
+
+  out:
+    free(hot);
+    free(path);
+}
+
+/*
+ * Background tiering. Periodically promotes the hottest objects to the fast
+ * tier, and demotes cold objects from it when it runs out of space.
+ */
+static void *tier_thread(void *arg)
+{
+    struct pfiled *pfiled = (struct pfiled *) arg;
+    int i;
+
+    XSEGLOG2(&lc, I, "Tiering started");
+    while (!pfiled->stop_movers) {
+        for (i = 0; i < TIER_INTERVAL && !pfiled->stop_movers; i++) {
+            sleep(1);
+        }
+        if (fast_tier_usage(pfiled) > pfiled->tier_fast_max) {
+            walk_disk(pfiled, FAST_DISK, demote_object);
+        }
+        promote_objects(pfiled);
+    }
+    XSEGLOG2(&lc, I, "Tiering stopped");
+
+    return NULL;
+}
+
+static void execute(struct peerd *peer, struct peer_req *pr)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct xseg_request *req = pr->req;
+    char *target = xseg_get_target(peer->xseg, req);
+    struct xseg_request_copy *xcopy;
+    pthread_rwlock_t *lock = NULL, *src_lock = NULL, *tmp;
+
+    if (pfiled->rebalance || pfiled->tiering) {
+        lock = object_lock(pfiled, target, req->targetlen);
+        if (req->op == X_COPY) {
+            /* the source must not be moved while it is copied either */
+            xcopy = (struct xseg_request_copy *)
+                xseg_get_data(peer->xseg, req);
+            if (xcopy->targetlen <= XSEG_MAX_TARGETLEN) {
+                src_lock = object_lock(pfiled, xcopy->target,
+                                       xcopy->targetlen);
+            }
+        }
+        if (src_lock == lock) {
+            src_lock = NULL;
+        } else if (src_lock && src_lock < lock) {
+            /* take the locks in a fixed order */
+            tmp = lock;
+            lock = src_lock;
+            src_lock = tmp;
+        }
+        pthread_rwlock_rdlock(lock);
+        if (src_lock) {
+            pthread_rwlock_rdlock(src_lock);
+        }
+    }
+    if (pfiled->tiering && (req->op == X_READ || req->op == X_WRITE)) {
+        heat_touch(&pfiled->heat, target, req->targetlen);
+    }
+
+    switch (req->op) {
+    case X_READ:
+        handle_read(peer, pr);
+        break;
+    case X_WRITE:
+        handle_write(peer, pr);
+        break;
     case X_INFO:
         handle_info(peer, pr);
         break;
@@ -1825,6 +2768,261 @@ int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
     default:
         handle_unknown(peer, pr);
     }
+
+    /* pr may have already been reused. Do not touch it. */
+    if (src_lock) {
+        pthread_rwlock_unlock(src_lock);
+    }
+    if (lock) {
+        pthread_rwlock_unlock(lock);
+    }
+}
+
+static int is_aligned(struct peerd *peer, struct xseg_request *req)
+{
+    char *data = xseg_get_data(peer->xseg, req);
+
+    return !((unsigned long) data % 512) && !(req->size % 512) &&
+        !(req->offset % 512);
+}
+
+/* Can @next be served with the same vectored I/O, right after @last? */
+static int can_merge(struct peerd *peer, struct peer_req *last,
+                     struct peer_req *next)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct xseg_request *a = last->req, *b = next->req;
+
+    if (a->op != b->op || (a->op != X_READ && a->op != X_WRITE)) {
+        return 0;
+    }
+    /* cached reads are served a block at a time */
+    if (a->op == X_READ && pfiled->bcache_size) {
+        return 0;
+    }
+    if (!a->size || !b->size || a->datalen < a->size ||
+        b->datalen < b->size || a->offset + a->size != b->offset) {
+        return 0;
+    }
+    if (a->targetlen != b->targetlen ||
+        strncmp(xseg_get_target(peer->xseg, a),
+                xseg_get_target(peer->xseg, b), a->targetlen)) {
+        return 0;
+    }
+    /* direct I/O cannot bounce a vector through aligned buffers */
+    if (pfiled->directio && (!is_aligned(peer, a) || !is_aligned(peer, b))) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static void execute_batch(struct peerd *peer, struct peer_req **prs, int nr)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct xseg_request *req = prs[0]->req;
+    char *target = xseg_get_target(peer->xseg, req);
+    pthread_rwlock_t *lock = NULL;
+    int i;
+
+    /* all requests are for the same object */
+    if (pfiled->rebalance || pfiled->tiering) {
+        lock = object_lock(pfiled, target, req->targetlen);
+        pthread_rwlock_rdlock(lock);
+    }
+    for (i = 0; i < nr && pfiled->tiering; i++) {
+        heat_touch(&pfiled->heat, target, req->targetlen);
+    }
+
+    handle_batch(peer, prs, nr);
+
+    if (lock) {
+        pthread_rwlock_unlock(lock);
+    }
+}
+
+static int is_open(struct pfiled *pfiled, char *target, uint32_t targetlen)
+{
+    char name[XSEG_MAX_TARGETLEN + 1];
+    xcache_handler h;
+
+    if (targetlen > XSEG_MAX_TARGETLEN) {
+        return 0;
+    }
+    strncpy(name, target, targetlen);
+    name[targetlen] = '\0';
+
+    h = xcache_lookup(&pfiled->cache, name);
+    if (h == NoEntry) {
+        return 0;
+    }
+    xcache_put(&pfiled->cache, h);
+    return 1;
+}
+
+/*
+ * Reads, and writes to objects that are already open, only do data I/O.
+ * Everything else may create, link or unlink files and directories. Writes
+ * to objects that are not open, and copies, only open their target on the
+ * metadata threads, see execute_meta().
+ */
+static int is_metadata_op(struct peerd *peer, struct xseg_request *req)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+
+    switch (req->op) {
+    case X_READ:
+        return 0;
+    case X_WRITE:
+        return !is_open(pfiled, xseg_get_target(peer->xseg, req),
+                        req->targetlen);
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Open, and create if needed, the target of a write or a copy, and hand the
+ * request over to the disk queue of the target for its data transfer. The fd
+ * of the target is kept in the fd cache, so it is not opened again there.
+ */
+static void open_target(struct peerd *peer, struct peer_req *pr)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct fio *fio = __get_fio(pr);
+    struct xseg_request *req = pr->req;
+    char *target = xseg_get_target(peer->xseg, req);
+    pthread_rwlock_t *lock = NULL;
+    uint32_t disk;
+    int fd;
+
+    if (pfiled->rebalance || pfiled->tiering) {
+        lock = object_lock(pfiled, target, req->targetlen);
+        pthread_rwlock_rdlock(lock);
+    }
+    fd = dir_open(pfiled, fio, target, req->targetlen, WRITE);
+    if (fd >= 0) {
+        xcache_put(&pfiled->cache, fio->h);
+        fio->h = NoEntry;
+    }
+    if (lock) {
+        pthread_rwlock_unlock(lock);
+    }
+    if (fd < 0) {
+        XSEGLOG2(&lc, E, "Open failed");
+        pfiled_fail(peer, pr);
+        return;
+    }
+
+    disk = get_disk(pfiled, target, req->targetlen);
+    pool_submit(&pfiled->disks[disk].pool, &fio->pe, pr);
+}
+
+/* Serve the requests of the metadata threads */
+static void execute_meta(struct peerd *peer, struct peer_req *pr)
+{
+    switch (pr->req->op) {
+    case X_WRITE:
+    case X_COPY:
+        open_target(peer, pr);
+        break;
+    default:
+        execute(peer, pr);
+    }
+}
+
+int dispatch(struct peerd *peer, struct peer_req *pr, struct xseg_request *req,
+             enum dispatch_reason reason)
+{
+    struct pfiled *pfiled = __get_pfiled(peer);
+    struct fio *fio = __get_fio(pr);
+    char *target;
+    uint32_t disk = 0;
+
+    if (reason == dispatch_accept) {
+        fio->h = NoEntry;
+    }
+
+    if (pfiled->meta_threads && is_metadata_op(peer, req)) {
+        pool_submit(&pfiled->meta_pool, &fio->pe, pr);
+        return 0;
+    }
+
+    if (pfiled->disk_threads) {
+        /* serve requests on the queue of the disk they belong to */
+        if (req->op != X_ACQUIRE && req->op != X_RELEASE) {
+            target = xseg_get_target(peer->xseg, req);
+            disk = get_disk(pfiled, target, req->targetlen);
+        }
+        pool_submit(&pfiled->disks[disk].pool, &fio->pe, pr);
+        return 0;
+    }
+
+    execute(peer, pr);
+    return 0;
+}
+
+/*
+ * Each disk is weighted explicitly, so that the placement of objects does not
+ * change along with the free space or the size of its filesystem.
+ */
+static int setup_disk(struct filed_disk *disk, char *path, uint64_t weight)
+{
+    strncpy(disk->path, path, MAX_PATH_SIZE - 1);
+    disk->path[MAX_PATH_SIZE - 1] = '\0';
+    disk->path_len = strlen(disk->path);
+    if (disk->path[disk->path_len - 1] != '/') {
+        disk->path[disk->path_len] = '/';
+        disk->path[++disk->path_len] = '\0';
+    }
+    disk->seed = fnv_hash(disk->path, disk->path_len);
+    disk->weight = weight;
+    XSEGLOG2(&lc, I, "Data directory %s, weight %llu", disk->path,
+             (unsigned long long) disk->weight);
+
+    return 0;
+}
+
+/*
+ * Parse the comma-separated list of data directories given with --archip.
+ * Each one may be followed by ':' and its weight, which defaults to 1.
+ */
+static int parse_disks(struct pfiled *pfiled)
+{
+    char *tok, *sep, *end, *saveptr = NULL;
+    unsigned long long weight;
+
+    for (tok = strtok_r(pfiled->vpath, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        if (!strlen(tok)) {
+            continue;
+        }
+        if (pfiled->nr_disks == MAX_DISKS) {
+            XSEGLOG2(&lc, E, "Too many data directories. Max: %d", MAX_DISKS);
+            return -1;
+        }
+        weight = 1;
+        sep = strrchr(tok, ':');
+        if (sep) {
+            *sep = '\0';
+            errno = 0;
+            weight = strtoull(sep + 1, &end, 10);
+            if (errno || *end || end == sep + 1 || !weight ||
+                !strlen(tok)) {
+                XSEGLOG2(&lc, E, "Invalid weight %s of data directory %s",
+                         sep + 1, tok);
+                return -1;
+            }
+        }
+        setup_disk(&pfiled->disks[pfiled->nr_disks], tok, weight);
+        pfiled->nr_disks++;
+    }
+
+    if (!pfiled->nr_disks) {
+        XSEGLOG2(&lc, E, "Archipelago path was not provided");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -1842,6 +3040,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
     int ret = 0;
     int i, r;
+    char name[POOL_NAME_LEN + 1];
     struct fio *fio;
     struct pfiled *pfiled = malloc(sizeof(struct pfiled));
     struct rlimit rlim;
@@ -1859,9 +3058,12 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
     pfiled->maxfds = 2 * peer->nr_ops;
     pfiled->migrate = 0;        /* false by default */
+    pfiled->bcache_size = 0;
+    pfiled->bcache_bs = BC_DEFAULT_BLOCKSIZE;
+    pfiled->nr_finalized = 0;
 
     for (i = 0; i < peer->nr_ops; i++) {
-        peer->peer_reqs[i].priv = malloc(sizeof(struct fio));
+        peer->peer_reqs[i].priv = peer_alloc(sizeof(struct fio));
         if (!peer->peer_reqs->priv) {
             XSEGLOG2(&lc, E, "Out of memory");
             ret = -ENOMEM;
@@ -1874,9 +3076,35 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
     }
 
     pfiled->vpath[0] = '\0';
+    pfiled->nr_disks = 0;
+    pfiled->disk_threads = 0;
+    pfiled->coalesce = 0;
+    pfiled->meta_threads = 0;
+    pfiled->rebalance = 0;
+    pfiled->stop_movers = 0;
+    pfiled->nr_moved = 0;
+    pfiled->move_bw = 0;
+    pfiled->fast_path[0] = '\0';
+    pfiled->tiering = 0;
+    pfiled->tier_promote = 4;
+    pfiled->tier_fast_max = 90;
+    pfiled->tier_track = 16384;
+    pfiled->nr_promoted = 0;
+    pfiled->nr_demoted = 0;
     pfiled->prefix[0] = '\0';
     pfiled->uniquestr[0] = '\0';
     pfiled->lockpath[0] = '\0';
+    pfiled->readahead = 0;
+    pfiled->ra_drop = 0;
+    pfiled->ra_seq_reads = 0;
+    pfiled->ra_hits = 0;
+    pfiled->ra_prefetches = 0;
+    pfiled->ra_prefetched = 0;
+    pfiled->ra_dropped = 0;
+    pfiled->prealloc = 0;
+    pfiled->prealloc_grow_size = 0;
+    pfiled->nr_prealloc = 0;
+    pfiled->nr_prealloc_failed = 0;
 
     BEGIN_READ_ARGS(argc, argv);
     READ_ARG_ULONG("--fdcache", pfiled->maxfds);
@@ -1886,21 +3114,51 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
     READ_ARG_STRING("--uniquestr", pfiled->uniquestr, MAX_UNIQUESTR_LEN);
     READ_ARG_BOOL("--directio", pfiled->directio);
     READ_ARG_BOOL("--pithos-migrate", pfiled->migrate);
+    READ_ARG_ULONG("--blockcache", pfiled->bcache_size);
+    READ_ARG_ULONG("--blockcache-bs", pfiled->bcache_bs);
+    READ_ARG_ULONG("--disk-threads", pfiled->disk_threads);
+    READ_ARG_ULONG("--coalesce", pfiled->coalesce);
+    READ_ARG_ULONG("--meta-threads", pfiled->meta_threads);
+    READ_ARG_BOOL("--rebalance", pfiled->rebalance);
+    READ_ARG_ULONG("--move-bw", pfiled->move_bw);
+    READ_ARG_STRING("--archip-fast", pfiled->fast_path, MAX_PATH_SIZE - 1);
+    READ_ARG_ULONG("--tier-promote", pfiled->tier_promote);
+    READ_ARG_ULONG("--tier-fast-max", pfiled->tier_fast_max);
+    READ_ARG_ULONG("--tier-track", pfiled->tier_track);
+    READ_ARG_ULONG("--readahead", pfiled->readahead);
+    READ_ARG_BOOL("--readahead-drop", pfiled->ra_drop);
+    READ_ARG_ULONG("--prealloc", pfiled->prealloc);
+    READ_ARG_BOOL("--prealloc-grow-size", pfiled->prealloc_grow_size);
     END_READ_ARGS();
 
     pfiled->uniquestr_len = strlen(pfiled->uniquestr);
     pfiled->prefix_len = strlen(pfiled->prefix);
 
     //TODO test path exist/is_dir/have_access
-    pfiled->vpath_len = strlen(pfiled->vpath);
-    if (!pfiled->vpath_len) {
+    if (!strlen(pfiled->vpath)) {
         XSEGLOG2(&lc, E, "Archipelago path was not provided");
         usage(argv[0]);
         return -1;
     }
-    if (pfiled->vpath[pfiled->vpath_len - 1] != '/') {
-        pfiled->vpath[pfiled->vpath_len] = '/';
-        pfiled->vpath[++pfiled->vpath_len] = '\0';
+    r = parse_disks(pfiled);
+    if (r < 0) {
+        return -1;
+    }
+
+    if (strlen(pfiled->fast_path)) {
+        r = setup_disk(&pfiled->disks[FAST_DISK], pfiled->fast_path, 1);
+        if (r < 0) {
+            return -1;
+        }
+        r = heat_init(&pfiled->heat, pfiled->tier_track);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Could not allocate access tracking table");
+            return -1;
+        }
+        if (!pfiled->tier_promote) {
+            pfiled->tier_promote = 1;
+        }
+        pfiled->tiering = 1;
     }
 
     pfiled->lockpath_len = strlen(pfiled->lockpath);
@@ -1931,15 +3189,188 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         return -1;
     }
 
+    for (i = 0; i < NR_OBJECT_LOCKS; i++) {
+        pthread_rwlock_init(&pfiled->object_locks[i], NULL);
+    }
+
+    if ((pfiled->coalesce || pfiled->meta_threads) && !pfiled->disk_threads) {
+        /* requests are coalesced, and handed over by the metadata threads,
+         * on the disk queues
+         */
+        pfiled->disk_threads = peer->nr_threads;
+    }
+
+    if (pfiled->disk_threads) {
+        for (i = 0; i < pfiled->nr_disks; i++) {
+            sprintf(name, "disk%d", i);
+            r = pool_init(&pfiled->disks[i].pool, peer, name,
+                          pfiled->disk_threads, execute);
+            if (r < 0) {
+                XSEGLOG2(&lc, E, "Could not start threads for disk %d", i);
+                return -1;
+            }
+            if (pfiled->coalesce) {
+                pool_set_coalescing(&pfiled->disks[i].pool, pfiled->coalesce,
+                                    can_merge, execute_batch);
+            }
+        }
+    }
+
+    if (pfiled->meta_threads) {
+        r = pool_init(&pfiled->meta_pool, peer, "meta", pfiled->meta_threads,
+                      execute_meta);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Could not start metadata threads");
+            return -1;
+        }
+    }
+
+    if (pfiled->rebalance) {
+        if (pfiled->nr_disks < 2) {
+            pfiled->rebalance = 0;
+        } else {
+            r = pthread_create(&pfiled->rebalance_thread, NULL,
+                               rebalance_thread, pfiled);
+            if (r) {
+                XSEGLOG2(&lc, E, "Could not start rebalancing");
+                return -1;
+            }
+        }
+    }
+
+    if (pfiled->tiering) {
+        r = pthread_create(&pfiled->tier_thread, NULL, tier_thread, pfiled);
+        if (r) {
+            XSEGLOG2(&lc, E, "Could not start tiering");
+            return -1;
+        }
+    }
+
+    pfiled->readahead <<= 10;
+    pfiled->prealloc <<= 10;
+    if (pfiled->readahead && pfiled->directio) {
+        /* direct I/O bypasses the page cache */
+        XSEGLOG2(&lc, W, "Readahead is ignored with --directio");
+        pfiled->readahead = 0;
+    }
+
+    if (pfiled->bcache_size) {
+        if (!pfiled->directio) {
+            XSEGLOG2(&lc, W, "Block cache enabled without --directio");
+        }
+        r = blockcache_init(&pfiled->bcache, pfiled->bcache_size << 20,
+                            pfiled->bcache_bs);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Could not initialize block cache");
+            return -1;
+        }
+    }
+
   out:
     return ret;
 }
 
+static void report_pool_stats(struct filed_pool *pool)
+{
+    struct pool_stats stats;
+    uint64_t completed;
+
+    pool_get_stats(pool, &stats);
+    completed = stats.completed ? stats.completed : 1;
+    XSEGLOG2(&lc, I, "Pool %s: %llu requests, max queue depth %llu, "
+             "avg/max wait %llu/%llu us, avg service %llu us, "
+             "%llu requests coalesced in %llu batches", pool->name,
+             (unsigned long long) stats.submitted,
+             (unsigned long long) stats.max_depth,
+             (unsigned long long) (stats.wait_us / completed),
+             (unsigned long long) stats.max_wait_us,
+             (unsigned long long) (stats.service_us / completed),
+             (unsigned long long) stats.merged,
+             (unsigned long long) stats.batches);
+}
+
+static void report_stats(struct pfiled *pfiled)
+{
+    struct bc_stats stats;
+    uint32_t i;
+
+    if (pfiled->bcache_size) {
+        blockcache_get_stats(&pfiled->bcache, &stats);
+        XSEGLOG2(&lc, I, "Block cache: hits %llu, misses %llu, "
+                 "ghost hits %llu, inserts %llu, evictions %llu, "
+                 "invalidations %llu",
+                 (unsigned long long) stats.hits,
+                 (unsigned long long) stats.misses,
+                 (unsigned long long) stats.ghost_hits,
+                 (unsigned long long) stats.inserts,
+                 (unsigned long long) stats.evictions,
+                 (unsigned long long) stats.invalidations);
+    }
+
+    for (i = 0; i < pfiled->nr_disks && pfiled->disk_threads; i++) {
+        report_pool_stats(&pfiled->disks[i].pool);
+    }
+    if (pfiled->meta_threads) {
+        report_pool_stats(&pfiled->meta_pool);
+    }
+
+    if (pfiled->nr_moved) {
+        XSEGLOG2(&lc, I, "Moved %llu objects between disks",
+                 (unsigned long long) pfiled->nr_moved);
+    }
+
+    if (pfiled->tiering) {
+        XSEGLOG2(&lc, I, "Tiering: promoted %llu objects, demoted %llu",
+                 (unsigned long long) pfiled->nr_promoted,
+                 (unsigned long long) pfiled->nr_demoted);
+    }
+
+    if (pfiled->readahead) {
+        XSEGLOG2(&lc, I, "Readahead: %llu sequential reads, %llu prefetched, "
+                 "%llu prefetches of %llu bytes, %llu bytes dropped",
+                 (unsigned long long) pfiled->ra_seq_reads,
+                 (unsigned long long) pfiled->ra_hits,
+                 (unsigned long long) pfiled->ra_prefetches,
+                 (unsigned long long) pfiled->ra_prefetched,
+                 (unsigned long long) pfiled->ra_dropped);
+    }
+
+    if (pfiled->prealloc) {
+        XSEGLOG2(&lc, I, "Preallocated %llu objects, %llu failed",
+                 (unsigned long long) pfiled->nr_prealloc,
+                 (unsigned long long) pfiled->nr_prealloc_failed);
+    }
+}
+
 void custom_peer_finalize(struct peerd *peer)
 {
+    struct pfiled *pfiled = __get_pfiled(peer);
+    uint32_t i;
+
     /*
        we could close all fds, but we can let the system do it for us.
      */
+
+    /* every peer thread finalizes. Report once, from the last one. */
+    if (__sync_add_and_fetch(&pfiled->nr_finalized, 1) != peer->nr_threads) {
+        return;
+    }
+
+    pfiled->stop_movers = 1;
+    if (pfiled->rebalance) {
+        pthread_join(pfiled->rebalance_thread, NULL);
+    }
+    if (pfiled->tiering) {
+        pthread_join(pfiled->tier_thread, NULL);
+    }
+    for (i = 0; i < pfiled->nr_disks && pfiled->disk_threads; i++) {
+        pool_stop(&pfiled->disks[i].pool);
+    }
+    if (pfiled->meta_threads) {
+        pool_stop(&pfiled->meta_pool);
+    }
+
+    report_stats(pfiled);
     return;
 }
 
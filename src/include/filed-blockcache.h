@@ -0,0 +1,100 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILED_BLOCKCACHE_H
+#define _FILED_BLOCKCACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+
+/*
+ * User-space block cache for filed.
+ *
+ * When filed runs with --directio, the page cache is bypassed and every read
+ * hits the disk. The block cache keeps fixed-size, aligned blocks of objects
+ * in memory and uses ARC (Adaptive Replacement Cache) as its replacement
+ * policy, so that one-off sequential scans do not flush the frequently
+ * accessed blocks out of the cache.
+ *
+ * Writes, copies and deletes invalidate the affected blocks.
+ */
+
+#define BC_DEFAULT_BLOCKSIZE	(64 * 1024)
+
+/* ARC lists */
+#define BC_T1	0               /* recently used once, resident */
+#define BC_T2	1               /* used at least twice, resident */
+#define BC_B1	2               /* ghosts evicted from T1 */
+#define BC_B2	3               /* ghosts evicted from T2 */
+#define BC_NR_LISTS	4
+
+struct bc_block {
+    struct bc_block *hnext;
+    struct bc_block *prev;
+    struct bc_block *next;
+    unsigned char list;
+    uint64_t index;
+    char *data;                 /* NULL for ghost entries */
+    uint32_t namelen;
+    char name[XSEG_MAX_TARGETLEN + 1];
+};
+
+struct bc_list {
+    struct bc_block *head;      /* MRU */
+    struct bc_block *tail;      /* LRU */
+    uint64_t count;
+};
+
+struct bc_bucket {
+    struct bc_block *head;
+    uint64_t generation;
+};
+
+struct bc_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t ghost_hits;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+struct blockcache {
+    pthread_mutex_t lock;
+    uint64_t blocksize;
+    uint64_t size;              /* c: max resident blocks */
+    uint64_t p;                 /* target size of T1 */
+    struct bc_list lists[BC_NR_LISTS];
+    struct bc_bucket *buckets;
+    uint64_t nr_buckets;
+    struct bc_stats stats;
+};
+
+int blockcache_init(struct blockcache *bc, uint64_t memory, uint64_t blocksize);
+void blockcache_destroy(struct blockcache *bc);
+
+int blockcache_lookup(struct blockcache *bc, char *name, uint32_t namelen,
+                      uint64_t index, char *buf, uint64_t offset,
+                      uint64_t len, uint64_t *generation);
+void blockcache_insert(struct blockcache *bc, char *name, uint32_t namelen,
+                       uint64_t index, char *data, uint64_t generation);
+void blockcache_invalidate(struct blockcache *bc, char *name,
+                           uint32_t namelen, uint64_t offset, uint64_t size);
+void blockcache_get_stats(struct blockcache *bc, struct bc_stats *stats);
+
+#endif                          /* end of include guard: _FILED_BLOCKCACHE_H */
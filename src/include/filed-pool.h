@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILED_POOL_H
+#define _FILED_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <peer.h>
+
+#define POOL_NAME_LEN	15
+#define POOL_MAX_BATCH	32
+
+/*
+ * A pool of worker threads with a FIFO queue of peer requests.
+ *
+ * Peer threads hand requests off to a pool with pool_submit, and the pool
+ * threads run them to completion with the pool's execute callback.
+ *
+ * With coalescing enabled, a worker also takes off the queue the requests
+ * that can_merge accepts after the one it dequeued, and hands them all
+ * together to execute_batch. If no request can be merged and other workers
+ * are busy, it waits up to the coalescing window for one to arrive.
+ */
+
+/* Embedded in the private data of every peer request */
+struct pool_entry {
+    struct pool_entry *next;
+    struct peer_req *pr;
+    uint64_t queued;            /* usecs */
+};
+
+struct pool_stats {
+    uint64_t submitted;
+    uint64_t depth;
+    uint64_t max_depth;
+    uint64_t batches;
+    uint64_t merged;
+    uint64_t completed;
+    uint64_t wait_us;           /* total time spent queued */
+    uint64_t service_us;        /* total time spent executing */
+    uint64_t max_wait_us;
+};
+
+struct filed_pool {
+    char name[POOL_NAME_LEN + 1];
+    struct peerd *peer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pool_entry *head;
+    struct pool_entry *tail;
+    uint32_t nr_threads;
+    pthread_t *threads;
+    int stopping;
+    uint32_t busy;
+    void (*execute) (struct peerd * peer, struct peer_req * pr);
+    uint64_t window;
+    int (*can_merge) (struct peerd * peer, struct peer_req * last,
+                      struct peer_req * next);
+    void (*execute_batch) (struct peerd * peer, struct peer_req ** prs,
+                           int nr);
+    struct pool_stats stats;
+};
+
+int pool_init(struct filed_pool *pool, struct peerd *peer, char *name,
+              uint32_t nr_threads,
+              void (*execute) (struct peerd * peer, struct peer_req * pr));
+void pool_set_coalescing(struct filed_pool *pool, uint64_t window,
+                         int (*can_merge) (struct peerd * peer,
+                                           struct peer_req * last,
+                                           struct peer_req * next),
+                         void (*execute_batch) (struct peerd * peer,
+                                                struct peer_req ** prs,
+                                                int nr));
+void pool_submit(struct filed_pool *pool, struct pool_entry *pe,
+                 struct peer_req *pr);
+void pool_stop(struct filed_pool *pool);
+void pool_get_stats(struct filed_pool *pool, struct pool_stats *stats);
+
+#endif                          /* end of include guard: _FILED_POOL_H */
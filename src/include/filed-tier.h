@@ -0,0 +1,58 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILED_TIER_H
+#define _FILED_TIER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <xseg/xseg.h>
+
+/*
+ * Access-frequency tracking for hot/cold tiering.
+ *
+ * Every object access adds one to the heat of the object, and heat decays
+ * exponentially with time, halving every HEAT_HALFLIFE seconds. Objects are
+ * kept in a fixed-size, set-associative table. When a set is full, the
+ * coldest entry of the set is replaced.
+ */
+
+#define HEAT_HALFLIFE		600
+#define HEAT_SET_WAYS		4
+#define HEAT_NR_LOCKS		64
+
+struct heat_entry {
+    uint64_t hash;
+    double heat;
+    double last;
+    uint32_t namelen;
+    char name[XSEG_MAX_TARGETLEN + 1];
+};
+
+struct heat_table {
+    struct heat_entry *entries;
+    uint64_t nr_sets;
+    pthread_mutex_t locks[HEAT_NR_LOCKS];
+};
+
+int heat_init(struct heat_table *ht, uint64_t nr_entries);
+void heat_touch(struct heat_table *ht, char *name, uint32_t namelen);
+double heat_get(struct heat_table *ht, char *name, uint32_t namelen);
+int heat_hottest(struct heat_table *ht, struct heat_entry *out, int max,
+                 double min_heat);
+
+#endif                          /* end of include guard: _FILED_TIER_H */
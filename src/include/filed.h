@@ -20,6 +20,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define _GNU_SOURCE
 #include <xseg/xcache.h>
+#include "filed-blockcache.h"
+#include "filed-pool.h"
+#include "filed-tier.h"
 
 #define FIO_STR_ID_LEN		3
 #define LOCK_SUFFIX		"_lock"
@@ -32,6 +35,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_UNIQUESTR_LEN	128
 #define SNAP_SUFFIX		"_snap"
 #define SNAP_SUFFIX_LEN		5
+#define MOVE_SUFFIX		".filed_move"
+#define MAX_DISKS		16
+#define FAST_DISK		MAX_DISKS       /* index of the fast tier */
+#define NR_OBJECT_LOCKS		256
+
+/* tiering */
+#define TIER_INTERVAL		10      /* seconds between tiering rounds */
+#define TIER_BATCH		64      /* max objects promoted per round */
+#define TIER_HYSTERESIS		10      /* percent below tier_fast_max */
+
+/* readahead */
+#define RA_MIN_SEQ		2       /* sequential reads before prefetching */
+#define RA_PAGE_SIZE		4096
 
 #define WRITE 1
 #define READ 2
@@ -43,11 +59,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 struct fdcache_entry {
     volatile int fd;
     volatile unsigned int flags;
+    pthread_mutex_t ra_lock;
+    uint64_t ra_next;           /* offset a sequential read would start at */
+    uint64_t ra_end;            /* end of the prefetched range */
+    uint32_t ra_seq;            /* sequential reads in a row */
+};
+
+/* data directory */
+struct filed_disk {
+    uint32_t path_len;
+    uint64_t weight;
+    uint64_t seed;
+    char path[MAX_PATH_SIZE + 1];
+    struct filed_pool pool;
 };
 
 /* pfiled context */
 struct pfiled {
-    uint32_t vpath_len;
     uint32_t prefix_len;
     uint32_t lockpath_len;
     uint32_t uniquestr_len;
@@ -59,6 +87,42 @@ struct pfiled {
     char uniquestr[MAX_UNIQUESTR_LEN + 1];
     struct xcache cache;
     uint32_t migrate;
+    uint64_t bcache_size;
+    uint64_t bcache_bs;
+    struct blockcache bcache;
+    uint32_t nr_finalized;
+    uint32_t nr_disks;
+    struct filed_disk disks[MAX_DISKS + 1];
+    uint32_t disk_threads;
+    uint64_t coalesce;
+    uint32_t meta_threads;
+    struct filed_pool meta_pool;
+    uint32_t rebalance;
+    volatile int stop_movers;
+    pthread_t rebalance_thread;
+    uint64_t nr_moved;
+    uint64_t move_bw;
+    uint32_t tiering;
+    char fast_path[MAX_PATH_SIZE + 1];
+    uint64_t tier_promote;
+    uint64_t tier_fast_max;
+    uint64_t tier_track;
+    struct heat_table heat;
+    pthread_t tier_thread;
+    uint64_t nr_promoted;
+    uint64_t nr_demoted;
+    pthread_rwlock_t object_locks[NR_OBJECT_LOCKS];
+    uint64_t readahead;         /* bytes */
+    uint32_t ra_drop;
+    uint64_t ra_seq_reads;
+    uint64_t ra_hits;
+    uint64_t ra_prefetches;
+    uint64_t ra_prefetched;
+    uint64_t ra_dropped;
+    uint64_t prealloc;          /* bytes */
+    uint32_t prealloc_grow_size;
+    uint64_t nr_prealloc;
+    uint64_t nr_prealloc_failed;
 };
 
 /*
@@ -69,6 +133,7 @@ struct fio {
     uint32_t state;
     xcache_handler h;
     char str_id[FIO_STR_ID_LEN];
+    struct pool_entry pe;
 };
 
 
@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FNV_H
+#define _FNV_H
+
+#include <stdint.h>
+
+#define FNV_OFFSET_BASIS	14695981039346656037ULL
+#define FNV_PRIME		1099511628211ULL
+
+/*
+ * 64-bit FNV-1a hash of @len bytes of @s. Cheap and well spread, for hash
+ * tables and for spreading names over buckets, disks or processes. Its values
+ * must not change, since some of them decide where objects are placed.
+ */
+static inline uint64_t fnv_hash(const char *s, uint32_t len)
+{
+    uint64_t h = FNV_OFFSET_BASIS;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+#endif
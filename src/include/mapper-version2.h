@@ -25,6 +25,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 struct map;
 
+/*
+ * MAP_V3 maps use the v2 format. Their objects are writable only in the epoch
+ * they were created in, so a snapshot only has to increase the epoch of the
+ * map.
+ *
+ * A MAP_V3 map can also be a clone of a parent map, named in its header. An
+ * empty object entry of a clone stands for the object of the parent map with
+ * the same index.
+ *
+ * A clone can also have partial objects, which hold only some of the
+ * sub-blocks of the object. The entry of a partial object keeps the bitmap of
+ * its valid sub-blocks in the last bytes of the object name, so its name must
+ * be shorter.
+ */
+
 /* Maximum length of an object name in memory */
 #define v2_max_objectlen 123
 
@@ -38,6 +53,8 @@ struct v2_object_on_disk {
     unsigned char object[v2_max_objectlen];
 } __attribute__ ((packed));
 
+#define v2_max_partial_objectlen (v2_max_objectlen - sizeof(uint64_t))
+
 //This must be a power of 2. Currently set to 128.
 #define v2_objectsize_in_map (sizeof(struct v2_object_on_disk))
 
@@ -48,7 +65,13 @@ struct v2_object_on_disk {
  * 	block size    - uint32_t
  * 	map flags     - uint32_t
  * 	map epoch     - uint64_t
+ * and for MAP_V3 maps:
+ * 	parent epoch  - uint64_t
+ * 	parent len    - uint32_t
+ * 	parent name   - v2_max_parentlen bytes
  */
+#define v2_max_parentlen v2_max_objectlen
+
 struct v2_header_struct {
     uint32_t signature;
     uint32_t version;
@@ -56,6 +79,9 @@ struct v2_header_struct {
     uint32_t blocksize;
     uint32_t flags;
     uint64_t epoch;
+    uint64_t parent_epoch;
+    uint32_t parentlen;
+    char parent[v2_max_parentlen];
 } __attribute__ ((packed));
 
 #define v2_mapheader_size (sizeof(struct v2_header_struct))
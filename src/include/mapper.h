@@ -29,8 +29,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <mapper-version2.h>
 
 /* Alternative, each header file could define an appropriate MAP_V# */
-enum { MAP_V0, MAP_V1, MAP_V2 };
-#define MAP_LATEST_VERSION MAP_V2
+enum { MAP_V0, MAP_V1, MAP_V2, MAP_V3 };
+#define MAP_LATEST_VERSION MAP_V3
 #define MAP_LATEST_MOPS &v2_ops
 
 struct header_struct {
@@ -45,6 +45,8 @@ struct header_struct {
 #define MIN_BLOCKSIZE (v2_objectsize_in_map)
 /* should always be the maximum objectlen of all versions */
 #define MAX_OBJECT_LEN 123
+/* maximum objectlen of partial objects, whose entries also hold a bitmap */
+#define MAX_PARTIAL_OBJECT_LEN v2_max_partial_objectlen
 
 /* since object names are cacluclated from the volume names, the limit of the
  * maximum volume len is calculated from the maximum object len, statically for
@@ -98,16 +100,22 @@ struct header_struct {
 
 struct map;
 struct map_node;
+struct map_object;
 /* Map I/O ops */
 struct map_ops {
-    void (*object_to_map) (unsigned char *buf, struct map_node * mn);
-    int (*read_object) (struct map_node * mn, unsigned char *buf);
+    void (*object_to_map) (unsigned char *buf, struct map_object * obj);
+    int (*read_object) (struct map_object * obj, unsigned char *buf);
     struct xseg_request *(*prepare_write_object) (struct peer_req * pr,
                                                   struct map * map,
-                                                  struct map_node * mn);
+                                                  struct map_object * obj);
     int (*load_map_data) (struct peer_req * pr, struct map * map);
+    int (*load_map_objects) (struct peer_req * pr, struct map * map,
+                             uint64_t start, uint64_t nr);
     int (*write_map_data) (struct peer_req * pr, struct map * map);
     int (*delete_map_data) (struct peer_req * pr, struct map * map);
+    int (*copy_map_data) (struct peer_req * pr, struct map * map,
+                          struct map * dst);
+    int (*init_map_data) (struct peer_req * pr, struct map * map);
 };
 
 /* general mapper flags */
@@ -117,6 +125,7 @@ struct map_ops {
 #define MF_ARCHIP	(1 << 3)
 
 #define MAPPER_DEFAULT_BLOCKSIZE (1<<22)
+#define MAPPER_DEFAULT_CACHE 64  /* MB of maps not opened exclusively */
 
 #define MAPPER_PREFIX "archip_"
 #define MAPPER_PREFIX_LEN 7
@@ -141,6 +150,14 @@ typedef void (*cb_t) (struct peer_req * pr, struct xseg_request * req);
 #define MF_OBJECT_ARCHIP	(1 << 1)
 #define MF_OBJECT_ZERO		(1 << 2)
 #define MF_OBJECT_DELETED	(1 << 3)
+/* Not overridden by a clone, the object of the parent map is used. Stored as
+ * an empty entry.
+ */
+#define MF_OBJECT_INHERITED	(1 << 4)
+/* Holds only the sub-blocks that are valid in its bitmap, and falls through to
+ * the object of the parent map for the rest (see mapnode_valid).
+ */
+#define MF_OBJECT_PARTIAL	(1 << 5)
 
 /* run time map object state flags */
 #define MF_OBJECT_COPYING	(1 << 0)
@@ -151,22 +168,66 @@ typedef void (*cb_t) (struct peer_req * pr, struct xseg_request * req);
 
 #define MF_OBJECT_NOT_READY	(MF_OBJECT_COPYING|MF_OBJECT_WRITING|\
 				MF_OBJECT_DELETING|MF_OBJECT_SNAPSHOTTING)
+
+/*
+ * There is a map node for every object of every loaded map, so map nodes are
+ * kept small:
+ *
+ * - The object name is encoded in a handle, which is decoded with
+ *   mapnode_get_name only when the name is needed (see mapper-node.c).
+ * - The object index is the position of the node in the objects of its map.
+ * - A condition variable is allocated only while someone waits on the node.
+ */
 struct map_node {
+    struct map *map;
+    uint32_t name;
+    volatile uint16_t ref;
+    uint8_t flags;
+    volatile uint8_t state;
+};
+
+/* Decoded information of an object, as read from or written to a map */
+struct map_object {
     uint32_t flags;
-    volatile uint32_t state;
-    uint64_t objectidx;         /* FIXME this is probably not needed */
+    uint64_t objectidx;
     uint32_t objectlen;
     char object[MAX_OBJECT_LEN + 1];    /* NULL terminated string */
-    struct map *map;
-    volatile uint32_t ref;
-    volatile uint32_t waiters;
-    st_cond_t cond;
+    uint64_t valid;             /* sub-blocks of a partial object */
+};
+
+/* Valid sub-blocks of a partial object, kept out of its map node */
+struct map_partial {
+    uint64_t idx;
+    uint64_t valid;
+};
+
+struct map_hash;
+struct mapnode_wait;
+
+/* Object names of a map that cannot be encoded in its map nodes */
+struct map_names {
+    struct map_hash *hashes;    /* binary hashes of content named objects */
+    uint32_t nr_hashes;
+    uint32_t size_hashes;
+    uint32_t free_hash;
+    char **strings;             /* any other name */
+    uint32_t nr_strings;
+    uint32_t size_strings;
+    char **prefixes;            /* name prefixes of archipelago objects */
+    uint32_t nr_prefixes;
+    uint32_t size_prefixes;
 };
 
 
 /* map flags */
 #define MF_MAP_READONLY		(1 << 0)
 #define MF_MAP_DELETED		(1 << 1)
+/* Writable objects not created by archipelago (see mapnode_writable) */
+#define MF_MAP_FOREIGN_WRITABLE	(1 << 2)
+/* The map may have partial objects, which are completed in the background */
+#define MF_MAP_PARTIAL		(1 << 3)
+/* The objects of the deleted map are still to be reclaimed */
+#define MF_MAP_RECLAIM		(1 << 4)
 
 /* run time map state flags */
 #define MF_MAP_LOADING		(1 << 0)
@@ -194,6 +255,10 @@ struct map_node {
 				MF_MAP_DELETING_DATA|MF_MAP_DESTROYING|        \
 				MF_MAP_TRUNCATING|MF_MAP_CLOSING)
 
+/* map chunk states, for maps whose objects are loaded on demand */
+#define MF_CHUNK_LOADED		(1 << 0)
+#define MF_CHUNK_LOADING	(1 << 1)
+
 /* hex value of "AMF."
  * Stands for Archipelago Map Format */
 #define MAP_SIGNATURE (uint32_t)(0x414d462e)
@@ -210,7 +275,25 @@ struct map {
     uint32_t volumelen;
     char volume[MAX_VOLUME_LEN + 1];    /* NULL terminated string */
     char key[MAX_VOLUME_LEN + 1];       /* NULL terminated string, for cache */
+    /* Map that a clone falls through to. Empty if the map is not a clone */
+    uint32_t parentlen;
+    char parent[MAX_VOLUME_LEN + 1];    /* NULL terminated string */
+    uint64_t parent_epoch;
+    struct map *parent_map;     /* loaded on demand */
     struct map_node *objects;
+    /* Chunk states, while not all objects are loaded. NULL otherwise */
+    volatile unsigned char *chunks;
+    uint64_t nr_chunks;
+    uint64_t nr_loaded_chunks;
+    uint32_t chunk_objs;        /* objects per chunk */
+    /* Chunks changed since the map was last written. NULL for all */
+    unsigned char *dirty;
+    struct map_names names;
+    /* Partial objects, sorted by index */
+    struct map_partial *partials;
+    uint32_t nr_partials;
+    uint32_t size_partials;
+    struct mapnode_wait *node_waits;    /* map nodes someone waits on */
     volatile uint32_t ref;
     volatile uint32_t waiters;
     st_cond_t cond;
@@ -220,12 +303,72 @@ struct map {
     volatile uint32_t users;
     volatile uint32_t waiters_users;
     st_cond_t users_cond;
+
+    /* shared map cache */
+    struct map *lru_prev;
+    struct map *lru_next;
+    uint64_t cache_size;        /* bytes accounted, 0 if not in the LRU */
+};
+
+struct map_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+/*
+ * Maps that are not opened exclusively stay in the map cache after use, as
+ * long as they fit in its memory budget, least recently used first out.
+ */
+struct map_cache {
+    uint64_t budget;            /* bytes, 0 disables the cache */
+    uint64_t used;
+    struct map *head;           /* most recently used */
+    struct map *tail;
+    struct map_cache_stats stats;
+};
+
+#define MAX_JOURNAL_LEN 512
+#define MAPPER_DEFAULT_RECLAIM_DIR "/var/lib/archipelago"
+#define MAPPER_DEFAULT_RECLAIM_JOURNAL MAPPER_DEFAULT_RECLAIM_DIR "/mapperd.reclaim"
+/* separates the name of a destroyed map from its epoch, in its reclaim name */
+#define MAPPER_RECLAIM_SEP '@'
+/* objects to reclaim per second, and at most per step */
+#define MAPPER_DEFAULT_RECLAIM_RATE 256
+#define MAPPER_RECLAIM_BATCH 64
+/* usecs to wait before retrying a map that cannot be opened */
+#define MAPPER_RECLAIM_RETRY 10000000UL
+
+/*
+ * A deleted map whose objects are reclaimed in the background. The map is
+ * opened, and its objects are loaded, one step at a time.
+ */
+struct reclaim {
+    char volume[MAX_VOLUME_LEN + 1];
+    uint32_t volumelen;
+    struct map *map;            /* NULL until opened */
+    uint64_t cursor;            /* next object to reclaim */
+    uint64_t failed;            /* deletions that failed so far */
+    struct reclaim *next;
 };
 
 struct mapperd {
     xport bportno;              /* blocker that accesses data */
     xport mbportno;             /* blocker that accesses maps */
     xhash_t *hashmaps;          // hash_function(target) --> struct map
+    struct map_cache cache;
+    int partial_copyups;        /* copy up only the written sub-blocks */
+    int complete_pending;       /* maps may have partial objects */
+    uint32_t nr_shards;         /* processes that serve maps */
+    uint32_t shard;             /* shard served by this process */
+    xport shard_port;           /* port of the second shard */
+    pid_t *shard_pids;          /* processes of the other shards */
+    struct reclaim *reclaims;   /* maps to reclaim, oldest first */
+    int reclaiming;             /* a reclaim step is in progress */
+    uint64_t reclaim_rate;      /* objects per second, 0 for no limit */
+    uint64_t reclaim_next;      /* time of the next reclaim step, in usecs */
+    char reclaim_journal[MAX_JOURNAL_LEN + 1];
 };
 
 struct mapper_io {
@@ -251,10 +394,9 @@ struct mapper_io {
 #define wait_on_mapnode(__mn, __condition__)	\
 	do {					\
 		ta--;				\
-		__mn->waiters++;		\
-		XSEGLOG2(&lc, D, "Waiting on map node %lx %s, waiters: %u, \
-			ta: %u",  __mn, __mn->object, __mn->waiters, ta);  \
-		st_cond_wait(__mn->cond);	\
+		XSEGLOG2(&lc, D, "Waiting on map node %lx, ta: %u",  \
+				__mn, ta);	\
+		mapnode_wait(__mn);		\
 	} while (__condition__)
 
 #define wait_on_map(__map, __condition__)	\
@@ -312,13 +454,8 @@ struct mapper_io {
 
 #define signal_mapnode(__mn)			\
 	do { 					\
-		if (__mn->waiters) {		\
-			ta += __mn->waiters;	\
-			XSEGLOG2(&lc, D, "Signaling map node %lx %s, waiters: \
-			%u, ta: %u",  __mn, __mn->object, __mn->waiters, ta); \
-			__mn->waiters = 0;	\
-			st_cond_broadcast(__mn->cond);	\
-		}				\
+		XSEGLOG2(&lc, D, "Checking map node %lx, ta: %u", __mn, ta); \
+		mapnode_signal(__mn);		\
 	}while(0)
 
 
@@ -350,6 +487,61 @@ static inline uint64_t calc_map_obj(struct map *map)
     return __calc_map_obj(map->size, map->blocksize);
 }
 
+static inline uint64_t mapnode_idx(struct map_node *mn)
+{
+    return mn - mn->map->objects;
+}
+
+/*
+ * A partial object is split in MAPPER_SUBBLOCKS sub-blocks of equal size, and
+ * a bitmap marks the sub-blocks it holds.
+ */
+#define MAPPER_SUBBLOCKS 64
+#define MAPPER_ALL_SUBBLOCKS ((uint64_t)-1)
+
+static inline uint64_t subblock_size(struct map *map)
+{
+    return map->blocksize / MAPPER_SUBBLOCKS;
+}
+
+/* Bitmap of sub-blocks first to last */
+static inline uint64_t subblock_range(uint64_t first, uint64_t last)
+{
+    uint64_t mask = MAPPER_ALL_SUBBLOCKS << first;
+
+    if (last < MAPPER_SUBBLOCKS - 1) {
+        mask &= (1ULL << (last + 1)) - 1;
+    }
+    return mask;
+}
+
+/* Bitmap of the sub-blocks that [offset, offset + size) of an object touches */
+static inline uint64_t subblocks_touched(struct map *map, uint64_t offset,
+                                         uint64_t size)
+{
+    uint64_t sbsize = subblock_size(map);
+
+    if (!size) {
+        return 0;
+    }
+    return subblock_range(offset / sbsize, (offset + size - 1) / sbsize);
+}
+
+/* Bitmap of the sub-blocks of object @idx that hold volume data */
+static inline uint64_t object_subblocks(struct map *map, uint64_t idx)
+{
+    uint64_t start = idx * map->blocksize;
+    uint64_t size = map->blocksize;
+
+    if (start >= map->size) {
+        return 0;
+    }
+    if (start + size > map->size) {
+        size = map->size - start;
+    }
+    return subblocks_touched(map, 0, size);
+}
+
 static inline int is_valid_blocksize(uint64_t x)
 {
     return (x && !(x & (x - 1)) && x > MIN_BLOCKSIZE);
@@ -367,10 +559,21 @@ int write_map_metadata(struct peer_req *pr, struct map *map);
 struct xseg_request *__load_map(struct peer_req *pr, struct map *m);
 int read_map(struct map *map, unsigned char *buf);
 int load_map(struct peer_req *pr, struct map *map);
-struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn);
+int load_map_objects(struct peer_req *pr, struct map *map, uint64_t start,
+                     uint64_t nr);
+int unload_map_objects(struct map *map);
+int load_parent_objects(struct peer_req *pr, struct map *map, uint64_t start,
+                        uint64_t nr);
+int track_dirty_chunks(struct map *map);
+void mark_objects_dirty(struct map *map, uint64_t start, uint64_t nr);
+struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn,
+                                     int overwrite);
+struct xseg_request *__copyup_partial(struct peer_req *pr, struct map_node *mn,
+                                      uint64_t copy, uint64_t written);
 void copyup_cb(struct peer_req *pr, struct xseg_request *req);
 struct xseg_request *__object_write(struct peerd *peer, struct peer_req *pr,
-                                    struct map *map, struct map_node *mn);
+                                    struct map *map, struct map_object *obj,
+                                    struct map_node *mn);
 int __set_node(struct mapper_io *mio, struct xseg_request *req,
                struct map_node *mn);
 struct map_node *__get_node(struct mapper_io *mio, struct xseg_request *req);
@@ -383,10 +586,27 @@ int load_map_metadata(struct peer_req *pr, struct map *map);
 int delete_map_data(struct peer_req *pr, struct map *map);
 int delete_map(struct peer_req *pr, struct map *map, int delete_data);
 int purge_map(struct peer_req *pr, struct map *map);
-int initialize_map_objects(struct map *map);
+int initialize_map_objects(struct map *map, uint64_t start, uint64_t nr);
 int hash_map(struct peer_req *pr, struct map *map, struct map *hashed_map);
 struct map_node *get_mapnode(struct map *map, uint64_t objindex);
 void put_mapnode(struct map_node *mn);
 struct xseg_request *__object_delete(struct peer_req *pr, struct map_node *mn);
 void object_delete_cb(struct peer_req *pr, struct xseg_request *req);
+void reclaim_object_cb(struct peer_req *pr, struct xseg_request *req);
+
+/* map node functions */
+uint32_t mapnode_get_name(struct map_node *mn, char *buf);
+int mapnode_set_name(struct map_node *mn, char *name, uint32_t namelen);
+void mapnode_get_object(struct map_node *mn, struct map_object *obj);
+int mapnode_set_object(struct map_node *mn, struct map_object *obj);
+void mapnode_wait(struct map_node *mn);
+void mapnode_signal(struct map_node *mn);
+void free_map_names(struct map *map);
+uint64_t map_names_size(struct map *map);
+uint64_t mapnode_epoch(struct map_node *mn);
+int mapnode_writable(struct map_node *mn);
+uint64_t mapnode_valid(struct map_node *mn);
+int mapnode_get_parent_object(struct map_node *mn, struct map_object *obj);
+void drop_map_partials(struct map *map, uint64_t start);
+uint64_t map_partials_size(struct map *map);
 #endif                          /* end MAPPER_H */
@@ -61,6 +61,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
 #define PEER_DEFAULT_UMASK     0007
+#define PEER_DEFAULT_IDLE_TIMEOUT 10000000UL
 
 /* main peer structs */
 struct peer_req {
@@ -96,6 +97,8 @@ struct peerd {
     struct peer_req *peer_reqs;
     struct xq free_reqs;
     int (*peerd_loop) (void *arg);
+    int (*custom_poll) (struct peerd * peer);
+    uint64_t idle_timeout;      /* max usecs to wait for a signal when idle */
     void *sd;
     void *priv;
 #ifdef MT
@@ -126,6 +129,7 @@ void get_responds_stats();
 void usage();
 void print_req(struct xseg *xseg, struct xseg_request *req);
 int all_peer_reqs_free(struct peerd *peer);
+void *peer_alloc(size_t size);
 
 #ifdef MT
 int thread_execute(struct peerd *peer, void (*func) (void *arg), void *arg);
@@ -351,6 +351,7 @@ struct xseg_request *__write_map_metadata(struct peer_req *pr, struct map *map)
         header_size = v1_mapheader_size;
         break;
     case MAP_V2:
+    case MAP_V3:
         write_map_header_v2(map, (struct v2_header_struct *) &hdr);
         header_size = v2_mapheader_size;
         break;
@@ -418,23 +419,92 @@ int write_map_data(struct peer_req *pr, struct map *map)
 }
 */
 
+/*
+ * Start tracking the chunks of @map that change, so that the next write_map
+ * writes only them. Maps that are not split in chunks are always written as
+ * a whole.
+ */
+int track_dirty_chunks(struct map *map)
+{
+    if (!map->chunk_objs || !map->nr_chunks) {
+        return -1;
+    }
+    if (map->dirty) {
+        return 0;
+    }
+    map->dirty = calloc(map->nr_chunks, sizeof(unsigned char));
+    if (!map->dirty) {
+        XSEGLOG2(&lc, W, "Cannot track dirty chunks of map %s", map->volume);
+        return -1;
+    }
+    return 0;
+}
+
+void mark_objects_dirty(struct map *map, uint64_t start, uint64_t nr)
+{
+    uint64_t c, last;
+
+    if (!map->dirty || !nr) {
+        return;
+    }
+    last = (start + nr - 1) / map->chunk_objs;
+    for (c = start / map->chunk_objs; c <= last; c++) {
+        map->dirty[c] = 1;
+    }
+}
+
+static int load_dirty_chunks(struct peer_req *pr, struct map *map)
+{
+    uint64_t c, start, nr;
+
+    for (c = 0; c < map->nr_chunks; c++) {
+        if (!map->dirty[c]) {
+            continue;
+        }
+        start = c * map->chunk_objs;
+        nr = map->nr_objs - start;
+        if (nr > map->chunk_objs) {
+            nr = map->chunk_objs;
+        }
+        if (load_map_objects(pr, map, start, nr) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int write_map(struct peer_req *pr, struct map *map)
 {
     int r;
-    map->state |= MF_MAP_WRITING;
     struct mapper_io *mio = __get_mapper_io(pr);
 
+    /* Every chunk that is written must be loaded */
+    if (map->dirty) {
+        r = load_dirty_chunks(pr, map);
+    } else {
+        r = load_map_objects(pr, map, 0, map->nr_objs);
+    }
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
+        goto out;
+    }
+
+    map->state |= MF_MAP_WRITING;
     mio->cb = NULL;
     mio->err = 0;
 
     r = map->mops->write_map_data(pr, map);
+    map->state &= ~MF_MAP_WRITING;
     if (r < 0) {
-        map->state &= ~MF_MAP_WRITING;
-        return r;
+        goto out;
     }
-    map->state &= ~MF_MAP_WRITING;
 
-    return write_map_metadata(pr, map);
+    r = write_map_metadata(pr, map);
+
+  out:
+    free(map->dirty);
+    map->dirty = NULL;
+    return r;
 }
 
 
@@ -607,7 +677,8 @@ int load_map_metadata(struct peer_req *pr, struct map *map)
     char *data;
     uint32_t version;
     uint32_t signature;
-    uint32_t assume_v0 = pr->req->flags & XF_ASSUMEV0;
+    /* background requests have no client request */
+    uint32_t assume_v0 = pr->req ? pr->req->flags & XF_ASSUMEV0 : 0;
     uint32_t signature_on_disk;
     uint32_t version1_on_disk;
 
@@ -654,6 +725,7 @@ int load_map_metadata(struct peer_req *pr, struct map *map)
         r = read_map_header_v1(map, (struct v1_header_struct *) data);
         break;
     case MAP_V2:
+    case MAP_V3:
         r = read_map_header_v2(map, (struct v2_header_struct *) data);
         break;
     default:
@@ -687,6 +759,7 @@ int load_map(struct peer_req *pr, struct map *map)
     //struct xseg_request *req;
     int r;
     uint32_t prev_version;
+    uint32_t prev_flags;
     struct map_ops *prev_mops;
     uint64_t v0_size = NO_V0SIZE;
     uint64_t nr_objs = 0;
@@ -723,13 +796,23 @@ int load_map(struct peer_req *pr, struct map *map)
         /* FIXME assert that all old map data are overwritten */
         prev_version = map->version;
         prev_mops = map->mops;
+        prev_flags = map->flags;
+        if (prev_version < MAP_V3) {
+            /* writable objects may have been created in any epoch */
+            map->flags |= MF_MAP_FOREIGN_WRITABLE;
+        }
         map->version = MAP_LATEST_VERSION;
         map->mops = MAP_LATEST_MOPS;
+        if (map->mops == prev_mops) {
+            /* same format, only the header changes */
+            track_dirty_chunks(map);
+        }
         if (write_map(pr, map) < 0) {
             XSEGLOG2(&lc, E, "Could not update map %s to latest version",
                      map->volume);
             map->version = prev_version;
             map->mops = prev_mops;
+            map->flags = prev_flags;
             goto out_err;
         }
     }
@@ -745,6 +828,145 @@ int load_map(struct peer_req *pr, struct map *map)
     return -1;
 }
 
+static inline int chunk_loading(struct map *map, uint64_t c)
+{
+    return map->chunks && (map->chunks[c] & MF_CHUNK_LOADING);
+}
+
+/* Load chunks [first, last) of @map, which must be marked as loading */
+static int __load_map_chunks(struct peer_req *pr, struct map *map,
+                             uint64_t first, uint64_t last)
+{
+    int r;
+    uint64_t c, start, end;
+    struct mapper_io *mio = __get_mapper_io(pr);
+
+    start = first * map->chunk_objs;
+    end = last * map->chunk_objs;
+    if (end > map->nr_objs) {
+        end = map->nr_objs;
+    }
+
+    XSEGLOG2(&lc, D, "Loading chunks %llu-%llu of map %s",
+             (unsigned long long) first, (unsigned long long) last,
+             map->volume);
+    mio->err = 0;
+    r = map->mops->load_map_objects(pr, map, start, end - start);
+    if (r >= 0 && map->parentlen) {
+        r = load_parent_objects(pr, map, start, end - start);
+    }
+    for (c = first; c < last; c++) {
+        map->chunks[c] = (r < 0) ? 0 : MF_CHUNK_LOADED;
+    }
+    if (r >= 0) {
+        map->nr_loaded_chunks += last - first;
+        if (map->nr_loaded_chunks == map->nr_chunks) {
+            XSEGLOG2(&lc, I, "All objects of map %s loaded", map->volume);
+            free((void *) map->chunks);
+            map->chunks = NULL;
+        }
+    }
+    /* wake up anyone waiting on these chunks */
+    signal_map(map);
+
+    return r;
+}
+
+/*
+ * Make sure that objects [start, start + nr) of @map are loaded.
+ *
+ * Maps that are loaded on demand keep the state of every chunk of their
+ * objects. Chunks that nobody has loaded yet are loaded here, and chunks that
+ * another request is loading are waited on.
+ */
+int load_map_objects(struct peer_req *pr, struct map *map, uint64_t start,
+                     uint64_t nr)
+{
+    int r;
+    uint64_t c, first, last, end;
+
+    if (!nr) {
+        return 0;
+    }
+    if (start + nr > map->nr_objs) {
+        XSEGLOG2(&lc, E, "Objects %llu-%llu out of range for map %s",
+                 (unsigned long long) start,
+                 (unsigned long long) (start + nr), map->volume);
+        return -1;
+    }
+
+  retry:
+    if (!map->chunks) {
+        return 0;
+    }
+    first = start / map->chunk_objs;
+    last = (start + nr - 1) / map->chunk_objs + 1;
+
+    for (c = first; c < last && map->chunks; c = end) {
+        if (map->chunks[c]) {
+            end = c + 1;
+            continue;
+        }
+        /* claim all consecutive chunks, to load them in parallel */
+        for (end = c; end < last && !map->chunks[end]; end++) {
+            map->chunks[end] = MF_CHUNK_LOADING;
+        }
+        r = __load_map_chunks(pr, map, c, end);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Loading objects %llu-%llu of map %s failed",
+                     (unsigned long long) start,
+                     (unsigned long long) (start + nr), map->volume);
+            return -1;
+        }
+    }
+
+    for (c = first; c < last && map->chunks; c++) {
+        if (chunk_loading(map, c)) {
+            wait_on_map(map, chunk_loading(map, c));
+        }
+        if (map->chunks && !(map->chunks[c] & MF_CHUNK_LOADED)) {
+            /* loading by another request failed */
+            goto retry;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Drop the loaded objects of @map, so that they are loaded again on demand.
+ * Only maps whose objects are loaded on demand support this.
+ */
+int unload_map_objects(struct map *map)
+{
+    uint64_t c;
+
+    if (!map->mops->load_map_objects) {
+        return -1;
+    }
+    if (!map->nr_chunks) {
+        return 0;
+    }
+    if (!map->chunks) {
+        map->chunks = calloc(map->nr_chunks, sizeof(unsigned char));
+        if (!map->chunks) {
+            return -1;
+        }
+    } else {
+        for (c = 0; c < map->nr_chunks; c++) {
+            if (map->chunks[c] & MF_CHUNK_LOADING) {
+                return -1;
+            }
+        }
+        memset((void *) map->chunks, 0, map->nr_chunks);
+    }
+    map->nr_loaded_chunks = 0;
+    XSEGLOG2(&lc, D, "Unloaded objects of map %s", map->volume);
+
+    return 0;
+}
+
 
 /*
 struct xseg_request * __snapshot_object(struct peer_req *pr,
@@ -809,25 +1031,18 @@ out_err:
 }
 */
 
-struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn)
+/*
+ * Name the object that @mn is copied up to in the current epoch of its map.
+ * Returns the length of the name.
+ */
+static uint32_t new_object_name(struct map_node *mn, char *new_target)
 {
-    struct peerd *peer = pr->peer;
-    struct mapperd *mapper = __get_mapperd(peer);
-    struct mapper_io *mio = __get_mapper_io(pr);
     struct map *map = mn->map;
-    struct xseg_request *req;
-    struct xseg_request_copy *xcopy;
-    int r = -1;
-
-    //assert !(mn->flags & MF_OBJECT_WRITABLE)
-
-    uint32_t newtargetlen;
-    char new_target[MAX_OBJECT_LEN + 1];
     char *tmp = new_target;
     char hexlified_epoch[HEXLIFIED_EPOCH];
     char hexlified_index[HEXLIFIED_INDEX];
     uint64_t be_epoch = __cpu_to_be64(map->epoch);
-    uint64_t be_objectidx = __cpu_to_be64(mn->objectidx);
+    uint64_t be_objectidx = __cpu_to_be64(mapnode_idx(mn));
 
 //      strncpy(new_target, MAPPER_PREFIX, MAPPER_PREFIX_LEN);
 
@@ -845,26 +1060,59 @@ struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn)
     strncpy(tmp, hexlified_index, HEXLIFIED_INDEX);
     tmp += HEXLIFIED_INDEX;
     *tmp = 0;
-    newtargetlen = tmp - new_target;
+
+    return tmp - new_target;
+}
+
+/*
+ * Copy up the object of @mn to a new writable object of its map. If
+ * @overwrite is set, the whole object is about to be written, so the data of
+ * the old object is not copied, and the new object is only put in the map.
+ */
+struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn,
+                                     int overwrite)
+{
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct map *map = mn->map;
+    struct xseg_request *req;
+    struct xseg_request_copy *xcopy;
+    struct map_object newobj;
+    int r = -1;
+
+    //assert !(mn->flags & MF_OBJECT_WRITABLE)
+
+    uint32_t newtargetlen, objectlen;
+    char object[MAX_OBJECT_LEN + 1];
+    char new_target[MAX_OBJECT_LEN + 1];
+
+    newtargetlen = new_object_name(mn, new_target);
     XSEGLOG2(&lc, D, "New target: %s (len: %d)", new_target, newtargetlen);
 
-    if (!strncmp(mn->object, zero_block, ZERO_BLOCK_LEN)) {
+    objectlen = mapnode_get_name(mn, object);
+    if (!strncmp(object, zero_block, ZERO_BLOCK_LEN)) {
         goto copyup_zeroblock;
     }
+    if (overwrite) {
+        XSEGLOG2(&lc, I, "Object %s is overwritten as a whole. "
+                 "Copying up its data is not needed.", object);
+        goto copyup_newobject;
+    }
 
     req = get_request(pr, mapper->bportno, new_target, newtargetlen,
                       sizeof(struct xseg_request_copy));
 
     xcopy = (struct xseg_request_copy *) xseg_get_data(peer->xseg, req);
-    strncpy(xcopy->target, mn->object, mn->objectlen);
-    xcopy->targetlen = mn->objectlen;
+    strncpy(xcopy->target, object, objectlen);
+    xcopy->targetlen = objectlen;
 
     req->offset = 0;
     req->size = map->blocksize;
     req->op = X_COPY;
     r = __set_node(mio, req, mn);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
+        XSEGLOG2(&lc, E, "Cannot set map node for object %s", object);
         goto out_put;
     }
 
@@ -875,7 +1123,7 @@ struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn)
         goto out_unset_node;
     }
     mn->state |= MF_OBJECT_COPYING;
-    XSEGLOG2(&lc, I, "Copying up object %s \n\t to %s", mn->object,
+    XSEGLOG2(&lc, I, "Copying up object %s \n\t to %s", object,
              new_target);
     return req;
 
@@ -884,37 +1132,141 @@ struct xseg_request *__copyup_object(struct peer_req *pr, struct map_node *mn)
   out_put:
     put_request(pr, req);
 //out_err:
-    XSEGLOG2(&lc, E, "Copying up object %s \n\t to %s failed", mn->object,
+    XSEGLOG2(&lc, E, "Copying up object %s \n\t to %s failed", object,
              new_target);
     return NULL;
 
   copyup_zeroblock:
     XSEGLOG2(&lc, I, "Copying up of zero block is not needed."
              "Proceeding in writing the new object in map");
-    /* construct a tmp map_node for writing purposes */
-    struct map_node newmn = *mn;
-    newmn.flags = 0;
-    newmn.flags |= MF_OBJECT_WRITABLE;
-    newmn.flags |= MF_OBJECT_ARCHIP;
-    strncpy(newmn.object, new_target, newtargetlen);
-    newmn.object[newtargetlen] = 0;
-    newmn.objectlen = newtargetlen;
-    newmn.objectidx = mn->objectidx;
-    req = __object_write(peer, pr, map, &newmn);
+  copyup_newobject:
+    /* construct a tmp map object for writing purposes */
+    newobj.flags = 0;
+    newobj.flags |= MF_OBJECT_WRITABLE;
+    newobj.flags |= MF_OBJECT_ARCHIP;
+    strncpy(newobj.object, new_target, newtargetlen);
+    newobj.object[newtargetlen] = 0;
+    newobj.objectlen = newtargetlen;
+    newobj.objectidx = mapnode_idx(mn);
+    newobj.valid = 0;
+    req = __object_write(peer, pr, map, &newobj, mn);
     if (!req) {
         XSEGLOG2(&lc, E, "Object write returned error for object %s"
                  "\n\t of map %s [%llu]",
-                 mn->object, map->volume, (unsigned long long) mn->objectidx);
-        __set_node(mio, req, NULL);
+                 object, map->volume, (unsigned long long) newobj.objectidx);
+        return NULL;
+    }
+    mn->state |= MF_OBJECT_WRITING;
+    XSEGLOG2(&lc, I, "Object %s copy up completed. Pending writing.",
+             object);
+    return req;
+}
+
+/*
+ * Take a step in making the sub-blocks @copy and @written of @mn valid, for a
+ * write to a clone that does not cover the whole object. If @mn falls through
+ * to its parent, a new partial object is created for it. Otherwise it must be
+ * a partial object, which is filled in place.
+ *
+ * The first run of sub-blocks of @copy that is not valid is copied from the
+ * parent object, and marked valid when the copy completes. Once there is
+ * nothing left to copy, the sub-blocks of @written, which are about to be
+ * written as a whole, are marked valid without copying them.
+ *
+ * An object that ends up with all of its sub-blocks valid is no longer
+ * partial.
+ */
+struct xseg_request *__copyup_partial(struct peer_req *pr, struct map_node *mn,
+                                      uint64_t copy, uint64_t written)
+{
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct map *map = mn->map;
+    struct xseg_request *req;
+    struct xseg_request_copy *xcopy;
+    struct map_object obj, src;
+    uint64_t idx = mapnode_idx(mn);
+    uint64_t all = object_subblocks(map, idx);
+    uint64_t pending, first, last;
+    int r;
+
+    if (mn->flags & MF_OBJECT_PARTIAL) {
+        mapnode_get_object(mn, &obj);
+    } else {
+        obj.flags = MF_OBJECT_WRITABLE | MF_OBJECT_ARCHIP | MF_OBJECT_PARTIAL;
+        obj.objectidx = idx;
+        obj.objectlen = new_object_name(mn, obj.object);
+        obj.valid = 0;
+    }
+    if (mapnode_get_parent_object(mn, &src) < 0) {
         return NULL;
     }
+    if (src.flags & MF_OBJECT_ZERO) {
+        /* the holes of the object read as zeros */
+        written |= copy;
+        copy = 0;
+    }
+
+    pending = copy & ~obj.valid & all;
+    if (!pending) {
+        goto write_object;
+    }
+    for (first = 0; !(pending & (1ULL << first)); first++) ;
+    for (last = first; last + 1 < MAPPER_SUBBLOCKS &&
+         (pending & (1ULL << (last + 1))); last++) ;
+
+    req = get_request(pr, mapper->bportno, obj.object, obj.objectlen,
+                      sizeof(struct xseg_request_copy));
+    if (!req) {
+        XSEGLOG2(&lc, E, "Cannot get request for object %s", obj.object);
+        return NULL;
+    }
+    xcopy = (struct xseg_request_copy *) xseg_get_data(peer->xseg, req);
+    strncpy(xcopy->target, src.object, src.objectlen);
+    xcopy->targetlen = src.objectlen;
+
+    req->offset = first * subblock_size(map);
+    req->size = (last - first + 1) * subblock_size(map);
+    req->op = X_COPY;
     r = __set_node(mio, req, mn);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
+        XSEGLOG2(&lc, E, "Cannot set map node for object %s", obj.object);
+        goto out_put;
+    }
+    r = send_request(pr, req);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot send request %p, pr: %p, map: %s",
+                 req, pr, map->volume);
+        goto out_unset_node;
+    }
+    mn->state |= MF_OBJECT_COPYING;
+    XSEGLOG2(&lc, I, "Copying up sub-blocks %llu-%llu of object %s \n\t to %s",
+             (unsigned long long) first, (unsigned long long) last,
+             src.object, obj.object);
+    return req;
+
+  out_unset_node:
+    __set_node(mio, req, NULL);
+  out_put:
+    put_request(pr, req);
+    XSEGLOG2(&lc, E, "Copying up sub-blocks of object %s \n\t to %s failed",
+             src.object, obj.object);
+    return NULL;
+
+  write_object:
+    obj.valid |= written & all;
+    if (obj.valid == all) {
+        obj.flags &= ~MF_OBJECT_PARTIAL;
+    }
+    req = __object_write(peer, pr, map, &obj, mn);
+    if (!req) {
+        XSEGLOG2(&lc, E, "Object write returned error for object %s"
+                 "\n\t of map %s [%llu]",
+                 obj.object, map->volume, (unsigned long long) idx);
+        return NULL;
     }
     mn->state |= MF_OBJECT_WRITING;
-    XSEGLOG2(&lc, I, "Object %s copy up completed. Pending writing.",
-             mn->object);
     return req;
 }
 
@@ -924,40 +1276,59 @@ static int __copyup_copy_cb(struct peer_req *pr, struct xseg_request *req,
     struct peerd *peer = pr->peer;
     struct map *map;
     struct xseg_request *xreq;
-    struct map_node newmn;
+    struct map_object newobj;
     char *target;
-    int r;
-    struct mapper_io *mio = __get_mapper_io(pr);
+    char name[MAX_OBJECT_LEN + 1];
+    uint32_t namelen;
+    uint64_t all;
 
     mn->state &= ~MF_OBJECT_COPYING;
 
     map = mn->map;
     if (!map) {
-        XSEGLOG2(&lc, E, "Object %s has no map back pointer", mn->object);
+        XSEGLOG2(&lc, E, "Object %llu has no map back pointer",
+                 (unsigned long long) mapnode_idx(mn));
         return -1;
     }
 
-    /* construct a tmp map_node for writing purposes */
+    /* construct a tmp map object for writing purposes */
     target = xseg_get_target(peer->xseg, req);
-    newmn = *mn;
-    newmn.flags = 0;
-    newmn.flags |= MF_OBJECT_WRITABLE;
-    newmn.flags |= MF_OBJECT_ARCHIP;
-    strncpy(newmn.object, target, req->targetlen);
-    newmn.object[req->targetlen] = 0;
-    newmn.objectlen = req->targetlen;
-    newmn.objectidx = mn->objectidx;
-    xreq = __object_write(peer, pr, map, &newmn);
+    namelen = mapnode_get_name(mn, name);
+    if (mn->flags & MF_OBJECT_PARTIAL && req->targetlen == namelen &&
+        !strncmp(target, name, namelen)) {
+        /* sub-blocks copied in place */
+        mapnode_get_object(mn, &newobj);
+    } else {
+        newobj.flags = 0;
+        newobj.flags |= MF_OBJECT_WRITABLE;
+        newobj.flags |= MF_OBJECT_ARCHIP;
+        strncpy(newobj.object, target, req->targetlen);
+        newobj.object[req->targetlen] = 0;
+        newobj.objectlen = req->targetlen;
+        newobj.objectidx = mapnode_idx(mn);
+        newobj.valid = 0;
+        if (mn->flags & MF_OBJECT_PARTIAL) {
+            /* a copy of a partial object holds the same sub-blocks */
+            newobj.flags |= MF_OBJECT_PARTIAL;
+            newobj.valid = mapnode_valid(mn);
+        }
+    }
+    if (req->offset || req->size != map->blocksize) {
+        newobj.flags |= MF_OBJECT_PARTIAL;
+        newobj.valid |= subblocks_touched(map, req->offset, req->size);
+    }
+    all = object_subblocks(map, newobj.objectidx);
+    if (newobj.flags & MF_OBJECT_PARTIAL && (newobj.valid & all) == all) {
+        newobj.flags &= ~MF_OBJECT_PARTIAL;
+    }
+    xreq = __object_write(peer, pr, map, &newobj, mn);
     if (!xreq) {
         XSEGLOG2(&lc, E, "Object write returned error for object %s"
                  "\n\t of map %s [%llu]",
-                 mn->object, map->volume, (unsigned long long) mn->objectidx);
+                 newobj.object, map->volume,
+                 (unsigned long long) newobj.objectidx);
         return -1;
     }
-    r = __set_node(mio, xreq, mn);
-    if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
-    }
     mn->state |= MF_OBJECT_WRITING;
     return 0;
 }
@@ -966,7 +1337,7 @@ static int __copyup_write_cb(struct peer_req *pr, struct xseg_request *req,
                              struct map_node *mn)
 {
     struct peerd *peer = pr->peer;
-    struct map_node tmp;
+    struct map_object tmp;
     char *data;
     struct map *map = mn->map;
 
@@ -975,17 +1346,14 @@ static int __copyup_write_cb(struct peer_req *pr, struct xseg_request *req,
 
     data = xseg_get_data(peer->xseg, req);
     map->mops->read_object(&tmp, (unsigned char *) data);
-    /* old object should not be writable */
-    if (mn->flags & MF_OBJECT_WRITABLE) {
-        XSEGLOG2(&lc, E, "map node %s has wrong flags", mn->object);
+    /* old object should not be writable, unless it was partial */
+    if (mapnode_writable(mn) && !(mn->flags & MF_OBJECT_PARTIAL)) {
+        XSEGLOG2(&lc, E, "map node %llu has wrong flags",
+                 (unsigned long long) mapnode_idx(mn));
         return -1;
     }
     /* update object on cache */
-    strncpy(mn->object, tmp.object, tmp.objectlen);
-    mn->object[tmp.objectlen] = 0;
-    mn->objectlen = tmp.objectlen;
-    mn->flags = tmp.flags;
-    return 0;
+    return mapnode_set_object(mn, &tmp);
 }
 
 void copyup_cb(struct peer_req *pr, struct xseg_request *req)
@@ -1011,8 +1379,8 @@ void copyup_cb(struct peer_req *pr, struct xseg_request *req)
         if (__copyup_write_cb(pr, req, mn) < 0) {
             goto out_err;
         }
-        XSEGLOG2(&lc, I, "Object write of %s completed successfully",
-                 mn->object);
+        XSEGLOG2(&lc, I, "Object write of %llu completed successfully",
+                 (unsigned long long) mapnode_idx(mn));
         mio->pending_reqs--;
         signal_mapnode(mn);
         signal_pr(pr);
@@ -1021,8 +1389,8 @@ void copyup_cb(struct peer_req *pr, struct xseg_request *req)
         if (__copyup_copy_cb(pr, req, mn) < 0) {
             goto out_err;
         }
-        XSEGLOG2(&lc, I, "Object %s copy up completed. "
-                 "Pending writing.", mn->object);
+        XSEGLOG2(&lc, I, "Object %llu copy up completed. "
+                 "Pending writing.", (unsigned long long) mapnode_idx(mn));
     } else {
         //wtf??
         ;
@@ -1044,14 +1412,19 @@ void copyup_cb(struct peer_req *pr, struct xseg_request *req)
 
 }
 
+/*
+ * Write @obj to its slot in the map. The request is accounted to @mn, whose
+ * cached object is updated by the callback.
+ */
 struct xseg_request *__object_write(struct peerd *peer, struct peer_req *pr,
-                                    struct map *map, struct map_node *mn)
+                                    struct map *map, struct map_object *obj,
+                                    struct map_node *mn)
 {
     int r;
     struct mapper_io *mio = __get_mapper_io(pr);
     struct xseg_request *req;
 
-    req = map->mops->prepare_write_object(pr, map, mn);
+    req = map->mops->prepare_write_object(pr, map, obj);
     if (!req) {
         XSEGLOG2(&lc, E, "Cannot prepare write object");
         goto out_err;
@@ -1059,7 +1432,7 @@ struct xseg_request *__object_write(struct peerd *peer, struct peer_req *pr,
 
     r = __set_node(mio, req, mn);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
+        XSEGLOG2(&lc, E, "Cannot set map node for object %s", obj->object);
         goto out_put;
     }
     r = send_request(pr, req);
@@ -1070,7 +1443,7 @@ struct xseg_request *__object_write(struct peerd *peer, struct peer_req *pr,
     }
     XSEGLOG2(&lc, I, "Writing object %s \n\t"
              "Map: %s [%llu]",
-             mn->object, map->volume, (unsigned long long) mn->objectidx);
+             obj->object, map->volume, (unsigned long long) obj->objectidx);
 
     return req;
 
@@ -1081,7 +1454,7 @@ struct xseg_request *__object_write(struct peerd *peer, struct peer_req *pr,
   out_err:
     XSEGLOG2(&lc, E, "Object write for object %s failed. \n\t"
              "(Map: %s [%llu]",
-             mn->object, map->volume, (unsigned long long) mn->objectidx);
+             obj->object, map->volume, (unsigned long long) obj->objectidx);
     return NULL;
 }
 
@@ -1092,32 +1465,28 @@ static int __object_delete_delete_cb(struct peer_req *pr,
     struct peerd *peer = pr->peer;
     struct map *map;
     struct xseg_request *xreq;
-    struct map_node newmn;
-    int r;
-    struct mapper_io *mio = __get_mapper_io(pr);
+    struct map_object newobj;
 
     mn->state &= ~MF_OBJECT_DELETING;
 
     map = mn->map;
     if (!map) {
-        XSEGLOG2(&lc, E, "Object %s has no map back pointer", mn->object);
+        XSEGLOG2(&lc, E, "Object %llu has no map back pointer",
+                 (unsigned long long) mapnode_idx(mn));
         return -1;
     }
 
-    /* construct a tmp map_node for writing purposes */
-    newmn = *mn;
-    newmn.flags |= MF_OBJECT_DELETED;
-    xreq = __object_write(peer, pr, map, &newmn);
+    /* construct a tmp map object for writing purposes */
+    mapnode_get_object(mn, &newobj);
+    newobj.flags |= MF_OBJECT_DELETED;
+    xreq = __object_write(peer, pr, map, &newobj, mn);
     if (!xreq) {
         XSEGLOG2(&lc, E, "Object write returned error for object %s"
                  "\n\t of map %s [%llu]",
-                 mn->object, map->volume, (unsigned long long) mn->objectidx);
+                 newobj.object, map->volume,
+                 (unsigned long long) newobj.objectidx);
         return -1;
     }
-    r = __set_node(mio, xreq, mn);
-    if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
-    }
     mn->state |= MF_OBJECT_WRITING;
     return 0;
 }
@@ -1127,7 +1496,6 @@ static int __object_delete_write_cb(struct peer_req *pr,
                                     struct map_node *mn)
 {
     struct peerd *peer = pr->peer;
-    struct map_node tmp;
     char *data;
 
     //assert mn->state & MF_OBJECT_WRITING
@@ -1163,8 +1531,8 @@ void object_delete_cb(struct peer_req *pr, struct xseg_request *req)
         if (__object_delete_write_cb(pr, req, mn) < 0) {
             goto out_err;
         }
-        XSEGLOG2(&lc, I, "Object write of %s completed successfully",
-                 mn->object);
+        XSEGLOG2(&lc, I, "Object write of %llu completed successfully",
+                 (unsigned long long) mapnode_idx(mn));
         mio->pending_reqs--;
         signal_mapnode(mn);
         //put mapnode here to match get on do_destroy()
@@ -1175,8 +1543,8 @@ void object_delete_cb(struct peer_req *pr, struct xseg_request *req)
         if (__object_delete_delete_cb(pr, req, mn) < 0) {
             goto out_err;
         }
-        XSEGLOG2(&lc, I, "Object deletion of %s completed. "
-                 "Pending writing.", mn->object);
+        XSEGLOG2(&lc, I, "Object deletion of %llu completed. "
+                 "Pending writing.", (unsigned long long) mapnode_idx(mn));
     } else {
         //FIXME   wtf??
         ;
@@ -1194,6 +1562,45 @@ void object_delete_cb(struct peer_req *pr, struct xseg_request *req)
     goto out;
 }
 
+/*
+ * Completion of an object deletion of the background reclaimer. The object is
+ * marked as deleted only in memory, and the reclaimer writes the chunks of all
+ * the objects of its step at once. Deletions are forced, so an object that was
+ * deleted before a crash, but whose chunk was not written, is deleted again
+ * without failing. Objects whose deletion fails are left in the map, which is
+ * retried later.
+ */
+void reclaim_object_cb(struct peer_req *pr, struct xseg_request *req)
+{
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct reclaim *rc = (struct reclaim *) mio->priv;
+    struct map_node *mn = __get_node(mio, req);
+
+    __set_node(mio, req, NULL);
+
+    if (!mn) {
+        XSEGLOG2(&lc, E, "Cannot get mapnode");
+        mio->err = 1;
+        goto out;
+    }
+
+    mn->state &= ~MF_OBJECT_DELETING;
+    if (req->state & XS_FAILED) {
+        XSEGLOG2(&lc, W, "Cannot delete object %llu of map %s",
+                 (unsigned long long) mapnode_idx(mn), rc->volume);
+        rc->failed++;
+    } else {
+        mn->flags |= MF_OBJECT_DELETED;
+        mark_objects_dirty(mn->map, mapnode_idx(mn), 1);
+    }
+    signal_mapnode(mn);
+    put_mapnode(mn);
+
+  out:
+    mio->pending_reqs--;
+    signal_pr(pr);
+    put_request(pr, req);
+}
 
 struct xseg_request *__object_delete(struct peer_req *pr, struct map_node *mn)
 {
@@ -1201,33 +1608,38 @@ struct xseg_request *__object_delete(struct peer_req *pr, struct map_node *mn)
     struct mapperd *mapper = __get_mapperd(peer);
     struct mapper_io *mio = __get_mapper_io(pr);
     struct xseg_request *req;
+    char object[MAX_OBJECT_LEN + 1];
+    uint32_t objectlen;
     int r;
 
-    XSEGLOG2(&lc, I, "Deleting mapnode %s", mn->object);
+    objectlen = mapnode_get_name(mn, object);
+    XSEGLOG2(&lc, I, "Deleting mapnode %s", object);
 
-    req = get_request(pr, mapper->bportno, mn->object, mn->objectlen, 0);
+    req = get_request(pr, mapper->bportno, object, objectlen, 0);
     if (!req) {
-        XSEGLOG2(&lc, E, "Cannot get request for object %s", mn->object);
+        XSEGLOG2(&lc, E, "Cannot get request for object %s", object);
         goto out_err;
     }
 
     req->op = X_DELETE;
     req->size = req->datalen;
     req->offset = 0;
+    /* objects that are already gone count as deleted */
+    req->flags = XF_FORCE;
 
     r = __set_node(mio, req, mn);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot set map node for object %s", mn->object);
+        XSEGLOG2(&lc, E, "Cannot set map node for object %s", object);
         goto out_put;
     }
     r = send_request(pr, req);
     if (r < 0) {
         XSEGLOG2(&lc, E, "Cannot send request %p, pr: %p, object: %s",
-                 req, pr, mn->object);
+                 req, pr, object);
         goto out_unset_node;
     }
-    mn->flags |= MF_OBJECT_DELETING;
-    XSEGLOG2(&lc, I, "Object %s deletion pending", mn->object);
+    mn->state |= MF_OBJECT_DELETING;
+    XSEGLOG2(&lc, I, "Object %s deletion pending", object);
 
     mio->pending_reqs++;
 
@@ -1238,7 +1650,7 @@ struct xseg_request *__object_delete(struct peer_req *pr, struct map_node *mn)
   out_put:
     put_request(pr, req);
   out_err:
-    XSEGLOG2(&lc, I, "Object %s deletion failed", mn->object);
+    XSEGLOG2(&lc, I, "Object %s deletion failed", object);
     return NULL;
 }
 
@@ -1328,11 +1740,13 @@ void hash_cb(struct peer_req *pr, struct xseg_request *req)
         goto out;
     }
 
-    strncpy(mn->object, xreply->target, HEXLIFIED_SHA256_DIGEST_SIZE);
-    mn->object[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
-    mn->objectlen = HEXLIFIED_SHA256_DIGEST_SIZE;
-    XSEGLOG2(&lc, D, "Received hash object %llu: %s (%p)",
-             mn->objectidx, mn->object, mn);
+    if (mapnode_set_name(mn, xreply->target, xreply->targetlen) < 0) {
+        mio->err = 1;
+        goto out;
+    }
+    XSEGLOG2(&lc, D, "Received hash object %llu: %.*s (%p)",
+             (unsigned long long) mapnode_idx(mn), xreply->targetlen,
+             xreply->target, mn);
     mn->flags = 0;
 
   out:
@@ -1353,6 +1767,8 @@ int __hash_map(struct peer_req *pr, struct map *map, struct map *hashed_map)
     uint64_t i;
     struct map_node *mn, *hashed_mn;
     struct xseg_request *req;
+    char object[MAX_OBJECT_LEN + 1];
+    uint32_t objectlen;
     int r;
 
     mio->priv = 0;
@@ -1372,19 +1788,21 @@ int __hash_map(struct peer_req *pr, struct map *map, struct map *hashed_map)
             put_mapnode(mn);
             return -1;
         }
+        objectlen = mapnode_get_name(mn, object);
         if (!(mn->flags & MF_OBJECT_ARCHIP)) {
             mio->priv++;
-            strncpy(hashed_mn->object, mn->object, mn->objectlen);
-            hashed_mn->objectlen = mn->objectlen;
-            hashed_mn->object[hashed_mn->objectlen] = 0;
+            r = mapnode_set_name(hashed_mn, object, objectlen);
             hashed_mn->flags = mn->flags;
 
             put_mapnode(mn);
             put_mapnode(hashed_mn);
+            if (r < 0) {
+                return -1;
+            }
             continue;
         }
 
-        req = get_request(pr, mapper->bportno, mn->object, mn->objectlen, 0);
+        req = get_request(pr, mapper->bportno, object, objectlen, 0);
         if (!req) {
             XSEGLOG2(&lc, E, "Cannot get request for map %s", map->volume);
             put_mapnode(mn);
@@ -1427,6 +1845,11 @@ int hash_map(struct peer_req *pr, struct map *map, struct map *hashed_map)
     struct mapper_io *mio = __get_mapper_io(pr);
 
     XSEGLOG2(&lc, I, "Hashing map %s", map->volume);
+    if (load_map_objects(pr, map, 0, map->nr_objs) < 0 ||
+        load_map_objects(pr, hashed_map, 0, hashed_map->nr_objs) < 0) {
+        XSEGLOG2(&lc, E, "Hashing map %s failed", map->volume);
+        return -1;
+    }
     map->state |= MF_MAP_HASHING;
     mio->pending_reqs = 0;
     mio->cb = hash_cb;
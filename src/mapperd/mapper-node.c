@@ -0,0 +1,615 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <asm/byteorder.h>
+#include <xseg/xseg.h>
+
+#include "peer.h"
+#include "hash.h"
+#include "mapper.h"
+
+/*
+ * Object names are encoded in the name handle of a map node. The two high
+ * bits of the handle hold the type of the name and the rest an id, whose
+ * meaning depends on the type:
+ *
+ * MN_NAME_ZERO:   The zero block. The id is not used.
+ * MN_NAME_ARCHIP: An archipelago object, named after the volume and epoch
+ *                 it was created in and its index (see __copyup_object). The
+ *                 id is the name prefix up to the index, in map->names, and
+ *                 the index is the index of the node.
+ * MN_NAME_HASH:   A content named object. The id is the binary hash of the
+ *                 object, in map->names.
+ * MN_NAME_STRING: Any other name, stored as is in map->names.
+ *
+ * The names are stored in the map of the node, and must be decoded with
+ * mapnode_get_name.
+ */
+#define MN_NAME_ZERO	0
+#define MN_NAME_ARCHIP	1
+#define MN_NAME_HASH	2
+#define MN_NAME_STRING	3
+
+#define MN_NAME_TYPE_SHIFT	30
+#define MN_NAME_ID_MASK		((1U << MN_NAME_TYPE_SHIFT) - 1)
+
+#define name_type(__name) ((__name) >> MN_NAME_TYPE_SHIFT)
+#define name_id(__name) ((__name) & MN_NAME_ID_MASK)
+#define make_name(__type, __id) (((__type) << MN_NAME_TYPE_SHIFT) | (__id))
+
+#define NO_HASH ((uint32_t)-1)
+#define MIN_NAMES 64
+
+struct map_hash {
+    union {
+        unsigned char hash[SHA256_DIGEST_SIZE];
+        uint32_t next_free;
+    } u;
+};
+
+struct mapnode_wait {
+    struct map_node *mn;
+    uint32_t waiters;           /* threads to be signaled */
+    uint32_t sleepers;          /* threads not yet woken up */
+    st_cond_t cond;
+    struct mapnode_wait *next;
+};
+
+/* Make room for one more entry in a table of @size entries */
+static void *grow_table(void *table, uint32_t nr, uint32_t *size,
+                        size_t entry_size)
+{
+    uint32_t new_size;
+    void *new_table;
+
+    if (nr < *size) {
+        return table;
+    }
+    new_size = *size ? *size * 2 : MIN_NAMES;
+    if (new_size > MN_NAME_ID_MASK + 1) {
+        return NULL;
+    }
+    new_table = realloc(table, new_size * entry_size);
+    if (!new_table) {
+        return NULL;
+    }
+    *size = new_size;
+    return new_table;
+}
+
+static int is_hash_name(char *name, uint32_t namelen)
+{
+    uint32_t i;
+
+    if (namelen != HEXLIFIED_SHA256_DIGEST_SIZE) {
+        return 0;
+    }
+    /* only names that hexlify reproduces */
+    for (i = 0; i < namelen; i++) {
+        if (!isdigit(name[i]) && (name[i] < 'a' || name[i] > 'f')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void hexlify_index(uint64_t idx, char *buf)
+{
+    uint64_t be_idx = __cpu_to_be64(idx);
+
+    hexlify((unsigned char *) &be_idx, sizeof(be_idx), buf);
+}
+
+/* Returns the length of the prefix if @name ends with the index of @mn */
+static uint32_t archip_prefix_len(struct map_node *mn, char *name,
+                                  uint32_t namelen)
+{
+    char hex_index[HEXLIFIED_INDEX];
+
+    if (namelen <= HEXLIFIED_INDEX) {
+        return 0;
+    }
+    hexlify_index(mapnode_idx(mn), hex_index);
+    if (memcmp(name + namelen - HEXLIFIED_INDEX, hex_index, HEXLIFIED_INDEX)) {
+        return 0;
+    }
+    return namelen - HEXLIFIED_INDEX;
+}
+
+static int encode_prefix(struct map_names *names, char *prefix,
+                         uint32_t prefixlen, uint32_t *id)
+{
+    uint32_t i;
+    char **prefixes;
+
+    /* there are only a few of them, one for every epoch of the volume and
+     * its ancestors that it has objects of */
+    for (i = 0; i < names->nr_prefixes; i++) {
+        if (strlen(names->prefixes[i]) == prefixlen &&
+            !memcmp(names->prefixes[i], prefix, prefixlen)) {
+            *id = i;
+            return 0;
+        }
+    }
+
+    prefixes = grow_table(names->prefixes, names->nr_prefixes,
+                          &names->size_prefixes, sizeof(char *));
+    if (!prefixes) {
+        return -1;
+    }
+    names->prefixes = prefixes;
+    prefixes[names->nr_prefixes] = strndup(prefix, prefixlen);
+    if (!prefixes[names->nr_prefixes]) {
+        return -1;
+    }
+    *id = names->nr_prefixes++;
+    return 0;
+}
+
+static int encode_hash(struct map_names *names, char *name, uint32_t *id)
+{
+    struct map_hash *hashes;
+
+    if (names->nr_hashes == 0) {
+        names->free_hash = NO_HASH;
+    }
+    if (names->free_hash != NO_HASH) {
+        *id = names->free_hash;
+        names->free_hash = names->hashes[*id].u.next_free;
+    } else {
+        hashes = grow_table(names->hashes, names->nr_hashes,
+                            &names->size_hashes, sizeof(struct map_hash));
+        if (!hashes) {
+            return -1;
+        }
+        names->hashes = hashes;
+        *id = names->nr_hashes++;
+    }
+    unhexlify(name, names->hashes[*id].u.hash);
+    return 0;
+}
+
+static int encode_string(struct map_names *names, char *name,
+                         uint32_t namelen, uint32_t *id)
+{
+    char **strings;
+
+    strings = grow_table(names->strings, names->nr_strings,
+                         &names->size_strings, sizeof(char *));
+    if (!strings) {
+        return -1;
+    }
+    names->strings = strings;
+    strings[names->nr_strings] = strndup(name, namelen);
+    if (!strings[names->nr_strings]) {
+        return -1;
+    }
+    *id = names->nr_strings++;
+    return 0;
+}
+
+static void release_name(struct map_names *names, uint32_t name)
+{
+    uint32_t id = name_id(name);
+
+    switch (name_type(name)) {
+    case MN_NAME_HASH:
+        names->hashes[id].u.next_free = names->free_hash;
+        names->free_hash = id;
+        break;
+    case MN_NAME_STRING:
+        free(names->strings[id]);
+        names->strings[id] = NULL;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Decode the object name of @mn to @buf, which must have room for
+ * MAX_OBJECT_LEN + 1 bytes. Returns the length of the name.
+ */
+uint32_t mapnode_get_name(struct map_node *mn, char *buf)
+{
+    struct map_names *names = &mn->map->names;
+    uint32_t id = name_id(mn->name);
+    uint32_t len = 0;
+
+    switch (name_type(mn->name)) {
+    case MN_NAME_ZERO:
+        memcpy(buf, zero_block, ZERO_BLOCK_LEN);
+        len = ZERO_BLOCK_LEN;
+        break;
+    case MN_NAME_ARCHIP:
+        len = strlen(names->prefixes[id]);
+        memcpy(buf, names->prefixes[id], len);
+        hexlify_index(mapnode_idx(mn), buf + len);
+        len += HEXLIFIED_INDEX;
+        break;
+    case MN_NAME_HASH:
+        hexlify(names->hashes[id].u.hash, SHA256_DIGEST_SIZE, buf);
+        len = HEXLIFIED_SHA256_DIGEST_SIZE;
+        break;
+    case MN_NAME_STRING:
+        len = strlen(names->strings[id]);
+        memcpy(buf, names->strings[id], len);
+        break;
+    }
+    buf[len] = 0;
+
+    return len;
+}
+
+int mapnode_set_name(struct map_node *mn, char *name, uint32_t namelen)
+{
+    struct map_names *names = &mn->map->names;
+    uint32_t id = 0, type, prefixlen;
+    int r;
+
+    if (namelen > MAX_OBJECT_LEN) {
+        XSEGLOG2(&lc, E, "Invalid object len %u", namelen);
+        return -1;
+    }
+
+    if (namelen == ZERO_BLOCK_LEN && !strncmp(name, zero_block, namelen)) {
+        type = MN_NAME_ZERO;
+        r = 0;
+    } else if (is_hash_name(name, namelen)) {
+        type = MN_NAME_HASH;
+        r = encode_hash(names, name, &id);
+    } else if ((prefixlen = archip_prefix_len(mn, name, namelen))) {
+        type = MN_NAME_ARCHIP;
+        r = encode_prefix(names, name, prefixlen, &id);
+    } else {
+        type = MN_NAME_STRING;
+        r = encode_string(names, name, namelen, &id);
+    }
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot store object name of map %s",
+                 mn->map->volume);
+        return -1;
+    }
+
+    release_name(names, mn->name);
+    mn->name = make_name(type, id);
+    return 0;
+}
+
+/*
+ * Find the partial object @idx of @map. Returns its position in the partial
+ * objects, or the position it should be inserted at in @pos.
+ */
+static struct map_partial *find_partial(struct map *map, uint64_t idx,
+                                        uint32_t *pos)
+{
+    uint32_t lo = 0, hi = map->nr_partials, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (map->partials[mid].idx < idx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (pos) {
+        *pos = lo;
+    }
+    if (lo < map->nr_partials && map->partials[lo].idx == idx) {
+        return &map->partials[lo];
+    }
+    return NULL;
+}
+
+static int set_partial(struct map *map, uint64_t idx, uint64_t valid)
+{
+    struct map_partial *p, *partials;
+    uint32_t pos;
+
+    p = find_partial(map, idx, &pos);
+    if (p) {
+        p->valid = valid;
+        return 0;
+    }
+    partials = grow_table(map->partials, map->nr_partials,
+                          &map->size_partials, sizeof(struct map_partial));
+    if (!partials) {
+        return -1;
+    }
+    map->partials = partials;
+    memmove(&partials[pos + 1], &partials[pos],
+            (map->nr_partials - pos) * sizeof(struct map_partial));
+    partials[pos].idx = idx;
+    partials[pos].valid = valid;
+    map->nr_partials++;
+    return 0;
+}
+
+static void clear_partial(struct map *map, uint64_t idx)
+{
+    uint32_t pos;
+
+    if (!map->nr_partials || !find_partial(map, idx, &pos)) {
+        return;
+    }
+    map->nr_partials--;
+    memmove(&map->partials[pos], &map->partials[pos + 1],
+            (map->nr_partials - pos) * sizeof(struct map_partial));
+}
+
+/* Forget the partial objects of @map from @start on */
+void drop_map_partials(struct map *map, uint64_t start)
+{
+    uint32_t pos;
+
+    find_partial(map, start, &pos);
+    map->nr_partials = pos;
+}
+
+/* Memory used by the partial objects of @map */
+uint64_t map_partials_size(struct map *map)
+{
+    return (uint64_t) map->size_partials * sizeof(struct map_partial);
+}
+
+/* The sub-blocks that the object of @mn holds. All, unless it is partial. */
+uint64_t mapnode_valid(struct map_node *mn)
+{
+    struct map_partial *p;
+
+    if (!(mn->flags & MF_OBJECT_PARTIAL)) {
+        return MAPPER_ALL_SUBBLOCKS;
+    }
+    p = find_partial(mn->map, mapnode_idx(mn), NULL);
+    return p ? p->valid : 0;
+}
+
+/*
+ * Get the object of the parent map that @mn falls through to, for the
+ * sub-blocks it does not hold. The parent objects are resolved along with the
+ * objects of the clone (see load_parent_objects), so they are already loaded.
+ */
+int mapnode_get_parent_object(struct map_node *mn, struct map_object *obj)
+{
+    struct map *parent = mn->map->parent_map;
+    struct map_node *pmn;
+    uint64_t idx = mapnode_idx(mn);
+
+    if (!parent) {
+        XSEGLOG2(&lc, E, "Parent map of %s is not loaded", mn->map->volume);
+        return -1;
+    }
+    if (idx >= parent->nr_objs) {
+        obj->flags = MF_OBJECT_ZERO;
+        obj->objectidx = idx;
+        obj->objectlen = ZERO_BLOCK_LEN;
+        memcpy(obj->object, zero_block, ZERO_BLOCK_LEN + 1);
+        obj->valid = 0;
+        return 0;
+    }
+    pmn = get_mapnode(parent, idx);
+    if (!pmn) {
+        XSEGLOG2(&lc, E, "Object %llu of parent map %s is not loaded",
+                 (unsigned long long) idx, parent->volume);
+        return -1;
+    }
+    mapnode_get_object(pmn, obj);
+    put_mapnode(pmn);
+    return 0;
+}
+
+void mapnode_get_object(struct map_node *mn, struct map_object *obj)
+{
+    obj->flags = mn->flags;
+    obj->objectidx = mapnode_idx(mn);
+    obj->objectlen = mapnode_get_name(mn, obj->object);
+    obj->valid = 0;
+    if (mn->flags & MF_OBJECT_PARTIAL) {
+        obj->valid = mapnode_valid(mn);
+    }
+}
+
+int mapnode_set_object(struct map_node *mn, struct map_object *obj)
+{
+    if (mapnode_set_name(mn, obj->object, obj->objectlen) < 0) {
+        return -1;
+    }
+    if (obj->flags & MF_OBJECT_PARTIAL) {
+        if (set_partial(mn->map, mapnode_idx(mn), obj->valid) < 0) {
+            XSEGLOG2(&lc, E, "Cannot store partial object of map %s",
+                     mn->map->volume);
+            return -1;
+        }
+    } else {
+        clear_partial(mn->map, mapnode_idx(mn));
+    }
+    mn->flags = obj->flags;
+    return 0;
+}
+
+void free_map_names(struct map *map)
+{
+    struct map_names *names = &map->names;
+    uint32_t i;
+
+    for (i = 0; i < names->nr_strings; i++) {
+        free(names->strings[i]);
+    }
+    for (i = 0; i < names->nr_prefixes; i++) {
+        free(names->prefixes[i]);
+    }
+    free(names->strings);
+    free(names->prefixes);
+    free(names->hashes);
+    memset(names, 0, sizeof(struct map_names));
+}
+
+/* Memory used by the object names of @map */
+uint64_t map_names_size(struct map *map)
+{
+    struct map_names *names = &map->names;
+    uint64_t size;
+    uint32_t i;
+
+    size = (uint64_t) names->size_hashes * sizeof(struct map_hash) +
+        (uint64_t) (names->size_strings + names->size_prefixes) *
+        sizeof(char *);
+    for (i = 0; i < names->nr_strings; i++) {
+        if (names->strings[i]) {
+            size += strlen(names->strings[i]) + 1;
+        }
+    }
+    for (i = 0; i < names->nr_prefixes; i++) {
+        size += strlen(names->prefixes[i]) + 1;
+    }
+
+    return size;
+}
+
+static uint64_t parse_epoch(char *hex)
+{
+    char buf[HEXLIFIED_EPOCH + 1];
+
+    memcpy(buf, hex, HEXLIFIED_EPOCH);
+    buf[HEXLIFIED_EPOCH] = 0;
+    return strtoull(buf, NULL, 16);
+}
+
+/*
+ * The epoch the object of @mn was created in. Archipelago objects are named
+ * after it (see __copyup_object). Any other object is taken to be of the
+ * first epoch.
+ */
+uint64_t mapnode_epoch(struct map_node *mn)
+{
+    struct map_names *names = &mn->map->names;
+    char name[MAX_OBJECT_LEN + 1];
+    char *prefix;
+    uint32_t len;
+
+    if (!(mn->flags & MF_OBJECT_ARCHIP)) {
+        return 0;
+    }
+
+    if (name_type(mn->name) == MN_NAME_ARCHIP) {
+        /* <volume>_<epoch>_ */
+        prefix = names->prefixes[name_id(mn->name)];
+        len = strlen(prefix);
+        if (len < HEXLIFIED_EPOCH + 1) {
+            return 0;
+        }
+        return parse_epoch(prefix + len - HEXLIFIED_EPOCH - 1);
+    }
+
+    /* <volume>_<epoch>_<index> */
+    len = mapnode_get_name(mn, name);
+    if (len < HEXLIFIED_EPOCH + HEXLIFIED_INDEX + 1) {
+        return 0;
+    }
+    return parse_epoch(name + len - HEXLIFIED_INDEX - 1 - HEXLIFIED_EPOCH);
+}
+
+/*
+ * Whether the object of @mn can be written in place. On MAP_V3 maps, an
+ * archipelago object is writable only in the epoch it was created in. Other
+ * objects carry no epoch, and the map has MF_MAP_FOREIGN_WRITABLE set while
+ * any of them is writable.
+ */
+int mapnode_writable(struct map_node *mn)
+{
+    struct map *map = mn->map;
+
+    if (!(mn->flags & MF_OBJECT_WRITABLE) || (map->flags & MF_MAP_READONLY)) {
+        return 0;
+    }
+    if (map->version < MAP_V3 || !(mn->flags & MF_OBJECT_ARCHIP)) {
+        return 1;
+    }
+    return mapnode_epoch(mn) == map->epoch;
+}
+
+static struct mapnode_wait *find_wait(struct map_node *mn)
+{
+    struct mapnode_wait *w;
+
+    for (w = mn->map->node_waits; w; w = w->next) {
+        if (w->mn == mn) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Wait until @mn is signaled. Only a few map nodes are waited on at any
+ * time, so their condition variables are kept in a list on the map.
+ */
+void mapnode_wait(struct map_node *mn)
+{
+    struct map *map = mn->map;
+    struct mapnode_wait *w, **pw;
+
+    w = find_wait(mn);
+    if (!w) {
+        w = calloc(1, sizeof(struct mapnode_wait));
+        if (w) {
+            w->cond = st_cond_new();
+        }
+        if (!w || !w->cond) {
+            XSEGLOG2(&lc, E, "Cannot allocate wait for map node %lx", mn);
+            free(w);
+            /* poll instead */
+            st_usleep(1000);
+            ta++;
+            return;
+        }
+        w->mn = mn;
+        w->next = map->node_waits;
+        map->node_waits = w;
+    }
+
+    w->waiters++;
+    w->sleepers++;
+    st_cond_wait(w->cond);
+    w->sleepers--;
+
+    /* the last one to wake up cleans up */
+    if (!w->sleepers && !w->waiters) {
+        for (pw = &map->node_waits; *pw != w; pw = &(*pw)->next) ;
+        *pw = w->next;
+        st_cond_destroy(w->cond);
+        free(w);
+    }
+}
+
+void mapnode_signal(struct map_node *mn)
+{
+    struct mapnode_wait *w = find_wait(mn);
+
+    if (!w || !w->waiters) {
+        return;
+    }
+    ta += w->waiters;
+    XSEGLOG2(&lc, D, "Signaling map node %lx, waiters: %u, ta: %u",
+             mn, w->waiters, ta);
+    w->waiters = 0;
+    st_cond_broadcast(w->cond);
+}
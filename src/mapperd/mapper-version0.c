@@ -24,29 +24,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /* version 0 functions */
 #define v0_chunked_read_size (512*1024)
 
-int read_object_v0(struct map_node *mn, unsigned char *buf)
+int read_object_v0(struct map_object *obj, unsigned char *buf)
 {
-    hexlify(buf, SHA256_DIGEST_SIZE, mn->object);
-    mn->object[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
-    mn->objectlen = HEXLIFIED_SHA256_DIGEST_SIZE;
-    mn->flags = 0;              //not MF_OBJECT_WRITABLE;
+    hexlify(buf, SHA256_DIGEST_SIZE, obj->object);
+    obj->object[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+    obj->objectlen = HEXLIFIED_SHA256_DIGEST_SIZE;
+    obj->flags = 0;             //not MF_OBJECT_WRITABLE;
     //check if zero
-    if (!strncmp(mn->object, zero_block, ZERO_BLOCK_LEN)) {
-        mn->flags |= MF_OBJECT_ZERO;
+    if (!strncmp(obj->object, zero_block, ZERO_BLOCK_LEN)) {
+        obj->flags |= MF_OBJECT_ZERO;
     }
 
     return 0;
 }
 
-void object_to_map_v0(unsigned char *data, struct map_node *mn)
+void object_to_map_v0(unsigned char *data, struct map_object *obj)
 {
-    unhexlify(mn->object, data);
+    unhexlify(obj->object, data);
     //if name == zero block, raize MF_OBJECT_ZERO
 }
 
 struct xseg_request *prepare_write_object_v0(struct peer_req *pr,
                                              struct map *map,
-                                             struct map_node *mn)
+                                             struct map_object *obj)
 {
     struct peerd *peer = pr->peer;
     struct mapperd *mapper = __get_mapperd(peer);
@@ -61,10 +61,10 @@ struct xseg_request *prepare_write_object_v0(struct peer_req *pr,
 
     req->op = X_WRITE;
     req->size = v0_objectsize_in_map;
-    req->offset = v0_mapheader_size + mn->objectidx * v0_objectsize_in_map;
+    req->offset = v0_mapheader_size + obj->objectidx * v0_objectsize_in_map;
 
     data = xseg_get_data(pr->peer->xseg, req);
-    object_to_map_v0((unsigned char *) data, mn);
+    object_to_map_v0((unsigned char *) data, obj);
     return req;
 }
 
@@ -72,6 +72,7 @@ int read_map_v0(struct map *m, unsigned char *data)
 {
     int r;
     struct map_node *map_node;
+    struct map_object obj;
     uint64_t i;
     uint64_t pos = 0, limit;
     uint64_t max_read_obj = v0_chunked_read_size / v0_objectsize_in_map;
@@ -89,13 +90,14 @@ int read_map_v0(struct map *m, unsigned char *data)
         if (!memcmp(data + pos, nulls, v0_objectsize_in_map)) {
             break;
         }
-        map_node[i].objectidx = i;
         map_node[i].map = m;
-        map_node[i].waiters = 0;
+        map_node[i].name = 0;
         map_node[i].state = 0;
         map_node[i].ref = 1;
-        map_node[i].cond = st_cond_new();       //FIXME err check;
-        read_object_v0(&map_node[i], data + pos);
+        read_object_v0(&obj, data + pos);
+        if (mapnode_set_object(&map_node[i], &obj) < 0) {
+            return -1;
+        }
         pos += v0_objectsize_in_map;
     }
     XSEGLOG2(&lc, D, "Found %llu objects", i);
@@ -118,7 +120,7 @@ struct xseg_request *__write_map_data_v0(struct peer_req *pr, struct map *map)
     struct xseg_request *req;
     char *data;
     uint64_t datalen, pos, i;
-    struct map_node *mn;
+    struct map_object obj;
 
     datalen = v0_mapheader_size + map->nr_objs * v0_objectsize_in_map;
     req = get_request(pr, mapper->mbportno, map->volume, map->volumelen,
@@ -137,8 +139,8 @@ struct xseg_request *__write_map_data_v0(struct peer_req *pr, struct map *map)
 
     pos = 0;
     for (i = 0; i < map->nr_objs; i++) {
-        mn = &map->objects[i];
-        object_to_map_v0((unsigned char *) (data + pos), mn);
+        mapnode_get_object(&map->objects[i], &obj);
+        object_to_map_v0((unsigned char *) (data + pos), &obj);
         pos += v0_objectsize_in_map;
     }
 
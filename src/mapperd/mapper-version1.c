@@ -24,46 +24,47 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 /* v1 functions */
 
-int read_object_v1(struct map_node *mn, unsigned char *buf)
+int read_object_v1(struct map_object *obj, unsigned char *buf)
 {
     char c = buf[0];
-    mn->flags = 0;
+    obj->flags = 0;
     if (c) {
-        mn->flags |= MF_OBJECT_WRITABLE;
-        mn->flags |= MF_OBJECT_ARCHIP;
-        strcpy(mn->object, MAPPER_PREFIX);
-        hexlify(buf + 1, SHA256_DIGEST_SIZE, mn->object + MAPPER_PREFIX_LEN);
-        mn->object[MAX_OBJECT_LEN] = 0;
-        mn->objectlen = strlen(mn->object);
+        obj->flags |= MF_OBJECT_WRITABLE;
+        obj->flags |= MF_OBJECT_ARCHIP;
+        strcpy(obj->object, MAPPER_PREFIX);
+        hexlify(buf + 1, SHA256_DIGEST_SIZE, obj->object + MAPPER_PREFIX_LEN);
+        obj->object[MAPPER_PREFIX_LEN + HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+        obj->objectlen = strlen(obj->object);
     } else {
-        mn->flags &= ~MF_OBJECT_WRITABLE;
-        mn->flags &= ~MF_OBJECT_ARCHIP;
-        hexlify(buf + 1, SHA256_DIGEST_SIZE, mn->object);
-        mn->object[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
-        mn->objectlen = strlen(mn->object);
-        if (!strncmp(mn->object, zero_block, ZERO_BLOCK_LEN)) {
-            mn->flags |= MF_OBJECT_ZERO;
+        obj->flags &= ~MF_OBJECT_WRITABLE;
+        obj->flags &= ~MF_OBJECT_ARCHIP;
+        hexlify(buf + 1, SHA256_DIGEST_SIZE, obj->object);
+        obj->object[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+        obj->objectlen = strlen(obj->object);
+        if (!strncmp(obj->object, zero_block, ZERO_BLOCK_LEN)) {
+            obj->flags |= MF_OBJECT_ZERO;
         }
     }
     return 0;
 }
 
-void object_to_map_v1(unsigned char *buf, struct map_node *mn)
+void object_to_map_v1(unsigned char *buf, struct map_object *obj)
 {
-    buf[0] = (mn->flags & MF_OBJECT_WRITABLE) ? 1 : 0;
-    //assert !(mn->flags & MF_OBJECT_ARCHIP)
+    buf[0] = (obj->flags & MF_OBJECT_WRITABLE) ? 1 : 0;
+    //assert !(obj->flags & MF_OBJECT_ARCHIP)
     if (buf[0]) {
         /* strip common prefix */
-        unhexlify(mn->object + MAPPER_PREFIX_LEN, (unsigned char *) (buf + 1));
+        unhexlify(obj->object + MAPPER_PREFIX_LEN,
+                  (unsigned char *) (buf + 1));
     } else {
-        unhexlify(mn->object, (unsigned char *) (buf + 1));
+        unhexlify(obj->object, (unsigned char *) (buf + 1));
     }
     //if name == zero block, raize MF_OBJECT_ZERO
 }
 
 struct xseg_request *prepare_write_object_v1(struct peer_req *pr,
                                              struct map *map,
-                                             struct map_node *mn)
+                                             struct map_object *obj)
 {
     struct peerd *peer = pr->peer;
     struct mapperd *mapper = __get_mapperd(peer);
@@ -79,10 +80,10 @@ struct xseg_request *prepare_write_object_v1(struct peer_req *pr,
 
     req->op = X_WRITE;
     req->size = v1_objectsize_in_map;
-    req->offset = v1_mapheader_size + mn->objectidx * v1_objectsize_in_map;
+    req->offset = v1_mapheader_size + obj->objectidx * v1_objectsize_in_map;
 
     data = xseg_get_data(pr->peer->xseg, req);
-    object_to_map_v1((unsigned char *) data, mn);
+    object_to_map_v1((unsigned char *) data, obj);
     return NULL;
 }
 
@@ -90,6 +91,7 @@ int read_map_v1(struct map *m, unsigned char *data)
 {
     int r;
     struct map_node *map_node;
+    struct map_object obj;
     uint64_t i;
     uint64_t pos = 0;
     uint64_t nr_objs = m->nr_objs;
@@ -102,12 +104,12 @@ int read_map_v1(struct map *m, unsigned char *data)
 
     for (i = 0; i < nr_objs; i++) {
         map_node[i].map = m;
-        map_node[i].objectidx = i;
-        map_node[i].waiters = 0;
         map_node[i].ref = 1;
         map_node[i].state = 0;
-        map_node[i].cond = st_cond_new();       //FIXME err check;
-        read_object_v1(&map_node[i], data + pos);
+        read_object_v1(&obj, data + pos);
+        if (mapnode_set_object(&map_node[i], &obj) < 0) {
+            return -1;
+        }
         pos += v1_objectsize_in_map;
     }
     return 0;
@@ -128,7 +130,7 @@ struct xseg_request *__write_map_data_v1(struct peer_req *pr, struct map *map)
     struct xseg_request *req;
     char *data;
     uint64_t i, pos;
-    struct map_node *mn;
+    struct map_object obj;
 
     req = get_request(pr, mapper->mbportno, map->volume, map->volumelen,
                       map->nr_objs * v1_objectsize_in_map);
@@ -146,8 +148,8 @@ struct xseg_request *__write_map_data_v1(struct peer_req *pr, struct map *map)
 
     pos = 0;
     for (i = 0; i < map->nr_objs; i++) {
-        mn = &map->objects[i];
-        object_to_map_v1((unsigned char *) (data + pos), mn);
+        mapnode_get_object(&map->objects[i], &obj);
+        object_to_map_v1((unsigned char *) (data + pos), &obj);
         pos += v1_objectsize_in_map;
     }
 
@@ -16,6 +16,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include <stdlib.h>
+#include <assert.h>
 #include <asm/byteorder.h>
 #include <xseg/xseg.h>
 
@@ -108,7 +109,7 @@ static int split_to_chunks(struct map *map, uint64_t start, uint64_t nr,
         } else {
             obj += objects_in_block - offset_in_block;
         }
-    } while (obj < nr);
+    } while (obj < start + nr);
 
     chunk = calloc(nr_chunks, sizeof(struct chunk));
     *chunks = chunk;
@@ -120,6 +121,7 @@ static int split_to_chunks(struct map *map, uint64_t start, uint64_t nr,
     i = 0;
     obj = start;
     do {
+        assert(i < nr_chunks);
         blockid = get_block_id(map, obj);
         chunk[i].targetlen = get_map_block_name(chunk[i].target, map, blockid);
         chunk[i].start = obj;
@@ -147,58 +149,75 @@ static int split_to_chunks(struct map *map, uint64_t start, uint64_t nr,
 }
 
 
-static int read_object_v2(struct map_node *mn, unsigned char *buf)
+static int read_object_v2(struct map_object *obj, unsigned char *buf)
 {
     char c = buf[0];
     int len = 0;
     uint32_t objectlen;
 
-    mn->flags = 0;
-    mn->flags |= MF_OBJECT_WRITABLE & c;
-    mn->flags |= MF_OBJECT_ARCHIP & c;
-    mn->flags |= MF_OBJECT_ZERO & c;
-    mn->flags |= MF_OBJECT_DELETED & c;
+    obj->flags = 0;
+    obj->flags |= MF_OBJECT_WRITABLE & c;
+    obj->flags |= MF_OBJECT_ARCHIP & c;
+    obj->flags |= MF_OBJECT_ZERO & c;
+    obj->flags |= MF_OBJECT_DELETED & c;
+    obj->flags |= MF_OBJECT_PARTIAL & c;
     objectlen = *(typeof(objectlen) *) (buf + 1);
-    mn->objectlen = objectlen;
-    if (mn->objectlen > v2_max_objectlen) {
-        XSEGLOG2(&lc, D, "mn: %p, buf: %p, objectlen: %u", mn, buf,
-                 mn->objectlen);
-        XSEGLOG2(&lc, E, "Invalid object len %u", mn->objectlen);
+    obj->objectlen = objectlen;
+    if (obj->objectlen > v2_max_objectlen ||
+        (obj->flags & MF_OBJECT_PARTIAL &&
+         obj->objectlen > v2_max_partial_objectlen)) {
+        XSEGLOG2(&lc, D, "obj: %p, buf: %p, objectlen: %u", obj, buf,
+                 obj->objectlen);
+        XSEGLOG2(&lc, E, "Invalid object len %u", obj->objectlen);
         return -1;
     }
-//      if (mn->flags & MF_OBJECT_ARCHIP){
-//              strcpy(mn->object, MAPPER_PREFIX);
+    obj->valid = 0;
+    if (obj->flags & MF_OBJECT_PARTIAL) {
+        memcpy(&obj->valid, buf + sizeof(objectlen) + 1 +
+               v2_max_partial_objectlen, sizeof(obj->valid));
+    }
+//      if (obj->flags & MF_OBJECT_ARCHIP){
+//              strcpy(obj->object, MAPPER_PREFIX);
 //              len += MAPPER_PREFIX_LEN;
 //      }
-    memcpy(mn->object + len, buf + sizeof(objectlen) + 1, mn->objectlen);
-    mn->object[mn->objectlen] = 0;
+    memcpy(obj->object + len, buf + sizeof(objectlen) + 1, obj->objectlen);
+    obj->object[obj->objectlen] = 0;
 
     return 0;
 }
 
-/* Fill a buffer representing an object on disk from a given map node */
-static void object_to_map_v2(unsigned char *buf, struct map_node *mn)
+/* Fill a buffer representing an object on disk from a given object */
+static void object_to_map_v2(unsigned char *buf, struct map_object *obj)
 {
     struct v2_object_on_disk *object;
 
-    //_Static_assert(typeof(mn->objectlen), typeof(object->objectlen));
-    if (mn->objectlen > v2_max_objectlen) {
-        XSEGLOG2(&lc, E, "Invalid object len %u", mn->objectlen);
-        mn->objectlen = v2_max_objectlen;
+    //_Static_assert(typeof(obj->objectlen), typeof(object->objectlen));
+    if (obj->objectlen > v2_max_objectlen) {
+        XSEGLOG2(&lc, E, "Invalid object len %u", obj->objectlen);
+        obj->objectlen = v2_max_objectlen;
     }
 
     memset(buf, 0, v2_objectsize_in_map);
+    if (obj->flags & MF_OBJECT_INHERITED) {
+        /* the empty entry of a clone */
+        return;
+    }
     object = (struct v2_object_on_disk *) buf;
 
     object->flags = 0;
-    object->flags |= mn->flags & MF_OBJECT_WRITABLE;
-    object->flags |= mn->flags & MF_OBJECT_ARCHIP;
-    object->flags |= mn->flags & MF_OBJECT_ZERO;
-    object->flags |= mn->flags & MF_OBJECT_DELETED;
-
-
-    object->objectlen = mn->objectlen;
-    memcpy(object->object, mn->object, object->objectlen);
+    object->flags |= obj->flags & MF_OBJECT_WRITABLE;
+    object->flags |= obj->flags & MF_OBJECT_ARCHIP;
+    object->flags |= obj->flags & MF_OBJECT_ZERO;
+    object->flags |= obj->flags & MF_OBJECT_DELETED;
+    object->flags |= obj->flags & MF_OBJECT_PARTIAL;
+
+
+    object->objectlen = obj->objectlen;
+    memcpy(object->object, obj->object, object->objectlen);
+    if (obj->flags & MF_OBJECT_PARTIAL) {
+        memcpy(object->object + v2_max_partial_objectlen, &obj->valid,
+               sizeof(obj->valid));
+    }
 }
 
 static struct xseg_request *prepare_write_chunk(struct peer_req *pr,
@@ -210,7 +229,7 @@ static struct xseg_request *prepare_write_chunk(struct peer_req *pr,
     struct peerd *peer = pr->peer;
     struct mapperd *mapper = __get_mapperd(peer);
     char *data;
-    struct map_node *mn;
+    struct map_object object;
 
     datalen = v2_chunksize;
 
@@ -237,8 +256,8 @@ static struct xseg_request *prepare_write_chunk(struct peer_req *pr,
     XSEGLOG2(&lc, D, "Start: %llu, nr: %llu", chunk->start, chunk->nr);
     pos = 0;
     for (obj = chunk->start; obj < chunk->start + chunk->nr; obj++) {
-        mn = &map->objects[obj];
-        object_to_map_v2((unsigned char *) (data + pos), mn);
+        mapnode_get_object(&map->objects[obj], &object);
+        object_to_map_v2((unsigned char *) (data + pos), &object);
         pos += v2_objectsize_in_map;
     }
 
@@ -302,27 +321,45 @@ struct xseg_request *prepare_write_objects_v2(struct peer_req *pr,
 
 static struct xseg_request *prepare_write_object_v2(struct peer_req *pr,
                                                     struct map *map,
-                                                    struct map_node *mn)
+                                                    struct map_object *obj)
 {
     struct peerd *peer = pr->peer;
     char *data;
     struct xseg_request *req;
 
-    req = prepare_write_objects_v2(pr, map, mn->objectidx, 1);
+    req = prepare_write_objects_v2(pr, map, obj->objectidx, 1);
     if (!req) {
         return NULL;
     }
     data = xseg_get_data(peer->xseg, req);
-    object_to_map_v2((unsigned char *) data, mn);
+    object_to_map_v2((unsigned char *) data, obj);
     return req;
 }
 
 
+static int alloc_map_objects_v2(struct map *map)
+{
+    struct map_node *map_node;
+
+    XSEGLOG2(&lc, D, "Allocating %llu nr_objs for size %llu",
+             (unsigned long long) map->nr_objs,
+             (unsigned long long) map->size);
+    map_node = calloc(map->nr_objs, sizeof(struct map_node));
+    if (!map_node) {
+        XSEGLOG2(&lc, E, "Cannot allocate mem for %llu objects",
+                 (unsigned long long) map->nr_objs);
+        return -1;
+    }
+    map->objects = map_node;
+    return 0;
+}
+
 int read_map_objects_v2(struct map *map, unsigned char *data, uint64_t start,
                         uint64_t nr)
 {
     int r;
     struct map_node *map_node;
+    struct map_object obj;
     uint64_t i;
     uint64_t pos = 0;
 
@@ -330,41 +367,38 @@ int read_map_objects_v2(struct map *map, unsigned char *data, uint64_t start,
         return -1;
     }
 
-    if (!map->objects) {
-        XSEGLOG2(&lc, D, "Allocating %llu nr_objs for size %llu",
-                 map->nr_objs, map->size);
-        map_node = calloc(map->nr_objs, sizeof(struct map_node));
-        if (!map_node) {
-            XSEGLOG2(&lc, E, "Cannot allocate mem for %llu objects",
-                     map->nr_objs);
-            return -1;
-        }
-        map->objects = map_node;
-        r = initialize_map_objects(map);
-        if (r < 0) {
-            XSEGLOG2(&lc, E, "Cannot initialize map objects for map %s",
-                     map->volume);
-            goto out_free;
-        }
+    if (!map->objects && alloc_map_objects_v2(map) < 0) {
+        return -1;
+    }
+
+    r = initialize_map_objects(map, start, nr);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot initialize map objects for map %s",
+                 map->volume);
+        return -1;
     }
 
     map_node = map->objects;
 
-    for (i = start; i < nr; i++) {
-        r = read_object_v2(&map_node[i], data + pos);
+    for (i = start; i < start + nr; i++) {
+        r = read_object_v2(&obj, data + pos);
+        if (r >= 0 && map->parentlen && !obj.objectlen) {
+            /* resolved by load_parent_objects */
+            obj.flags = MF_OBJECT_INHERITED;
+            obj.objectlen = ZERO_BLOCK_LEN;
+            memcpy(obj.object, zero_block, ZERO_BLOCK_LEN);
+        }
+        if (r >= 0) {
+            r = mapnode_set_object(&map_node[i], &obj);
+        }
         if (r < 0) {
             XSEGLOG2(&lc, E, "Map %s: Could not read object %llu",
                      map->volume, i);
-            goto out_free;
+            return -1;
         }
         pos += v2_objectsize_in_map;
     }
     return 0;
-
-  out_free:
-    free(map->objects);
-    map->objects = NULL;
-    return -1;
 }
 
 static int read_map_v2(struct map *m, unsigned char *data)
@@ -373,8 +407,7 @@ static int read_map_v2(struct map *m, unsigned char *data)
     return read_map_objects_v2(m, data, 0, m->nr_objs);
 }
 
-static void delete_map_data_v2_cb(struct peer_req *pr,
-                                  struct xseg_request *req)
+static void map_blocks_v2_cb(struct peer_req *pr, struct xseg_request *req)
 {
     struct mapper_io *mio = __get_mapper_io(pr);
 
@@ -434,7 +467,7 @@ static int delete_map_data_v2(struct peer_req *pr, struct map *map)
 {
     int r;
     struct mapper_io *mio = __get_mapper_io(pr);
-    mio->cb = delete_map_data_v2_cb;
+    mio->cb = map_blocks_v2_cb;
 
     r = __delete_map_data_v2(pr, map);
     if (r < 0) {
@@ -450,6 +483,172 @@ static int delete_map_data_v2(struct peer_req *pr, struct map *map)
     return (mio->err ? -1 : 0);
 }
 
+static void delete_blocks_v2_cb(struct peer_req *pr, struct xseg_request *req)
+{
+    struct mapper_io *mio = __get_mapper_io(pr);
+
+    /* blocks that do not exist cannot be deleted */
+    put_request(pr, req);
+    mio->pending_reqs--;
+    signal_pr(pr);
+    return;
+}
+
+static int __init_map_data_v2(struct peer_req *pr, struct map *map,
+                              uint32_t op)
+{
+    int r;
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct xseg_request *req;
+    char target[v2_max_objectlen];
+    uint32_t targetlen, blockid;
+    uint64_t objects_in_block, obj, datalen;
+
+    datalen = (op == X_WRITE) ? v2_objectsize_in_map : 0;
+    objects_in_block = map->blocksize / v2_objectsize_in_map;
+    for (obj = 0; obj < map->nr_objs; obj += objects_in_block) {
+        blockid = get_block_id(map, obj);
+        targetlen = get_map_block_name(target, map, blockid);
+        req = get_request(pr, mapper->mbportno, target, targetlen, datalen);
+        if (!req) {
+            XSEGLOG2(&lc, E, "Cannot get request");
+            goto out_err;
+        }
+        req->op = op;
+        req->offset = 0;
+        req->size = datalen;
+        if (datalen) {
+            memset(xseg_get_data(peer->xseg, req), 0, datalen);
+        }
+        r = send_request(pr, req);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot send request");
+            goto out_put;
+        }
+        mio->pending_reqs++;
+    }
+    return 0;
+
+  out_put:
+    put_request(pr, req);
+  out_err:
+    mio->err = 1;
+    return -1;
+}
+
+/*
+ * Create the blocks of a new clone, with every entry empty. Blocks left by a
+ * deleted map of the same name are deleted first, since a block is only
+ * created with its first entry. The rest of it reads as empty.
+ */
+static int init_map_data_v2(struct peer_req *pr, struct map *map)
+{
+    int r;
+    struct mapper_io *mio = __get_mapper_io(pr);
+    mio->err = 0;
+
+    mio->cb = delete_blocks_v2_cb;
+    r = __init_map_data_v2(pr, map, X_DELETE);
+    if (mio->pending_reqs > 0) {
+        wait_on_pr(pr, mio->pending_reqs > 0);
+    }
+
+    if (r >= 0) {
+        mio->cb = map_blocks_v2_cb;
+        __init_map_data_v2(pr, map, X_WRITE);
+        if (mio->pending_reqs > 0) {
+            wait_on_pr(pr, mio->pending_reqs > 0);
+        }
+    }
+
+    mio->priv = NULL;
+    mio->cb = NULL;
+    return (mio->err ? -1 : 0);
+}
+
+static int __copy_map_data_v2(struct peer_req *pr, struct map *map,
+                              struct map *dst)
+{
+    int r;
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct xseg_request *req;
+    struct xseg_request_copy *xcopy;
+    char target[v2_max_objectlen];
+    uint32_t targetlen, blockid;
+    uint64_t objects_in_block, obj;
+
+    objects_in_block = map->blocksize / v2_objectsize_in_map;
+    for (obj = 0; obj < map->nr_objs; obj += objects_in_block) {
+        blockid = get_block_id(map, obj);
+        targetlen = get_map_block_name(target, dst, blockid);
+        req = get_request(pr, mapper->mbportno, target, targetlen,
+                          sizeof(struct xseg_request_copy));
+        if (!req) {
+            XSEGLOG2(&lc, E, "Cannot get request");
+            goto out_err;
+        }
+        xcopy = (struct xseg_request_copy *) xseg_get_data(peer->xseg, req);
+        xcopy->targetlen = get_map_block_name(xcopy->target, map, blockid);
+        req->op = X_COPY;
+        req->offset = 0;
+        req->size = map->blocksize;
+        XSEGLOG2(&lc, D, "Copying %s(%u) to %s(%u)", xcopy->target,
+                 xcopy->targetlen, target, targetlen);
+        r = send_request(pr, req);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot send request");
+            goto out_put;
+        }
+        mio->pending_reqs++;
+    }
+    return 0;
+
+  out_put:
+    put_request(pr, req);
+  out_err:
+    mio->err = 1;
+    return -1;
+}
+
+/*
+ * Copy the objects of @map to @dst, block by block, without loading them.
+ * @dst must have the size and blocksize of @map. Blocks left by a deleted map
+ * with the name of @dst are deleted first, since a copy does not truncate
+ * them and their stale tail would outlive it.
+ */
+static int copy_map_data_v2(struct peer_req *pr, struct map *map,
+                            struct map *dst)
+{
+    int r;
+    struct mapper_io *mio = __get_mapper_io(pr);
+    mio->err = 0;
+
+    mio->cb = delete_blocks_v2_cb;
+    r = __init_map_data_v2(pr, dst, X_DELETE);
+    if (mio->pending_reqs > 0) {
+        wait_on_pr(pr, mio->pending_reqs > 0);
+    }
+
+    if (r >= 0) {
+        mio->cb = map_blocks_v2_cb;
+        r = __copy_map_data_v2(pr, map, dst);
+        if (r < 0) {
+            mio->err = 1;
+        }
+        if (mio->pending_reqs > 0) {
+            wait_on_pr(pr, mio->pending_reqs > 0);
+        }
+    }
+
+    mio->priv = NULL;
+    mio->cb = NULL;
+    return (mio->err ? -1 : 0);
+}
+
 static void write_objects_v2_cb(struct peer_req *pr, struct xseg_request *req)
 {
     struct mapper_io *mio = __get_mapper_io(pr);
@@ -546,8 +745,46 @@ static int write_objects_v2(struct peer_req *pr, struct map *map,
     return (mio->err ? -1 : 0);
 }
 
+/* Write the dirty chunks of @map, all in parallel */
+static int write_dirty_objects_v2(struct peer_req *pr, struct map *map)
+{
+    int r = 0;
+    struct mapper_io *mio = __get_mapper_io(pr);
+    uint64_t c, end, start, nr;
+
+    mio->cb = write_objects_v2_cb;
+
+    for (c = 0; c < map->nr_chunks && r >= 0; c = end) {
+        if (!map->dirty[c]) {
+            end = c + 1;
+            continue;
+        }
+        for (end = c; end < map->nr_chunks && map->dirty[end]; end++) ;
+        start = c * map->chunk_objs;
+        nr = end * map->chunk_objs - start;
+        if (start + nr > map->nr_objs) {
+            nr = map->nr_objs - start;
+        }
+        r = __write_objects_v2(pr, map, start, nr);
+    }
+    if (r < 0) {
+        mio->err = 1;
+    }
+
+    if (mio->pending_reqs > 0) {
+        wait_on_pr(pr, mio->pending_reqs > 0);
+    }
+
+    mio->priv = NULL;
+    mio->cb = NULL;
+    return (mio->err ? -1 : 0);
+}
+
 static int write_map_data_v2(struct peer_req *pr, struct map *map)
 {
+    if (map->dirty) {
+        return write_dirty_objects_v2(pr, map);
+    }
     return write_objects_v2(pr, map, 0, map->nr_objs);
 }
 
@@ -701,9 +938,38 @@ static int load_map_objects_v2(struct peer_req *pr, struct map *map,
     return (mio->err ? -1 : 0);
 }
 
+/*
+ * Objects of v2 maps are loaded on demand, a chunk at a time, so only the
+ * state of the chunks is set up here.
+ */
 static int load_map_data_v2(struct peer_req *pr, struct map *map)
 {
-    return load_map_objects_v2(pr, map, 0, map->nr_objs);
+    if (map->flags & MF_MAP_DELETED) {
+        XSEGLOG2(&lc, I, "Map deleted. Ignoring loading objects");
+        return 0;
+    }
+    if (!map->nr_objs) {
+        return 0;
+    }
+
+    map->chunk_objs = get_chunk_size(map) / v2_objectsize_in_map;
+    map->nr_chunks = (map->nr_objs + map->chunk_objs - 1) / map->chunk_objs;
+    map->nr_loaded_chunks = 0;
+    map->chunks = calloc(map->nr_chunks, sizeof(unsigned char));
+    if (!map->chunks) {
+        XSEGLOG2(&lc, E, "Cannot allocate chunks of map %s", map->volume);
+        return -1;
+    }
+
+    if (alloc_map_objects_v2(map) < 0) {
+        free((void *) map->chunks);
+        map->chunks = NULL;
+        return -1;
+    }
+
+    XSEGLOG2(&lc, D, "Map %s: %llu chunks of %u objects", map->volume,
+             (unsigned long long) map->nr_chunks, map->chunk_objs);
+    return 0;
 }
 
 struct map_ops v2_ops = {
@@ -711,25 +977,32 @@ struct map_ops v2_ops = {
     .read_object = read_object_v2,
     .prepare_write_object = prepare_write_object_v2,
     .load_map_data = load_map_data_v2,
+    .load_map_objects = load_map_objects_v2,
     .write_map_data = write_map_data_v2,
-    .delete_map_data = delete_map_data_v2
+    .delete_map_data = delete_map_data_v2,
+    .copy_map_data = copy_map_data_v2,
+    .init_map_data = init_map_data_v2
 };
 
 void write_map_header_v2(struct map *map, struct v2_header_struct *v2_hdr)
 {
     v2_hdr->signature = __cpu_to_be32(MAP_SIGNATURE);
-    v2_hdr->version = __cpu_to_be32(MAP_V2);
+    v2_hdr->version = __cpu_to_be32(map->version);
     v2_hdr->size = __cpu_to_be64(map->size);
     v2_hdr->blocksize = __cpu_to_be32(map->blocksize);
     v2_hdr->flags = __cpu_to_be32(map->flags);
     v2_hdr->epoch = __cpu_to_be64(map->epoch);
+    v2_hdr->parent_epoch = __cpu_to_be64(map->parent_epoch);
+    v2_hdr->parentlen = __cpu_to_be32(map->parentlen);
+    memset(v2_hdr->parent, 0, v2_max_parentlen);
+    memcpy(v2_hdr->parent, map->parent, map->parentlen);
 }
 
 int read_map_header_v2(struct map *map, struct v2_header_struct *v2_hdr)
 {
     int r;
     uint32_t version = __be32_to_cpu(v2_hdr->version);
-    if (version != MAP_V2) {
+    if (version != MAP_V2 && version != MAP_V3) {
         return -1;
     }
     map->version = version;
@@ -739,6 +1012,18 @@ int read_map_header_v2(struct map *map, struct v2_header_struct *v2_hdr)
     //FIXME check each flag seperately
     map->flags = __be32_to_cpu(v2_hdr->flags);
     map->epoch = __be64_to_cpu(v2_hdr->epoch);
+    map->parentlen = 0;
+    map->parent_epoch = 0;
+    if (version >= MAP_V3) {
+        map->parentlen = __be32_to_cpu(v2_hdr->parentlen);
+        map->parent_epoch = __be64_to_cpu(v2_hdr->parent_epoch);
+    }
+    if (map->parentlen > MAX_VOLUME_LEN) {
+        XSEGLOG2(&lc, E, "Invalid parent len %u", map->parentlen);
+        return -1;
+    }
+    memcpy(map->parent, v2_hdr->parent, map->parentlen);
+    map->parent[map->parentlen] = 0;
     /* sanitize flags */
     //map->flags &= MF_MAP_SANITIZE;
     map->nr_objs = calc_map_obj(map);
@@ -20,6 +20,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <signal.h>
 #include <pthread.h>
 #include <time.h>
 #include <xseg/xseg.h>
@@ -31,6 +35,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "peer.h"
 #include "hash.h"
+#include "fnv.h"
 #include "mapper.h"
 #include "mapper-versions.h"
 
@@ -47,7 +52,21 @@ void custom_peer_usage()
 {
     fprintf(stderr, "Custom peer options: \n"
             "-bp  : port for block blocker(!)\n"
-            "-mbp : port for map blocker\n" "\n");
+            "-mbp : port for map blocker\n"
+            "--map-cache : memory for maps not opened exclusively, in MB "
+            "(default: %d, 0 disables it)\n"
+            "--partial-copyups : copy up only the written sub-blocks of "
+            "the objects of clones\n"
+            "--shards : number of processes to spread volumes over "
+            "(default: 1)\n"
+            "--shard-port : port of the second shard. The other shards "
+            "use the next ports\n"
+            "--reclaim-rate : objects of deleted volumes to delete per "
+            "second (default: %d, 0 for no limit)\n"
+            "--reclaim-journal : file that keeps the deleted volumes to "
+            "reclaim across restarts (default: %s)\n" "\n",
+            MAPPER_DEFAULT_CACHE, MAPPER_DEFAULT_RECLAIM_RATE,
+            MAPPER_DEFAULT_RECLAIM_JOURNAL);
 }
 
 
@@ -165,6 +184,29 @@ static int remove_map(struct mapperd *mapper, struct map *map)
     return r;
 }
 
+static void uncache_map(struct mapperd *mapper, struct map *map)
+{
+    struct map_cache *cache = &mapper->cache;
+
+    if (!map->cache_size) {
+        return;
+    }
+    if (map->lru_prev) {
+        map->lru_prev->lru_next = map->lru_next;
+    } else {
+        cache->head = map->lru_next;
+    }
+    if (map->lru_next) {
+        map->lru_next->lru_prev = map->lru_prev;
+    } else {
+        cache->tail = map->lru_prev;
+    }
+    map->lru_prev = NULL;
+    map->lru_next = NULL;
+    cache->used -= map->cache_size;
+    map->cache_size = 0;
+}
+
 inline struct map_node *get_mapnode(struct map *map, uint64_t index)
 {
     struct map_node *mn;
@@ -177,6 +219,11 @@ inline struct map_node *get_mapnode(struct map *map, uint64_t index)
         //      XSEGLOG2(&lc, E, "Map %s has no objects", map->volume);
         return NULL;
     }
+    if (map->chunks &&
+        !(map->chunks[index / map->chunk_objs] & MF_CHUNK_LOADED)) {
+        /* must be loaded first, with load_map_objects */
+        return NULL;
+    }
     mn = &map->objects[index];
     mn->ref++;
     //XSEGLOG2(&lc, D,  "mapnode %p: ref: %u", mn, mn->ref);
@@ -187,28 +234,21 @@ inline void put_mapnode(struct map_node *mn)
 {
     mn->ref--;
     //XSEGLOG2(&lc, D, "mapnode %p: ref: %u", mn, mn->ref);
-    if (!mn->ref) {
-        //clean up mn
-        st_cond_destroy(mn->cond);
-    }
 }
 
-int initialize_map_objects(struct map *map)
+int initialize_map_objects(struct map *map, uint64_t start, uint64_t nr)
 {
     uint64_t i;
     struct map_node *map_node = map->objects;
 
-    if (!map_node) {
+    if (!map_node || start + nr > map->nr_objs) {
         return -1;
     }
 
-    for (i = 0; i < map->nr_objs; i++) {
+    for (i = start; i < start + nr; i++) {
         map_node[i].map = map;
-        map_node[i].objectidx = i;
-        map_node[i].waiters = 0;
         map_node[i].state = 0;
         map_node[i].ref = 1;
-        map_node[i].cond = st_cond_new();       //FIXME err check;
     }
     return 0;
 }
@@ -256,6 +296,15 @@ static inline void put_map(struct map *map)
         if (map->objects) {
             free(map->objects);
         }
+        if (map->chunks) {
+            free((void *) map->chunks);
+        }
+        free(map->dirty);
+        free_map_names(map);
+        free(map->partials);
+        if (map->parent_map) {
+            put_map(map->parent_map);
+        }
         XSEGLOG2(&lc, I, "Freed map %s", map->volume);
         free(map);
     }
@@ -311,6 +360,25 @@ static struct map *create_map(char *name, uint32_t namelen, uint32_t flags)
     return m;
 }
 
+/* Make @map a clone of @parent, or not a clone if @parent is NULL */
+static void set_map_parent(struct map *map, char *parent, uint32_t parentlen,
+                           uint64_t parent_epoch)
+{
+    if (map->parent_map) {
+        put_map(map->parent_map);
+        map->parent_map = NULL;
+    }
+    if (!parent) {
+        parentlen = 0;
+        parent_epoch = 0;
+    } else {
+        memcpy(map->parent, parent, parentlen);
+    }
+    map->parent[parentlen] = 0;
+    map->parentlen = parentlen;
+    map->parent_epoch = parent_epoch;
+}
+
 static void wait_all_map_objects_ready(struct map *map)
 {
     uint64_t i;
@@ -346,11 +414,117 @@ struct r2o {
     uint64_t size;
 };
 
+/* Whether @r2o covers the whole of its object */
+static int covers_object(struct r2o *r2o)
+{
+    struct map *map = r2o->mn->map;
+    uint64_t start = mapnode_idx(r2o->mn) * map->blocksize;
+    uint64_t size = map->blocksize;
+
+    if (start + size > map->size) {
+        size = map->size - start;
+    }
+    return !r2o->offset && r2o->size == size;
+}
+
+/* The sub-blocks of its object that @r2o covers as a whole */
+static uint64_t covered_subblocks(struct r2o *r2o)
+{
+    struct map *map = r2o->mn->map;
+    uint64_t sbsize = subblock_size(map);
+    uint64_t start = mapnode_idx(r2o->mn) * map->blocksize;
+    uint64_t end = r2o->offset + r2o->size;
+    uint64_t first, last;
+
+    first = (r2o->offset + sbsize - 1) / sbsize;
+    /* the last sub-block of the volume is covered up to the volume end */
+    if (start + end == map->size) {
+        last = (end + sbsize - 1) / sbsize;
+    } else {
+        last = end / sbsize;
+    }
+    if (first >= last) {
+        return 0;
+    }
+    return subblock_range(first, last - 1);
+}
+
+/* Whether @r2o must take another copy-up step before it can be written */
+static int copyup_pending(struct r2o *r2o)
+{
+    struct map_node *mn = r2o->mn;
+    uint64_t touched;
+
+    if (!mapnode_writable(mn)) {
+        return 1;
+    }
+    if (!(mn->flags & MF_OBJECT_PARTIAL)) {
+        return 0;
+    }
+    touched = subblocks_touched(mn->map, r2o->offset, r2o->size);
+    return (mapnode_valid(mn) & touched) != touched;
+}
+
+/* Whether a copy of the object of @mn can be partial */
+static int partial_name_fits(struct map_node *mn)
+{
+    return mn->map->volumelen + HEXLIFIED_EPOCH + HEXLIFIED_INDEX + 2 <=
+        MAX_PARTIAL_OBJECT_LEN;
+}
+
+/* Whether @r2o creates a new partial object, when it is copied up */
+static int creates_partial(struct mapperd *mapper, struct r2o *r2o)
+{
+    struct map_node *mn = r2o->mn;
+
+    return mapper->partial_copyups && mn->flags & MF_OBJECT_INHERITED &&
+        !(mn->flags & MF_OBJECT_ZERO) && !covers_object(r2o) &&
+        partial_name_fits(mn);
+}
+
+/* Take the next copy-up step of @r2o */
+static struct xseg_request *copyup_step(struct mapperd *mapper,
+                                        struct peer_req *pr, struct r2o *r2o)
+{
+    struct map_node *mn = r2o->mn;
+    uint64_t touched, covered;
+
+    if (!mapnode_writable(mn) && mn->flags & MF_OBJECT_PARTIAL &&
+        !partial_name_fits(mn)) {
+        /* complete it in place, so that it can be copied as a whole */
+        return __copyup_partial(pr, mn, MAPPER_ALL_SUBBLOCKS, 0);
+    }
+    if (mapnode_writable(mn) || creates_partial(mapper, r2o)) {
+        touched = subblocks_touched(mn->map, r2o->offset, r2o->size);
+        covered = covered_subblocks(r2o);
+        return __copyup_partial(pr, mn, touched & ~covered, covered);
+    }
+    return __copyup_object(pr, mn, covers_object(r2o));
+}
+
 static int do_copyups(struct peer_req *pr, struct r2o *mns, int n)
 {
+    struct mapperd *mapper = __get_mapperd(pr->peer);
     struct mapper_io *mio = __get_mapper_io(pr);
     struct map_node *mn;
-    int i, j, can_wait = 0;
+    struct map *map;
+    int i, j, issued, can_wait = 0;
+
+    /* the map must be marked before its first partial object is written */
+    for (i = 0; i < n; i++) {
+        map = mns[i].mn->map;
+        if (!(map->flags & MF_MAP_PARTIAL) &&
+            creates_partial(mapper, &mns[i])) {
+            map->flags |= MF_MAP_PARTIAL;
+            if (write_map_metadata(pr, map) < 0) {
+                XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
+                map->flags &= ~MF_MAP_PARTIAL;
+                return -1;
+            }
+            mapper->complete_pending = 1;
+        }
+    }
+
     mio->pending_reqs = 0;
     mio->cb = copyup_cb;
     mio->err = 0;
@@ -358,9 +532,12 @@ static int do_copyups(struct peer_req *pr, struct r2o *mns, int n)
     /* do a first scan and issue as many copyups as we can.
      * then retry and wait when an object is not ready.
      * this could be done better, since now we wait also on the
-     * pending copyups
+     * pending copyups.
+     * partial copy-ups take a step per scan, so scan until no object
+     * needs another step.
      */
-    for (j = 0; j < 2 && !mio->err; j++) {
+    for (j = 0, issued = 0; (j < 2 || issued) && !mio->err; j++) {
+        issued = 0;
         for (i = 0; i < n && !mio->err; i++) {
             mn = mns[i].mn;
             //do copyups
@@ -384,13 +561,14 @@ static int do_copyups(struct peer_req *pr, struct r2o *mns, int n)
                 }
             }
 
-            if (!(mn->flags & MF_OBJECT_WRITABLE)) {
+            if (copyup_pending(&mns[i])) {
                 //calc new_target, copy up object
-                if (__copyup_object(pr, mn) == NULL) {
+                if (copyup_step(mapper, pr, &mns[i]) == NULL) {
                     XSEGLOG2(&lc, E, "Error in copy up object");
                     mio->err = 1;
                 } else {
                     mio->pending_reqs++;
+                    issued++;
                 }
             }
 
@@ -409,18 +587,94 @@ static int do_copyups(struct peer_req *pr, struct r2o *mns, int n)
     return mio->err ? -1 : 0;
 }
 
+/*
+ * Get the run of sub-blocks of @r2o from @offset on, that are all valid or all
+ * invalid in @valid. Returns the size of the run.
+ */
+static uint64_t subblock_run(struct r2o *r2o, uint64_t valid, uint64_t offset,
+                             int *is_valid)
+{
+    uint64_t sbsize = subblock_size(r2o->mn->map);
+    uint64_t end = r2o->offset + r2o->size;
+    uint64_t pos = offset;
+
+    *is_valid = (valid >> (offset / sbsize)) & 1;
+    while (pos < end && ((valid >> (pos / sbsize)) & 1) == *is_valid) {
+        pos = (pos / sbsize + 1) * sbsize;
+    }
+    if (pos > end) {
+        pos = end;
+    }
+    return pos - offset;
+}
+
+/*
+ * Reads of a partial object are split in a segment for every run of its
+ * sub-blocks, and the runs it does not hold are read from its parent object.
+ */
+static uint32_t nr_read_segs(struct r2o *r2o)
+{
+    uint64_t valid = mapnode_valid(r2o->mn);
+    uint64_t offset;
+    uint32_t nr = 0;
+    int is_valid;
+
+    for (offset = r2o->offset; offset < r2o->offset + r2o->size; nr++) {
+        offset += subblock_run(r2o, valid, offset, &is_valid);
+    }
+    return nr;
+}
+
+static void set_reply_seg(struct xseg_reply_map_scatterlist *seg,
+                          struct map_object *obj, uint64_t offset,
+                          uint64_t size)
+{
+    strncpy(seg->target, obj->object, obj->objectlen);
+    seg->targetlen = obj->objectlen;
+    seg->offset = offset;
+    seg->size = size;
+    seg->flags = 0;
+    if (obj->flags & MF_OBJECT_ZERO) {
+        seg->flags |= XF_MAPFLAG_ZERO;
+    }
+}
+
+static int set_read_segs(struct xseg_reply_map_scatterlist *segs,
+                         struct r2o *r2o)
+{
+    struct map_object obj, parent;
+    uint64_t valid = mapnode_valid(r2o->mn);
+    uint64_t touched = subblocks_touched(r2o->mn->map, r2o->offset, r2o->size);
+    uint64_t offset, size;
+    int is_valid, i = 0;
+
+    mapnode_get_object(r2o->mn, &obj);
+    if ((valid & touched) != touched &&
+        mapnode_get_parent_object(r2o->mn, &parent) < 0) {
+        return -1;
+    }
+    for (offset = r2o->offset; offset < r2o->offset + r2o->size;
+         offset += size) {
+        size = subblock_run(r2o, valid, offset, &is_valid);
+        set_reply_seg(&segs[i++], is_valid ? &obj : &parent, offset, size);
+    }
+    return i;
+}
+
 static int req2objs(struct peer_req *pr, struct map *map, int write)
 {
     int r = 0;
     struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
     struct mapper_io *mio = __get_mapper_io(pr);
     char *target = xseg_get_target(peer->xseg, pr->req);
     uint32_t nr_objs = calc_nr_obj(map, pr->req);
-    uint64_t size = sizeof(struct xseg_reply_map) +
-        nr_objs * sizeof(struct xseg_reply_map_scatterlist);
+    uint32_t nr_segs;
+    uint64_t size;
     uint32_t idx, i;
     uint64_t rem_size, obj_index, obj_offset, obj_size;
     struct map_node *mn;
+    struct map_object obj;
     char buf[XSEG_MAX_TARGETLEN];
     struct xseg_reply_map *reply;
 
@@ -445,6 +699,13 @@ static int req2objs(struct peer_req *pr, struct map *map, int write)
     idx = 0;
     rem_size = pr->req->size;
     obj_index = pr->req->offset / map->blocksize;
+    r = load_map_objects(pr, map, obj_index, nr_objs);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects %llu-%llu of map %s",
+                 (unsigned long long) obj_index,
+                 (unsigned long long) (obj_index + nr_objs), map->volume);
+        goto out;
+    }
     obj_offset = pr->req->offset & (map->blocksize - 1);        //modulo
     obj_size =
         (obj_offset + rem_size >
@@ -474,8 +735,9 @@ static int req2objs(struct peer_req *pr, struct map *map, int write)
             goto out;
         }
         if (mn->flags & MF_OBJECT_DELETED) {
-            XSEGLOG2(&lc, E, "Trying to perform I/O on deleted object %s",
-                     mn->object);
+            XSEGLOG2(&lc, E, "Trying to perform I/O on deleted object "
+                     "%llu of map %s", (unsigned long long) obj_index,
+                     map->volume);
             r = -1;
             goto out;
         };
@@ -492,6 +754,21 @@ static int req2objs(struct peer_req *pr, struct map *map, int write)
         }
     }
 
+    if (map->flags & MF_MAP_PARTIAL) {
+        mapper->complete_pending = 1;
+    }
+
+    nr_segs = 0;
+    for (i = 0; i < idx; i++) {
+        if (!write && mns[i].mn->flags & MF_OBJECT_PARTIAL) {
+            nr_segs += nr_read_segs(&mns[i]);
+        } else {
+            nr_segs++;
+        }
+    }
+    size = sizeof(struct xseg_reply_map) +
+        nr_segs * sizeof(struct xseg_reply_map_scatterlist);
+
     /* resize request to fit reply */
     strncpy(buf, target, pr->req->targetlen);
     r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen, size);
@@ -504,17 +781,23 @@ static int req2objs(struct peer_req *pr, struct map *map, int write)
 
     /* structure reply */
     reply = (struct xseg_reply_map *) xseg_get_data(peer->xseg, pr->req);
-    reply->cnt = nr_objs;
-    for (i = 0; i < idx; i++) {
-        strncpy(reply->segs[i].target, mns[i].mn->object,
-                mns[i].mn->objectlen);
-        reply->segs[i].targetlen = mns[i].mn->objectlen;
-        reply->segs[i].offset = mns[i].offset;
-        reply->segs[i].size = mns[i].size;
-        reply->segs[i].flags = 0;
-        if (mns[i].mn->flags & MF_OBJECT_ZERO) {
-            reply->segs[i].flags |= XF_MAPFLAG_ZERO;
+    reply->cnt = nr_segs;
+    for (i = 0, nr_segs = 0; i < idx; i++) {
+        if (!write && mns[i].mn->flags & MF_OBJECT_PARTIAL) {
+            r = set_read_segs(&reply->segs[nr_segs], &mns[i]);
+            if (r < 0) {
+                XSEGLOG2(&lc, E, "Cannot map partial object %llu of map %s",
+                         (unsigned long long) mapnode_idx(mns[i].mn),
+                         map->volume);
+                goto out;
+            }
+            nr_segs += r;
+            r = 0;
+            continue;
         }
+        mapnode_get_object(mns[i].mn, &obj);
+        set_reply_seg(&reply->segs[nr_segs++], &obj, mns[i].offset,
+                      mns[i].size);
     }
   out:
     for (i = 0; i < idx; i++) {
@@ -528,350 +811,1228 @@ static int req2objs(struct peer_req *pr, struct map *map, int write)
     return r;
 }
 
-static int do_info(struct peer_req *pr, struct map *map)
+/*
+ * Copy the sub-blocks that the partial object of @mn does not hold from its
+ * parent object, one run at a time, until it is no longer partial.
+ */
+static int complete_object(struct peer_req *pr, struct map_node *mn)
 {
-    struct peerd *peer = pr->peer;
-    struct xseg_reply_info *xinfo;
-    struct xseg_request *req = pr->req;
-    char buf[XSEG_MAX_TARGETLEN + 1];
-    char *target;
-    int r;
+    struct mapper_io *mio = __get_mapper_io(pr);
 
-    if (req->datalen < sizeof(struct xseg_reply_info)) {
-        target = xseg_get_target(peer->xseg, req);
-        strncpy(buf, target, req->targetlen);
-        r = xseg_resize_request(peer->xseg, req, req->targetlen,
-                                sizeof(struct xseg_reply_info));
-        if (r < 0) {
-            XSEGLOG2(&lc, E, "Cannot resize request");
-            return -1;
+    mio->err = 0;
+    while (mn->flags & MF_OBJECT_PARTIAL && !mio->err) {
+        if (mn->state & MF_OBJECT_NOT_READY) {
+            wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
+            continue;
         }
-        target = xseg_get_target(peer->xseg, req);
-        strncpy(target, buf, req->targetlen);
+        if (mn->flags & MF_OBJECT_DELETED) {
+            mio->err = 1;
+            break;
+        }
+        mio->pending_reqs = 0;
+        mio->cb = copyup_cb;
+        if (!__copyup_partial(pr, mn, MAPPER_ALL_SUBBLOCKS, 0)) {
+            mio->err = 1;
+            break;
+        }
+        mio->pending_reqs++;
+        wait_on_pr(pr, mio->pending_reqs > 0);
     }
+    mio->cb = NULL;
 
-    xinfo = (struct xseg_reply_info *) xseg_get_data(peer->xseg, req);
-    xinfo->size = map->size;
-    return 0;
+    return mio->err ? -1 : 0;
 }
 
-
-static int do_open(struct peer_req *pr, struct map *map)
+/* Complete the next partial object of @map, whose objects must be loaded */
+static int complete_next_object(struct peer_req *pr, struct map *map)
 {
-    if (map->state & MF_MAP_EXCLUSIVE) {
-        return 0;
-    } else {
-        return -1;
-    }
-}
+    struct map_node *mn;
+    int r;
 
-static int do_update(struct peer_req *pr, struct map *map)
-{
-    if (map->version != MAP_LATEST_VERSION) {
+    mn = get_mapnode(map, map->partials[0].idx);
+    if (!mn) {
+        XSEGLOG2(&lc, E, "Cannot get partial object %llu of map %s",
+                 (unsigned long long) map->partials[0].idx, map->volume);
         return -1;
-    } else {
-        return 0;
     }
+    r = complete_object(pr, mn);
+    put_mapnode(mn);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot complete object %llu of map %s",
+                 (unsigned long long) mapnode_idx(mn), map->volume);
+    }
+    return r;
 }
 
-
-static int dropcache(struct peer_req *pr, struct map *map)
+/* Complete all the partial objects of @map, and mark it as such */
+static int complete_map(struct peer_req *pr, struct map *map)
 {
     int r;
-    struct peerd *peer = pr->peer;
-    struct mapperd *mapper = __get_mapperd(peer);
-    XSEGLOG2(&lc, I, "Dropping cache for map %s", map->volume);
-    /*
-     * We can lazily drop the cache from here, by just removing from the maps
-     * hashmap making it inaccessible from future requests. This is because:
-     *
-     * a) Dropping cache for a map is serialized on a map level. So there
-     * should not be any other threds modifying the struct map.
-     *
-     * b) Any other thread manipulating the map nodes should not have
-     * any pending requests on the map node, if the map is not opened
-     * exclusively. If that's the case, then we should not close the map,
-     * a.k.a. releasing the map lock without checking for any pending
-     * requests. Furthermore, since each operation on a map gets a map
-     * reference, the memory will not be freed, unless every request has
-     * finished processing the map.
-     */
 
-    /* Set map as destroyed to notify any waiters that hold a reference to
-     * the struct map.
-     */
-    //FIXME err check
-    r = remove_map(mapper, map);
+    r = load_map_objects(pr, map, 0, map->nr_objs);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Remove map %s from hashmap failed", map->volume);
-        XSEGLOG2(&lc, E, "Dropping cache for map %s failed", map->volume);
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
         return -1;
     }
-    map->state |= MF_MAP_DESTROYED;
-    XSEGLOG2(&lc, I, "Dropping cache for map %s completed", map->volume);
-    put_map(map);               // put map here to destroy it (matches m->ref = 1 on map create)
-    return 0;
-}
-
-static int do_close(struct peer_req *pr, struct map *map)
-{
-    if (!(map->state & MF_MAP_EXCLUSIVE)) {
-        XSEGLOG2(&lc, E, "Attempted to close a not opened map");
+    map->users++;
+    while (r >= 0 && map->nr_partials) {
+        r = complete_next_object(pr, map);
+    }
+    if (!--map->users) {
+        signal_all_objects_ready(map);
+    }
+    if (r < 0) {
         return -1;
     }
-    /* Do not close the map while there are pending requests on the
-     * map nodes.
-     */
-    wait_all_map_objects_ready(map);
-    if (close_map(pr, map) < 0) {
+    map->flags &= ~MF_MAP_PARTIAL;
+    r = write_map_metadata(pr, map);
+    if (r < 0) {
+        map->flags |= MF_MAP_PARTIAL;
+        XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
         return -1;
     }
-
+    XSEGLOG2(&lc, I, "Completed the partial objects of map %s", map->volume);
     return 0;
 }
 
-static int do_hash(struct peer_req *pr, struct map *map)
+/* Whether the partial objects of @map can be completed in the background */
+static int can_complete(struct map *map)
 {
-    return -1;
+    return map->flags & MF_MAP_PARTIAL && map->state & MF_MAP_EXCLUSIVE &&
+        !(map->state & MF_MAP_NOT_READY) && !(map->flags & MF_MAP_DELETED);
 }
 
-static int do_snapshot(struct peer_req *pr, struct map *map)
+/*
+ * Background completion of partial objects. Takes a single step for the first
+ * map that has partial objects: loads all of its objects, completes one
+ * partial object, or marks the map as complete, if no partial object is left
+ * and no request uses the map.
+ */
+static void *complete_partial_maps(struct peer_req *pr)
 {
-    uint64_t i;
     struct peerd *peer = pr->peer;
-    //struct mapper_io *mio = __get_mapper_io(pr);
-    struct map_node *mn;
-    uint64_t nr_objs;
-    struct map *snap_map;
-    struct xseg_request_snapshot *xsnapshot;
-    char *snapname;
-    uint32_t snapnamelen;
-    int r;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct map *map = NULL;
+    xhash_iter_t it;
+    xhashidx key, val;
+    int r = 0;
 
-    xsnapshot =
-        (struct xseg_request_snapshot *) xseg_get_data(peer->xseg, pr->req);
-    if (!xsnapshot) {
-        return -1;
+    xhash_iter_init(mapper->hashmaps, &it);
+    while (xhash_iterate(mapper->hashmaps, &it, &key, &val)) {
+        if (can_complete((struct map *) val)) {
+            map = (struct map *) val;
+            break;
+        }
     }
-    snapname = xsnapshot->target;
-    snapnamelen = xsnapshot->targetlen;
-
-    if (!snapnamelen) {
-        XSEGLOG2(&lc, E, "Snapshot name must be provided");
-        return -1;
+    if (!map) {
+        mapper->complete_pending = 0;
+        goto out;
     }
 
-    if (!(map->state & MF_MAP_EXCLUSIVE)) {
-        XSEGLOG2(&lc, E, "Map was not opened exclusively");
-        return -1;
+    __get_map(map);
+    map->users++;
+    if (map->chunks) {
+        r = load_map_objects(pr, map, 0, map->nr_objs);
+    } else if (map->nr_partials) {
+        r = complete_next_object(pr, map);
+    } else if (map->users == 1) {
+        map->flags &= ~MF_MAP_PARTIAL;
+        r = write_map_metadata(pr, map);
+        if (r < 0) {
+            map->flags |= MF_MAP_PARTIAL;
+        } else {
+            XSEGLOG2(&lc, I, "Completed the partial objects of map %s",
+                     map->volume);
+        }
     }
-    if (map->epoch == UINT64_MAX) {
-        XSEGLOG2(&lc, E, "Max epoch reached for %s", map->volume);
-        return -1;
+    if (!--map->users) {
+        signal_all_objects_ready(map);
+    }
+    if (r < 0) {
+        /* retry once the map is used again */
+        XSEGLOG2(&lc, E, "Background completion of map %s failed",
+                 map->volume);
+        mapper->complete_pending = 0;
+    }
+    put_map(map);
+
+  out:
+    free_peer_req(peer, pr);
+    ta--;
+    return NULL;
+}
+
+/*
+ * Start a background completion step, when there may be partial objects and
+ * mapperd serves no request.
+ */
+static int complete_poll(struct peerd *peer)
+{
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct peer_req *pr;
+
+    if (!mapper->complete_pending || ta || isTerminate() ||
+        !all_peer_reqs_free(peer)) {
+        return 0;
+    }
+    pr = alloc_peer_req(peer);
+    if (!pr) {
+        return 0;
+    }
+    __get_mapper_io(pr)->err = 0;
+    __get_mapper_io(pr)->cb = NULL;
+    __get_mapper_io(pr)->active = 1;
+    ta++;
+    st_thread_create(complete_partial_maps, pr, 0, 0);
+    return 1;
+}
+
+/*
+ * Background reclaiming of the objects of deleted maps
+ *
+ * Destroying a writable map first renames it to its reclaim name, the name
+ * of the map followed by MAPPER_RECLAIM_SEP and its epoch, so that the name
+ * of the map is free again at once. The map under the reclaim name is then
+ * marked as deleted, with MF_MAP_RECLAIM set, and queued for reclaiming. A
+ * map whose reclaim name does not fit, or is taken, is reclaimed under its
+ * own name, which cannot be reused until the map is reclaimed. Read-only maps
+ * have no objects of their own, and are only marked as deleted.
+ *
+ * The reclaimer deletes the objects of the queued maps, oldest map first, in
+ * steps of at most MAPPER_RECLAIM_BATCH objects, and at most reclaim_rate
+ * objects per second. It runs only while no request is running. The queue is
+ * kept in the reclaim journal, so that it survives restarts. A map left with
+ * the flag is also queued again when it is next loaded.
+ */
+
+static uint64_t now_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Rewrite the reclaim journal with the maps that are still queued */
+static int write_reclaim_journal(struct mapperd *mapper)
+{
+    char tmp[MAX_JOURNAL_LEN + 5];
+    struct reclaim *rc;
+    FILE *f;
+    int r = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", mapper->reclaim_journal);
+    f = fopen(tmp, "w");
+    if (!f) {
+        XSEGLOG2(&lc, E, "Cannot open %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    for (rc = mapper->reclaims; rc; rc = rc->next) {
+        if (fprintf(f, "%s\n", rc->volume) < 0) {
+            r = -1;
+        }
+    }
+    if (fflush(f) || fsync(fileno(f))) {
+        r = -1;
+    }
+    if (fclose(f)) {
+        r = -1;
+    }
+    if (r < 0 || rename(tmp, mapper->reclaim_journal) < 0) {
+        XSEGLOG2(&lc, E, "Cannot write reclaim journal %s",
+                 mapper->reclaim_journal);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct reclaim *add_reclaim(struct mapperd *mapper, char *name,
+                                   uint32_t namelen)
+{
+    struct reclaim *rc, **p;
+
+    if (!namelen || namelen > MAX_VOLUME_LEN) {
+        return NULL;
+    }
+    for (p = &mapper->reclaims; *p; p = &(*p)->next) {
+        if ((*p)->volumelen == namelen &&
+            !strncmp((*p)->volume, name, namelen)) {
+            return *p;
+        }
+    }
+
+    rc = calloc(1, sizeof(struct reclaim));
+    if (!rc) {
+        XSEGLOG2(&lc, E, "Cannot allocate reclaim of map %.*s", namelen, name);
+        return NULL;
+    }
+    strncpy(rc->volume, name, namelen);
+    rc->volume[namelen] = 0;
+    rc->volumelen = namelen;
+    *p = rc;
+    XSEGLOG2(&lc, I, "Map %s queued for reclaiming", rc->volume);
+
+    return rc;
+}
+
+static int queue_reclaim(struct mapperd *mapper, char *name, uint32_t namelen)
+{
+    if (!add_reclaim(mapper, name, namelen)) {
+        return -1;
+    }
+    return write_reclaim_journal(mapper);
+}
+
+static void remove_reclaim(struct mapperd *mapper, struct reclaim *rc)
+{
+    struct reclaim **p;
+
+    for (p = &mapper->reclaims; *p; p = &(*p)->next) {
+        if (*p == rc) {
+            *p = rc->next;
+            break;
+        }
+    }
+    free(rc);
+    write_reclaim_journal(mapper);
+}
+
+/* Move the oldest map to the end of the queue, to try the others first */
+static void rotate_reclaims(struct mapperd *mapper)
+{
+    struct reclaim *rc = mapper->reclaims, **p;
+
+    if (!rc || !rc->next) {
+        return;
+    }
+    mapper->reclaims = rc->next;
+    rc->next = NULL;
+    for (p = &mapper->reclaims; *p; p = &(*p)->next) ;
+    *p = rc;
+}
+
+static int read_reclaim_journal(struct mapperd *mapper)
+{
+    char line[MAX_VOLUME_LEN + 2];
+    size_t len;
+    FILE *f;
+
+    f = fopen(mapper->reclaim_journal, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        XSEGLOG2(&lc, E, "Cannot open reclaim journal %s: %s",
+                 mapper->reclaim_journal, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        len = strcspn(line, "\n");
+        line[len] = 0;
+        if (len) {
+            add_reclaim(mapper, line, len);
+        }
+    }
+    fclose(f);
+
+    return 0;
+}
+
+/*
+ * Open the map of @rc and set up the on demand loading of its objects.
+ * Returns 1 if the map has objects to reclaim, 0 if it has not, and -1 if it
+ * cannot be opened now, e.g. because another host holds it.
+ */
+static int open_reclaim(struct peer_req *pr, struct reclaim *rc)
+{
+    struct map *map;
+    int r;
+
+    map = create_map(rc->volume, rc->volumelen, MF_ARCHIP);
+    if (!map) {
+        return -1;
+    }
+    if (open_map(pr, map, 0) < 0) {
+        XSEGLOG2(&lc, W, "Cannot open map %s to reclaim its objects",
+                 map->volume);
+        put_map(map);
+        return -1;
+    }
+
+    r = load_map_metadata(pr, map);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load map %s to reclaim its objects",
+                 map->volume);
+        close_map(pr, map);
+        put_map(map);
+        return -1;
+    }
+    if (!(map->flags & MF_MAP_DELETED) || !(map->flags & MF_MAP_RECLAIM)) {
+        /* reclaimed, or recreated by a mapperd that ignores the flag */
+        goto out_close;
+    }
+    if (!map->mops->load_map_objects) {
+        XSEGLOG2(&lc, E, "Objects of map %s cannot be loaded on demand",
+                 map->volume);
+        goto out_close;
+    }
+
+    /* objects of deleted maps are not loaded */
+    map->flags &= ~MF_MAP_DELETED;
+    r = map->mops->load_map_data(pr, map);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load map %s to reclaim its objects",
+                 map->volume);
+        close_map(pr, map);
+        put_map(map);
+        return -1;
+    }
+
+    XSEGLOG2(&lc, I, "Reclaiming the objects of map %s", map->volume);
+    rc->map = map;
+    rc->cursor = 0;
+    rc->failed = 0;
+    return 1;
+
+  out_close:
+    close_map(pr, map);
+    put_map(map);
+    return 0;
+}
+
+static void close_reclaim(struct peer_req *pr, struct reclaim *rc)
+{
+    close_map(pr, rc->map);
+    put_map(rc->map);
+    rc->map = NULL;
+}
+
+/*
+ * Delete the next objects of @rc, until @max deletions are issued, and write
+ * their chunks all at once. Returns the number of deletions, or -1 on error.
+ */
+static int reclaim_objects(struct peer_req *pr, struct reclaim *rc,
+                           uint64_t max)
+{
+    struct mapper_io *mio = __get_mapper_io(pr);
+    struct map *map = rc->map;
+    struct map_node *mn;
+    uint64_t i, n = 0;
+    int r;
+
+    /* writing all the objects would need loading them with the map deleted */
+    if (track_dirty_chunks(map) < 0) {
+        XSEGLOG2(&lc, E, "Cannot track the chunks of map %s", map->volume);
+        return -1;
+    }
+    mio->priv = rc;
+    mio->cb = reclaim_object_cb;
+    mio->err = 0;
+    mio->pending_reqs = 0;
+    for (i = rc->cursor; i < map->nr_objs && n < max; i++) {
+        if (load_map_objects(pr, map, i, 1) < 0) {
+            XSEGLOG2(&lc, E, "Cannot load object %llu of map %s",
+                     (unsigned long long) i, map->volume);
+            mio->err = 1;
+            break;
+        }
+        mn = get_mapnode(map, i);
+        if (!mn) {
+            XSEGLOG2(&lc, E, "Could not get map node %llu for map %s",
+                     (unsigned long long) i, map->volume);
+            mio->err = 1;
+            break;
+        }
+        /* only remove writable archipelago objects */
+        if (mn->flags & (MF_OBJECT_ZERO | MF_OBJECT_DELETED) ||
+            !(mn->flags & MF_OBJECT_ARCHIP && mapnode_writable(mn))) {
+            put_mapnode(mn);
+            continue;
+        }
+        if (!__object_delete(pr, mn)) {
+            XSEGLOG2(&lc, E, "Error removing object %llu",
+                     (unsigned long long) i);
+            put_mapnode(mn);
+            mio->err = 1;
+            break;
+        }
+        //mapnode will be put by reclaim_object_cb on completion
+        n++;
+    }
+    rc->cursor = i;
+
+    if (mio->pending_reqs > 0) {
+        wait_on_pr(pr, mio->pending_reqs > 0);
+    }
+    mio->cb = NULL;
+    mio->priv = NULL;
+    if (mio->err) {
+        free(map->dirty);
+        map->dirty = NULL;
+        return -1;
+    }
+    if (!n) {
+        free(map->dirty);
+        map->dirty = NULL;
+        return 0;
+    }
+
+    map->flags |= MF_MAP_DELETED;
+    r = write_map(pr, map);
+    map->flags &= ~MF_MAP_DELETED;
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
+        return -1;
+    }
+
+    return n;
+}
+
+/* Mark @rc as reclaimed, once all its objects are deleted */
+static int finish_reclaim(struct peer_req *pr, struct reclaim *rc)
+{
+    struct map *map = rc->map;
+    int r;
+
+    map->flags |= MF_MAP_DELETED;
+    map->flags &= ~MF_MAP_RECLAIM;
+    r = write_map_metadata(pr, map);
+    if (r < 0) {
+        map->flags |= MF_MAP_RECLAIM;
+        map->flags &= ~MF_MAP_DELETED;
+        XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
+        return -1;
+    }
+    XSEGLOG2(&lc, I, "Reclaimed the objects of map %s", map->volume);
+
+    return 0;
+}
+
+/*
+ * Take a single reclaim step for the oldest queued map: open it, delete a
+ * batch of its objects, put it back at the end of the queue if the deletion
+ * of some objects failed, or drop it from the queue once no object is left.
+ */
+static void *reclaim_maps(struct peer_req *pr)
+{
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct reclaim *rc = mapper->reclaims;
+    uint64_t max = MAPPER_RECLAIM_BATCH;
+    int r;
+
+    if (mapper->reclaim_rate && mapper->reclaim_rate < max) {
+        max = mapper->reclaim_rate;
+    }
+
+    if (!rc->map) {
+        r = open_reclaim(pr, rc);
+        if (!r) {
+            remove_reclaim(mapper, rc);
+        } else if (r < 0) {
+            goto out_retry;
+        }
+        goto out;
+    }
+
+    if (rc->cursor < rc->map->nr_objs) {
+        r = reclaim_objects(pr, rc, max);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Reclaiming objects of map %s failed",
+                     rc->volume);
+            close_reclaim(pr, rc);
+            goto out_retry;
+        }
+        if (mapper->reclaim_rate) {
+            mapper->reclaim_next = now_usecs() +
+                r * 1000000 / mapper->reclaim_rate;
+        }
+        goto out;
+    }
+
+    if (rc->failed) {
+        /* the map is opened again and its objects are walked from the start */
+        XSEGLOG2(&lc, W, "Could not delete %llu objects of map %s. "
+                 "Retrying later", (unsigned long long) rc->failed,
+                 rc->volume);
+        close_reclaim(pr, rc);
+        goto out_retry;
+    }
+
+    r = finish_reclaim(pr, rc);
+    close_reclaim(pr, rc);
+    if (r < 0) {
+        goto out_retry;
+    }
+    remove_reclaim(mapper, rc);
+    goto out;
+
+  out_retry:
+    rotate_reclaims(mapper);
+    mapper->reclaim_next = now_usecs() + MAPPER_RECLAIM_RETRY;
+  out:
+    mapper->reclaiming = 0;
+    free_peer_req(peer, pr);
+    ta--;
+    return NULL;
+}
+
+/*
+ * Start a reclaim step, when one is due and mapperd serves no request. Until
+ * the next step is due, the peer wakes up in time for it.
+ */
+static int reclaim_poll(struct peerd *peer)
+{
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct peer_req *pr;
+    uint64_t now;
+
+    peer->idle_timeout = PEER_DEFAULT_IDLE_TIMEOUT;
+    if (!mapper->reclaims || mapper->reclaiming || isTerminate()) {
+        return 0;
+    }
+    now = now_usecs();
+    if (now < mapper->reclaim_next) {
+        if (mapper->reclaim_next - now < PEER_DEFAULT_IDLE_TIMEOUT) {
+            peer->idle_timeout = mapper->reclaim_next - now;
+        }
+        return 0;
+    }
+    if (ta) {
+        return 0;
+    }
+    pr = alloc_peer_req(peer);
+    if (!pr) {
+        return 0;
+    }
+    __get_mapper_io(pr)->err = 0;
+    __get_mapper_io(pr)->cb = NULL;
+    __get_mapper_io(pr)->active = 1;
+    mapper->reclaiming = 1;
+    ta++;
+    st_thread_create(reclaim_maps, pr, 0, 0);
+    return 1;
+}
+
+static int mapper_poll(struct peerd *peer)
+{
+    return complete_poll(peer) || reclaim_poll(peer);
+}
+
+/*
+ * Whether the name of @map, whose metadata were loaded, is in use. A deleted
+ * map that is reclaimed under its own name keeps it until its objects are
+ * reclaimed.
+ */
+static int map_name_taken(struct peer_req *pr, struct map *map)
+{
+    struct mapperd *mapper = __get_mapperd(pr->peer);
+
+    if (!(map->flags & MF_MAP_DELETED)) {
+        return 1;
+    }
+    if (map->flags & MF_MAP_RECLAIM) {
+        XSEGLOG2(&lc, E, "Objects of deleted map %s are still reclaimed",
+                 map->volume);
+        queue_reclaim(mapper, map->volume, map->volumelen);
+        return 1;
+    }
+    return 0;
+}
+
+static int do_info(struct peer_req *pr, struct map *map)
+{
+    struct peerd *peer = pr->peer;
+    struct xseg_reply_info *xinfo;
+    struct xseg_request *req = pr->req;
+    char buf[XSEG_MAX_TARGETLEN + 1];
+    char *target;
+    int r;
+
+    if (req->datalen < sizeof(struct xseg_reply_info)) {
+        target = xseg_get_target(peer->xseg, req);
+        strncpy(buf, target, req->targetlen);
+        r = xseg_resize_request(peer->xseg, req, req->targetlen,
+                                sizeof(struct xseg_reply_info));
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot resize request");
+            return -1;
+        }
+        target = xseg_get_target(peer->xseg, req);
+        strncpy(target, buf, req->targetlen);
+    }
+
+    xinfo = (struct xseg_reply_info *) xseg_get_data(peer->xseg, req);
+    xinfo->size = map->size;
+    return 0;
+}
+
+
+static int do_open(struct peer_req *pr, struct map *map)
+{
+    struct mapperd *mapper = __get_mapperd(pr->peer);
+
+    if (map->flags & MF_MAP_PARTIAL) {
+        mapper->complete_pending = 1;
+    }
+    if (map->state & MF_MAP_EXCLUSIVE) {
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+static int do_update(struct peer_req *pr, struct map *map)
+{
+    if (map->version != MAP_LATEST_VERSION) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+
+static int dropcache(struct peer_req *pr, struct map *map)
+{
+    int r;
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    XSEGLOG2(&lc, I, "Dropping cache for map %s", map->volume);
+    /*
+     * We can lazily drop the cache from here, by just removing from the maps
+     * hashmap making it inaccessible from future requests. This is because:
+     *
+     * a) Dropping cache for a map is serialized on a map level. So there
+     * should not be any other threds modifying the struct map.
+     *
+     * b) Any other thread manipulating the map nodes should not have
+     * any pending requests on the map node, if the map is not opened
+     * exclusively. If that's the case, then we should not close the map,
+     * a.k.a. releasing the map lock without checking for any pending
+     * requests. Furthermore, since each operation on a map gets a map
+     * reference, the memory will not be freed, unless every request has
+     * finished processing the map.
+     */
+
+    /* Set map as destroyed to notify any waiters that hold a reference to
+     * the struct map.
+     */
+    //FIXME err check
+    r = remove_map(mapper, map);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Remove map %s from hashmap failed", map->volume);
+        XSEGLOG2(&lc, E, "Dropping cache for map %s failed", map->volume);
+        return -1;
+    }
+    uncache_map(mapper, map);
+    map->state |= MF_MAP_DESTROYED;
+    XSEGLOG2(&lc, I, "Dropping cache for map %s completed", map->volume);
+    put_map(map);               // put map here to destroy it (matches m->ref = 1 on map create)
+    return 0;
+}
+
+static uint64_t map_mem_size(struct map *map)
+{
+    return sizeof(struct map) + map->nr_objs * sizeof(struct map_node) +
+        (map->chunks ? map->nr_chunks : 0) + map_names_size(map) +
+        map_partials_size(map) +
+        (map->parent_map && !map->parent_map->cache_size ?
+         map_mem_size(map->parent_map) : 0);
+}
+
+/*
+ * Keep @map, which is not opened exclusively, in the map cache and evict the
+ * least recently used maps that no longer fit in its budget.
+ */
+static void cache_map(struct peer_req *pr, struct map *map)
+{
+    struct mapperd *mapper = __get_mapperd(pr->peer);
+    struct map_cache *cache = &mapper->cache;
+    struct map *victim;
+
+    if (map->state & MF_MAP_DESTROYED) {
+        return;
+    }
+    /* v0 maps take their size from the request, so they cannot be
+     * revalidated. Writable maps whose objects cannot be loaded on demand
+     * would have to be loaded in full on every use.
+     */
+    if (!cache->budget || map->version == MAP_V0 ||
+        (map->flags & MF_MAP_DELETED) ||
+        (!(map->flags & MF_MAP_READONLY) && !map->mops->load_map_objects)) {
+        dropcache(pr, map);
+        return;
     }
-    XSEGLOG2(&lc, I, "Starting snapshot for map %s", map->volume);
-    map->state |= MF_MAP_SNAPSHOTTING;
 
-    //create new map struct with name snapshot name and flag readonly.
-    snap_map = create_map(snapname, snapnamelen, MF_ARCHIP);
-    if (!snap_map) {
-        goto out_err;
+    uncache_map(mapper, map);
+    map->cache_size = map_mem_size(map);
+    if (map->cache_size > cache->budget) {
+        XSEGLOG2(&lc, D, "Map %s too large for the map cache", map->volume);
+        dropcache(pr, map);
+        return;
     }
-    //open/load map to check if snap exists
-    r = open_map(pr, snap_map, 0);
-    if (r < 0) {
-        XSEGLOG2(&lc, E, "Could not open snap map");
-        XSEGLOG2(&lc, E, "Snapshot exists");
-        goto out_put;
+    map->lru_prev = NULL;
+    map->lru_next = cache->head;
+    if (cache->head) {
+        cache->head->lru_prev = map;
+    } else {
+        cache->tail = map;
     }
-    r = load_map_metadata(pr, snap_map);
-    if (r >= 0 && !(map->flags & MF_MAP_DELETED)) {
-        XSEGLOG2(&lc, E, "Snapshot exists");
+    cache->head = map;
+    cache->used += map->cache_size;
+
+    while (cache->used > cache->budget) {
+        victim = cache->tail;
+        XSEGLOG2(&lc, I, "Evicting map %s from map cache", victim->volume);
+        cache->stats.evictions++;
+        if (dropcache(pr, victim) < 0) {
+            uncache_map(mapper, victim);
+        }
+    }
+}
+
+/*
+ * Check a cached map against its header on storage before reusing it.
+ *
+ * Objects of writable maps may have been changed by the holder of the map, so
+ * they are dropped, to be loaded again on demand. If the request wants the map
+ * exclusively, it is opened here. Returns 0 if the map can be used, or -1 if
+ * it was dropped from the cache and must be loaded again.
+ */
+static int revalidate_map(struct peer_req *pr, struct map *map,
+                          uint32_t flags)
+{
+    struct mapperd *mapper = __get_mapperd(pr->peer);
+    struct map_cache *cache = &mapper->cache;
+    struct map *hdr;
+    int r, opened = 0;
+
+    /* ours and the cache's */
+    if (map->ref > 2) {
+        /* other requests use the map and have already revalidated it */
+        if (flags & MF_EXCLUSIVE) {
+            goto out_drop;
+        }
+        cache->stats.hits++;
+        return 0;
+    }
+
+    map->state |= MF_MAP_LOADING;
+    if (flags & MF_EXCLUSIVE) {
+        r = open_map(pr, map, flags);
+        if (r < 0 && (flags & MF_FORCE)) {
+            map->state &= ~MF_MAP_LOADING;
+            goto out_drop;
+        }
+        opened = (r >= 0);
+    }
+
+    hdr = create_map(map->volume, map->volumelen, 0);
+    if (!hdr) {
         goto out_close;
     }
-    snap_map->epoch = 0;
-    //snap_map->flags &= ~MF_MAP_DELETED;
-    snap_map->flags = MF_MAP_READONLY;
-    snap_map->objects = map->objects;
-    snap_map->size = map->size;
-    snap_map->blocksize = map->blocksize;
-    snap_map->nr_objs = map->nr_objs;
+    r = load_map_metadata(pr, hdr);
+    if (r < 0 || hdr->version != map->version || hdr->size != map->size ||
+        hdr->blocksize != map->blocksize || hdr->flags != map->flags ||
+        hdr->epoch != map->epoch) {
+        XSEGLOG2(&lc, I, "Cached map %s is stale", map->volume);
+        put_map(hdr);
+        goto out_close;
+    }
+    put_map(hdr);
 
+    if (!(map->flags & MF_MAP_READONLY) && unload_map_objects(map) < 0) {
+        goto out_close;
+    }
+    if (opened) {
+        /* only maps that are not opened exclusively are in the LRU */
+        uncache_map(mapper, map);
+    }
+    map->state &= ~MF_MAP_LOADING;
+    cache->stats.hits++;
+    XSEGLOG2(&lc, D, "Map %s found in map cache", map->volume);
+    return 0;
 
-    nr_objs = map->nr_objs;
+  out_close:
+    if (opened) {
+        close_map(pr, map);
+    }
+    map->state &= ~MF_MAP_LOADING;
+    cache->stats.invalidations++;
+  out_drop:
+    if (!(map->state & MF_MAP_DESTROYED)) {
+        dropcache(pr, map);
+    }
+    return -1;
+}
 
-    //set all map_nodes read only;
-    //TODO, maybe skip that check and add an epoch number on each object.
-    //Then we can check if object is writable iff object epoch == map epoch
-    wait_all_map_objects_ready(map);
-    for (i = 0; i < nr_objs; i++) {
-        mn = get_mapnode(map, i);
-        if (!mn) {
-            XSEGLOG2(&lc, E, "Could not get map node %llu for map %s",
-                     i, map->volume);
-            goto out_err;
+/*
+ * Get the parent map of clone @map, loading its metadata the first time.
+ *
+ * The parent map is shared by the clones of the same snapshot through the map
+ * cache. It is loaded even if it has been deleted, since the clone still falls
+ * through to it, but it is then kept private to the clone. It must not have
+ * been created again since the clone was made.
+ */
+static struct map *get_parent_map(struct peer_req *pr, struct map *map)
+{
+    struct mapperd *mapper = __get_mapperd(pr->peer);
+    struct map *parent;
+    int r, deleted;
+
+  retry:
+    parent = map->parent_map;
+    if (parent) {
+        __get_map(parent);
+        if (parent->state & MF_MAP_LOADING) {
+            wait_on_map(parent, parent->state & MF_MAP_LOADING);
         }
-        // make sure all pending operations on all objects are completed
-        // Basically make sure, that no previously copy up operation,
-        // will mess with our state.
-        // This works, since only a map_w, that was processed before
-        // this request, can have issued an object write request which
-        // may be pending. Since the objects are processed in the same
-        // order by the copyup operation and the snapshot operation, we
-        // can be sure, that no previously ready objects, have changed
-        // their state into not read.
-        // No other operation that manipulated map objects can occur
-        // simutaneously with snapshot operation.
-        if (mn->state & MF_OBJECT_NOT_READY) {
-            XSEGLOG2(&lc, E, "BUG: object not ready");
-            //              wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
+        if (map->parent_map != parent) {
+            /* loading failed */
+            put_map(parent);
+            return NULL;
         }
+        return parent;
+    }
 
-        mn->flags &= ~MF_OBJECT_WRITABLE;
-        put_mapnode(mn);
+    parent = find_map_len(mapper, map->parent, map->parentlen, 0);
+    if (parent) {
+        __get_map(parent);
+        if (parent->state & MF_MAP_NOT_READY) {
+            wait_on_map(parent, parent->state & MF_MAP_NOT_READY);
+            put_map(parent);
+            goto retry;
+        }
+        if (map->parent_map) {
+            /* another request of the clone got the parent meanwhile */
+            put_map(parent);
+            goto retry;
+        }
+        if (!(parent->state & MF_MAP_DESTROYED) &&
+            (parent->flags & MF_MAP_READONLY) &&
+            !(parent->flags & MF_MAP_DELETED) &&
+            parent->epoch == map->parent_epoch &&
+            parent->mops->load_map_objects) {
+            map->parent_map = parent;
+            __get_map(parent);
+            return parent;
+        }
+        put_map(parent);
     }
-    //increase epoch
-    map->epoch++;
-    //write map
-    r = write_map(pr, map);
-    if (r < 0) {
-        XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
-        /* Not restoring epoch or writable status here, is not
-         * devastating, since this is not the common case, and it can
-         * only cause unneeded copy-on-write operations.
-         */
-        goto out_err;
+
+    parent = create_map(map->parent, map->parentlen, 0);
+    if (!parent) {
+        return NULL;
     }
-    //write snapshot map
-    r = write_map(pr, snap_map);
+    map->parent_map = parent;
+    __get_map(parent);
+    parent->state |= MF_MAP_LOADING;
+
+    r = load_map_metadata(pr, parent);
+    if (r >= 0 && parent->epoch != map->parent_epoch) {
+        XSEGLOG2(&lc, E, "Parent map %s of %s has been recreated",
+                 parent->volume, map->volume);
+        r = -1;
+    }
+    if (r >= 0 && !parent->mops->load_map_objects) {
+        XSEGLOG2(&lc, E, "Parent map %s of %s cannot be loaded on demand",
+                 parent->volume, map->volume);
+        r = -1;
+    }
+    deleted = parent->flags & MF_MAP_DELETED;
+    if (r >= 0) {
+        parent->flags &= ~MF_MAP_DELETED;
+        r = parent->mops->load_map_data(pr, parent);
+    }
+
+    parent->state &= ~MF_MAP_LOADING;
+    signal_map(parent);
     if (r < 0) {
-        XSEGLOG2(&lc, E, "Write of snapshot map failed");
-        goto out_unset;
+        XSEGLOG2(&lc, E, "Cannot load parent map %s of %s",
+                 parent->volume, map->volume);
+        map->parent_map = NULL;
+        put_map(parent);
+        put_map(parent);
+        return NULL;
     }
 
-    close_map(pr, snap_map);
-    snap_map->objects = NULL;
-    put_map(snap_map);
+    if (!deleted && (parent->flags & MF_MAP_READONLY) &&
+        !find_map(mapper, parent->key) && insert_cache(mapper, parent) >= 0) {
+        /* the reference of the map cache */
+        __get_map(parent);
+        cache_map(pr, parent);
+    }
+    return parent;
+}
 
-    map->state &= ~MF_MAP_SNAPSHOTTING;
+/*
+ * Resolve the inherited objects of clone @map in [start, start + nr), which
+ * have just been loaded, to the objects of its parent map. Objects beyond the
+ * size of the parent are zero.
+ */
+int load_parent_objects(struct peer_req *pr, struct map *map, uint64_t start,
+                        uint64_t nr)
+{
+    struct map *parent;
+    struct map_node *mn, *pmn;
+    char name[MAX_OBJECT_LEN + 1];
+    uint32_t namelen, flags;
+    uint64_t i, pnr;
+    int r = 0;
 
-    if (map->opened_count == cur_count) {
-        close_map(pr, map);
+    parent = get_parent_map(pr, map);
+    if (!parent) {
+        return -1;
+    }
+    pnr = 0;
+    if (start < parent->nr_objs) {
+        pnr = parent->nr_objs - start;
+        if (pnr > nr) {
+            pnr = nr;
+        }
+    }
+    if (load_map_objects(pr, parent, start, pnr) < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of parent map %s",
+                 parent->volume);
+        put_map(parent);
+        return -1;
+    }
+
+    for (i = start; i < start + nr && r >= 0; i++) {
+        mn = &map->objects[i];
+        if (!(mn->flags & MF_OBJECT_INHERITED)) {
+            continue;
+        }
+        pmn = get_mapnode(parent, i);
+        if (pmn) {
+            namelen = mapnode_get_name(pmn, name);
+            flags = pmn->flags & (MF_OBJECT_ARCHIP | MF_OBJECT_ZERO);
+            put_mapnode(pmn);
+        } else {
+            memcpy(name, zero_block, ZERO_BLOCK_LEN);
+            namelen = ZERO_BLOCK_LEN;
+            flags = MF_OBJECT_ZERO;
+        }
+        r = mapnode_set_name(mn, name, namelen);
+        mn->flags = MF_OBJECT_INHERITED | flags;
+    }
+    put_map(parent);
+
+    return r;
+}
+
+static int do_close(struct peer_req *pr, struct map *map)
+{
+    if (!(map->state & MF_MAP_EXCLUSIVE)) {
+        XSEGLOG2(&lc, E, "Attempted to close a not opened map");
+        return -1;
+    }
+    /* Do not close the map while there are pending requests on the
+     * map nodes.
+     */
+    wait_all_map_objects_ready(map);
+    if (close_map(pr, map) < 0) {
+        return -1;
     }
 
-    XSEGLOG2(&lc, I, "Snapshot for map %s completed", map->volume);
     return 0;
+}
 
-  out_unset:
-    snap_map->objects = NULL;
-  out_close:
-    close_map(pr, snap_map);
-  out_put:
-    put_map(snap_map);
-  out_err:
-    map->state &= ~MF_MAP_SNAPSHOTTING;
-    XSEGLOG2(&lc, E, "Snapshot for map %s failed", map->volume);
+static int do_hash(struct peer_req *pr, struct map *map)
+{
     return -1;
 }
 
-/* This should probably me a map function */
-static int do_destroy(struct peer_req *pr, struct map *map)
+static int do_snapshot(struct peer_req *pr, struct map *map)
 {
-    uint64_t i, nr_objs;
+    uint64_t i;
     struct peerd *peer = pr->peer;
-    struct mapper_io *mio = __get_mapper_io(pr);
+    //struct mapper_io *mio = __get_mapper_io(pr);
     struct map_node *mn;
-    struct xseg_request *req;
+    uint64_t nr_objs;
+    struct map *snap_map;
+    struct xseg_request_snapshot *xsnapshot;
+    char *snapname;
+    uint32_t snapnamelen;
     int r;
 
-    if (!(map->state & MF_MAP_EXCLUSIVE)) {
+    xsnapshot =
+        (struct xseg_request_snapshot *) xseg_get_data(peer->xseg, pr->req);
+    if (!xsnapshot) {
         return -1;
     }
+    snapname = xsnapshot->target;
+    snapnamelen = xsnapshot->targetlen;
 
-    if (map->flags & MF_MAP_DELETED) {
-        XSEGLOG2(&lc, E, "Map %s already deleted", map->volume);
-        do_close(pr, map);
+    if (!snapnamelen) {
+        XSEGLOG2(&lc, E, "Snapshot name must be provided");
         return -1;
     }
 
-    XSEGLOG2(&lc, I, "Destroying map %s", map->volume);
-    map->state |= MF_MAP_DESTROYING;
+    if (!(map->state & MF_MAP_EXCLUSIVE)) {
+        XSEGLOG2(&lc, E, "Map was not opened exclusively");
+        return -1;
+    }
+    if (map->epoch == UINT64_MAX) {
+        XSEGLOG2(&lc, E, "Max epoch reached for %s", map->volume);
+        return -1;
+    }
+    XSEGLOG2(&lc, I, "Starting snapshot for map %s", map->volume);
+    map->state |= MF_MAP_SNAPSHOTTING;
 
-    wait_all_map_objects_ready(map);
+    //create new map struct with name snapshot name and flag readonly.
+    snap_map = create_map(snapname, snapnamelen, MF_ARCHIP);
+    if (!snap_map) {
+        goto out_err;
+    }
+    //open/load map to check if snap exists
+    r = open_map(pr, snap_map, 0);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Could not open snap map");
+        XSEGLOG2(&lc, E, "Snapshot exists");
+        goto out_put;
+    }
+    r = load_map_metadata(pr, snap_map);
+    if (r >= 0 && map_name_taken(pr, snap_map)) {
+        XSEGLOG2(&lc, E, "Snapshot exists");
+        goto out_close;
+    }
+    /* a snapshot recreated with the name of a deleted one must not be
+     * mistaken for it by the clones of the deleted one
+     */
+    snap_map->epoch = (r >= 0) ? snap_map->epoch + 1 : 0;
+    /* partial objects are shared with the snapshot as they are */
+    snap_map->flags = MF_MAP_READONLY | (map->flags & MF_MAP_PARTIAL);
+    /* inherited objects are shared with the snapshot as well */
+    snap_map->version = map->version;
+    snap_map->mops = map->mops;
+    set_map_parent(snap_map, map->parent, map->parentlen, map->parent_epoch);
+    snap_map->size = map->size;
+    snap_map->blocksize = map->blocksize;
+    snap_map->nr_objs = map->nr_objs;
 
-    mio->cb = object_delete_cb;
-    nr_objs = map->nr_objs;
-    mio->pending_reqs = 0;
-    for (i = 0; i < nr_objs; i++) {
-        //throttle generated requests
-        if (mio->pending_reqs >= peer->nr_ops) {
-            wait_on_pr(pr, mio->pending_reqs >= peer->nr_ops);
+    if (map->version >= MAP_V3 && map->mops->copy_map_data &&
+        !(map->flags & MF_MAP_FOREIGN_WRITABLE)) {
+        /*
+         * Objects are writable only in the epoch they were created in, so
+         * increasing the epoch makes all of them read-only, without touching
+         * them. The snapshot map gets a copy of the map blocks as they are.
+         */
+        wait_all_map_objects_ready(map);
+        map->epoch++;
+        r = write_map_metadata(pr, map);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
+            map->epoch--;
+            goto out_close;
+        }
+        r = map->mops->copy_map_data(pr, map, snap_map);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot copy map %s to %s", map->volume,
+                     snap_map->volume);
+            goto out_close;
+        }
+        r = write_map_metadata(pr, snap_map);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Write of snapshot map failed");
+            goto out_close;
         }
+        goto out_done;
+    }
+
+    /* the snapshot shares all the objects of the map */
+    r = load_map_objects(pr, map, 0, map->nr_objs);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
+        goto out_close;
+    }
+    snap_map->objects = map->objects;
+
+
+    nr_objs = map->nr_objs;
 
+    //set all map_nodes read only;
+    //TODO, maybe skip that check and add an epoch number on each object.
+    //Then we can check if object is writable iff object epoch == map epoch
+    wait_all_map_objects_ready(map);
+    /* only chunks with writable objects change */
+    track_dirty_chunks(map);
+    for (i = 0; i < nr_objs; i++) {
         mn = get_mapnode(map, i);
         if (!mn) {
             XSEGLOG2(&lc, E, "Could not get map node %llu for map %s",
                      i, map->volume);
-            mio->err = 1;
-            break;
+            goto out_err;
         }
-
+        // make sure all pending operations on all objects are completed
+        // Basically make sure, that no previously copy up operation,
+        // will mess with our state.
+        // This works, since only a map_w, that was processed before
+        // this request, can have issued an object write request which
+        // may be pending. Since the objects are processed in the same
+        // order by the copyup operation and the snapshot operation, we
+        // can be sure, that no previously ready objects, have changed
+        // their state into not read.
+        // No other operation that manipulated map objects can occur
+        // simutaneously with snapshot operation.
         if (mn->state & MF_OBJECT_NOT_READY) {
             XSEGLOG2(&lc, E, "BUG: object not ready");
-            wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
-        }
-
-        if (mn->flags & MF_OBJECT_ZERO
-            || mn->flags & MF_OBJECT_DELETED
-            || !(mn->flags & MF_OBJECT_ARCHIP
-                 && mn->flags & MF_OBJECT_WRITABLE)) {
-            //only remove writable archipelago objects.
-            //skip already deleted
-            XSEGLOG2(&lc, D, "Skipping object %s", mn->object);
-            put_mapnode(mn);
-            continue;
+            //              wait_on_mapnode(mn, mn->state & MF_OBJECT_NOT_READY);
         }
-        XSEGLOG2(&lc, D, "%s flags:\n  Writable: %s\n  Zero: %s\n"
-                 "  Deleted: %s\n  Archip: %s", mn->object,
-                 (mn->flags & MF_OBJECT_WRITABLE ? "yes" : "no"),
-                 (mn->flags & MF_OBJECT_ZERO ? "yes" : "no"),
-                 (mn->flags & MF_OBJECT_DELETED ? "yes" : "no"),
-                 (mn->flags & MF_OBJECT_ARCHIP ? "yes" : "no"));
 
-        req = __object_delete(pr, mn);
-        if (!req) {
-            put_mapnode(mn);
-            XSEGLOG2(&lc, E, "Error removing object %s", mn->object);
-            mio->err = 1;
+        if (mn->flags & MF_OBJECT_WRITABLE) {
+            mn->flags &= ~MF_OBJECT_WRITABLE;
+            mark_objects_dirty(map, i, 1);
         }
-        //mapnode will be put by delete_object on completion
+        put_mapnode(mn);
     }
-
-    if (mio->pending_reqs > 0) {
-        wait_on_pr(pr, mio->pending_reqs > 0);
+    /* no object is writable any more */
+    map->flags &= ~MF_MAP_FOREIGN_WRITABLE;
+    //increase epoch
+    map->epoch++;
+    //write map
+    r = write_map(pr, map);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot write map %s", map->volume);
+        /* Not restoring epoch or writable status here, is not
+         * devastating, since this is not the common case, and it can
+         * only cause unneeded copy-on-write operations.
+         */
+        goto out_err;
     }
-
-    if (mio->err) {
-        XSEGLOG2(&lc, E, "Error while removing objects of %s", map->volume);
-        map->state &= ~MF_MAP_DESTROYING;
-        return -1;
+    //write snapshot map
+    r = write_map(pr, snap_map);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Write of snapshot map failed");
+        goto out_unset;
     }
 
-    r = delete_map(pr, map, 0);
-    if (r < 0) {
-        map->state &= ~MF_MAP_DESTROYING;
-        XSEGLOG2(&lc, E, "Failed to destroy map %s", map->volume);
-        return -1;
+  out_done:
+    close_map(pr, snap_map);
+    snap_map->objects = NULL;
+    put_map(snap_map);
+
+    map->state &= ~MF_MAP_SNAPSHOTTING;
+
+    if (map->opened_count == cur_count) {
+        close_map(pr, map);
     }
-    map->state &= ~MF_MAP_DESTROYING;
-    XSEGLOG2(&lc, I, "Destroyed map %s", map->volume);
-    /* do close will drop the map from cache  */
 
-    do_close(pr, map);
-    /* if do_close fails, an error message will be logged, but the deletion
-     * was successfull, and there isn't much to do about the error.
-     */
+    XSEGLOG2(&lc, I, "Snapshot for map %s completed", map->volume);
     return 0;
+
+  out_unset:
+    snap_map->objects = NULL;
+  out_close:
+    close_map(pr, snap_map);
+  out_put:
+    put_map(snap_map);
+  out_err:
+    map->state &= ~MF_MAP_SNAPSHOTTING;
+    XSEGLOG2(&lc, E, "Snapshot for map %s failed", map->volume);
+    return -1;
 }
 
 //Returns a new opened map
@@ -885,7 +2046,7 @@ static int rename_map(struct peer_req *pr, struct map *map,
     uint64_t nr_objs;
     struct map *new_map;
     struct xseg_request_rename *xrename;
-    int r;
+    int r, existed;
 
     if (!newnamelen) {
         XSEGLOG2(&lc, E, "A new name must be provided");
@@ -912,22 +2073,39 @@ static int rename_map(struct peer_req *pr, struct map *map,
         goto out_put;
     }
     r = load_map_metadata(pr, new_map);
-    if (r >= 0 && !(map->flags & MF_MAP_DELETED)) {
+    if (r >= 0 && map_name_taken(pr, new_map)) {
         XSEGLOG2(&lc, E, "Rename destination exists");
         goto out_close;
     }
+    existed = (r >= 0);
     if (new_map->epoch == UINT64_MAX) {
         XSEGLOG2(&lc, E, "Max epoch reached for %s", new_map->volume);
         goto out_close;
     }
+    /* the new map takes over all the objects of the map */
+    r = load_map_objects(pr, map, 0, map->nr_objs);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
+        goto out_close;
+    }
 
-    /* Populate new map fields */
-    new_map->epoch++;
+    /*
+     * Populate new map fields. Keep the epoch of the map, so that its objects
+     * stay writable, unless the new name was used in that epoch or later.
+     */
+    if (existed && new_map->epoch + 1 > map->epoch) {
+        new_map->epoch++;
+    } else {
+        new_map->epoch = map->epoch;
+    }
     new_map->objects = map->objects;
     new_map->size = map->size;
     new_map->blocksize = map->blocksize;
     new_map->nr_objs = map->nr_objs;
     new_map->flags = map->flags;
+    new_map->version = map->version;
+    new_map->mops = map->mops;
+    set_map_parent(new_map, map->parent, map->parentlen, map->parent_epoch);
 
     nr_objs = map->nr_objs;
 
@@ -996,6 +2174,69 @@ static int rename_map(struct peer_req *pr, struct map *map,
     return -1;
 }
 
+/* This should probably me a map function */
+static int do_destroy(struct peer_req *pr, struct map *map)
+{
+    struct peerd *peer = pr->peer;
+    struct mapperd *mapper = __get_mapperd(peer);
+    char name[MAX_VOLUME_LEN + 1];
+    int len, reclaim, r;
+
+    if (!(map->state & MF_MAP_EXCLUSIVE)) {
+        return -1;
+    }
+
+    if (map->flags & MF_MAP_DELETED) {
+        XSEGLOG2(&lc, E, "Map %s already deleted", map->volume);
+        do_close(pr, map);
+        return -1;
+    }
+
+    XSEGLOG2(&lc, I, "Destroying map %s", map->volume);
+    wait_all_map_objects_ready(map);
+
+    /*
+     * Read-only maps have no objects to reclaim, and the clones of a
+     * snapshot still need its map blocks, under its own name.
+     */
+    reclaim = !(map->flags & MF_MAP_READONLY);
+    if (reclaim) {
+        /* free the name of the map, by moving the map to its reclaim name */
+        len = snprintf(name, sizeof(name), "%s%c%016llx", map->volume,
+                       MAPPER_RECLAIM_SEP, (unsigned long long) map->epoch);
+        if (len >= (int) sizeof(name) ||
+            rename_map(pr, map, name, len, 0) < 0) {
+            XSEGLOG2(&lc, W, "Map %s keeps its name until it is reclaimed",
+                     map->volume);
+        }
+        /* the objects of the map are reclaimed in the background */
+        map->flags |= MF_MAP_RECLAIM;
+    }
+
+    map->state |= MF_MAP_DESTROYING;
+    r = delete_map(pr, map, 0);
+    if (r < 0) {
+        map->flags &= ~MF_MAP_RECLAIM;
+        map->state &= ~MF_MAP_DESTROYING;
+        XSEGLOG2(&lc, E, "Failed to destroy map %s", map->volume);
+        return -1;
+    }
+    map->state &= ~MF_MAP_DESTROYING;
+    if (reclaim && queue_reclaim(mapper, map->volume, map->volumelen) < 0) {
+        /* not fatal, it is queued again when loaded */
+        XSEGLOG2(&lc, W, "Could not queue map %s for reclaiming",
+                 map->volume);
+    }
+    XSEGLOG2(&lc, I, "Destroyed map %s", map->volume);
+    /* do close will drop the map from cache  */
+
+    do_close(pr, map);
+    /* if do_close fails, an error message will be logged, but the deletion
+     * was successfull, and there isn't much to do about the error.
+     */
+    return 0;
+}
+
 static int do_rename(struct peer_req *pr, struct map *map)
 {
     struct peerd *peer = pr->peer;
@@ -1116,6 +2357,8 @@ static int do_clone(struct peer_req *pr, struct map *map)
     char *target = xseg_get_target(peer->xseg, pr->req);
     struct map *clonemap;
     struct map_node *map_nodes, *mn;
+    char name[MAX_OBJECT_LEN + 1];
+    uint32_t namelen;
     struct xseg_request_clone *xclone =
         (struct xseg_request_clone *) xseg_get_data(peer->xseg, pr->req);
 
@@ -1123,6 +2366,12 @@ static int do_clone(struct peer_req *pr, struct map *map)
         XSEGLOG2(&lc, E, "Cloning is supported only from a snapshot");
         return -1;
     }
+    /* a clone falls through to whole objects only */
+    if (map->flags & MF_MAP_PARTIAL && complete_map(pr, map) < 0) {
+        XSEGLOG2(&lc, E, "Cannot complete the partial objects of map %s",
+                 map->volume);
+        return -1;
+    }
 
     XSEGLOG2(&lc, I, "Cloning map %s", map->volume);
     clonemap = create_map(target, pr->req->targetlen, MF_ARCHIP);
@@ -1139,7 +2388,7 @@ static int do_clone(struct peer_req *pr, struct map *map)
         goto out_put;
     }
     r = load_map_metadata(pr, clonemap);
-    if (r >= 0 && !(clonemap->flags & MF_MAP_DELETED)) {
+    if (r >= 0 && map_name_taken(pr, clonemap)) {
         XSEGLOG2(&lc, E, "Target volume %s exists", clonemap->volume);
         goto out_close;
     }
@@ -1165,6 +2414,38 @@ static int do_clone(struct peer_req *pr, struct map *map)
         goto out_close;
     }
 
+    if (map->mops->load_map_objects &&
+        map->blocksize == MAPPER_DEFAULT_BLOCKSIZE) {
+        /*
+         * The clone falls through to the map for every object, until it
+         * copies it up, so only empty map blocks are created.
+         */
+        clonemap->version = MAP_LATEST_VERSION;
+        clonemap->mops = MAP_LATEST_MOPS;
+        clonemap->blocksize = map->blocksize;
+        clonemap->nr_objs = calc_map_obj(clonemap);
+        set_map_parent(clonemap, map->volume, map->volumelen, map->epoch);
+        r = clonemap->mops->init_map_data(pr, clonemap);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot create map blocks of %s",
+                     clonemap->volume);
+            goto out_close;
+        }
+        r = write_map_metadata(pr, clonemap);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Cannot write map %s", clonemap->volume);
+            goto out_close;
+        }
+        goto out_done;
+    }
+    set_map_parent(clonemap, NULL, 0, 0);
+
+    r = load_map_objects(pr, map, 0, map->nr_objs);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
+        goto out_close;
+    }
+
     clonemap->blocksize = MAPPER_DEFAULT_BLOCKSIZE;
     //alloc and init map_nodes
     c = calc_map_obj(clonemap);
@@ -1175,10 +2456,13 @@ static int do_clone(struct peer_req *pr, struct map *map)
     clonemap->objects = map_nodes;
     clonemap->nr_objs = c;
     for (i = 0; i < c; i++) {
+        map_nodes[i].state = 0;
+        map_nodes[i].map = clonemap;
+        map_nodes[i].ref = 1;
         mn = get_mapnode(map, i);
         if (mn) {
-            strncpy(map_nodes[i].object, mn->object, mn->objectlen);
-            map_nodes[i].objectlen = mn->objectlen;
+            namelen = mapnode_get_name(mn, name);
+            r = mapnode_set_name(&map_nodes[i], name, namelen);
             map_nodes[i].flags = 0;
             if (mn->flags & MF_OBJECT_ARCHIP) {
                 map_nodes[i].flags |= MF_OBJECT_ARCHIP;
@@ -1187,18 +2471,13 @@ static int do_clone(struct peer_req *pr, struct map *map)
                 map_nodes[i].flags |= MF_OBJECT_ZERO;
             }
             put_mapnode(mn);
+            if (r < 0) {
+                goto out_close;
+            }
         } else {
-            strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-            map_nodes[i].objectlen = ZERO_BLOCK_LEN;
+            mapnode_set_name(&map_nodes[i], zero_block, ZERO_BLOCK_LEN);
             map_nodes[i].flags = MF_OBJECT_ZERO;
         }
-        map_nodes[i].object[map_nodes[i].objectlen] = '\0';     //NULL terminate
-        map_nodes[i].state = 0;
-        map_nodes[i].objectidx = i;
-        map_nodes[i].map = clonemap;
-        map_nodes[i].ref = 1;
-        map_nodes[i].waiters = 0;
-        map_nodes[i].cond = st_cond_new();      //FIXME errcheck;
     }
 
     r = write_map(pr, clonemap);
@@ -1207,6 +2486,7 @@ static int do_clone(struct peer_req *pr, struct map *map)
         goto out_close;
     }
 
+  out_done:
     XSEGLOG2(&lc, I, "Cloning map %s to %s completed",
              map->volume, clonemap->volume);
     close_map(pr, clonemap);
@@ -1237,6 +2517,12 @@ static int truncate_map(struct peer_req *pr, struct map *map, uint64_t offset)
 
     wait_all_map_objects_ready(map);
 
+    r = load_map_objects(pr, map, 0, map->nr_objs);
+    if (r < 0) {
+        XSEGLOG2(&lc, E, "Cannot load objects of map %s", map->volume);
+        goto out_unset;
+    }
+
     old_nr_objs = map->nr_objs;
     nr_objs = __calc_map_obj(offset, map->blocksize);
 
@@ -1251,49 +2537,44 @@ static int truncate_map(struct peer_req *pr, struct map *map, uint64_t offset)
         }
         uint64_t i;
         for (i = 0; i < old_nr_objs; i++) {
+            map_nodes[i].state = 0;
+            map_nodes[i].map = map;
+            map_nodes[i].ref = 1;
             mn = get_mapnode(map, i);
             if (mn) {
-                strncpy(map_nodes[i].object, mn->object, mn->objectlen);
-                map_nodes[i].objectlen = mn->objectlen;
-                map_nodes[i].flags = 0;
-                if (mn->flags & MF_OBJECT_ARCHIP) {
-                    map_nodes[i].flags |= MF_OBJECT_ARCHIP;
-                }
-                if (mn->flags & MF_OBJECT_ZERO) {
-                    map_nodes[i].flags |= MF_OBJECT_ZERO;
-                }
+                /* same map and index, so the name handle stays valid */
+                map_nodes[i].name = mn->name;
+                map_nodes[i].flags = mn->flags;
                 put_mapnode(mn);
             } else {
-                strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-                map_nodes[i].objectlen = ZERO_BLOCK_LEN;
+                mapnode_set_name(&map_nodes[i], zero_block, ZERO_BLOCK_LEN);
                 map_nodes[i].flags = MF_OBJECT_ZERO;
             }
-            map_nodes[i].object[map_nodes[i].objectlen] = 0;
-            map_nodes[i].state = 0;
-            map_nodes[i].objectidx = i;
-            map_nodes[i].map = map;
-            map_nodes[i].ref = 1;
-            map_nodes[i].waiters = 0;
-            map_nodes[i].cond = st_cond_new();
         }
 
         for (i = old_nr_objs; i < nr_objs; i++) {
-            strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-            map_nodes[i].objectlen = ZERO_BLOCK_LEN;
-            map_nodes[i].flags = MF_OBJECT_ZERO;
-            map_nodes[i].object[map_nodes[i].objectlen] = 0;
             map_nodes[i].state = 0;
-            map_nodes[i].objectidx = i;
             map_nodes[i].map = map;
             map_nodes[i].ref = 1;
-            map_nodes[i].waiters = 0;
-            map_nodes[i].cond = st_cond_new();
+            mapnode_set_name(&map_nodes[i], zero_block, ZERO_BLOCK_LEN);
+            map_nodes[i].flags = MF_OBJECT_ZERO;
         }
         free(map->objects);
         map->objects = map_nodes;
     }
     map->size = offset;
     map->nr_objs = nr_objs;
+    drop_map_partials(map, nr_objs);
+    if (map->chunk_objs) {
+        map->nr_chunks = (nr_objs + map->chunk_objs - 1) / map->chunk_objs;
+        map->nr_loaded_chunks = map->nr_chunks;
+    }
+
+    /* only the new tail of the map must be written */
+    track_dirty_chunks(map);
+    if (nr_objs > old_nr_objs) {
+        mark_objects_dirty(map, old_nr_objs, nr_objs - old_nr_objs);
+    }
 
     r = write_map(pr, map);
     if (r < 0) {
@@ -1365,6 +2646,7 @@ struct map *get_map(struct peer_req *pr, char *name, uint32_t namelen,
             if (!map) {
                 return NULL;
             }
+            mapper->cache.stats.misses++;
             r = insert_cache(mapper, map);
             if (r < 0) {
                 XSEGLOG2(&lc, E, "Cannot insert map %s", map->volume);
@@ -1412,6 +2694,9 @@ struct map *get_map(struct peer_req *pr, char *name, uint32_t namelen,
             if (map->flags & MF_MAP_DELETED) {
                 XSEGLOG2(&lc, E, "Loaded deleted map %s. Failing...",
                          map->volume);
+                if (map->flags & MF_MAP_RECLAIM) {
+                    queue_reclaim(mapper, map->volume, map->volumelen);
+                }
                 do_close(pr, map);
                 dropcache(pr, map);
                 signal_map(map);
@@ -1434,11 +2719,24 @@ static struct map *get_ready_map(struct peer_req *pr, char *name,
                                  uint32_t namelen, uint32_t flags)
 {
     struct map *map;
+    int r;
     do {
         map = get_map(pr, name, namelen, flags);
-        if (!map || !(map->state & MF_MAP_NOT_READY)) {
+        if (!map) {
             return map;
         }
+        if (!(map->state & MF_MAP_NOT_READY)) {
+            if (!map->cache_size) {
+                return map;
+            }
+            r = revalidate_map(pr, map, flags);
+            signal_map(map);
+            if (r >= 0) {
+                return map;
+            }
+            put_map(map);
+            continue;
+        }
         wait_on_map(map, (map->state & MF_MAP_NOT_READY));
         put_map(map);
     } while (1);
@@ -1455,9 +2753,9 @@ static int map_action(int (action) (struct peer_req * pr, struct map * map),
         return -1;
     }
     int r = action(pr, map);
-    //always drop cache if map not read exclusively
+    //keep maps not opened exclusively in the map cache
     if (!(map->state & MF_MAP_EXCLUSIVE)) {
-        dropcache(pr, map);
+        cache_map(pr, map);
     }
     signal_map(map);
     put_map(map);
@@ -1521,7 +2819,7 @@ void *handle_clone(struct peer_req *pr)
             goto out;
         }
         r = load_map_metadata(pr, map);
-        if (r >= 0 && !(map->flags & MF_MAP_DELETED)) {
+        if (r >= 0 && map_name_taken(pr, map)) {
             XSEGLOG2(&lc, E, "Map exists %s", map->volume);
             close_map(pr, map);
             put_map(map);
@@ -1537,6 +2835,7 @@ void *handle_clone(struct peer_req *pr)
         }
         map->epoch++;
         map->flags = 0;
+        set_map_parent(map, NULL, 0, 0);
         map->size = xclone->size;
         map->blocksize = MAPPER_DEFAULT_BLOCKSIZE;
         map->nr_objs = 0;
@@ -1557,16 +2856,11 @@ void *handle_clone(struct peer_req *pr)
 
         uint64_t i;
         for (i = 0; i < nr_objs; i++) {
-            strncpy(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN);
-            map_nodes[i].objectlen = ZERO_BLOCK_LEN;
-            map_nodes[i].object[map_nodes[i].objectlen] = 0;    //NULL terminate
+            map_nodes[i].map = map;
+            mapnode_set_name(&map_nodes[i], zero_block, ZERO_BLOCK_LEN);
             map_nodes[i].flags = MF_OBJECT_ZERO;        //MF_OBJECT_ARCHIP;
             map_nodes[i].state = 0;
-            map_nodes[i].objectidx = i;
-            map_nodes[i].map = map;
             map_nodes[i].ref = 1;
-            map_nodes[i].waiters = 0;
-            map_nodes[i].cond = st_cond_new();  //FIXME errcheck;
         }
         r = write_map(pr, map);
         if (r < 0) {
@@ -1622,7 +2916,7 @@ void *handle_create(struct peer_req *pr)
         goto out;
     }
     r = load_map_metadata(pr, map);
-    if (r >= 0 && !(map->flags & MF_MAP_DELETED)) {
+    if (r >= 0 && map_name_taken(pr, map)) {
         XSEGLOG2(&lc, E, "Map exists %s", map->volume);
         close_map(pr, map);
         put_map(map);
@@ -1645,6 +2939,7 @@ void *handle_create(struct peer_req *pr)
 
     map->epoch++;
     map->flags = 0;
+    set_map_parent(map, NULL, 0, 0);
     if (mapdata->create_flags & XF_MAPFLAG_READONLY) {
         map->flags |= MF_MAP_READONLY;
     } else {
@@ -1687,18 +2982,26 @@ void *handle_create(struct peer_req *pr)
 
     uint64_t i;
     for (i = 0; i < nr_objs; i++) {
-        map_nodes[i].objectlen = mapdata->segs[i].targetlen;
-        strncpy(map_nodes[i].object, mapdata->segs[i].target,
-                mapdata->segs[i].targetlen);
-        map_nodes[i].object[mapdata->segs[i].targetlen] = 0;
-        XSEGLOG2(&lc, D, "%d: %s (%u)", i, map_nodes[i].object,
-                 mapdata->segs[i].targetlen);
+        map_nodes[i].map = map;
+        map_nodes[i].ref = 1;
         map_nodes[i].state = 0;
+        XSEGLOG2(&lc, D, "%llu: %.*s (%u)", (unsigned long long) i,
+                 mapdata->segs[i].targetlen, mapdata->segs[i].target,
+                 mapdata->segs[i].targetlen);
+        r = mapnode_set_name(&map_nodes[i], mapdata->segs[i].target,
+                             mapdata->segs[i].targetlen);
+        if (r < 0) {
+            close_map(pr, map);
+            put_map(map);
+            goto out;
+        }
         map_nodes[i].flags = 0;
         if (!(mapdata->segs[i].flags & XF_MAPFLAG_READONLY)) {
             map_nodes[i].flags |= MF_OBJECT_WRITABLE;
+            map->flags |= MF_MAP_FOREIGN_WRITABLE;
         }
-        if (!strncmp(map_nodes[i].object, zero_block, ZERO_BLOCK_LEN)) {
+        if (mapdata->segs[i].targetlen == ZERO_BLOCK_LEN &&
+            !strncmp(mapdata->segs[i].target, zero_block, ZERO_BLOCK_LEN)) {
             map_nodes[i].flags |= MF_OBJECT_ZERO;
             //assert READONLY
             if (map_nodes[i].flags & MF_OBJECT_WRITABLE) {
@@ -1706,11 +3009,6 @@ void *handle_create(struct peer_req *pr)
                 map_nodes[i].flags &= ~MF_OBJECT_WRITABLE;
             }
         }
-        map_nodes[i].objectidx = i;
-        map_nodes[i].map = map;
-        map_nodes[i].ref = 1;
-        map_nodes[i].waiters = 0;
-        map_nodes[i].cond = st_cond_new();      //FIXME errcheck;
     }
 
 
@@ -1900,12 +3198,151 @@ void *handle_update(struct peer_req *pr)
 }
 
 
+/*
+ * Sharding
+ *
+ * State Threads run all the threads of a process on a single OS thread, so a
+ * map load or a copy-up storm on a busy volume delays all the other volumes.
+ * With --shards, mapperd forks a process per extra shard, each with its own
+ * scheduler and map cache, and spreads volumes over them by the hash of their
+ * name. The first shard binds the mapper port and forwards every request for
+ * a volume of another shard to the port of that shard, which responds to the
+ * sender directly. Every map is served by a single process, so map state
+ * needs no locking. Between shards, maps behave as between mapperds of
+ * different hosts.
+ */
+
+static uint32_t volume_shard(struct mapperd *mapper, char *name,
+                             uint32_t namelen)
+{
+    return fnv_hash(name, namelen) % mapper->nr_shards;
+}
+
+static int forward_to_shard(struct peerd *peer, struct peer_req *pr,
+                            uint32_t shard)
+{
+    struct mapperd *mapper = __get_mapperd(peer);
+    xport p;
+
+    p = xseg_forward(peer->xseg, pr->req, mapper->shard_port + shard - 1,
+                     pr->portno, X_ALLOC);
+    if (p == NoPort) {
+        XSEGLOG2(&lc, E, "Cannot forward request %p to shard %u",
+                 pr->req, shard);
+        return -1;
+    }
+    if (xseg_signal(peer->xseg, p) < 0) {
+        XSEGLOG2(&lc, W, "Cannot signal port %u", p);
+    }
+    free_peer_req(peer, pr);
+
+    return 0;
+}
+
+static void stop_shards(struct peerd *peer)
+{
+    struct mapperd *mapper = __get_mapperd(peer);
+    uint32_t i;
+
+    if (!mapper->shard_pids) {
+        return;
+    }
+    for (i = 1; i < mapper->nr_shards; i++) {
+        if (mapper->shard_pids[i] > 0) {
+            kill(mapper->shard_pids[i], SIGTERM);
+        }
+    }
+    for (i = 1; i < mapper->nr_shards; i++) {
+        if (mapper->shard_pids[i] > 0 &&
+            waitpid(mapper->shard_pids[i], NULL, 0) < 0) {
+            XSEGLOG2(&lc, W, "Cannot wait for shard %u", i);
+        }
+    }
+    free(mapper->shard_pids);
+    mapper->shard_pids = NULL;
+}
+
+/*
+ * Bind the ports of the other shards and fork their processes. Every port
+ * gets its own signal descriptor, so that signals wake up only the shard that
+ * serves it. On return, the peer serves the port of its shard.
+ */
+static int start_shards(struct peerd *peer)
+{
+    struct mapperd *mapper = __get_mapperd(peer);
+    struct xseg_port *port;
+    xport p;
+    pid_t pid, ppid = getpid();
+    uint32_t i;
+
+    mapper->shard_pids = calloc(mapper->nr_shards, sizeof(pid_t));
+    if (!mapper->shard_pids) {
+        XSEGLOG2(&lc, E, "Cannot allocate shards");
+        return -1;
+    }
+
+    for (i = 1; i < mapper->nr_shards; i++) {
+        p = mapper->shard_port + i - 1;
+        port = xseg_bind_port(peer->xseg, p, NULL);
+        if (!port) {
+            XSEGLOG2(&lc, E, "Cannot bind port %u for shard %u", p, i);
+            goto out_stop;
+        }
+        pid = fork();
+        if (pid < 0) {
+            XSEGLOG2(&lc, E, "Cannot fork shard %u", i);
+            goto out_stop;
+        }
+        if (pid) {
+            mapper->shard_pids[i] = pid;
+            continue;
+        }
+
+        /* a shard cannot outlive the process that forwards it requests */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != ppid) {
+            exit(1);
+        }
+        free(mapper->shard_pids);
+        mapper->shard_pids = NULL;
+        mapper->shard = i;
+        peer->portno_start = p;
+        peer->portno_end = p;
+        peer->sd = xseg_get_signal_desc(peer->xseg, port);
+        if (xseg_init_local_signal(peer->xseg, p) < 0) {
+            XSEGLOG2(&lc, E, "Shard %u cannot initialize local signals", i);
+            exit(1);
+        }
+        break;
+    }
+    XSEGLOG2(&lc, I, "Shard %u of %u serves port %u", mapper->shard,
+             mapper->nr_shards, peer->portno_start);
+
+    return 0;
+
+  out_stop:
+    stop_shards(peer);
+    return -1;
+}
+
 int dispatch_accepted(struct peerd *peer, struct peer_req *pr,
                       struct xseg_request *req)
 {
-    //struct mapperd *mapper = __get_mapperd(peer);
+    struct mapperd *mapper = __get_mapperd(peer);
     struct mapper_io *mio = __get_mapper_io(pr);
     void *(*action) (struct peer_req *) = NULL;
+    uint32_t shard;
+
+    if (mapper->nr_shards > 1) {
+        shard = volume_shard(mapper, xseg_get_target(peer->xseg, req),
+                             req->targetlen);
+        if (shard != mapper->shard) {
+            if (forward_to_shard(peer, pr, shard) < 0) {
+                fail(peer, pr);
+            }
+            return 0;
+        }
+    }
 
     //mio->state = ACCEPTED;
     mio->err = 0;
@@ -2022,7 +3459,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
     mapper->hashmaps = xhash_new(3, 0, XHASH_STRING);
 
     for (i = 0; i < peer->nr_ops; i++) {
-        struct mapper_io *mio = calloc(1, sizeof(struct mapper_io));
+        struct mapper_io *mio = peer_alloc(sizeof(struct mapper_io));
         mio->copyups_nodes = xhash_new(3, 0, XHASH_INTEGER);
         mio->pending_reqs = 0;
         mio->err = 0;
@@ -2032,10 +3469,22 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 
     mapper->bportno = -1;
     mapper->mbportno = -1;
+    mapper->cache.budget = MAPPER_DEFAULT_CACHE;
+    mapper->nr_shards = 1;
+    mapper->shard_port = -1;
+    mapper->reclaim_rate = MAPPER_DEFAULT_RECLAIM_RATE;
     BEGIN_READ_ARGS(argc, argv);
     READ_ARG_ULONG("-bp", mapper->bportno);
     READ_ARG_ULONG("-mbp", mapper->mbportno);
+    READ_ARG_ULONG("--map-cache", mapper->cache.budget);
+    READ_ARG_BOOL("--partial-copyups", mapper->partial_copyups);
+    READ_ARG_ULONG("--shards", mapper->nr_shards);
+    READ_ARG_ULONG("--shard-port", mapper->shard_port);
+    READ_ARG_ULONG("--reclaim-rate", mapper->reclaim_rate);
+    READ_ARG_STRING("--reclaim-journal", mapper->reclaim_journal,
+                    MAX_JOURNAL_LEN);
     END_READ_ARGS();
+    mapper->cache.budget <<= 20;
     if (mapper->bportno == -1) {
         XSEGLOG2(&lc, E, "Portno for blocker must be provided");
         usage(argv[0]);
@@ -2046,6 +3495,35 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         usage(argv[0]);
         return -1;
     }
+    if (!mapper->nr_shards) {
+        mapper->nr_shards = 1;
+    }
+    if (mapper->nr_shards > 1) {
+        if (mapper->shard_port == -1) {
+            XSEGLOG2(&lc, E, "Portno for the shards must be provided");
+            usage(argv[0]);
+            return -1;
+        }
+        if (start_shards(peer) < 0) {
+            return -1;
+        }
+    }
+    if (!mapper->reclaim_journal[0]) {
+        strcpy(mapper->reclaim_journal, MAPPER_DEFAULT_RECLAIM_JOURNAL);
+        if (mkdir(MAPPER_DEFAULT_RECLAIM_DIR, 0750) < 0 && errno != EEXIST) {
+            XSEGLOG2(&lc, W, "Cannot create %s: %s",
+                     MAPPER_DEFAULT_RECLAIM_DIR, strerror(errno));
+        }
+    }
+    if (mapper->shard) {
+        /* every shard keeps the maps it reclaims in its own journal */
+        snprintf(mapper->reclaim_journal + strlen(mapper->reclaim_journal),
+                 MAX_JOURNAL_LEN + 1 - strlen(mapper->reclaim_journal),
+                 ".%u", mapper->shard);
+    }
+    if (read_reclaim_journal(mapper) < 0) {
+        return -1;
+    }
 
     const struct sched_param param = {.sched_priority = 99 };
     sched_setscheduler(syscall(SYS_gettid), SCHED_FIFO, &param);
@@ -2056,6 +3534,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
     xseg_set_freequeue_size(peer->xseg, peer->portno_start, 3000, 0);
 
     req_cond = st_cond_new();
+    peer->custom_poll = mapper_poll;
 
 //      test_map(peer);
 
@@ -2114,7 +3593,7 @@ void custom_peer_finalize(struct peerd *peer)
     struct peer_req *pr = alloc_peer_req(peer);
     if (!pr) {
         XSEGLOG2(&lc, E, "Cannot get peer request");
-        return;
+        goto out;
     }
     struct map *map;
     struct xseg_request *req;
@@ -2137,17 +3616,44 @@ void custom_peer_finalize(struct peerd *peer)
         map->state &= ~MF_MAP_CLOSING;
         put_request(pr, req);
     }
-    return;
+    if (mapper->reclaims && mapper->reclaims->map) {
+        map = mapper->reclaims->map;
+        req = __close_map(pr, map);
+        if (req) {
+            wait_reply(peer, req);
+            if (!(req->state & XS_SERVED)) {
+                XSEGLOG2(&lc, E, "Couldn't close map %s", map->volume);
+            }
+            put_request(pr, req);
+        }
+    }
 
+    XSEGLOG2(&lc, I, "Map cache: hits %llu, misses %llu, evictions %llu, "
+             "invalidations %llu, %llu/%llu bytes used",
+             (unsigned long long) mapper->cache.stats.hits,
+             (unsigned long long) mapper->cache.stats.misses,
+             (unsigned long long) mapper->cache.stats.evictions,
+             (unsigned long long) mapper->cache.stats.invalidations,
+             (unsigned long long) mapper->cache.used,
+             (unsigned long long) mapper->cache.budget);
 
+  out:
+    if (mapper->shard) {
+        /* the pidfile belongs to the first shard, do not return to remove it */
+        xseg_quit_local_signal(peer->xseg, peer->portno_start);
+        exit(0);
+    }
+    stop_shards(peer);
 }
 
 /*
 void print_obj(struct map_node *mn)
 {
+	char name[MAX_OBJECT_LEN + 1];
+	uint32_t namelen = mapnode_get_name(mn, name);
 	fprintf(stderr, "[%llu]object name: %s[%u] exists: %c\n",
-			(unsigned long long) mn->objectidx, mn->object,
-			(unsigned int) mn->objectlen,
+			(unsigned long long) mapnode_idx(mn), name,
+			(unsigned int) namelen,
 			(mn->flags & MF_OBJECT_WRITABLE) ? 'y' : 'n');
 }
 
@@ -30,6 +30,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sched.h>
 #include <pwd.h>
 #include <grp.h>
+#include <sys/mman.h>
 #include <xseg/xseg.h>
 #ifdef MT
 #include <pthread.h>
@@ -49,6 +50,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_SPEC_LEN 128
 #define MAX_PIDFILE_LEN 512
 #define MAX_CPUS_LEN 512
+#define HUGEPAGE_SIZE (2UL << 20)
+#define PEER_ALLOC_ALIGN 64
 
 /* Define the cpus on which the threads/process will be pinned */
 struct cpu_list {
@@ -64,6 +67,17 @@ struct log_ctx lc;
 uint32_t ta = 0;
 #endif
 
+/* memory handed out by peer_alloc */
+static struct {
+    int hugepages;
+    char *chunk;
+    size_t chunk_size;
+    size_t chunk_used;
+    uint64_t hugetlb;           /* bytes on explicit hugepages */
+    uint64_t thp;               /* bytes on transparent hugepages */
+    uint64_t small;             /* bytes on regular pages */
+} arena;
+
 #ifdef MT
 struct peerd *global_peer;
 static pthread_key_t threadkey;
@@ -608,6 +622,9 @@ int defer_request(struct peerd *peer, struct peer_req *pr)
 /*
  * generic_peerd_loop is a general-purpose port-checker loop that is
  * suitable both for multi-threaded and single-threaded peers.
+ * Peers can also plug a custom_poll function, which is called along with the
+ * port checks, to serve work that is not queued on their ports. Work that is
+ * due at a later time can lower idle_timeout, so that the peer wakes up for it.
  */
 static int generic_peerd_loop(void *arg)
 {
@@ -641,6 +658,8 @@ static int generic_peerd_loop(void *arg)
 #else
             test = check_ports(peer);
 #endif
+            if (peer->custom_poll && peer->custom_poll(peer))
+                test = 1;
             if (test)
                 loops = threshold;
         }
@@ -651,7 +670,7 @@ static int generic_peerd_loop(void *arg)
         }
 #endif
         XSEGLOG2(&lc, I, "%s goes to sleep\n", id);
-        xseg_wait_signal(xseg, peer->sd, 10000000UL);
+        xseg_wait_signal(xseg, peer->sd, peer->idle_timeout);
         xseg_cancel_wait(xseg, peer->portno_start);
         XSEGLOG2(&lc, I, "%s woke up\n", id);
     }
@@ -691,6 +710,95 @@ static void *st_peerd_loop(void *peer)
 }
 #endif
 
+/*
+ * Map @size bytes, a multiple of HUGEPAGE_SIZE, backed by hugepages if
+ * possible. Try explicit hugepages first, and fall back to an aligned mapping
+ * with transparent hugepages enabled on it.
+ */
+static void *map_huge(size_t size)
+{
+    char *p, *aligned;
+    size_t head;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        arena.hugetlb += size;
+        return p;
+    }
+
+    /* over-allocate, so that we can trim the mapping to a hugepage boundary */
+    p = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    aligned = (char *) (((unsigned long) p + HUGEPAGE_SIZE - 1) &
+                        ~(HUGEPAGE_SIZE - 1));
+    head = aligned - p;
+    if (head) {
+        munmap(p, head);
+    }
+    munmap(aligned + size, HUGEPAGE_SIZE - head);
+
+    if (madvise(aligned, size, MADV_HUGEPAGE) < 0) {
+        arena.small += size;
+    } else {
+        arena.thp += size;
+    }
+    return aligned;
+}
+
+/*
+ * Allocate zeroed memory that lives as long as the peer, such as the peer
+ * requests and their private data. With --hugepages, allocations are packed
+ * into hugepage-backed chunks to cut TLB misses with many ops. Memory from
+ * peer_alloc cannot be freed. Meant to be called during initialization, it
+ * is not thread-safe.
+ */
+void *peer_alloc(size_t size)
+{
+    size_t chunk_size;
+    char *p;
+
+    if (!arena.hugepages) {
+        p = calloc(1, size);
+        if (p) {
+            arena.small += size;
+        }
+        return p;
+    }
+
+    size = (size + PEER_ALLOC_ALIGN - 1) & ~(PEER_ALLOC_ALIGN - 1);
+    if (!arena.chunk || arena.chunk_size - arena.chunk_used < size) {
+        chunk_size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        p = map_huge(chunk_size);
+        if (!p) {
+            p = calloc(1, size);
+            if (p) {
+                arena.small += size;
+            }
+            return p;
+        }
+        arena.chunk = p;
+        arena.chunk_size = chunk_size;
+        arena.chunk_used = 0;
+    }
+
+    p = arena.chunk + arena.chunk_used;
+    arena.chunk_used += size;
+    return p;
+}
+
+static void report_peer_alloc(void)
+{
+    XSEGLOG2(&lc, I, "Peer memory: %llu bytes on hugepages, %llu bytes on "
+             "transparent hugepages, %llu bytes on regular pages",
+             (unsigned long long) arena.hugetlb,
+             (unsigned long long) arena.thp,
+             (unsigned long long) arena.small);
+}
+
 static struct xseg *join(char *spec)
 {
     struct xseg_config config;
@@ -755,7 +863,7 @@ static struct peerd *peerd_init(uint32_t nr_ops, char *spec, long portno_start,
         peer->nr_ops = peer->free_reqs.size;
     }
 #endif
-    peer->peer_reqs = calloc(nr_ops, sizeof(struct peer_req));
+    peer->peer_reqs = peer_alloc(nr_ops * sizeof(struct peer_req));
     if (!peer->peer_reqs) {
       malloc_fail:
         perror("malloc");
@@ -811,6 +919,8 @@ static struct peerd *peerd_init(uint32_t nr_ops, char *spec, long portno_start,
 
     //Plug default peerd_loop. This can change later on by custom_peer_init.
     peer->peerd_loop = generic_peerd_loop;
+    peer->custom_poll = NULL;
+    peer->idle_timeout = PEER_DEFAULT_IDLE_TIMEOUT;
 
 #ifdef MT
     peer->interactive_func = NULL;
@@ -912,7 +1022,9 @@ void usage(char *argv0)
             "    -t        | No      | Number of threads \n"
 #endif
             "    --cpus    | No      | Coma-separated list of CPUs\n"
-            "              |         | to pin the process or threads\n" "\n");
+            "              |         | to pin the process or threads\n"
+            "    --hugepages | No    | Back requests and their private data\n"
+            "              |         | with hugepages\n" "\n");
     custom_peer_usage();
 }
 
@@ -973,6 +1085,7 @@ int main(int argc, char *argv[])
     READ_ARG_STRING("--cpus", cpus, MAX_CPUS_LEN);
     READ_ARG_STRING("--pidfile", pidfile, MAX_PIDFILE_LEN);
     READ_ARG_ULONG("--umask", peer_umask);
+    READ_ARG_BOOL("--hugepages", arena.hugepages);
     END_READ_ARGS();
 
     if (help) {
@@ -1110,6 +1223,7 @@ int main(int argc, char *argv[])
     if (r < 0) {
         goto out;
     }
+    report_peer_alloc();
 #if defined(MT)
     //TODO err check
     peerd_start_threads(peer);
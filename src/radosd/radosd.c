@@ -21,19 +21,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xseg.h>
 #include <xseg/protocol.h>
 #include <rados/librados.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "peer.h"
 #include "hash.h"
+#include "fnv.h"
 
 
 #define LOCK_SUFFIX "_lock"
 #define LOCK_SUFFIX_LEN 5
 #define HASH_SUFFIX "_hash"
 #define HASH_SUFFIX_LEN 5
+#define HASH_XATTR "archip.hashed"
 
 #define MAX_POOL_NAME 64
 #define MAX_CEPHXID_NAME 256
@@ -43,11 +46,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define RADOS_LOCK_COOKIE "foo"
 #define RADOS_LOCK_TAG ""
 #define RADOS_LOCK_DESC ""
+#define DEFAULT_LOCK_THREADS 4
+#define MAX_HANDLES 16
+#define LOCK_HANDLE 0
+#define COPY_CHUNK_SIZE (1024 * 1024)
+#define HASH_CHUNK_SIZE (512 * 1024)
+#define HASH_READS_IN_FLIGHT 4
 
 void custom_peer_usage()
 {
     fprintf(stderr, "Custom peer options:\n"
-            "--pool: Rados pool to connect\n" "--cephx-id: Cephx id" "\n");
+            "--pool: Rados pool to connect\n" "--cephx-id: Cephx id\n"
+            "--lock-threads: Threads serving lock requests (default: 4)\n"
+            "--handles: Cluster connections to shard objects over (default: 1)"
+            "\n");
 }
 
 enum rados_state {
@@ -57,13 +69,97 @@ enum rados_state {
     WRITING = 3,
     STATING = 4,
     PREHASHING = 5,
-    POSTHASHING = 6
+    POSTHASHING = 6,
+    LOCKING = 7,
+    HASHING = 8,
+    SEALING = 9
 };
 
-struct radosd {
+struct lock_stats {
+    uint64_t submitted;
+    uint64_t depth;
+    uint64_t max_depth;
+    uint64_t parked;
+    uint64_t max_parked;
+    uint64_t retries;
+    uint64_t acquired;
+    uint64_t wait_us;
+};
+
+/*
+ * Lock requests are served by a fixed number of lock workers, from a FIFO
+ * queue. A worker never blocks on a busy lock. It parks the request on the
+ * watch of the lock object instead, and the request is queued again when
+ * the lock holder notifies the watchers on release.
+ */
+struct lock_workers {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct peer_req *head;
+    struct peer_req *tail;
+    uint32_t nr_threads;
+    pthread_t *threads;
+    int stopping;
+    struct lock_stats stats;
+};
+
+/*
+ * librados callbacks do not dispatch requests themselves. They push an entry
+ * to a lock-free completion queue, which the peer threads drain in batches.
+ */
+struct cq_entry {
+    struct cq_entry *next;
+    struct peer_req *pr;
+    volatile int queued;
+};
+
+struct cq_stats {
+    uint64_t completions;
+    uint64_t batches;
+    uint64_t max_batch;
+};
+
+/* a cluster connection and its I/O context */
+struct rados_handle {
     rados_t cluster;
     rados_ioctx_t ioctx;
+    uint64_t inflight;
+    uint64_t max_inflight;
+    uint64_t submitted;
+};
+
+struct radosd {
+    struct rados_handle handles[MAX_HANDLES];
+    uint32_t nr_handles;
     char pool[MAX_POOL_NAME + 1];
+    struct lock_workers lw;
+    struct cq_entry *cq;
+    struct cq_stats cq_stats;
+    uint32_t nr_finalized;
+};
+
+struct hash_read {
+    struct cq_entry cqe;
+    struct peer_req *pr;
+    char *buf;
+    uint64_t len;
+    int ret;
+    int done;
+};
+
+/* state of a pipelined hash, shared by the callbacks of its reads */
+struct hash_state {
+    EVP_MD_CTX *ctx;
+    pthread_mutex_t lock;
+    struct hash_read reads[HASH_READS_IN_FLIGHT];
+    uint64_t submitted;         /* chunks */
+    uint64_t hashed;            /* chunks */
+    uint64_t length;            /* bytes read */
+    uint64_t zeros;             /* trailing zero bytes not hashed yet */
+    uint32_t inflight;          /* reads not dispatched back yet */
+    int eof;
+    int error;
+    int finished;
 };
 
 struct rados_io {
@@ -71,31 +167,130 @@ struct rados_io {
     enum rados_state state;
     uint64_t size;
     char *second_name, *buf;
+    struct hash_state *hs;
+    struct cq_entry cqe;
+    struct rados_handle *h;
+    size_t bytes_read;          /* by the read of a stat-and-read op */
+    int stat_ret;
+    int read_ret;
     uint64_t read;
+    uint64_t chunk;
     uint64_t watch_handle;
-    pthread_t tid;
-    pthread_cond_t cond;
+    struct peer_req *lnext;
+    uint64_t lock_start;
+    int parked;
+    int notified;
     pthread_mutex_t m;
 };
 
+/*
+ * Objects are sharded over the cluster connections by name, so that all
+ * operations on an object go through the same connection, in order.
+ */
+static struct rados_handle *get_handle(struct radosd *rados, char *name)
+{
+    return &rados->handles[fnv_hash(name, strlen(name)) % rados->nr_handles];
+}
+
+/*
+ * Rados locks and watches belong to the client that took them, so all lock
+ * operations go through the same connection.
+ */
+static rados_ioctx_t lock_ioctx(struct radosd *rados)
+{
+    return rados->handles[LOCK_HANDLE].ioctx;
+}
+
+static void handle_get(struct rados_handle *h)
+{
+    uint64_t inflight, max;
+
+    __sync_fetch_and_add(&h->submitted, 1);
+    inflight = __sync_add_and_fetch(&h->inflight, 1);
+    do {
+        max = h->max_inflight;
+    } while (inflight > max &&
+             !__sync_bool_compare_and_swap(&h->max_inflight, max, inflight));
+}
+
+static void handle_put(struct rados_handle *h)
+{
+    __sync_fetch_and_sub(&h->inflight, 1);
+}
+
+static void cq_push(struct peerd *peer, struct cq_entry *e)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct cq_entry *head;
+
+    e->queued = 1;
+    do {
+        head = rados->cq;
+        e->next = head;
+    } while (!__sync_bool_compare_and_swap(&rados->cq, head, e));
+
+    /* wake up a peer thread, unless one is already due to drain the queue */
+    if (!head) {
+        xseg_signal(peer->xseg, peer->portno_start);
+    }
+}
+
+/* Dispatch all queued completions. Called by the peer threads. */
+static int cq_drain(struct peerd *peer)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct cq_entry *e, *next, *fifo = NULL;
+    uint64_t nr = 0, max;
+
+    e = __sync_lock_test_and_set(&rados->cq, NULL);
+    if (!e) {
+        return 0;
+    }
+
+    /* entries were pushed LIFO */
+    for (; e; e = next) {
+        next = e->next;
+        e->next = fifo;
+        fifo = e;
+        nr++;
+    }
+    for (e = fifo; e; e = next) {
+        /* the entry may be reused as soon as the request is dispatched */
+        next = e->next;
+        __sync_lock_release(&e->queued);
+        dispatch(peer, e->pr, e->pr->req, dispatch_internal);
+    }
+
+    __sync_fetch_and_add(&rados->cq_stats.completions, nr);
+    __sync_fetch_and_add(&rados->cq_stats.batches, 1);
+    do {
+        max = rados->cq_stats.max_batch;
+    } while (nr > max &&
+             !__sync_bool_compare_and_swap(&rados->cq_stats.max_batch, max,
+                                           nr));
+    return 1;
+}
+
 void rados_ack_cb(rados_completion_t c, void *arg)
 {
     struct peer_req *pr = (struct peer_req *) arg;
-    struct peerd *peer = pr->peer;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
     int ret = rados_aio_get_return_value(c);
     pr->retval = ret;
     rados_aio_release(c);
-    dispatch(peer, pr, pr->req, dispatch_internal);
+    handle_put(rio->h);
+    cq_push(pr->peer, &rio->cqe);
 }
 
 void rados_commit_cb(rados_completion_t c, void *arg)
 {
     struct peer_req *pr = (struct peer_req *) arg;
-    struct peerd *peer = pr->peer;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
     int ret = rados_aio_get_return_value(c);
     pr->retval = ret;
     rados_aio_release(c);
-    dispatch(peer, pr, pr->req, dispatch_internal);
+    handle_put(rio->h);
+    cq_push(pr->peer, &rio->cqe);
 }
 
 static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
@@ -104,16 +299,19 @@ static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
 {
     struct radosd *rados = (struct radosd *) peer->priv;
     struct rados_io *rio = (struct rados_io *) pr->priv;
+    rados_ioctx_t ioctx;
     int r;
 
     rados_completion_t rados_compl;
+    rio->h = get_handle(rados, target);
+    ioctx = rio->h->ioctx;
     switch (op) {
     case X_READ:
         r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
         if (r < 0) {
             return -1;
         }
-        r = rados_aio_read(rados->ioctx, target, rados_compl,
+        r = rados_aio_read(ioctx, target, rados_compl,
                            buf, size, offset);
         break;
     case X_WRITE:
@@ -122,7 +320,7 @@ static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
         if (r < 0) {
             return -1;
         }
-        r = rados_aio_write(rados->ioctx, target, rados_compl,
+        r = rados_aio_write(ioctx, target, rados_compl,
                             buf, size, offset);
         break;
     case X_DELETE:
@@ -130,14 +328,14 @@ static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
         if (r < 0) {
             return -1;
         }
-        r = rados_aio_remove(rados->ioctx, target, rados_compl);
+        r = rados_aio_remove(ioctx, target, rados_compl);
         break;
     case X_INFO:
         r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
         if (r < 0) {
             return -1;
         }
-        r = rados_aio_stat(rados->ioctx, target, rados_compl, &rio->size,
+        r = rados_aio_stat(ioctx, target, rados_compl, &rio->size,
                            NULL);
         break;
     default:
@@ -145,7 +343,178 @@ static int do_aio_generic(struct peerd *peer, struct peer_req *pr, uint32_t op,
     }
     if (r < 0) {
         rados_aio_release(rados_compl);
+    } else {
+        handle_get(rio->h);
+    }
+    return r;
+}
+
+/*
+ * Write @size bytes of @buf to @target at @offset and zero the @zero bytes
+ * that follow, in a single operation. Zeroing happens on the OSDs, without
+ * sending any data.
+ */
+static int do_aio_write_zero(struct peerd *peer, struct peer_req *pr,
+                             char *target, char *buf, uint64_t size,
+                             uint64_t offset, uint64_t zero)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    rados_completion_t rados_compl;
+    rados_write_op_t op;
+    int r;
+
+    op = rados_create_write_op();
+    if (!op) {
+        return -1;
+    }
+    if (size) {
+        rados_write_op_write(op, buf, size, offset);
+    }
+    if (zero) {
+        rados_write_op_zero(op, offset + size, zero);
+    }
+
+    r = rados_aio_create_completion(pr, NULL, rados_commit_cb, &rados_compl);
+    if (r < 0) {
+        rados_release_write_op(op);
+        return -1;
+    }
+    rio->h = get_handle(rados, target);
+    r = rados_aio_write_op_operate(op, rio->h->ioctx, rados_compl, target,
+                                   NULL, LIBRADOS_OPERATION_NOFLAG);
+    if (r < 0) {
+        rados_aio_release(rados_compl);
+    } else {
+        handle_get(rio->h);
+    }
+    /* the operation has been submitted and is no longer needed */
+    rados_release_write_op(op);
+    return r;
+}
+
+/*
+ * Stat the content-addressed object @target and check that it has been
+ * sealed with @size, in a single operation. Fails if the object does not
+ * exist or has not been completely written.
+ */
+static int do_aio_stat_hashed(struct peerd *peer, struct peer_req *pr,
+                              char *target, uint64_t size)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    rados_completion_t rados_compl;
+    rados_read_op_t op;
+    char val[24];
+    int r;
+
+    op = rados_create_read_op();
+    if (!op) {
+        return -1;
+    }
+    rio->size = 0;
+    snprintf(val, sizeof(val), "%llu", (unsigned long long) size);
+    rados_read_op_stat(op, &rio->size, NULL, &rio->stat_ret);
+    rados_read_op_cmpxattr(op, HASH_XATTR, LIBRADOS_CMPXATTR_OP_EQ, val,
+                           strlen(val));
+
+    r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
+    if (r < 0) {
+        rados_release_read_op(op);
+        return -1;
+    }
+    rio->h = get_handle(rados, target);
+    r = rados_aio_read_op_operate(op, rio->h->ioctx, rados_compl, target,
+                                  LIBRADOS_OPERATION_NOFLAG);
+    if (r < 0) {
+        rados_aio_release(rados_compl);
+    } else {
+        handle_get(rio->h);
+    }
+    rados_release_read_op(op);
+    return r;
+}
+
+/*
+ * Mark the content-addressed object @target as complete, once all of its
+ * @size bytes have been written. The object is created if it is empty and
+ * cut at @size, in case a crashed hash left garbage past it.
+ */
+static int do_aio_seal_hashed(struct peerd *peer, struct peer_req *pr,
+                              char *target, uint64_t size)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    rados_completion_t rados_compl;
+    rados_write_op_t op;
+    char val[24];
+    int r;
+
+    op = rados_create_write_op();
+    if (!op) {
+        return -1;
+    }
+    snprintf(val, sizeof(val), "%llu", (unsigned long long) size);
+    rados_write_op_create(op, LIBRADOS_CREATE_IDEMPOTENT, NULL);
+    rados_write_op_truncate(op, size);
+    rados_write_op_setxattr(op, HASH_XATTR, val, strlen(val));
+
+    r = rados_aio_create_completion(pr, NULL, rados_commit_cb, &rados_compl);
+    if (r < 0) {
+        rados_release_write_op(op);
+        return -1;
+    }
+    rio->h = get_handle(rados, target);
+    r = rados_aio_write_op_operate(op, rio->h->ioctx, rados_compl, target,
+                                   NULL, LIBRADOS_OPERATION_NOFLAG);
+    if (r < 0) {
+        rados_aio_release(rados_compl);
+    } else {
+        handle_get(rio->h);
+    }
+    rados_release_write_op(op);
+    return r;
+}
+
+/*
+ * Stat @target and read from it in a single operation. The OSD returns no
+ * data for the part of the range past the end of the object, and the caller
+ * zero-fills it from the object size in rio->size.
+ */
+static int do_aio_stat_read(struct peerd *peer, struct peer_req *pr,
+                            char *target, char *buf, uint64_t size,
+                            uint64_t offset)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    rados_completion_t rados_compl;
+    rados_read_op_t op;
+    int r;
+
+    op = rados_create_read_op();
+    if (!op) {
+        return -1;
+    }
+    rio->size = 0;
+    rio->bytes_read = 0;
+    rados_read_op_stat(op, &rio->size, NULL, &rio->stat_ret);
+    rados_read_op_read(op, offset, size, buf, &rio->bytes_read,
+                       &rio->read_ret);
+
+    r = rados_aio_create_completion(pr, rados_ack_cb, NULL, &rados_compl);
+    if (r < 0) {
+        rados_release_read_op(op);
+        return -1;
+    }
+    rio->h = get_handle(rados, target);
+    r = rados_aio_read_op_operate(op, rio->h->ioctx, rados_compl, target,
+                                  LIBRADOS_OPERATION_NOFLAG);
+    if (r < 0) {
+        rados_aio_release(rados_compl);
+    } else {
+        handle_get(rio->h);
     }
+    rados_release_read_op(op);
     return r;
 }
 
@@ -155,10 +524,10 @@ static int do_aio_read(struct peerd *peer, struct peer_req *pr)
     struct rados_io *rio = (struct rados_io *) pr->priv;
     char *data = xseg_get_data(peer->xseg, pr->req);
 
-    return do_aio_generic(peer, pr, X_READ, rio->obj_name,
-                          data + req->serviced,
-                          req->size - req->serviced,
-                          req->offset + req->serviced);
+    return do_aio_stat_read(peer, pr, rio->obj_name,
+                            data + req->serviced,
+                            req->size - req->serviced,
+                            req->offset + req->serviced);
 }
 
 static int do_aio_write(struct peerd *peer, struct peer_req *pr)
@@ -188,7 +557,11 @@ int handle_delete(struct peerd *peer, struct peer_req *pr)
             fail(peer, pr);
         }
     } else {
-        if (pr->retval < 0) {
+        if (pr->retval == -ENOENT && (pr->req->flags & XF_FORCE)) {
+            /* forced deletions of objects that do not exist succeed */
+            XSEGLOG2(&lc, I, "Object %s already deleted", rio->obj_name);
+            complete(peer, pr);
+        } else if (pr->retval < 0) {
             XSEGLOG2(&lc, E, "Deletion of %s failed", rio->obj_name);
             fail(peer, pr);
         } else {
@@ -275,9 +648,14 @@ int handle_read(struct peerd *peer, struct peer_req *pr)
     } else if (rio->state == READING) {
         XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
         data = xseg_get_data(peer->xseg, pr->req);
-        if (pr->retval > 0) {
-            req->serviced += pr->retval;
-        } else if (pr->retval == 0) {
+        if (pr->retval < 0 || rio->stat_ret < 0 || rio->read_ret < 0) {
+            XSEGLOG2(&lc, E, "Reading of %s failed", rio->obj_name);
+            fail(peer, pr);
+            return 0;
+        }
+        req->serviced += rio->bytes_read;
+        if (!rio->bytes_read ||
+            req->offset + req->serviced >= rio->size) {
             XSEGLOG2(&lc, I, "Reading of %s reached end of file at "
                      "%llu bytes. Zeroing out rest", rio->obj_name,
                      (unsigned long long) req->serviced);
@@ -286,11 +664,6 @@ int handle_read(struct peerd *peer, struct peer_req *pr)
              */
             memset(data + req->serviced, 0, req->size - req->serviced);
             req->serviced = req->size;
-        } else {
-            XSEGLOG2(&lc, E, "Reading of %s failed", rio->obj_name);
-            /* pr->retval < 0 && pr->retval != -2 */
-            fail(peer, pr);
-            return 0;
         }
         if (req->serviced >= req->size) {
             XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
@@ -359,6 +732,30 @@ int handle_write(struct peerd *peer, struct peer_req *pr)
     return 0;
 }
 
+/* Read the next chunk of the source object of a copy */
+static int copy_next_chunk(struct peerd *peer, struct peer_req *pr)
+{
+    struct xseg_request *req = pr->req;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+
+    rio->chunk = rio->size - rio->read;
+    if (rio->chunk > COPY_CHUNK_SIZE) {
+        rio->chunk = COPY_CHUNK_SIZE;
+    }
+    rio->state = READING;
+    XSEGLOG2(&lc, D, "Reading %llu bytes of %s at %llu",
+             (unsigned long long) rio->chunk, rio->second_name,
+             (unsigned long long) (req->offset + rio->read));
+    return do_aio_generic(peer, pr, X_READ, rio->second_name, rio->buf,
+                          rio->chunk, req->offset + rio->read);
+}
+
+/*
+ * Copy the range of the source object to the target in chunks of at most
+ * COPY_CHUNK_SIZE bytes, so that a copy holds a bounded buffer. The range is
+ * clipped to the size of the source, and the rest of it is zeroed on the
+ * OSDs instead of being written, in the same operation as the last chunk.
+ */
 int handle_copy(struct peerd *peer, struct peer_req *pr)
 {
     //struct radosd *rados = (struct radosd *) peer->priv;
@@ -369,8 +766,6 @@ int handle_copy(struct peerd *peer, struct peer_req *pr)
         (struct xseg_request_copy *) xseg_get_data(peer->xseg, req);
 
     if (rio->state == ACCEPTED) {
-        XSEGLOG2(&lc, I, "Copy of object %s to object %s started",
-                 rio->second_name, rio->obj_name);
         if (!req->size) {
             complete(peer, pr); //or fail?
             return 0;
@@ -387,86 +782,126 @@ int handle_copy(struct peerd *peer, struct peer_req *pr)
              MAX_OBJ_NAME) ? MAX_OBJ_NAME : xcopy->targetlen;
         strncpy(rio->second_name, xcopy->target, end);
         rio->second_name[end] = 0;
+        XSEGLOG2(&lc, I, "Copy of object %s to object %s started",
+                 rio->second_name, rio->obj_name);
 
-        rio->buf = malloc(req->size);
+        rio->buf = malloc(req->size < COPY_CHUNK_SIZE ?
+                          req->size : COPY_CHUNK_SIZE);
         if (!rio->buf) {
             r = -1;
             goto out_src;
         }
 
-        rio->state = READING;
+        rio->state = STATING;
         rio->read = 0;
-        XSEGLOG2(&lc, I, "Reading %s", rio->second_name);
-        if (do_aio_generic
-            (peer, pr, X_READ, rio->second_name, rio->buf + rio->read,
-             req->size - rio->read, req->offset + rio->read) < 0) {
-            XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read",
-                     rio->obj_name);
-            fail(peer, pr);
+        XSEGLOG2(&lc, I, "Stating %s", rio->second_name);
+        if (do_aio_generic(peer, pr, X_INFO, rio->second_name, NULL, 0, 0)
+            < 0) {
+            XSEGLOG2(&lc, E, "Stating %s failed", rio->second_name);
             r = -1;
             goto out_buf;
         }
-    } else if (rio->state == READING) {
-        XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
-        if (pr->retval > 0) {
-            rio->read += pr->retval;
-        } else if (pr->retval == 0) {
-            XSEGLOG2(&lc, I, "Reading of %s reached end of file at "
-                     "%llu bytes. Zeroing out rest", rio->obj_name,
-                     (unsigned long long) req->serviced);
-            memset(rio->buf + rio->read, 0, req->size - rio->read);
-            rio->read = req->size;
+    } else if (rio->state == STATING) {
+        if (pr->retval < 0) {
+            XSEGLOG2(&lc, E, "Stating %s failed", rio->second_name);
+            r = -1;
+            goto out_buf;
+        }
+        /* from now on, rio->size is the part of the range with data */
+        if (rio->size <= req->offset) {
+            rio->size = 0;
+        } else if (rio->size - req->offset > req->size) {
+            rio->size = req->size;
         } else {
+            rio->size -= req->offset;
+        }
+        goto next;
+    } else if (rio->state == READING) {
+        XSEGLOG2(&lc, I, "Reading of %s callback", rio->second_name);
+        if (pr->retval < 0) {
             XSEGLOG2(&lc, E, "Reading of %s failed", rio->second_name);
             r = -1;
             goto out_buf;
+        } else if (pr->retval < rio->chunk) {
+            /* source shrank after we stated it */
+            memset(rio->buf + pr->retval, 0, rio->chunk - pr->retval);
         }
 
-        if (rio->read >= req->size) {
-            XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
-            //do_aio_write
+        if (rio->read + rio->chunk == rio->size && rio->size < req->size) {
+            /* last chunk. Zero the rest of the range along with it. */
+            rio->state = PENDING;
+            r = do_aio_write_zero(peer, pr, rio->obj_name, rio->buf,
+                                  rio->chunk, req->offset + rio->read,
+                                  req->size - rio->size);
+        } else {
             rio->state = WRITING;
-            XSEGLOG2(&lc, I, "Writing %s", rio->obj_name);
-            if (do_aio_generic(peer, pr, X_WRITE, rio->obj_name,
-                               rio->buf, req->size, req->offset) < 0) {
-                XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write",
-                         rio->obj_name);
-                r = -1;
-                goto out_buf;
-            }
-            return 0;
+            r = do_aio_generic(peer, pr, X_WRITE, rio->obj_name, rio->buf,
+                               rio->chunk, req->offset + rio->read);
         }
-
-        XSEGLOG2(&lc, I, "Resubmitting read of %s", rio->obj_name);
-        if (do_aio_generic
-            (peer, pr, X_READ, rio->second_name, rio->buf + rio->read,
-             req->size - rio->read, req->offset + rio->read) < 0) {
-            XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write",
                      rio->obj_name);
             r = -1;
             goto out_buf;
         }
     } else if (rio->state == WRITING) {
         XSEGLOG2(&lc, I, "Writing of %s callback", rio->obj_name);
-        if (pr->retval == 0) {
-            XSEGLOG2(&lc, I, "Writing of %s completed", rio->obj_name);
-            XSEGLOG2(&lc, I, "Copy of object %s to object %s completed",
+        if (pr->retval < 0) {
+            XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
+            XSEGLOG2(&lc, E, "Copy of object %s to object %s failed",
                      rio->second_name, rio->obj_name);
-            req->serviced = req->size;
-            r = 0;
+            r = -1;
             goto out_buf;
-        } else {
-            XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
+        }
+        rio->read += rio->chunk;
+        goto next;
+    } else if (rio->state == PENDING) {
+        XSEGLOG2(&lc, I, "Writing and zeroing of %s callback",
+                 rio->obj_name);
+        if (pr->retval < 0) {
+            XSEGLOG2(&lc, E, "Writing and zeroing of %s failed",
+                     rio->obj_name);
             XSEGLOG2(&lc, E, "Copy of object %s to object %s failed",
                      rio->second_name, rio->obj_name);
             r = -1;
             goto out_buf;
         }
+        goto done;
     } else {
         XSEGLOG2(&lc, E, "Unknown state");
     }
     return 0;
 
+  next:
+    if (rio->read < rio->size) {
+        if (copy_next_chunk(peer, pr) < 0) {
+            XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
+                     rio->second_name);
+            r = -1;
+            goto out_buf;
+        }
+        return 0;
+    }
+    if (rio->size < req->size) {
+        /* the source has no data in the rest of the range */
+        rio->state = PENDING;
+        if (do_aio_write_zero(peer, pr, rio->obj_name, NULL, 0,
+                              req->offset + rio->size,
+                              req->size - rio->size) < 0) {
+            XSEGLOG2(&lc, E, "Zeroing of %s failed on do_aio_write_zero",
+                     rio->obj_name);
+            r = -1;
+            goto out_buf;
+        }
+        return 0;
+    }
+
+  done:
+    XSEGLOG2(&lc, I, "Copy of object %s to object %s completed",
+             rio->second_name, rio->obj_name);
+    req->serviced = req->size;
+    r = 0;
+
   out_buf:
     free(rio->buf);
   out_src:
@@ -483,34 +918,226 @@ int handle_copy(struct peerd *peer, struct peer_req *pr)
     return 0;
 }
 
-int handle_hash(struct peerd *peer, struct peer_req *pr)
+static void hash_state_free(struct hash_state *hs)
 {
-    //struct radosd *rados = (struct radosd *) peer->priv;
-    struct xseg_request *req = pr->req;
-    struct rados_io *rio = (struct rados_io *) pr->priv;
-    uint64_t trailing_zeros = 0;
-    unsigned char sha[SHA256_DIGEST_SIZE];
-    struct xseg_reply_hash *xreply;
-    int r;
-    char hash_name[HEXLIFIED_SHA256_DIGEST_SIZE + 1];
-    uint32_t pos;
+    int i;
 
-    if (rio->state == ACCEPTED) {
-        XSEGLOG2(&lc, I, "Starting hashing of object %s", rio->obj_name);
-        if (!req->size) {
-            fail(peer, pr);     //or fail?
-            return 0;
-        }
+    if (!hs) {
+        return;
+    }
+    for (i = 0; i < HASH_READS_IN_FLIGHT; i++) {
+        free(hs->reads[i].buf);
+    }
+    EVP_MD_CTX_free(hs->ctx);
+    free(hs);
+}
 
-        rio->second_name = malloc(MAX_OBJ_NAME + 1);
-        if (!rio->second_name) {
-            return -1;
+static struct hash_state *hash_state_alloc(struct peer_req *pr)
+{
+    struct hash_state *hs;
+    int i;
+
+    hs = calloc(1, sizeof(struct hash_state));
+    if (!hs) {
+        return NULL;
+    }
+    for (i = 0; i < HASH_READS_IN_FLIGHT; i++) {
+        hs->reads[i].pr = pr;
+        hs->reads[i].cqe.pr = pr;
+        hs->reads[i].buf = malloc(HASH_CHUNK_SIZE);
+        if (!hs->reads[i].buf) {
+            hash_state_free(hs);
+            return NULL;
         }
-        rio->buf = malloc(req->size);
-        if (!rio->buf) {
-            r = -1;
-            goto out_src;
+    }
+    hs->ctx = EVP_MD_CTX_new();
+    if (!hs->ctx || EVP_DigestInit_ex(hs->ctx, EVP_sha256(), NULL) != 1) {
+        hash_state_free(hs);
+        return NULL;
+    }
+    pthread_mutex_init(&hs->lock, NULL);
+
+    return hs;
+}
+
+void hash_read_cb(rados_completion_t c, void *arg)
+{
+    struct hash_read *hr = (struct hash_read *) arg;
+    struct peer_req *pr = hr->pr;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    int ret = rados_aio_get_return_value(c);
+
+    rados_aio_release(c);
+    handle_put(rio->h);
+    pthread_mutex_lock(&rio->hs->lock);
+    hr->ret = ret;
+    hr->done = 1;
+    pthread_mutex_unlock(&rio->hs->lock);
+    cq_push(pr->peer, &hr->cqe);
+}
+
+/*
+ * Feed a chunk to the digest. Zeros at the end of a chunk are held back
+ * until a non-zero byte follows them, so that the trailing zeros of the
+ * object are never hashed.
+ */
+static void hash_chunk(struct hash_state *hs, char *buf, uint64_t len)
+{
+    static const char zeros[4096];
+    uint64_t last, n;
+
+    for (last = len; last > 0 && !buf[last - 1]; last--) ;
+    if (!last) {
+        hs->zeros += len;
+        return;
+    }
+    while (hs->zeros) {
+        n = hs->zeros < sizeof(zeros) ? hs->zeros : sizeof(zeros);
+        EVP_DigestUpdate(hs->ctx, zeros, n);
+        hs->zeros -= n;
+    }
+    EVP_DigestUpdate(hs->ctx, buf, last);
+    hs->zeros = len - last;
+}
+
+/* Keep up to HASH_READS_IN_FLIGHT chunk reads in flight. Called locked. */
+static void hash_submit(struct peerd *peer, struct peer_req *pr)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    struct hash_state *hs = rio->hs;
+    struct xseg_request *req = pr->req;
+    struct hash_read *hr;
+    rados_completion_t rados_compl;
+    uint64_t offset;
+
+    while (!hs->eof && !hs->error &&
+           hs->submitted - hs->hashed < HASH_READS_IN_FLIGHT &&
+           hs->submitted * HASH_CHUNK_SIZE < req->size) {
+        hr = &hs->reads[hs->submitted % HASH_READS_IN_FLIGHT];
+        if (hr->cqe.queued) {
+            /* its dispatch will submit the read */
+            break;
+        }
+        offset = hs->submitted * HASH_CHUNK_SIZE;
+        hr->len = req->size - offset;
+        if (hr->len > HASH_CHUNK_SIZE) {
+            hr->len = HASH_CHUNK_SIZE;
+        }
+        hr->done = 0;
+        if (rados_aio_create_completion(hr, hash_read_cb, NULL,
+                                        &rados_compl) < 0) {
+            hs->error = 1;
+            break;
+        }
+        rio->h = get_handle(rados, rio->obj_name);
+        if (rados_aio_read(rio->h->ioctx, rio->obj_name, rados_compl,
+                           hr->buf, hr->len, req->offset + offset) < 0) {
+            rados_aio_release(rados_compl);
+            hs->error = 1;
+            break;
+        }
+        handle_get(rio->h);
+        hs->submitted++;
+        hs->inflight++;
+    }
+}
+
+/*
+ * Hash the chunks that have been read, in order, and read more. Every read
+ * completion is dispatched once, with @retire set. The hash is finished by
+ * the caller that retires the last read, once the completion queue holds no
+ * entry of the hash state anymore.
+ * Returns 1 to the caller that must finish the hashing, 0 otherwise.
+ */
+static int hash_progress(struct peerd *peer, struct peer_req *pr, int retire)
+{
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    struct hash_state *hs = rio->hs;
+    struct hash_read *hr;
+    int finish = 0;
+
+    pthread_mutex_lock(&hs->lock);
+    if (retire) {
+        hs->inflight--;
+    }
+    while (hs->hashed < hs->submitted) {
+        hr = &hs->reads[hs->hashed % HASH_READS_IN_FLIGHT];
+        if (!hr->done) {
+            break;
+        }
+        if (hr->ret < 0) {
+            hs->error = 1;
+        } else if (!hs->eof && !hs->error) {
+            hash_chunk(hs, hr->buf, hr->ret);
+            hs->length += hr->ret;
+            if (hr->ret < hr->len) {
+                hs->eof = 1;
+            }
+        }
+        hr->done = 0;
+        hs->hashed++;
+    }
+    hash_submit(peer, pr);
+    if (!hs->inflight && !hs->finished) {
+        hs->finished = 1;
+        finish = 1;
+    }
+    pthread_mutex_unlock(&hs->lock);
+
+    return finish;
+}
+
+/* Copy the next chunk of the object to its content-addressed object */
+static int hash_copy_next(struct peerd *peer, struct peer_req *pr)
+{
+    struct xseg_request *req = pr->req;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+
+    rio->chunk = rio->read - rio->size;
+    if (rio->chunk > COPY_CHUNK_SIZE) {
+        rio->chunk = COPY_CHUNK_SIZE;
+    }
+    rio->state = READING;
+    return do_aio_generic(peer, pr, X_READ, rio->obj_name, rio->buf,
+                          rio->chunk, req->offset + rio->size);
+}
+
+/*
+ * Hash an object and store it under its content-addressed name.
+ *
+ * The object is read in chunks of HASH_CHUNK_SIZE, with up to
+ * HASH_READS_IN_FLIGHT of them in flight, and is hashed incrementally, so
+ * memory use does not depend on the object size. If the content-addressed
+ * object does not exist yet, the object is copied to it in chunks and then
+ * sealed. An object that is not sealed, because another hash of the same
+ * content is still copying it or crashed while doing so, is copied again.
+ * The copies write the same data, so they never corrupt each other.
+ */
+int handle_hash(struct peerd *peer, struct peer_req *pr)
+{
+    //struct radosd *rados = (struct radosd *) peer->priv;
+    struct xseg_request *req = pr->req;
+    struct rados_io *rio = (struct rados_io *) pr->priv;
+    unsigned char sha[SHA256_DIGEST_SIZE];
+    struct xseg_reply_hash *xreply;
+    int r;
+    char hash_name[HEXLIFIED_SHA256_DIGEST_SIZE + 1];
+    uint32_t pos;
+
+    if (rio->state == ACCEPTED) {
+        XSEGLOG2(&lc, I, "Starting hashing of object %s", rio->obj_name);
+        if (!req->size) {
+            fail(peer, pr);     //or fail?
+            return 0;
+        }
+
+        rio->second_name = malloc(MAX_OBJ_NAME + 1);
+        if (!rio->second_name) {
+            return -1;
         }
+        rio->buf = NULL;
+        rio->hs = NULL;
 
         rio->second_name[0] = 0;
         rio->state = PREHASHING;
@@ -525,7 +1152,6 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
                            HEXLIFIED_SHA256_DIGEST_SIZE, 0) < 0) {
             XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read",
                      rio->obj_name);
-            fail(peer, pr);
             r = -1;
             goto out_buf;
         }
@@ -542,86 +1168,89 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
             XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
                      rio->second_name, rio->obj_name);
             req->serviced = req->size;
+            r = 0;
             goto out_buf;
 
         }
-        rio->state = READING;
-        rio->read = 0;
+        rio->hs = hash_state_alloc(pr);
+        if (!rio->hs) {
+            XSEGLOG2(&lc, E, "Out of memory");
+            r = -1;
+            goto out_buf;
+        }
+        rio->state = HASHING;
         XSEGLOG2(&lc, I, "Reading %s", rio->obj_name);
-        if (do_aio_generic
-            (peer, pr, X_READ, rio->obj_name, rio->buf + rio->read,
-             req->size - rio->read, req->offset + rio->read) < 0) {
-            XSEGLOG2(&lc, I, "Reading of %s failed on do_aio_read",
+        if (hash_progress(peer, pr, 0)) {
+            /* could not submit any read */
+            XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
                      rio->obj_name);
-            fail(peer, pr);
             r = -1;
             goto out_buf;
         }
-    } else if (rio->state == READING) {
-        XSEGLOG2(&lc, I, "Reading of %s callback", rio->obj_name);
-        if (pr->retval >= 0) {
-            rio->read += pr->retval;
-        } else {
-            XSEGLOG2(&lc, E, "Reading of %s failed", rio->second_name);
+    } else if (rio->state == HASHING) {
+        if (!hash_progress(peer, pr, 1)) {
+            /* more reads in flight */
+            return 0;
+        }
+        if (rio->hs->error) {
+            XSEGLOG2(&lc, E, "Reading of %s failed", rio->obj_name);
             r = -1;
             goto out_buf;
         }
-
-        if (!pr->retval || rio->read >= req->size) {
-            XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
-            //rstrip here in case zeros were written in the end
-            for (; trailing_zeros < rio->read; trailing_zeros++)
-                if (rio->buf[rio->read - trailing_zeros - 1]) {
-                    break;
-                }
-            XSEGLOG2(&lc, D, "Read %llu, Trainling zeros %llu",
-                     rio->read, trailing_zeros);
-
-            rio->read -= trailing_zeros;
-            SHA256((unsigned char *) rio->buf, rio->read, sha);
-            hexlify(sha, SHA256_DIGEST_SIZE, rio->second_name);
-            rio->second_name[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
-
-            xreply = (struct xseg_reply_hash *) xseg_get_data(peer->xseg, req);
-            r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen,
-                                    sizeof(struct xseg_reply_hash));
-            strncpy(xreply->target, rio->second_name,
-                    HEXLIFIED_SHA256_DIGEST_SIZE);
-            xreply->targetlen = HEXLIFIED_SHA256_DIGEST_SIZE;
-
-            XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
-                     rio->second_name, rio->obj_name);
+        XSEGLOG2(&lc, I, "Reading of %s completed", rio->obj_name);
+        XSEGLOG2(&lc, D, "Read %llu, Trainling zeros %llu",
+                 (unsigned long long) rio->hs->length,
+                 (unsigned long long) rio->hs->zeros);
+
+        rio->read = rio->hs->length - rio->hs->zeros;
+        if (EVP_DigestFinal_ex(rio->hs->ctx, sha, NULL) != 1) {
+            XSEGLOG2(&lc, E, "Hashing of %s failed", rio->obj_name);
+            r = -1;
+            goto out_buf;
+        }
+        hash_state_free(rio->hs);
+        rio->hs = NULL;
+        hexlify(sha, SHA256_DIGEST_SIZE, rio->second_name);
+        rio->second_name[HEXLIFIED_SHA256_DIGEST_SIZE] = 0;
+
+        xreply = (struct xseg_reply_hash *) xseg_get_data(peer->xseg, req);
+        r = xseg_resize_request(peer->xseg, pr->req, pr->req->targetlen,
+                                sizeof(struct xseg_reply_hash));
+        strncpy(xreply->target, rio->second_name,
+                HEXLIFIED_SHA256_DIGEST_SIZE);
+        xreply->targetlen = HEXLIFIED_SHA256_DIGEST_SIZE;
+
+        XSEGLOG2(&lc, I, "Calculated %s as hash of %s",
+                 rio->second_name, rio->obj_name);
 
 
-            //aio_stat
-            rio->state = STATING;
-            r = do_aio_generic(peer, pr, X_INFO, rio->second_name, NULL, 0, 0);
-            if (r < 0) {
-                XSEGLOG2(&lc, E, "Stating %s failed", rio->second_name);
-                r = -1;
-                goto out_buf;
-            }
-            return 0;
-        }
-        XSEGLOG2(&lc, I, "Resubmitting read of %s", rio->obj_name);
-        if (do_aio_generic
-            (peer, pr, X_READ, rio->obj_name, rio->buf + rio->read,
-             req->size - rio->read, req->offset + rio->read) < 0) {
-            XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
-                     rio->obj_name);
+        rio->state = STATING;
+        r = do_aio_stat_hashed(peer, pr, rio->second_name, rio->read);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Stating %s failed", rio->second_name);
             r = -1;
             goto out_buf;
         }
         return 0;
     } else if (rio->state == STATING) {
-        if (pr->retval < 0) {
-            //write
-            XSEGLOG2(&lc, I, "Stating %s failed. Writing.", rio->second_name);
-            rio->state = WRITING;
-            if (do_aio_generic(peer, pr, X_WRITE, rio->second_name,
-                               rio->buf, rio->read, 0) < 0) {
-                XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write",
-                         rio->second_name);
+        if (pr->retval < 0 || rio->stat_ret < 0 || rio->size != rio->read) {
+            XSEGLOG2(&lc, I, "%s not found complete. Writing.",
+                     rio->second_name);
+            rio->buf = malloc(COPY_CHUNK_SIZE);
+            if (!rio->buf) {
+                r = -1;
+                goto out_buf;
+            }
+            rio->size = 0;
+            if (!rio->read) {
+                /* create an empty object */
+                rio->state = SEALING;
+                r = do_aio_seal_hashed(peer, pr, rio->second_name, 0);
+            } else {
+                r = hash_copy_next(peer, pr);
+            }
+            if (r < 0) {
+                XSEGLOG2(&lc, E, "Writing of %s failed", rio->second_name);
                 r = -1;
                 goto out_buf;
             }
@@ -635,10 +1264,57 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
             r = 0;
             goto out_buf;
         }
+    } else if (rio->state == READING) {
+        if (pr->retval < 0) {
+            XSEGLOG2(&lc, E, "Reading of %s failed", rio->obj_name);
+            r = -1;
+            goto out_buf;
+        } else if (pr->retval < rio->chunk) {
+            /* object shrank after it was hashed */
+            memset(rio->buf + pr->retval, 0, rio->chunk - pr->retval);
+        }
+        rio->state = WRITING;
+        r = do_aio_generic(peer, pr, X_WRITE, rio->second_name,
+                           rio->buf, rio->chunk, rio->size);
+        if (r < 0) {
+            XSEGLOG2(&lc, E, "Writing of %s failed on do_aio_write",
+                     rio->second_name);
+            r = -1;
+            goto out_buf;
+        }
+        return 0;
     } else if (rio->state == WRITING) {
         XSEGLOG2(&lc, I, "Writing of %s callback", rio->obj_name);
         if (pr->retval == 0) {
+            rio->size += rio->chunk;
+            if (rio->size < rio->read) {
+                if (hash_copy_next(peer, pr) < 0) {
+                    XSEGLOG2(&lc, E, "Reading of %s failed on do_aio_read",
+                             rio->obj_name);
+                    r = -1;
+                    goto out_buf;
+                }
+                return 0;
+            }
             XSEGLOG2(&lc, I, "Writing of %s completed", rio->second_name);
+            rio->state = SEALING;
+            if (do_aio_seal_hashed(peer, pr, rio->second_name,
+                                   rio->read) < 0) {
+                XSEGLOG2(&lc, E, "Sealing of %s failed on do_aio_write",
+                         rio->second_name);
+                r = -1;
+                goto out_buf;
+            }
+            return 0;
+        } else {
+            XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
+            XSEGLOG2(&lc, E, "Hash of object %s failed", rio->obj_name);
+            r = -1;
+            goto out_buf;
+        }
+    } else if (rio->state == SEALING) {
+        if (pr->retval == 0) {
+            XSEGLOG2(&lc, I, "Sealing of %s completed", rio->second_name);
             XSEGLOG2(&lc, I, "Hash of object %s to object %s completed",
                      rio->obj_name, rio->second_name);
 
@@ -659,7 +1335,7 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
             }
             return 0;
         } else {
-            XSEGLOG2(&lc, E, "Writing of %s failed", rio->obj_name);
+            XSEGLOG2(&lc, E, "Sealing of %s failed", rio->second_name);
             XSEGLOG2(&lc, E, "Hash of object %s failed", rio->obj_name);
             r = -1;
             goto out_buf;
@@ -684,10 +1360,11 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
 
   out_buf:
     free(rio->buf);
-  out_src:
+    hash_state_free(rio->hs);
     free(rio->second_name);
 
     rio->buf = NULL;
+    rio->hs = NULL;
     rio->second_name = NULL;
     rio->read = 0;
 
@@ -699,77 +1376,142 @@ int handle_hash(struct peerd *peer, struct peer_req *pr)
     return 0;
 }
 
-int spawnthread(struct peerd *peer, struct peer_req *pr,
-                void *(*func) (void *arg))
+static uint64_t now_us(void)
 {
-    //struct radosd *rados = (struct radosd *) peer->priv;
-    struct rados_io *rio = (struct rados_io *) (pr->priv);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+static void lock_queue(struct radosd *rados, struct peer_req *pr)
+{
+    struct lock_workers *lw = &rados->lw;
+    struct rados_io *rio = (struct rados_io *) (pr->priv);
 
-    return (pthread_create(&rio->tid, &attr, func, (void *) pr));
+    rio->lnext = NULL;
+    pthread_mutex_lock(&lw->lock);
+    if (lw->tail) {
+        ((struct rados_io *) lw->tail->priv)->lnext = pr;
+    } else {
+        lw->head = pr;
+    }
+    lw->tail = pr;
+    lw->stats.submitted++;
+    lw->stats.depth++;
+    if (lw->stats.depth > lw->stats.max_depth) {
+        lw->stats.max_depth = lw->stats.depth;
+    }
+    pthread_cond_signal(&lw->cond);
+    pthread_mutex_unlock(&lw->lock);
 }
 
 void watch_cb(uint8_t opcode, uint64_t ver, void *arg)
 {
     //assert pr valid
     struct peer_req *pr = (struct peer_req *) arg;
-    //struct radosd *rados = (struct radosd *) pr->peer->priv;
+    struct radosd *rados = (struct radosd *) pr->peer->priv;
     struct rados_io *rio = (struct rados_io *) (pr->priv);
+    int wake = 0;
 
-    if (pr->req->op == X_ACQUIRE) {
-        XSEGLOG2(&lc, I, "watch cb signaling rio of %s", rio->obj_name);
-        pthread_cond_signal(&rio->cond);
-    } else {
+    if (pr->req->op != X_ACQUIRE) {
         XSEGLOG2(&lc, E, "Invalid req op in watch_cb");
+        return;
+    }
+
+    /* if the request is not parked yet, make its next failed try retry */
+    pthread_mutex_lock(&rio->m);
+    if (rio->parked) {
+        rio->parked = 0;
+        wake = 1;
+        pthread_mutex_lock(&rados->lw.lock);
+        rados->lw.stats.parked--;
+        rados->lw.stats.retries++;
+        pthread_mutex_unlock(&rados->lw.lock);
+    } else {
+        rio->notified = 1;
+    }
+    pthread_mutex_unlock(&rio->m);
+
+    if (wake) {
+        XSEGLOG2(&lc, I, "watch cb requeueing rio of %s", rio->obj_name);
+        lock_queue(rados, pr);
     }
 }
 
-void *lock_op(void *arg)
+static void lock_op(struct peer_req *pr)
 {
-    struct peer_req *pr = (struct peer_req *) arg;
     struct radosd *rados = (struct radosd *) pr->peer->priv;
     struct rados_io *rio = (struct rados_io *) (pr->priv);
-    uint32_t len = strlen(rio->obj_name);
-    strncpy(rio->obj_name + len, LOCK_SUFFIX, LOCK_SUFFIX_LEN);
-    rio->obj_name[len + LOCK_SUFFIX_LEN] = 0;
+    uint32_t len;
+    int r;
 
-    XSEGLOG2(&lc, I, "Starting lock op for %s", rio->obj_name);
-    if (!(pr->req->flags & XF_NOSYNC)) {
-        if (rados_watch(rados->ioctx, rio->obj_name, 0,
-                        &rio->watch_handle, watch_cb, pr) < 0) {
-            XSEGLOG2(&lc, E, "Rados watch failed for %s", rio->obj_name);
-            fail(pr->peer, pr);
-            return NULL;
+    if (rio->state == ACCEPTED) {
+        len = strlen(rio->obj_name);
+        strncpy(rio->obj_name + len, LOCK_SUFFIX, LOCK_SUFFIX_LEN);
+        rio->obj_name[len + LOCK_SUFFIX_LEN] = 0;
+        rio->state = LOCKING;
+        rio->lock_start = now_us();
+        rio->parked = 0;
+        rio->notified = 0;
+
+        XSEGLOG2(&lc, I, "Starting lock op for %s", rio->obj_name);
+        if (!(pr->req->flags & XF_NOSYNC)) {
+            if (rados_watch(lock_ioctx(rados), rio->obj_name, 0,
+                            &rio->watch_handle, watch_cb, pr) < 0) {
+                XSEGLOG2(&lc, E, "Rados watch failed for %s", rio->obj_name);
+                fail(pr->peer, pr);
+                return;
+            }
         }
     }
 
     /* passing flag 1 means renew lock */
-    while (rados_lock_exclusive(rados->ioctx, rio->obj_name, RADOS_LOCK_NAME,
-                                RADOS_LOCK_COOKIE, RADOS_LOCK_DESC, NULL,
-                                LIBRADOS_LOCK_FLAG_RENEW) < 0) {
+    r = rados_lock_exclusive(lock_ioctx(rados), rio->obj_name, RADOS_LOCK_NAME,
+                             RADOS_LOCK_COOKIE, RADOS_LOCK_DESC, NULL,
+                             LIBRADOS_LOCK_FLAG_RENEW);
+    if (r < 0) {
         if (pr->req->flags & XF_NOSYNC) {
             XSEGLOG2(&lc, E, "Rados lock failed for %s", rio->obj_name);
             fail(pr->peer, pr);
-            return NULL;
-        } else {
-            XSEGLOG2(&lc, D, "rados lock for %s sleeping", rio->obj_name);
-            pthread_mutex_lock(&rio->m);
-            pthread_cond_wait(&rio->cond, &rio->m);
+            return;
+        }
+        pthread_mutex_lock(&rio->m);
+        if (rio->notified) {
+            /* lock was released while we were trying */
+            rio->notified = 0;
             pthread_mutex_unlock(&rio->m);
-            XSEGLOG2(&lc, D, "rados lock for %s woke up", rio->obj_name);
+            pthread_mutex_lock(&rados->lw.lock);
+            rados->lw.stats.retries++;
+            pthread_mutex_unlock(&rados->lw.lock);
+            lock_queue(rados, pr);
+            return;
         }
+        XSEGLOG2(&lc, D, "rados lock for %s parked", rio->obj_name);
+        rio->parked = 1;
+        pthread_mutex_lock(&rados->lw.lock);
+        rados->lw.stats.parked++;
+        if (rados->lw.stats.parked > rados->lw.stats.max_parked) {
+            rados->lw.stats.max_parked = rados->lw.stats.parked;
+        }
+        pthread_mutex_unlock(&rados->lw.lock);
+        /* watch_cb may requeue the request from now on */
+        pthread_mutex_unlock(&rio->m);
+        return;
     }
+
     if (!(pr->req->flags & XF_NOSYNC)) {
-        if (rados_unwatch(rados->ioctx, rio->obj_name, rio->watch_handle) < 0) {
+        if (rados_unwatch(lock_ioctx(rados), rio->obj_name,
+                          rio->watch_handle) < 0) {
             XSEGLOG2(&lc, E, "Rados unwatch failed");
         }
     }
+    pthread_mutex_lock(&rados->lw.lock);
+    rados->lw.stats.acquired++;
+    rados->lw.stats.wait_us += now_us() - rio->lock_start;
+    pthread_mutex_unlock(&rados->lw.lock);
     XSEGLOG2(&lc, I, "Successfull lock op for %s", rio->obj_name);
     complete(pr->peer, pr);
-    return NULL;
 }
 
 int break_lock(struct radosd *rados, struct rados_io *rio)
@@ -791,7 +1533,7 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
             break;
         }
 
-        nr_lockers = rados_list_lockers(rados->ioctx, rio->obj_name,
+        nr_lockers = rados_list_lockers(lock_ioctx(rados), rio->obj_name,
                                         RADOS_LOCK_NAME, &exclusive, tag,
                                         &tag_len, clients, &clients_len,
                                         cookies, &cookies_len, addrs,
@@ -822,7 +1564,7 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
                 r = -1;
                 break;
             }
-            r = rados_break_lock(rados->ioctx, rio->obj_name,
+            r = rados_break_lock(lock_ioctx(rados), rio->obj_name,
                                  RADOS_LOCK_NAME, clients, RADOS_LOCK_COOKIE);
             break;
         }
@@ -836,9 +1578,8 @@ int break_lock(struct radosd *rados, struct rados_io *rio)
     return r;
 }
 
-void *unlock_op(void *arg)
+static void unlock_op(struct peer_req *pr)
 {
-    struct peer_req *pr = (struct peer_req *) arg;
     struct radosd *rados = (struct radosd *) pr->peer->priv;
     struct rados_io *rio = (struct rados_io *) (pr->priv);
     uint32_t len = strlen(rio->obj_name);
@@ -850,7 +1591,7 @@ void *unlock_op(void *arg)
     if (pr->req->flags & XF_FORCE) {
         r = break_lock(rados, rio);
     } else {
-        r = rados_unlock(rados->ioctx, rio->obj_name, RADOS_LOCK_NAME,
+        r = rados_unlock(lock_ioctx(rados), rio->obj_name, RADOS_LOCK_NAME,
                          RADOS_LOCK_COOKIE);
     }
     /* ENOENT means that the lock did not existed.
@@ -862,37 +1603,147 @@ void *unlock_op(void *arg)
                  r);
         fail(pr->peer, pr);
     } else {
-        if (rados_notify(rados->ioctx, rio->obj_name, 0, NULL, 0) < 0) {
+        if (rados_notify(lock_ioctx(rados), rio->obj_name, 0, NULL, 0) < 0) {
             XSEGLOG2(&lc, E, "rados notify failed");
         }
         XSEGLOG2(&lc, I, "Successfull unlock op for %s", rio->obj_name);
         complete(pr->peer, pr);
     }
+}
+
+static void *lock_worker(void *arg)
+{
+    struct peerd *peer = (struct peerd *) arg;
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct lock_workers *lw = &rados->lw;
+    struct peer_req *pr;
+
+    pthread_mutex_lock(&lw->lock);
+    for (;;) {
+        while (!lw->head && !lw->stopping) {
+            pthread_cond_wait(&lw->cond, &lw->lock);
+        }
+        if (!lw->head) {
+            break;
+        }
+        pr = lw->head;
+        lw->head = ((struct rados_io *) pr->priv)->lnext;
+        if (!lw->head) {
+            lw->tail = NULL;
+        }
+        lw->stats.depth--;
+        pthread_mutex_unlock(&lw->lock);
+
+        if (pr->req->op == X_ACQUIRE) {
+            lock_op(pr);
+        } else {
+            unlock_op(pr);
+        }
+
+        pthread_mutex_lock(&lw->lock);
+    }
+    pthread_mutex_unlock(&lw->lock);
+
     return NULL;
 }
 
-int handle_acquire(struct peerd *peer, struct peer_req *pr)
+static int start_lock_workers(struct peerd *peer, uint32_t nr_threads)
 {
-    int r = spawnthread(peer, pr, lock_op);
-    if (r < 0) {
-        fail(pr->peer, pr);
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct lock_workers *lw = &rados->lw;
+    uint32_t i;
+
+    memset(lw, 0, sizeof(struct lock_workers));
+    pthread_mutex_init(&lw->lock, NULL);
+    pthread_cond_init(&lw->cond, NULL);
+
+    lw->threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!lw->threads) {
+        return -1;
     }
+    for (i = 0; i < nr_threads; i++) {
+        if (pthread_create(&lw->threads[i], NULL, lock_worker, peer)) {
+            XSEGLOG2(&lc, E, "Could not create lock worker %u", i);
+            return -1;
+        }
+        lw->nr_threads++;
+    }
+
+    return 0;
+}
+
+static void stop_lock_workers(struct radosd *rados)
+{
+    struct lock_workers *lw = &rados->lw;
+    uint32_t i;
+
+    pthread_mutex_lock(&lw->lock);
+    lw->stopping = 1;
+    pthread_cond_broadcast(&lw->cond);
+    pthread_mutex_unlock(&lw->lock);
+
+    for (i = 0; i < lw->nr_threads; i++) {
+        pthread_join(lw->threads[i], NULL);
+    }
+    free(lw->threads);
+    lw->threads = NULL;
+    lw->nr_threads = 0;
+}
+
+int handle_acquire(struct peerd *peer, struct peer_req *pr)
+{
+    struct radosd *rados = (struct radosd *) peer->priv;
+
+    lock_queue(rados, pr);
     return 0;
 }
 
 
 int handle_release(struct peerd *peer, struct peer_req *pr)
 {
-    int r = spawnthread(peer, pr, unlock_op);
-    if (r < 0) {
-        fail(pr->peer, pr);
+    struct radosd *rados = (struct radosd *) peer->priv;
+
+    lock_queue(rados, pr);
+    return 0;
+}
+
+static int connect_handle(struct radosd *rados, struct rados_handle *h,
+                          char *cephx_id)
+{
+    if (rados_create(&h->cluster, (cephx_id[0] == '\0') ? NULL : cephx_id)
+        < 0) {
+        XSEGLOG2(&lc, E, "Rados create failed!");
+        return -1;
+    }
+
+    if (rados_conf_read_file(h->cluster, NULL) < 0) {
+        XSEGLOG2(&lc, E, "Error reading rados conf files!");
+        goto out_shutdown;
+    }
+    if (rados_connect(h->cluster) < 0) {
+        XSEGLOG2(&lc, E, "Rados connect failed!");
+        goto out_shutdown;
+    }
+    if (rados_pool_lookup(h->cluster, rados->pool) < 0) {
+        XSEGLOG2(&lc, E, "Pool does not exists. Try creating it first");
+        goto out_shutdown;
+    }
+    if (rados_ioctx_create(h->cluster, rados->pool, &h->ioctx) < 0) {
+        XSEGLOG2(&lc, E, "ioctx create problem.");
+        goto out_shutdown;
     }
     return 0;
+
+  out_shutdown:
+    rados_shutdown(h->cluster);
+    return -1;
 }
 
 int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 {
     int i, j;
+    unsigned long lock_threads = DEFAULT_LOCK_THREADS;
+    unsigned long nr_handles = 1;
     struct radosd *rados = malloc(sizeof(struct radosd));
     char *cephx_id = calloc(1, MAX_CEPHXID_NAME);
     struct rados_io *rio;
@@ -900,11 +1751,15 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         perror("malloc");
         return -1;
     }
+    memset(rados->handles, 0, sizeof(rados->handles));
     rados->pool[0] = 0;
+    rados->nr_finalized = 0;
 
     BEGIN_READ_ARGS(argc, argv);
     READ_ARG_STRING("--pool", rados->pool, MAX_POOL_NAME);
     READ_ARG_STRING("--cephx-id", cephx_id, MAX_CEPHXID_NAME);
+    READ_ARG_ULONG("--lock-threads", lock_threads);
+    READ_ARG_ULONG("--handles", nr_handles);
     END_READ_ARGS();
 
     if (!rados->pool[0]) {
@@ -914,57 +1769,29 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         return -1;
     }
 
-    if (rados_create(&rados->cluster, (cephx_id[0] == '\0') ? NULL : cephx_id)
-        < 0) {
-        XSEGLOG2(&lc, E, "Rados create failed!");
-        free(cephx_id);
-        return -1;
-    }
-
-    if (rados_conf_read_file(rados->cluster, NULL) < 0) {
-        XSEGLOG2(&lc, E, "Error reading rados conf files!");
-        return -1;
-    }
-    if (rados_connect(rados->cluster) < 0) {
-        XSEGLOG2(&lc, E, "Rados connect failed!");
-        rados_shutdown(rados->cluster);
+    if (!nr_handles || nr_handles > MAX_HANDLES) {
+        XSEGLOG2(&lc, E, "Handles must be between 1 and %d", MAX_HANDLES);
         free(rados);
         free(cephx_id);
         return -1;
     }
-    if (rados_pool_lookup(rados->cluster, rados->pool) < 0) {
-        XSEGLOG2(&lc, E, "Pool does not exists. Try creating it first");
-        rados_shutdown(rados->cluster);
-        free(rados);
-        free(cephx_id);
-        return -1;
-        /*
-           if (rados_pool_create(rados->cluster, rados->pool) < 0){
-           XSEGLOG2(&lc, E, "Couldn't create pool %s", rados->pool);
-           rados_shutdown(rados->cluster);
-           free(rados);
-           return -1;
-           }
-           XSEGLOG2(&lc, I, "Pool created.");
-         */
 
-    }
-    if (rados_ioctx_create(rados->cluster, rados->pool, &(rados->ioctx)) < 0) {
-        XSEGLOG2(&lc, E, "ioctx create problem.");
-        rados_shutdown(rados->cluster);
-        free(rados);
-        free(cephx_id);
-        return -1;
+    rados->nr_handles = nr_handles;
+    for (i = 0; i < rados->nr_handles; i++) {
+        if (connect_handle(rados, &rados->handles[i], cephx_id) < 0) {
+            for (j = 0; j < i; j++) {
+                rados_ioctx_destroy(rados->handles[j].ioctx);
+                rados_shutdown(rados->handles[j].cluster);
+            }
+            free(rados);
+            free(cephx_id);
+            return -1;
+        }
     }
     peer->priv = (void *) rados;
     for (i = 0; i < peer->nr_ops; i++) {
-        rio = malloc(sizeof(struct rados_io));
+        rio = peer_alloc(sizeof(struct rados_io));
         if (!rio) {
-            //ugly
-            //is this really necessary?
-            for (j = 0; j < i; j++) {
-                free(peer->peer_reqs[j].priv);
-            }
             free(rados);
             free(cephx_id);
             perror("malloc");
@@ -973,12 +1800,30 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         rio->buf = 0;
         rio->read = 0;
         rio->size = 0;
+        rio->chunk = 0;
+        rio->hs = NULL;
+        rio->cqe.next = NULL;
+        rio->cqe.pr = &peer->peer_reqs[i];
         rio->second_name = 0;
         rio->watch_handle = 0;
-        pthread_cond_init(&rio->cond, NULL);
+        rio->lnext = NULL;
+        rio->parked = 0;
+        rio->notified = 0;
         pthread_mutex_init(&rio->m, NULL);
         peer->peer_reqs[i].priv = (void *) rio;
     }
+
+    if (!lock_threads) {
+        lock_threads = 1;
+    }
+    if (start_lock_workers(peer, lock_threads) < 0) {
+        XSEGLOG2(&lc, E, "Could not start lock workers");
+        return -1;
+    }
+
+    rados->cq = NULL;
+    memset(&rados->cq_stats, 0, sizeof(struct cq_stats));
+    peer->custom_poll = cq_drain;
     return 0;
 }
 
@@ -990,6 +1835,37 @@ int custom_arg_parse(int argc, const char *argv[])
 
 void custom_peer_finalize(struct peerd *peer)
 {
+    struct radosd *rados = (struct radosd *) peer->priv;
+    struct lock_stats *stats = &rados->lw.stats;
+    uint32_t i;
+
+    /* every peer thread finalizes. Report once, from the last one. */
+    if (__sync_add_and_fetch(&rados->nr_finalized, 1) != peer->nr_threads) {
+        return;
+    }
+
+    stop_lock_workers(rados);
+    XSEGLOG2(&lc, I, "Lock workers: %llu requests queued, max queue depth "
+             "%llu, max parked %llu, %llu retries, %llu locks acquired, "
+             "avg acquire time %llu us",
+             (unsigned long long) stats->submitted,
+             (unsigned long long) stats->max_depth,
+             (unsigned long long) stats->max_parked,
+             (unsigned long long) stats->retries,
+             (unsigned long long) stats->acquired,
+             (unsigned long long) (stats->acquired ?
+                                   stats->wait_us / stats->acquired : 0));
+    XSEGLOG2(&lc, I, "Completion queue: %llu completions in %llu batches, "
+             "max batch %llu",
+             (unsigned long long) rados->cq_stats.completions,
+             (unsigned long long) rados->cq_stats.batches,
+             (unsigned long long) rados->cq_stats.max_batch);
+    for (i = 0; i < rados->nr_handles; i++) {
+        XSEGLOG2(&lc, I, "Handle %u: %llu operations submitted, "
+                 "max in flight %llu", i,
+                 (unsigned long long) rados->handles[i].submitted,
+                 (unsigned long long) rados->handles[i].max_inflight);
+    }
     return;
 }
 
@@ -897,7 +897,7 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
 {
     struct vlmc_io *vio;
     struct vlmcd *vlmc = malloc(sizeof(struct vlmcd));
-    int i, j;
+    int i;
 
     if (!vlmc) {
         XSEGLOG2(&lc, E, "Cannot alloc vlmc");
@@ -930,9 +930,9 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
     }
 
     for (i = 0; i < peer->nr_ops; i++) {
-        vio = malloc(sizeof(struct vlmc_io));
+        vio = peer_alloc(sizeof(struct vlmc_io));
         if (!vio) {
-            break;
+            return -1;
         }
         vio->mreq = NULL;
         vio->breqs = NULL;
@@ -941,12 +941,6 @@ int custom_peer_init(struct peerd *peer, int argc, char *argv[])
         xlock_release(&vio->lock);
         peer->peer_reqs[i].priv = (void *) vio;
     }
-    if (i < peer->nr_ops) {
-        for (j = 0; j < i; j++) {
-            free(peer->peer_reqs[i].priv);
-        }
-        return -1;
-    }
 
 
     const struct sched_param param = {.sched_priority = 99 };
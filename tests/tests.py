@@ -15,7 +15,7 @@
 
 import archipelago
 from archipelago.common import Xseg_ctx, Request, Filed, Mapperd, Vlmcd, Radosd, \
-        Error, Segment
+        Error, Segment, archip_dirs, BIN_DIR
 from archipelago.archipelago import start_peer, stop_peer
 import random as rnd
 import unittest2 as unittest
@@ -23,12 +23,16 @@ from xseg.xprotocol import *
 from xseg.xseg_api import *
 import ctypes
 import os
+import signal
+import subprocess
+import time
 from copy import copy
 from sets import Set
 from binascii import hexlify, unhexlify
 from hashlib import sha256
-from struct import pack
+from struct import pack, unpack
 import pwd
+import re
 import grp
 
 def get_random_string(length=64, repeat=16):
@@ -54,6 +58,45 @@ def recursive_remove(path):
         for name in dirs:
             os.rmdir(os.path.join(root, name))
 
+def find_file(paths, name):
+    for path in archip_dirs(paths):
+        for root, dirs, files in os.walk(path):
+            if name in files:
+                return os.path.join(root, name)
+    return None
+
+def file_exists(paths, name):
+    return find_file(paths, name) is not None
+
+def get_children(pid):
+    children = []
+    for p in os.listdir('/proc'):
+        if not p.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % p) as f:
+                ppid = int(f.read().rsplit(')', 1)[1].split()[1])
+        except (IOError, IndexError, ValueError):
+            continue
+        if ppid == pid:
+            children.append(int(p))
+    return children
+
+def wait_exited(pids, timeout=10):
+    while timeout > 0:
+        if not [p for p in pids if os.path.exists('/proc/%d' % p)]:
+            return True
+        time.sleep(0.1)
+        timeout -= 0.1
+    return False
+
+def get_rss(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1]) * 1024
+    return 0
+
 def merkle_hash(hashes):
     if len(hashes) == 0:
         return sha256('').digest()
@@ -171,6 +214,18 @@ class XsegTest(unittest.TestCase):
             ret.segs[i].targetlen = len(ret.segs[i].target)
         return ret
 
+    @staticmethod
+    def get_segs_map_reply(segs):
+        ret = xseg_reply_map()
+        ret.cnt = len(segs)
+        SegsArray = xseg_reply_map_scatterlist * ret.cnt
+        array = SegsArray()
+        for i in range(0, ret.cnt):
+            array[i].target, array[i].offset, array[i].size = segs[i]
+            array[i].targetlen = len(array[i].target)
+        ret.segs = array
+        return ret
+
     @staticmethod
     def get_copy_map_reply(volume, offset, size, epoch):
         blocksize = XsegTest.blocksize
@@ -295,9 +350,9 @@ class XsegTest(unittest.TestCase):
 
     send_and_evaluate_copy = evaluate(send_copy)
 
-    def send_acquire(self, dst, target):
+    def send_acquire(self, dst, target, wait=False):
         #req = self.get_req(X_ACQUIRE, dst, target, flags=XF_NOSYNC)
-        req = Request.get_acquire_request(self.xseg, dst, target)
+        req = Request.get_acquire_request(self.xseg, dst, target, wait=wait)
         req.submit()
         return req
 
@@ -314,9 +369,9 @@ class XsegTest(unittest.TestCase):
 
     send_and_evaluate_release = evaluate(send_release)
 
-    def send_delete(self, dst, target):
+    def send_delete(self, dst, target, force=False):
         #req = self.get_req(X_DELETE, dst, target)
-        req = Request.get_delete_request(self.xseg, dst, target)
+        req = Request.get_delete_request(self.xseg, dst, target, force)
         req.submit()
         return req
 
@@ -412,12 +467,12 @@ class XsegTest(unittest.TestCase):
     send_and_evaluate_rename = evaluate(send_rename)
 
     def get_filed(self, args, clean=False):
-        path = args['archip_dir']
-        if not os.path.exists(path):
-            os.makedirs(path)
+        for path in archip_dirs(args['archip_dir']):
+            if not os.path.exists(path):
+                os.makedirs(path)
 
-        if clean:
-            recursive_remove(path)
+            if clean:
+                recursive_remove(path)
 
         return Filed(user=self.user, group=self.group, **args)
 
@@ -781,11 +836,14 @@ class MapperdTest(XsegTest):
             'log_level': 3,
             'blockerb_port': 0,
             'blockerm_port': 1,
+            'reclaim_journal': '/tmp/mapperdtest.reclaim',
             }
     blocksize = 4*1024*1024
 
     def setUp(self):
         super(MapperdTest, self).setUp()
+        if os.path.exists(self.mapperd_args['reclaim_journal']):
+            os.remove(self.mapperd_args['reclaim_journal'])
         try:
             self.blockerm = self.get_filed(self.mfiled_args, clean=True)
             self.blockerb = self.get_filed(self.bfiled_args, clean=True)
@@ -808,6 +866,64 @@ class MapperdTest(XsegTest):
         stop_peer(self.blockerm)
         super(MapperdTest, self).tearDown()
 
+    def restart_mapperd(self, **kwargs):
+        stop_peer(self.mapperd)
+        args = copy(self.mapperd_args)
+        args.update(kwargs)
+        self.mapperd = self.get_mapperd(args)
+        start_peer(self.mapperd)
+
+    @staticmethod
+    def get_volume_shard(volume, shards):
+        # FNV-1a, as mapperd spreads volumes over its shards
+        h = 14695981039346656037
+        for c in volume:
+            h ^= ord(c)
+            h = (h * 1099511628211) & 0xffffffffffffffff
+        return h % shards
+
+    def object_exists(self, name):
+        return file_exists(self.bfiled_args['archip_dir'], name)
+
+    def get_map_version(self, volume):
+        path = find_file(self.mfiled_args['archip_dir'], "archip_" + volume)
+        with open(path, 'rb') as f:
+            return unpack(">I", f.read(8)[4:8])[0]
+
+    def set_map_version(self, volume, version):
+        # rewrite the version of the map header, with mapperd stopped
+        path = find_file(self.mfiled_args['archip_dir'], "archip_" + volume)
+        with open(path, 'r+b') as f:
+            f.seek(4)
+            f.write(pack(">I", version))
+
+    def wait_reclaimed(self, objects, timeout=30):
+        # objects are reclaimed in the background, while mapperd is idle
+        while timeout > 0:
+            if not [o for o in objects if self.object_exists(o)]:
+                return
+            time.sleep(1)
+            timeout -= 1
+        self.fail("Objects %s were not reclaimed" % objects)
+
+    def wait_map_read(self, volume, expected_data, offset=0, size=0,
+            timeout=30):
+        # wait for a background change of the map, e.g. a completion
+        while timeout > 0:
+            req = self.send_map_read(self.mapperdport, volume, offset=offset,
+                    size=size)
+            req.wait()
+            done = req.success() and \
+                    req.get_data(xseg_reply_map).contents.cnt == \
+                    expected_data.cnt
+            self.assertTrue(req.put())
+            if done:
+                break
+            time.sleep(1)
+            timeout -= 1
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=expected_data, offset=offset, size=size)
+
     def test_create(self):
         volume = "myvolume"
         volsize = 10*1024*1024
@@ -843,6 +959,439 @@ class MapperdTest(XsegTest):
         self.send_and_evaluate_map_write(self.mapperdport, volume,
                 expected_data=ret, offset=offset, size=size)
 
+    def test_delete_reclaim(self):
+        volume = "myvolume"
+        volsize = 10*1024*1024
+        offset = 0
+        size = volsize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        objects = [ret.segs[i].target for i in range(0, ret.cnt)]
+        for o in objects:
+            self.assertTrue(self.object_exists(o))
+
+        # the name is free at once, while the old objects are reclaimed
+        self.send_and_evaluate_delete(self.mapperdport, volume)
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=self.get_zero_map_reply(offset, size),
+                offset=offset, size=size)
+        ret = self.get_copy_map_reply(volume, offset, size, 2)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+
+        self.wait_reclaimed(objects)
+        for i in range(0, ret.cnt):
+            self.assertTrue(self.object_exists(ret.segs[i].target))
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+
+        # the recreated volume is reclaimed as well
+        self.send_and_evaluate_delete(self.mapperdport, volume)
+        self.wait_reclaimed([ret.segs[i].target for i in range(0, ret.cnt)])
+        self.send_and_evaluate_delete(self.mapperdport, volume, expected=False)
+
+    def test_delete_snapshot(self):
+        volume = "myvolume"
+        snap = "mysnapshot"
+        clone = "myclone"
+        volsize = 2*self.blocksize
+        offset = 0
+        size = volsize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        self.send_and_evaluate_clone(self.mapperdport, snap, clone=clone)
+
+        # the snapshot has no objects to reclaim, and its clone still reads
+        # its objects through it
+        self.send_and_evaluate_delete(self.mapperdport, snap)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                offset=offset, size=size, expected=False)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret, offset=offset, size=size)
+
+    def test_reclaim_restart(self):
+        volume = "myvolume"
+        volsize = 40*1024*1024
+        offset = 0
+        size = volsize
+        journal = self.mapperd_args['reclaim_journal']
+        reclaim_name = volume + "@" + "%016x" % 1
+
+        # reclaim a single object per second, to restart in the middle
+        self.restart_mapperd(reclaim_rate=1)
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        objects = [ret.segs[i].target for i in range(0, ret.cnt)]
+        self.send_and_evaluate_delete(self.mapperdport, volume)
+        stop_peer(self.mapperd)
+
+        self.assertIn(reclaim_name, open(journal).read().split())
+        self.assertTrue([o for o in objects if self.object_exists(o)])
+
+        self.restart_mapperd()
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.wait_reclaimed(objects)
+        self.assertNotIn(reclaim_name, open(journal).read().split())
+        self.send_and_evaluate_info(self.mapperdport, volume,
+                expected_data=self.get_reply_info(volsize))
+
+    def test_lazy_clone(self):
+        volume = "myvolume"
+        snap = "mysnapshot"
+        clone = "myclone"
+        bs = self.blocksize
+        volsize = 2*bs
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, 0, volsize, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=0, size=volsize)
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        self.send_and_evaluate_clone(self.mapperdport, snap, clone=clone)
+        self.assertEqual(self.get_map_version(clone), 3)
+
+        # the objects of the clone are those of its parent
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret, offset=0, size=volsize)
+
+        # until they are copied up, and the clone gets its own entries
+        cobj = self.get_object_name(clone, 1, 0)
+        pobj = self.get_object_name(volume, 1, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, clone,
+                expected_data=self.get_copy_map_reply(clone, 0, bs, 1),
+                offset=0, size=bs)
+        ret2 = self.get_segs_map_reply([(cobj, 0, bs), (pobj, 0, bs)])
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret2, offset=0, size=volsize)
+        self.send_and_evaluate_close(self.mapperdport, clone)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret2, offset=0, size=volsize)
+
+        # a snapshot recreated under the name of the parent is not mistaken
+        # for it
+        self.send_and_evaluate_delete(self.mapperdport, snap)
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret, offset=0, size=volsize)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                offset=0, size=volsize, expected=False)
+        self.send_and_evaluate_map_write(self.mapperdport, clone,
+                offset=bs, size=bs, expected=False)
+
+    def test_partial_copyups(self):
+        volume = "myvolume"
+        snap = "mysnapshot"
+        clone = "myclone"
+        snap2 = "mysnapshot2"
+        volsize = 2*self.blocksize
+        sbsize = self.blocksize // 64
+        offset = sbsize + 1
+        size = 10
+
+        # spread the objects over two filesystems, so that some copies
+        # cannot be done by the kernel alone
+        stop_peer(self.blockerb)
+        args = copy(self.bfiled_args)
+        args['archip_dir'] = '/tmp/bfiledtest/,/dev/shm/bfiledtest/'
+        self.blockerb = self.get_filed(args, clean=True)
+        start_peer(self.blockerb)
+        self.restart_mapperd(partial_copyups=True)
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, 0, volsize, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=0, size=volsize)
+        pobj = self.get_object_name(volume, 1, 0)
+        cobj = self.get_object_name(clone, 1, 0)
+        data = get_random_string(2*sbsize + 100)
+        self.send_and_evaluate_write(self.blockerb.portno_start, pobj,
+                data=data, serviced=len(data))
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        self.send_and_evaluate_clone(self.mapperdport, snap, clone=clone)
+
+        # inherited objects are read from the parent
+        ret = self.get_copy_map_reply(volume, 0, volsize, 1)
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret, offset=0, size=volsize)
+
+        # The write copies up only the sub-block it touches. Snapshot the
+        # clone along with it, before the object is completed, so that the
+        # snapshot keeps the partial object.
+        self.send_and_evaluate_open(self.mapperdport, clone)
+        ret = self.get_copy_map_reply(clone, offset, size, 1)
+        reqs = [self.send_map_write(self.mapperdport, clone, offset=offset,
+                    size=size),
+                self.send_snapshot(self.mapperdport, clone, snap=snap2)]
+        for req in reqs:
+            req.wait()
+        self.evaluate_req(reqs[0], data=ret)
+        self.evaluate_req(reqs[1])
+        for req in reqs:
+            self.assertTrue(req.put())
+
+        # the sub-blocks the partial object lacks are read from the parent
+        ret = self.get_segs_map_reply([(pobj, 0, sbsize),
+                (cobj, sbsize, sbsize), (pobj, 2*sbsize, sbsize)])
+        self.send_and_evaluate_map_read(self.mapperdport, snap2,
+                expected_data=ret, offset=0, size=3*sbsize)
+        ret = self.get_copy_map_reply(volume, self.blocksize,
+                self.blocksize, 1)
+        self.send_and_evaluate_map_read(self.mapperdport, snap2,
+                expected_data=ret, offset=self.blocksize,
+                size=self.blocksize)
+
+        # the background completer copies the rest of the object
+        ret = self.get_copy_map_reply(clone, 0, self.blocksize, 1)
+        self.wait_map_read(clone, ret, offset=0, size=self.blocksize)
+        self.send_and_evaluate_read(self.blockerb.portno_start, cobj,
+                size=len(data), expected_data=data)
+        self.send_and_evaluate_close(self.mapperdport, clone)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, clone,
+                expected_data=ret, offset=0, size=self.blocksize)
+        self.send_and_evaluate_map_read(self.mapperdport, snap2,
+                expected_data=self.get_segs_map_reply([(pobj, 0, sbsize),
+                    (cobj, sbsize, sbsize), (pobj, 2*sbsize, sbsize)]),
+                offset=0, size=3*sbsize)
+
+    def test_snapshot_v3(self):
+        volume = "myvolume"
+        snap = "mysnapshot"
+        volsize = 2*self.blocksize
+        offset = 0
+        size = volsize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.assertEqual(self.get_map_version(volume), 3)
+        ret1 = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret1, offset=offset, size=size)
+
+        # the snapshot makes the objects read-only by raising the epoch
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret1, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret1, offset=offset, size=size)
+
+        # objects of older epochs are copied up on their first write
+        ret2 = self.get_copy_map_reply(volume, offset, self.blocksize, 2)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret2, offset=offset, size=self.blocksize)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret2, offset=offset, size=self.blocksize)
+
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret1, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret2, offset=offset, size=self.blocksize)
+        ret = self.get_copy_map_reply(volume, self.blocksize,
+                self.blocksize, 2)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=self.blocksize,
+                size=self.blocksize)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret1, offset=offset, size=size)
+
+    def test_upgrade_v2(self):
+        volume = "myvolume"
+        snap = "mysnapshot"
+        volsize = 2*self.blocksize
+        offset = 0
+        size = volsize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret1 = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret1, offset=offset, size=size)
+        self.send_and_evaluate_close(self.mapperdport, volume)
+        stop_peer(self.mapperd)
+        self.set_map_version(volume, 2)
+        start_peer(self.mapperd)
+
+        # reads leave the map as it is
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret1, offset=offset, size=size)
+        self.assertEqual(self.get_map_version(volume), 2)
+
+        # opening it exclusively upgrades it, and its objects stay writable
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret1, offset=offset, size=size)
+        self.assertEqual(self.get_map_version(volume), 3)
+
+        self.send_and_evaluate_snapshot(self.mapperdport, volume, snap=snap)
+        ret2 = self.get_copy_map_reply(volume, offset, size, 2)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret2, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret1, offset=offset, size=size)
+
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret2, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret1, offset=offset, size=size)
+
+    def test_foreign_writable(self):
+        volume = "myvolume"
+        foreign = "myforeign"
+        snap = "mysnapshot"
+        snap2 = "mysnapshot2"
+        volsize = 2*self.blocksize
+        offset = 0
+        size = volsize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        ret = self.get_copy_map_reply(volume, offset, size, 1)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+
+        # a map created from writable objects of another map writes them in
+        # place, whatever their epoch
+        objects = []
+        for i in range(0, ret.cnt):
+            objects.append({'name': ret.segs[i].target, 'flags': 0})
+        self.send_and_evaluate_create(self.mapperdport, foreign, size=volsize,
+                objects=objects, mapflags=0, blocksize=self.blocksize)
+        self.send_and_evaluate_map_write(self.mapperdport, foreign,
+                expected_data=ret, offset=offset, size=size)
+
+        # its first snapshot marks all of its objects read-only
+        self.send_and_evaluate_snapshot(self.mapperdport, foreign, snap=snap)
+        ret2 = self.get_copy_map_reply(foreign, offset, size, 2)
+        self.send_and_evaluate_map_write(self.mapperdport, foreign,
+                expected_data=ret2, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret, offset=offset, size=size)
+
+        # and later snapshots only raise the epoch
+        self.send_and_evaluate_snapshot(self.mapperdport, foreign, snap=snap2)
+        ret3 = self.get_copy_map_reply(foreign, offset, size, 3)
+        self.send_and_evaluate_map_write(self.mapperdport, foreign,
+                expected_data=ret3, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, snap2,
+                expected_data=ret2, offset=offset, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, snap,
+                expected_data=ret, offset=offset, size=size)
+
+    def test_shards(self):
+        shards = 2
+        volsize = 2*self.blocksize
+        offset = 0
+        size = volsize
+
+        self.restart_mapperd(shards=shards, shard_port=3)
+        shard_pids = get_children(self.mapperd.get_pid())
+        self.assertEqual(len(shard_pids), shards - 1)
+
+        volumes = {}
+        snaps = {}
+        i = 0
+        while len(volumes) < shards or len(snaps) < shards:
+            volume = "myvolume%d" % i
+            volumes.setdefault(self.get_volume_shard(volume, shards), volume)
+            snap = "mysnapshot%d" % i
+            snaps.setdefault(self.get_volume_shard(snap, shards), snap)
+            i += 1
+
+        # every request goes to the mapper port, and is served, and replied
+        # to, by the shard of its volume
+        for volume in volumes.values():
+            self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                    clone_size=volsize)
+            ret = self.get_copy_map_reply(volume, offset, size, 1)
+            self.send_and_evaluate_map_write(self.mapperdport, volume,
+                    expected_data=ret, offset=offset, size=size)
+            self.send_and_evaluate_map_read(self.mapperdport, volume,
+                    expected_data=ret, offset=offset, size=size)
+            self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                    clone_size=volsize, expected=False)
+
+        # maps of one shard are used by the others through the storage
+        for shard, volume in volumes.items():
+            snap = snaps[(shard + 1) % shards]
+            self.send_and_evaluate_snapshot(self.mapperdport, volume,
+                    snap=snap)
+            ret = self.get_copy_map_reply(volume, offset, size, 1)
+            self.send_and_evaluate_map_read(self.mapperdport, snap,
+                    expected_data=ret, offset=offset, size=size)
+
+        # stopping the first shard stops the others
+        stop_peer(self.mapperd)
+        self.assertTrue(wait_exited(shard_pids))
+
+        # and so does its death
+        start_peer(self.mapperd)
+        pid = self.mapperd.get_pid()
+        shard_pids = get_children(pid)
+        self.assertEqual(len(shard_pids), shards - 1)
+        for volume in volumes.values():
+            ret = self.get_copy_map_reply(volume, offset, size, 2)
+            self.send_and_evaluate_map_write(self.mapperdport, volume,
+                    expected_data=ret, offset=offset, size=size)
+        os.kill(pid, signal.SIGKILL)
+        self.assertTrue(wait_exited([pid] + shard_pids))
+        if os.path.exists(self.mapperd.pidfile):
+            os.remove(self.mapperd.pidfile)
+
+    def test_map_memory(self):
+        # Report the memory a large map takes in mapperd, once all its objects
+        # are loaded. Before map nodes were compacted, each one took about
+        # 176 bytes.
+        old_node_size = 176
+        volume = "myvolume"
+        nr_objs = 65536
+        volsize = nr_objs*self.blocksize
+        chunk = 256*self.blocksize
+
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.send_and_evaluate_open(self.mapperdport, volume)
+        pid = self.mapperd.get_pid()
+        rss_before = get_rss(pid)
+        for offset in range(0, volsize, chunk):
+            ret = self.get_copy_map_reply(volume, offset, chunk, 1)
+            self.send_and_evaluate_map_write(self.mapperdport, volume,
+                    expected_data=ret, offset=offset, size=chunk)
+        rss_after = get_rss(pid)
+
+        per_obj = float(rss_after - rss_before) / nr_objs
+        print "\nMap of %d objects: mapperd RSS %d -> %d bytes, " \
+                "%.1f bytes per object (was about %d)" % (nr_objs,
+                        rss_before, rss_after, per_obj, old_node_size)
+        self.assertTrue(per_obj < old_node_size / 2)
+        self.send_and_evaluate_close(self.mapperdport, volume)
+
     def test_clone_snapshot(self):
         volume = "myvolume"
         snap = "mysnapshot"
@@ -1018,6 +1567,29 @@ class MapperdTest(XsegTest):
             reqs.remove(req)
             self.assertTrue(req.put())
 
+    def test_mapr4(self):
+        volume = "myvolume"
+        volsize = 100*1024*1024*1024
+        offset = 32*1024*1024*1024 - 2
+        size = 512*1024
+        epoch = 1
+
+        # The range spans the second and third chunk of the map.
+        ret = self.get_copy_map_reply(volume, offset, size, epoch)
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+
+        # Make the first chunk resident, so that the next load starts past it.
+        zero_ret = MapperdTest.get_zero_map_reply(0, size)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=zero_ret, offset=0, size=size)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+
     def test_mapw(self):
         blocksize = self.blocksize
         volume = "myvolume"
@@ -1048,6 +1620,29 @@ class MapperdTest(XsegTest):
         self.send_and_evaluate_map_write(self.mapperdport, volume,
                 offset=offset, size=size, expected=False)
 
+    def test_mapw3(self):
+        volume = "myvolume"
+        volsize = 100*1024*1024*1024
+        offset = 32*1024*1024*1024 - 2
+        size = 512*1024
+        epoch = 1
+
+        # The write dirties both the second and the third chunk of the map,
+        # which are then written back as a single run past object 0.
+        ret = self.get_copy_map_reply(volume, offset, size, epoch)
+        self.send_and_evaluate_clone(self.mapperdport, "", clone=volume,
+                clone_size=volsize)
+        self.send_and_evaluate_map_write(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        stop_peer(self.mapperd)
+        start_peer(self.mapperd)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret, offset=offset, size=size)
+        size = 4*1024*1024
+        ret = MapperdTest.get_zero_map_reply(offset - size, size)
+        self.send_and_evaluate_map_read(self.mapperdport, volume,
+                expected_data=ret, offset=offset - size, size=size)
+
     def test_rename(self):
         blocksize = self.blocksize
         volume = "myvolume"
@@ -1253,6 +1848,9 @@ class BlockerTest(object):
         data = '\x00' * datalen
         self.send_and_evaluate_read(self.blockerport, target, size=datalen,
                 expected=False)
+        self.send_and_evaluate_delete(self.blockerport, target, False)
+        self.send_and_evaluate_delete(self.blockerport, target, True,
+                force=True)
 
     def test_hash(self):
         datalen = 1024
@@ -1321,6 +1919,294 @@ class FiledTest(BlockerTest, XsegTest):
         stop_peer(self.blocker)
         super(FiledTest, self).tearDown()
 
+    def restart_filed(self, **kwargs):
+        stop_peer(self.blocker)
+        args = copy(self.filed_args)
+        args.update(kwargs)
+        self.blocker = self.get_filed(args, clean=True)
+        start_peer(self.blocker)
+
+    def count_log(self, text):
+        if not os.path.exists(self.blocker.logfile):
+            return 0
+        with open(self.blocker.logfile) as f:
+            return len([l for l in f if text in l])
+
+    def get_log_line(self, prefix):
+        # the rest of the last line filed logged with prefix, e.g. the stats
+        # it logs when it stops
+        stop_peer(self.blocker)
+        stats = None
+        with open(self.blocker.logfile) as f:
+            for line in f:
+                if prefix in line:
+                    stats = line.split(prefix, 1)[1].strip()
+        start_peer(self.blocker)
+        self.assertTrue(stats is not None)
+        return stats
+
+    def get_log_stats(self, prefix):
+        # the numbers of stats logged as "<prefix> name N, other name M"
+        return dict((k.strip(), int(v)) for k, v in
+                re.findall(r'([a-z][a-z ]*) (\d+)', self.get_log_line(prefix)))
+
+    def check_filed(self, datalen=256*1024, target="mytarget"):
+        # read-after-write, copy and delete, across a restart of filed
+        data = get_random_string(datalen, 16)
+        part = get_random_string(datalen//4, 16)
+        copy_target = "copy_" + target
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data, serviced=datalen)
+        self.send_and_evaluate_write(self.blockerport, target, data=part,
+                offset=datalen//2, serviced=len(part))
+        data = data[:datalen//2] + part + data[datalen//2 + len(part):]
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data, serviced=datalen)
+        self.send_and_evaluate_copy(self.blockerport, target,
+                dst_target=copy_target, size=datalen, serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, copy_target,
+                size=datalen, expected_data=data, serviced=datalen)
+
+        stop_peer(self.blocker)
+        start_peer(self.blocker)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data, serviced=datalen)
+        self.send_and_evaluate_delete(self.blockerport, target)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected=False)
+        self.send_and_evaluate_read(self.blockerport, copy_target,
+                size=datalen, expected_data=data, serviced=datalen)
+        self.send_and_evaluate_delete(self.blockerport, copy_target)
+
+    def test_block_cache(self):
+        datalen = 256*1024
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+
+        self.restart_filed(block_cache=16)
+        self.check_filed()
+
+        # the cache serves repeated reads, and drops overwritten blocks
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+        data = data[::-1]
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data)
+        stats = self.get_log_stats("Block cache:")
+        self.assertTrue(stats['hits'] > 0)
+        self.assertTrue(stats['invalidations'] > 0)
+
+    def test_disks(self):
+        datalen = 64*1024
+        disks = [self.filed_args['archip_dir'], '/tmp/filedtest2/']
+        targets = ["mytarget%d" % i for i in range(0, 32)]
+        data = {}
+
+        self.restart_filed(archip_dir="%s,%s:3" % tuple(disks))
+        self.check_filed()
+        for target in targets:
+            data[target] = get_random_string(datalen, 16)
+            self.send_and_evaluate_write(self.blockerport, target,
+                    data=data[target], serviced=datalen)
+        for target in targets:
+            self.send_and_evaluate_read(self.blockerport, target,
+                    size=datalen, expected_data=data[target])
+        # objects are striped over all data directories
+        for disk in disks:
+            self.assertTrue([t for t in targets if file_exists(disk, t)])
+
+    def test_rebalance(self):
+        datalen = 64*1024
+        disks = [self.filed_args['archip_dir'], '/tmp/filedtest2/']
+        targets = ["mytarget%d" % i for i in range(0, 32)]
+        data = {}
+
+        self.restart_filed(archip_dir=disks[0])
+        for target in targets:
+            data[target] = get_random_string(datalen, 16)
+            self.send_and_evaluate_write(self.blockerport, target,
+                    data=data[target], serviced=datalen)
+
+        # a new data directory gets its share of the objects in the
+        # background, and they are served throughout
+        stop_peer(self.blocker)
+        recursive_remove(disks[1])
+        args = copy(self.filed_args)
+        args['archip_dir'] = ','.join(disks)
+        args['rebalance'] = True
+        self.blocker = self.get_filed(args)
+        finished = self.count_log("Rebalancing finished")
+        start_peer(self.blocker)
+        timeout = 30
+        while timeout > 0:
+            for target in targets:
+                self.send_and_evaluate_read(self.blockerport, target,
+                        size=datalen, expected_data=data[target])
+            if self.count_log("Rebalancing finished") > finished:
+                break
+            time.sleep(1)
+            timeout -= 1
+        moved = [t for t in targets if file_exists(disks[1], t)]
+        self.assertTrue(moved)
+        for target in moved:
+            self.assertFalse(file_exists(disks[0], target))
+        self.check_filed()
+
+    def test_tiering(self):
+        datalen = 64*1024
+        fast_dir = '/tmp/filedtest-fast/'
+        hot = "myhottarget"
+        cold = "mycoldtarget"
+        hot_data = get_random_string(datalen, 16)
+        cold_data = get_random_string(datalen, 16)
+
+        if not os.path.exists(fast_dir):
+            os.makedirs(fast_dir)
+        recursive_remove(fast_dir)
+        self.restart_filed(fast_dir=fast_dir, tier_fast_max=100)
+        self.check_filed()
+        self.send_and_evaluate_write(self.blockerport, hot, data=hot_data,
+                serviced=datalen)
+        self.send_and_evaluate_write(self.blockerport, cold, data=cold_data,
+                serviced=datalen)
+
+        # objects read often are promoted to the fast tier in the background
+        timeout = 30
+        while timeout > 0 and not file_exists(fast_dir, hot):
+            for i in range(0, 8):
+                self.send_and_evaluate_read(self.blockerport, hot,
+                        size=datalen, expected_data=hot_data)
+            time.sleep(1)
+            timeout -= 1
+        self.assertTrue(file_exists(fast_dir, hot))
+        self.assertFalse(file_exists(self.filed_args['archip_dir'], hot))
+        self.assertFalse(file_exists(fast_dir, cold))
+
+        self.send_and_evaluate_read(self.blockerport, hot, size=datalen,
+                expected_data=hot_data)
+        self.send_and_evaluate_read(self.blockerport, cold, size=datalen,
+                expected_data=cold_data)
+        hot_data = hot_data[::-1]
+        self.send_and_evaluate_write(self.blockerport, hot, data=hot_data,
+                serviced=datalen)
+        stats = self.get_log_stats("Tiering:")
+        self.assertTrue(stats['promoted'] > 0)
+        self.send_and_evaluate_read(self.blockerport, hot, size=datalen,
+                expected_data=hot_data)
+        self.check_filed(target=hot)
+
+    def test_coalesce(self):
+        chunk = 16*1024
+        nr_chunks = 16
+        datalen = chunk*nr_chunks
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+
+        self.restart_filed(coalesce=1000)
+        self.check_filed()
+
+        # adjacent requests queued together may be served as one
+        reqs = {}
+        for i in range(0, nr_chunks):
+            req = self.send_write(self.blockerport, target,
+                    data=data[i*chunk:(i+1)*chunk], offset=i*chunk)
+            reqs[req] = None
+        while len(reqs) > 0:
+            req = self.xseg.wait_requests(reqs.keys())
+            self.evaluate_req(req, serviced=chunk)
+            del reqs[req]
+            self.assertTrue(req.put())
+        self.send_and_evaluate_read(self.blockerport, target, size=datalen,
+                expected_data=data, serviced=datalen)
+
+        for i in range(0, nr_chunks):
+            req = self.send_read(self.blockerport, target, size=chunk,
+                    offset=i*chunk)
+            reqs[req] = data[i*chunk:(i+1)*chunk]
+        while len(reqs) > 0:
+            req = self.xseg.wait_requests(reqs.keys())
+            self.evaluate_req(req, serviced=chunk, data=reqs[req])
+            del reqs[req]
+            self.assertTrue(req.put())
+
+    def test_readahead(self):
+        chunk = 16*1024
+        datalen = 1024*1024
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+
+        for drop in [False, True]:
+            self.restart_filed(readahead=128, readahead_drop=drop)
+            self.check_filed()
+
+            # sequential reads are served from the prefetched ranges, and
+            # writes in between are not hidden by them
+            self.send_and_evaluate_write(self.blockerport, target, data=data,
+                    serviced=datalen)
+            for offset in range(0, datalen//2, chunk):
+                self.send_and_evaluate_read(self.blockerport, target,
+                        size=chunk, offset=offset,
+                        expected_data=data[offset:offset+chunk])
+            part = get_random_string(chunk, 16)
+            data = data[:datalen//2] + part + data[datalen//2+chunk:]
+            self.send_and_evaluate_write(self.blockerport, target, data=part,
+                    offset=datalen//2, serviced=chunk)
+            for offset in range(datalen//2, datalen, chunk):
+                self.send_and_evaluate_read(self.blockerport, target,
+                        size=chunk, offset=offset,
+                        expected_data=data[offset:offset+chunk])
+
+            line = self.get_log_line("Readahead:")
+            prefetches = re.search(r'(\d+) prefetches', line)
+            self.assertTrue(prefetches and int(prefetches.group(1)) > 0)
+            if drop:
+                dropped = re.search(r'(\d+) bytes dropped', line)
+                self.assertTrue(dropped and int(dropped.group(1)) > 0)
+
+    def test_prealloc(self):
+        datalen = 4096
+        prealloc = 1024*1024
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+        archip_dir = self.filed_args['archip_dir']
+
+        # new objects are allocated at once, and keep their size by default
+        for grow_size in [False, True]:
+            self.restart_filed(prealloc=prealloc//1024,
+                    prealloc_grow_size=grow_size)
+            self.check_filed()
+            self.send_and_evaluate_write(self.blockerport, target, data=data,
+                    serviced=datalen)
+            self.send_and_evaluate_read(self.blockerport, target,
+                    size=datalen, expected_data=data)
+            st = os.stat(find_file(archip_dir, target))
+            self.assertTrue(st.st_blocks*512 >= prealloc)
+            size = prealloc if grow_size else datalen
+            self.assertEqual(st.st_size, size)
+            self.send_and_evaluate_info(self.blockerport, target,
+                    expected_data=self.get_reply_info(size))
+
+        # the fragmentation tool reports every object
+        p = subprocess.Popen([os.path.join(BIN_DIR, 'archip-filed-frag'),
+            archip_dir], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = p.communicate()
+        if p.returncode == 2 and 'not supported' in err:
+            # no FIEMAP on the filesystem of the archip dir
+            return
+        self.assertEqual(p.returncode, 0)
+        objects = re.search(r'Objects: *(\d+)', out)
+        self.assertTrue(objects)
+        self.assertEqual(int(objects.group(1)), 1)
+
     def test_locking(self):
         target = "mytarget"
         self.send_and_evaluate_acquire(self.blockerport, target, expected=True)
@@ -1366,6 +2252,89 @@ class RadosdTest(BlockerTest, XsegTest):
         stop_peer(self.blocker)
         super(RadosdTest, self).tearDown()
 
+    def test_copy_chunks(self):
+        # larger than the 1MB chunks radosd copies in, and not aligned to them
+        datalen = 5*512*1024
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+        copy_target = "copy_target"
+        offset = 512*1024
+        size = 3*1024*1024
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        self.send_and_evaluate_copy(self.blockerport, target,
+                dst_target=copy_target, offset=offset, size=size,
+                serviced=size)
+        # the range past the end of the source is zeroed in the copy
+        expected = data[offset:] + '\x00' * (offset + size - datalen)
+        self.send_and_evaluate_read(self.blockerport, copy_target,
+                offset=offset, size=size, expected_data=expected,
+                serviced=size)
+        self.send_and_evaluate_read(self.blockerport, copy_target,
+                size=offset, expected_data='\x00' * offset, serviced=offset)
+
+    def test_read_eof(self):
+        datalen = 1024
+        data = get_random_string(datalen, 16)
+        target = "mytarget"
+        size = 4096
+
+        self.send_and_evaluate_write(self.blockerport, target, data=data,
+                serviced=datalen)
+        # reads past the end of the object are zero-filled by radosd
+        self.send_and_evaluate_read(self.blockerport, target, size=size,
+                expected_data=data + '\x00' * (size - datalen),
+                serviced=size)
+        self.send_and_evaluate_read(self.blockerport, target,
+                offset=datalen//2, size=size,
+                expected_data=data[datalen//2:] +
+                '\x00' * (size - datalen//2), serviced=size)
+        self.send_and_evaluate_read(self.blockerport, target, offset=size,
+                size=size, expected_data='\x00' * size, serviced=size)
+
+    def test_lock_contention(self):
+        lock_threads = 2
+        targets = ["mytarget%d" % i for i in range(0, 2*lock_threads)]
+        free_target = "myfreetarget"
+
+        # a second radosd, with its own lock owner, on the next port
+        args = copy(self.filed_args)
+        args['role'] = 'testradosd2'
+        args['portno_start'] = self.blockerport + 1
+        args['portno_end'] = self.blockerport + 1
+        args['lock_threads'] = lock_threads
+        blocker2 = Radosd(user=self.user, group=self.group, **args)
+        start_peer(blocker2)
+        try:
+            for target in targets:
+                self.send_and_evaluate_acquire(self.blockerport, target)
+
+            # waiters park without holding a lock worker, so more of them
+            # than --lock-threads do not keep other lock requests waiting
+            reqs = Set([])
+            for target in targets:
+                reqs.add(self.send_acquire(blocker2.portno_start, target,
+                    wait=True))
+            time.sleep(1)
+            self.send_and_evaluate_acquire(blocker2.portno_start,
+                    free_target)
+            self.send_and_evaluate_acquire(blocker2.portno_start, targets[0],
+                    expected=False)
+
+            # and are all woken up as the locks are released
+            for target in targets:
+                self.send_and_evaluate_release(self.blockerport, target)
+            while len(reqs) > 0:
+                req = self.xseg.wait_requests(reqs)
+                self.evaluate_req(req)
+                reqs.remove(req)
+                self.assertTrue(req.put())
+            for target in targets + [free_target]:
+                self.send_and_evaluate_release(blocker2.portno_start, target)
+        finally:
+            stop_peer(blocker2)
+
 if __name__=='__main__':
     init()
     unittest.main()